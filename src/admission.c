@@ -0,0 +1,216 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "admission.h"
+#include "configuration.h"
+#include "log.h"
+
+static void token_bucket_init(struct token_bucket *bucket, int64_t records,
+                              int64_t window)
+{
+        bucket->capacity = (double)records;
+        bucket->tokens = bucket->capacity;
+        bucket->refill_rate = (double)records / (double)window;
+        clock_gettime(CLOCK_MONOTONIC, &bucket->last_refill);
+}
+
+/* Takes a token from the bucket. Returns false, and sets retry_after to the
+ * milliseconds until the next token, if the bucket is empty. */
+static bool token_bucket_take(struct token_bucket *bucket, uint32_t *retry_after)
+{
+        struct timespec now;
+        double elapsed;
+        double wait;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (double)(now.tv_sec - bucket->last_refill.tv_sec) +
+                  (double)(now.tv_nsec - bucket->last_refill.tv_nsec) / 1e9;
+        bucket->tokens += elapsed * bucket->refill_rate;
+        if (bucket->tokens > bucket->capacity) {
+                bucket->tokens = bucket->capacity;
+        }
+        bucket->last_refill = now;
+
+        if (bucket->tokens >= 1) {
+                bucket->tokens -= 1;
+                return true;
+        }
+
+        /* Rounded up, so that the token is there when the peer retries */
+        wait = (1 - bucket->tokens) / bucket->refill_rate * 1000 + 1;
+        *retry_after = wait < UINT32_MAX ? (uint32_t)wait : UINT32_MAX;
+
+        return false;
+}
+
+static void free_peer_classes(struct peer *peer)
+{
+        struct peer_class *class;
+
+        while ((class = peer->classes) != NULL) {
+                peer->classes = class->next;
+                free(class->pattern);
+                free(class);
+        }
+}
+
+/* Sets the rate limit of the records of a peer from the configuration */
+static void configure_peer(struct peer *peer)
+{
+        int64_t records, window;
+
+        peer->limited = peer_rate_limit_config((unsigned int)peer->uid, &records, &window);
+        if (peer->limited) {
+                token_bucket_init(&peer->bucket, records, window);
+        }
+        free_peer_classes(peer);
+}
+
+void admission_init(struct admission *adm)
+{
+        adm->peers = NULL;
+        adm->max_connections = 0;
+}
+
+void admission_configure(struct admission *adm)
+{
+        adm->max_connections = peer_max_connections_config();
+
+        for (struct peer *peer = adm->peers; peer; peer = peer->next) {
+                configure_peer(peer);
+        }
+}
+
+int admission_connect(struct admission *adm, uid_t uid, struct peer **peer)
+{
+        struct peer *p;
+
+        for (p = adm->peers; p; p = p->next) {
+                if (p->uid == uid) {
+                        break;
+                }
+        }
+
+        if (!p) {
+                p = calloc(1, sizeof(struct peer));
+                if (!p) {
+                        return -ENOMEM;
+                }
+                p->uid = uid;
+                configure_peer(p);
+                p->next = adm->peers;
+                adm->peers = p;
+        }
+
+        if (adm->max_connections > 0 && p->connections >= adm->max_connections) {
+                p->refused++;
+                return -EUSERS;
+        }
+
+        p->connections++;
+        *peer = p;
+
+        return 0;
+}
+
+void admission_disconnect(struct peer *peer)
+{
+        if (peer->connections > 0) {
+                peer->connections--;
+        }
+}
+
+bool admission_record(struct peer *peer, uint32_t *retry_after)
+{
+        peer->records++;
+
+        if (peer->limited && !token_bucket_take(&peer->bucket, retry_after)) {
+                peer->throttled++;
+                return false;
+        }
+
+        return true;
+}
+
+bool admission_class_record(struct peer *peer, const char *classification,
+                            uint32_t *retry_after)
+{
+        struct peer_class *class;
+        const char *pattern;
+        int64_t records, window;
+
+        pattern = peer_class_rate_limit_config(classification, &records, &window);
+        if (!pattern) {
+                return true;
+        }
+
+        for (class = peer->classes; class; class = class->next) {
+                if (strcmp(class->pattern, pattern) == 0) {
+                        break;
+                }
+        }
+
+        if (!class) {
+                class = malloc(sizeof(struct peer_class));
+                if (!class || !(class->pattern = strdup(pattern))) {
+                        /* Let the record through rather than lose it */
+                        telem_log(LOG_ERR, "Unable to allocate memory for the rate"
+                                  " limit of %s\n", pattern);
+                        free(class);
+                        return true;
+                }
+                token_bucket_init(&class->bucket, records, window);
+                class->next = peer->classes;
+                peer->classes = class;
+        }
+
+        if (!token_bucket_take(&class->bucket, retry_after)) {
+                peer->class_throttled++;
+                return false;
+        }
+
+        return true;
+}
+
+void admission_log(struct admission *adm, int priority)
+{
+        for (struct peer *peer = adm->peers; peer; peer = peer->next) {
+                telem_log(priority, "Peer uid %u: %u connections, %" PRIu64
+                          " refused; %" PRIu64 " records, %" PRIu64
+                          " throttled, %" PRIu64 " throttled by classification\n",
+                          (unsigned int)peer->uid, peer->connections,
+                          peer->refused, peer->records, peer->throttled,
+                          peer->class_throttled);
+        }
+}
+
+void admission_free(struct admission *adm)
+{
+        struct peer *peer;
+
+        while ((peer = adm->peers) != NULL) {
+                adm->peers = peer->next;
+                free_peer_classes(peer);
+                free(peer);
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
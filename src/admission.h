@@ -0,0 +1,143 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* Allows capacity records at once, refilled at refill_rate records per
+ * second */
+struct token_bucket {
+        double tokens;
+        double capacity;
+        double refill_rate;
+        struct timespec last_refill;
+};
+
+/* Rate limit of the records a peer sends for the classifications matching
+ * a pattern of the peer_class_rate_limits section */
+struct peer_class {
+        char *pattern;
+        struct token_bucket bucket;
+        struct peer_class *next;
+};
+
+/* Admission state and counters of the connections of a user */
+struct peer {
+        uid_t uid;
+        /* connections open now */
+        unsigned int connections;
+        /* rate limit of every record of the user, if limited */
+        bool limited;
+        struct token_bucket bucket;
+        struct peer_class *classes;
+        /* records received, records dropped by the user and classification
+         * rate limits, and connections refused */
+        uint64_t records;
+        uint64_t throttled;
+        uint64_t class_throttled;
+        uint64_t refused;
+        struct peer *next;
+};
+
+/*
+ * Admission control of telemprobd. Peers are identified by the user id of
+ * their socket credentials, and are kept once seen so that their counters
+ * outlive their connections. Not thread-safe.
+ */
+struct admission {
+        struct peer *peers;
+        /* maximum connections per peer, 0 for no limit */
+        unsigned int max_connections;
+};
+
+/**
+ * Initialize the admission state
+ *
+ * @param adm The admission state
+ */
+void admission_init(struct admission *adm);
+
+/**
+ * Apply the limits of the configuration
+ *
+ * Rate limits of known peers restart with full buckets.
+ *
+ * @param adm The admission state
+ */
+void admission_configure(struct admission *adm);
+
+/**
+ * Admit a new connection
+ *
+ * @param adm The admission state
+ * @param uid The user id of the connected process
+ * @param peer Set to the peer the connection is accounted to
+ *
+ * @return 0 on success, -EUSERS if the peer has too many connections open,
+ *     or -ENOMEM
+ */
+int admission_connect(struct admission *adm, uid_t uid, struct peer **peer);
+
+/**
+ * Account for a closed connection
+ *
+ * @param peer The peer returned by admission_connect()
+ */
+void admission_disconnect(struct peer *peer);
+
+/**
+ * Admit a record, before any of it is read
+ *
+ * @param peer The peer that sends the record
+ * @param retry_after Set to the time in milliseconds until a record of the
+ *     peer is admitted again, if it is throttled
+ *
+ * @return false if the record is throttled
+ */
+bool admission_record(struct peer *peer, uint32_t *retry_after);
+
+/**
+ * Admit a record by its classification, once its headers are parsed
+ *
+ * @param peer The peer that sends the record
+ * @param classification The classification of the record
+ * @param retry_after Set as with admission_record()
+ *
+ * @return false if the record is throttled
+ */
+bool admission_class_record(struct peer *peer, const char *classification,
+                            uint32_t *retry_after);
+
+/**
+ * Log the counters of every peer
+ *
+ * @param adm The admission state
+ * @param priority The log priority, e.g. LOG_INFO
+ */
+void admission_log(struct admission *adm, int priority);
+
+/**
+ * Release the admission state
+ *
+ * @param adm The admission state
+ */
+void admission_free(struct admission *adm);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,253 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "log.h"
+
+/* Seconds a connection is idle before TCP keep-alive probes are sent, and
+ * between probes */
+#define BACKEND_KEEPALIVE_IDLE 60L
+#define BACKEND_KEEPALIVE_INTERVAL 30L
+
+static void free_backend(struct backend *backend)
+{
+        curl_slist_free_all(backend->headers);
+        curl_slist_free_all(backend->ndjson_headers);
+        compressor_free(&backend->compressor);
+        free(backend->url);
+        free(backend->cainfo);
+        free(backend->tidheader);
+        free(backend->dictionary);
+        free(backend);
+}
+
+static bool backend_matches(const struct backend *backend,
+                            const struct backend_config *config)
+{
+        return strcmp(backend->url, config->url) == 0 &&
+               strcmp(backend->cainfo, config->cainfo) == 0 &&
+               strcmp(backend->tidheader, config->tidheader) == 0 &&
+               backend->compression == config->compression &&
+               backend->compression_level == config->compression_level &&
+               strcmp(backend->dictionary, config->dictionary) == 0;
+}
+
+/* Adds the headers of the requests to a backend, returns false if memory
+ * could not be allocated */
+static bool add_headers(struct backend *backend)
+{
+        const char *encoding = compressor_encoding(&backend->compressor);
+        char content_encoding[32];
+
+        backend->headers = curl_slist_append(NULL, backend->tidheader);
+        backend->ndjson_headers = curl_slist_append(NULL, backend->tidheader);
+        // This should be set by probes/libtelemetry in the future
+        if (!backend->headers || !backend->ndjson_headers ||
+            !curl_slist_append(backend->headers, "Content-Type: application/json") ||
+            !curl_slist_append(backend->ndjson_headers,
+                               "Content-Type: application/x-ndjson")) {
+                return false;
+        }
+
+        if (encoding) {
+                snprintf(content_encoding, sizeof(content_encoding),
+                         "Content-Encoding: %s", encoding);
+                if (!curl_slist_append(backend->headers, content_encoding) ||
+                    !curl_slist_append(backend->ndjson_headers, content_encoding)) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/* Initializes libcurl, and the data shared by the handles of the cache.
+ * Returns false if libcurl could not be initialized. */
+static bool init_cache(struct backend_cache *cache)
+{
+        if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+                telem_log(LOG_ERR, "curl_global_init(): Unable to initialize libcurl\n");
+                return false;
+        }
+        cache->curl_initialized = true;
+
+        // Without it, every connection does a full TLS handshake
+        cache->share = curl_share_init();
+        if (!cache->share ||
+            curl_share_setopt(cache->share, CURLSHOPT_SHARE,
+                              CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK ||
+            curl_share_setopt(cache->share, CURLSHOPT_SHARE,
+                              CURL_LOCK_DATA_DNS) != CURLSHE_OK) {
+                telem_log(LOG_WARNING, "curl_share_init(): Unable to share TLS"
+                          " sessions between connections\n");
+                if (cache->share) {
+                        curl_share_cleanup(cache->share);
+                        cache->share = NULL;
+                }
+        }
+
+        return true;
+}
+
+struct backend *backend_get(struct backend_cache *cache,
+                            const struct backend_config *config)
+{
+        struct backend *backend;
+        const char *url = config->url;
+
+        cache->last_used = time(NULL);
+
+        for (backend = cache->backends; backend; backend = backend->next) {
+                if (backend_matches(backend, config)) {
+                        return backend;
+                }
+        }
+
+        if (!cache->curl_initialized && !init_cache(cache)) {
+                return NULL;
+        }
+
+        backend = calloc(1, sizeof(struct backend));
+        if (!backend) {
+                telem_log(LOG_ERR, "Unable to allocate memory for backend %s\n", url);
+                return NULL;
+        }
+        backend->url = strdup(url);
+        backend->cainfo = strdup(config->cainfo);
+        backend->tidheader = strdup(config->tidheader);
+        backend->dictionary = strdup(config->dictionary);
+        backend->compression = config->compression;
+        backend->compression_level = config->compression_level;
+        if (!backend->url || !backend->cainfo || !backend->tidheader ||
+            !backend->dictionary) {
+                telem_log(LOG_ERR, "Unable to allocate memory for backend %s\n", url);
+                free_backend(backend);
+                return NULL;
+        }
+
+        if (compressor_init(&backend->compressor, config->compression,
+                            config->compression_level, config->dictionary) < 0 ||
+            !add_headers(backend)) {
+                telem_log(LOG_ERR, "Unable to set up backend %s\n", url);
+                free_backend(backend);
+                return NULL;
+        }
+
+        backend->next = cache->backends;
+        cache->backends = backend;
+
+        return backend;
+}
+
+CURL *backend_handle(struct backend_cache *cache, struct backend *backend,
+                     char *errorbuf)
+{
+        CURL *curl;
+
+        curl = curl_easy_init();
+        if (!curl) {
+                telem_log(LOG_ERR, "curl_easy_init(): Unable to start libcurl"
+                          " easy session\n");
+                return NULL;
+        }
+
+        // Errors for any curl_easy_* functions will store nice error messages
+        // in errorbuf, so send log messages with errorbuf contents
+        if (curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorbuf) != CURLE_OK ||
+            curl_easy_setopt(curl, CURLOPT_URL, backend->url) != CURLE_OK ||
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L) != CURLE_OK ||
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L) != CURLE_OK ||
+            curl_easy_setopt(curl, CURLOPT_POST, 1) != CURLE_OK ||
+#ifdef DEBUG
+            curl_easy_setopt(curl, CURLOPT_VERBOSE, 1) != CURLE_OK ||
+#endif
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, backend->headers) != CURLE_OK ||
+            curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY) != CURLE_OK ||
+            // Records posted at once share one connection if the server
+            // supports HTTP/2
+            curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS) != CURLE_OK ||
+            curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L) != CURLE_OK ||
+            // Keep the connection, and the TLS session to resume it, between
+            // records
+            curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L) != CURLE_OK ||
+            curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, BACKEND_KEEPALIVE_IDLE) != CURLE_OK ||
+            curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, BACKEND_KEEPALIVE_INTERVAL) != CURLE_OK ||
+            curl_easy_setopt(curl, CURLOPT_SSL_SESSIONID_CACHE, 1L) != CURLE_OK ||
+            (cache->share &&
+             curl_easy_setopt(curl, CURLOPT_SHARE, cache->share) != CURLE_OK)) {
+                telem_log(LOG_ERR, "curl_easy_setopt(): Failed to set one or more options\n");
+                curl_easy_cleanup(curl);
+                return NULL;
+        }
+
+        if (strlen(backend->cainfo) > 0 && access(backend->cainfo, F_OK) != -1) {
+                if (curl_easy_setopt(curl, CURLOPT_CAINFO, backend->cainfo) != CURLE_OK) {
+                        telem_log(LOG_ERR, "curl_easy_setopt(): Failed to set CAINFO\n");
+                        curl_easy_cleanup(curl);
+                        return NULL;
+                }
+                telem_log(LOG_INFO, "cafile was set to %s\n", backend->cainfo);
+        }
+
+        return curl;
+}
+
+int backend_cache_timeout(struct backend_cache *cache, int idle_time, time_t now)
+{
+        time_t remaining;
+
+        if (!cache->backends) {
+                return -1;
+        }
+
+        remaining = cache->last_used + idle_time - now;
+        if (remaining <= 0) {
+                return 0;
+        } else if (remaining > INT_MAX / 1000) {
+                return INT_MAX;
+        }
+
+        return (int)remaining * 1000;
+}
+
+void backend_cache_clear(struct backend_cache *cache)
+{
+        struct backend *backend;
+
+        while ((backend = cache->backends) != NULL) {
+                cache->backends = backend->next;
+                free_backend(backend);
+        }
+
+        if (cache->share) {
+                curl_share_cleanup(cache->share);
+                cache->share = NULL;
+        }
+
+        // Release libcurl as well, so that when the daemon is sitting idle, it
+        // will be consuming as little memory as possible
+        if (cache->curl_initialized) {
+                curl_global_cleanup();
+                cache->curl_initialized = false;
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
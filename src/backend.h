@@ -0,0 +1,122 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include "compress.h"
+
+/* The settings records are posted with, records with the same settings share
+ * a backend */
+struct backend_config {
+        const char *url;
+        /* the CA bundle to verify the server with, or "" */
+        const char *cainfo;
+        /* the X-Telemetry-TID header line */
+        const char *tidheader;
+        enum compression compression;
+        int compression_level;
+        /* the zstd dictionary shared with the server, or "" */
+        const char *dictionary;
+};
+
+/* A server records are posted to, with the settings of the records sent
+ * to it */
+struct backend {
+        char *url;
+        char *cainfo;
+        char *tidheader;
+        enum compression compression;
+        int compression_level;
+        char *dictionary;
+        /* compresses the bodies of the requests to the backend */
+        struct compressor compressor;
+        struct curl_slist *headers;
+        /* headers of the requests packing one record per line */
+        struct curl_slist *ndjson_headers;
+        struct backend *next;
+};
+
+/*
+ * The backends records were posted to recently. libcurl is only kept
+ * initialized while records are posted: the cache is emptied once it has not
+ * been used for idle_time seconds, so that an idle telempostd holds little
+ * memory. Not thread-safe.
+ */
+struct backend_cache {
+        struct backend *backends;
+        /* TLS sessions and DNS entries shared by the handles of the cache, so
+         * that new connections to a backend resume its TLS session */
+        CURLSH *share;
+        /* whether curl_global_init() was called for the cached handles */
+        bool curl_initialized;
+        /* time the cache was last used */
+        time_t last_used;
+};
+
+/**
+ * Get a backend from the cache
+ *
+ * Adds the backend the first time it is used, or after the cache was
+ * emptied.
+ *
+ * @param cache The cache
+ * @param config The settings of the records posted to the backend
+ *
+ * @return The backend, or NULL if libcurl could not be initialized
+ */
+struct backend *backend_get(struct backend_cache *cache,
+                            const struct backend_config *config);
+
+/**
+ * Create a handle set up for a POST request to a backend
+ *
+ * The handle uses HTTP/2 when the server supports it, and waits for a
+ * connection that can be multiplexed rather than opening a new one. The
+ * caller sets the request body, and cleans up the handle before the cache
+ * is cleared.
+ *
+ * @param cache The cache of the backend
+ * @param backend The backend
+ * @param errorbuf The buffer the errors of the handle are written to
+ *
+ * @return The handle, or NULL if libcurl could not set it up
+ */
+CURL *backend_handle(struct backend_cache *cache, struct backend *backend,
+                     char *errorbuf);
+
+/**
+ * Get the time until the cache is emptied
+ *
+ * @param cache The cache
+ * @param idle_time The idle time in seconds after which it is emptied
+ * @param now The current time
+ *
+ * @return The time in milliseconds, or -1 if the cache is empty
+ */
+int backend_cache_timeout(struct backend_cache *cache, int idle_time, time_t now);
+
+/**
+ * Empty the cache and release libcurl
+ *
+ * @param cache The cache
+ */
+void backend_cache_clear(struct backend_cache *cache);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,123 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bufpool.h"
+
+static inline size_t class_size(int index)
+{
+        return (size_t)1 << (BUFFER_POOL_MIN_SHIFT + index);
+}
+
+/* Returns the smallest class that fits size, or -1 if none does */
+static int class_index(size_t size)
+{
+        for (int i = 0; i < BUFFER_POOL_CLASSES; i++) {
+                if (size <= class_size(i)) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
+void buffer_pool_init(struct buffer_pool *pool, size_t max_cached)
+{
+        memset(pool, 0, sizeof(*pool));
+        pool->max_cached = max_cached;
+}
+
+void *buffer_pool_get(struct buffer_pool *pool, size_t size, size_t *capacity)
+{
+        struct buffer_pool_class *class;
+        struct buffer_pool_block *block;
+        int index = class_index(size);
+
+        if (index < 0) {
+                pool->misses++;
+                *capacity = size;
+                return malloc(size);
+        }
+
+        class = &pool->classes[index];
+        *capacity = class_size(index);
+
+        if (class->free) {
+                block = class->free;
+                class->free = block->next;
+                class->count--;
+                pool->cached -= *capacity;
+                pool->hits++;
+                return block;
+        }
+
+        pool->misses++;
+        return malloc(*capacity);
+}
+
+void buffer_pool_put(struct buffer_pool *pool, void *block, size_t capacity)
+{
+        struct buffer_pool_class *class;
+        struct buffer_pool_block *b = block;
+        int index;
+
+        if (!block) {
+                return;
+        }
+
+        index = class_index(capacity);
+        if (index < 0 || pool->cached + class_size(index) > pool->max_cached) {
+                free(block);
+                return;
+        }
+
+        class = &pool->classes[index];
+        b->next = class->free;
+        class->free = b;
+        class->count++;
+        pool->cached += class_size(index);
+}
+
+void buffer_pool_shrink(struct buffer_pool *pool, size_t max_cached)
+{
+        struct buffer_pool_block *block;
+
+        /* Free the largest blocks first */
+        for (int i = BUFFER_POOL_CLASSES - 1; i >= 0 && pool->cached > max_cached; i--) {
+                struct buffer_pool_class *class = &pool->classes[i];
+
+                while (class->free && pool->cached > max_cached) {
+                        block = class->free;
+                        class->free = block->next;
+                        class->count--;
+                        pool->cached -= class_size(i);
+                        free(block);
+                }
+        }
+}
+
+double buffer_pool_hit_rate(struct buffer_pool *pool)
+{
+        uint64_t total = pool->hits + pool->misses;
+
+        if (total == 0) {
+                return 0;
+        }
+        return 100.0 * (double)pool->hits / (double)total;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,105 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size classes are powers of two from 64 bytes to 32 KiB; larger blocks are
+ * not cached */
+#define BUFFER_POOL_MIN_SHIFT 6
+#define BUFFER_POOL_CLASSES 10
+
+struct buffer_pool_block {
+        struct buffer_pool_block *next;
+};
+
+struct buffer_pool_class {
+        /* cached blocks, all of the class size */
+        struct buffer_pool_block *free;
+        size_t count;
+};
+
+/*
+ * Cache of freed memory blocks, sorted in size classes, for the short-lived
+ * allocations of telemprobd (client structs and receive buffers). Not
+ * thread-safe. Every block handed out by the pool is a separate malloc()
+ * allocation, so it may also be released with free().
+ */
+struct buffer_pool {
+        struct buffer_pool_class classes[BUFFER_POOL_CLASSES];
+        /* bytes held in the free lists, and the high-water mark */
+        size_t cached;
+        size_t max_cached;
+        /* allocations served from the free lists, and from malloc() */
+        uint64_t hits;
+        uint64_t misses;
+};
+
+/**
+ * Initialize a buffer pool
+ *
+ * @param pool The pool
+ * @param max_cached Maximum number of bytes kept in the pool, 0 disables
+ *     caching
+ */
+void buffer_pool_init(struct buffer_pool *pool, size_t max_cached);
+
+/**
+ * Get a block of at least size bytes
+ *
+ * @param pool The pool
+ * @param size The number of bytes needed
+ * @param capacity Set to the usable size of the block
+ *
+ * @return The block, or NULL if memory could not be allocated
+ */
+void *buffer_pool_get(struct buffer_pool *pool, size_t size, size_t *capacity);
+
+/**
+ * Return a block to the pool
+ *
+ * The block is freed instead if the pool would grow past its high-water
+ * mark, or if it is too large to be cached.
+ *
+ * @param pool The pool
+ * @param block A block returned by buffer_pool_get(), or NULL
+ * @param capacity The size the block was requested with, or the capacity
+ *     returned with it
+ */
+void buffer_pool_put(struct buffer_pool *pool, void *block, size_t capacity);
+
+/**
+ * Free cached blocks until the pool holds at most max_cached bytes
+ *
+ * The high-water mark of the pool is not changed.
+ *
+ * @param pool The pool
+ * @param max_cached The number of bytes to keep
+ */
+void buffer_pool_shrink(struct buffer_pool *pool, size_t max_cached);
+
+/**
+ * Get the percentage of allocations served from the pool
+ *
+ * @param pool The pool
+ *
+ * @return The hit rate, or 0 if nothing was allocated yet
+ */
+double buffer_pool_hit_rate(struct buffer_pool *pool);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
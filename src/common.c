@@ -37,7 +37,16 @@ static const char *header_names[] = {
         TM_BOARD_NAME_STR,
         TM_CPU_MODEL_STR,
         TM_BIOS_VERSION_STR,
-        TM_EVENT_ID_STR
+        TM_EVENT_ID_STR,
+        TM_DROPPED_COUNT_STR,
+        TM_SAMPLE_RATE_STR
+};
+
+/* Headers added in record format version 5, with the values that records
+ * of older versions implicitly have */
+static const char *header_defaults[NUM_HEADERS] = {
+        [TM_DROPPED_COUNT] = "0",
+        [TM_SAMPLE_RATE] = "1/1"
 };
 
 const char *get_header_name(int ind)
@@ -46,4 +55,10 @@ const char *get_header_name(int ind)
         return header_names[ind];
 }
 
+const char *get_header_default(int ind)
+{
+        assert(ind >= 0 && ind < NUM_HEADERS);
+        return header_defaults[ind];
+}
+
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -39,6 +39,8 @@
 #define TM_CPU_MODEL 12
 #define TM_BIOS_VERSION 13
 #define TM_EVENT_ID 14
+#define TM_DROPPED_COUNT 15
+#define TM_SAMPLE_RATE 16
 
 #define TM_RECORD_VERSION_STR "record_format_version"
 #define TM_CLASSIFICATION_STR "classification"
@@ -55,8 +57,10 @@
 #define TM_CPU_MODEL_STR "cpu_model"
 #define TM_BIOS_VERSION_STR "bios_version"
 #define TM_EVENT_ID_STR "event_id"
+#define TM_DROPPED_COUNT_STR "dropped_count"
+#define TM_SAMPLE_RATE_STR "sample_rate"
 
-#define NUM_HEADERS 15
+#define NUM_HEADERS 17
 
 #define EVENT_ID_ALPHAB "0123456789abcdef"
 #define EVENT_ID_LEN 32
@@ -70,7 +74,7 @@
  * structure (e.g. adding or removing a header field). Note that the value
  * should be an unsigned int.
  */
-static const uint32_t RECORD_FORMAT_VERSION = 4;
+static const uint32_t RECORD_FORMAT_VERSION = 5;
 
 #define TM_SITE_VERSION_FILE "/etc/os-release"
 #define TM_DIST_VERSION_FILE "/usr/lib/os-release"
@@ -107,17 +111,59 @@ static const uint32_t RECORD_FORMAT_VERSION = 4;
 #define CFG_PREFIX_LENGTH 4
 #define CFG_PREFIX_32BIT  0x3a474643
 
-/* Very simple structure. Array of header strings and a payload. Calling
- * program is reponsible for passing in the payload as a simple string.
+/* Definitions for record acknowledgements. A client that sends
+ * RECORD_ACK_REQUEST in place of a record size receives a struct record_ack
+ * for each record it sends afterwards on the same connection. Older daemons
+ * take the value for an invalid record size and close the connection. */
+#define RECORD_ACK_REQUEST 0x314b4341
+
+/* status is an enum tm_ack_status value, retry_after is in milliseconds */
+struct record_ack {
+        uint32_t status;
+        uint32_t retry_after;
+};
+
+/* A record and its data live in a single allocation. data holds the record
+ * the way it is sent to the daemon after the record size and optional config
+ * file fields:
+ *
+ *   <uint32_t header_size> <header lines> <payload> <null byte>
+ *
+ * Headers are stored in index order and referenced by offset, so a record
+ * can be copied or moved as a plain block of memory. Header i spans
+ * header_offset[i] to header_offset[i + 1], and the payload starts at
+ * header_offset[NUM_HEADERS].
  */
 struct telem_record {
-        char *headers[NUM_HEADERS];
-        char *payload;
+        uint32_t header_offset[NUM_HEADERS + 1];
         size_t header_size;
         size_t payload_size;
+        /* bytes used and available in data */
+        size_t size;
+        size_t capacity;
+        char data[];
 };
 
+/* Returns header index of a record, which is not null-terminated, and stores
+ * its length in len */
+static inline const char *tm_record_header(const struct telem_record *record,
+                                           int index, size_t *len)
+{
+        *len = record->header_offset[index + 1] - record->header_offset[index];
+        return record->data + record->header_offset[index];
+}
+
+/* Returns the null-terminated payload of a record */
+static inline const char *tm_record_payload(const struct telem_record *record)
+{
+        return record->data + record->header_offset[NUM_HEADERS];
+}
+
 const char *get_header_name(int ind);
 
+/* Gets the value of a header that records of an older format lack, or NULL
+ * if every record has that header */
+const char *get_header_default(int ind);
+
 
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,252 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+#include "log.h"
+#include "util.h"
+
+/* Largest dictionary read, zstd dictionaries are usually around 100 KB */
+#define COMPRESS_MAX_DICTIONARY (16 * 1024 * 1024)
+
+/* gzip framing, rather than raw deflate or zlib */
+#define GZIP_WINDOW_BITS (MAX_WBITS + 16)
+
+static int init_gzip(struct compressor *c)
+{
+        int ret;
+
+        if (c->level == 0) {
+                c->level = Z_DEFAULT_COMPRESSION;
+        } else if (c->level < Z_BEST_SPEED) {
+                c->level = Z_BEST_SPEED;
+        } else if (c->level > Z_BEST_COMPRESSION) {
+                c->level = Z_BEST_COMPRESSION;
+        }
+
+        ret = deflateInit2(&c->zs, c->level, Z_DEFLATED, GZIP_WINDOW_BITS, 8,
+                           Z_DEFAULT_STRATEGY);
+        if (ret != Z_OK) {
+                telem_log(LOG_ERR, "deflateInit2(): Unable to initialize gzip: %s\n",
+                          c->zs.msg ? c->zs.msg : zError(ret));
+                return ret == Z_MEM_ERROR ? -ENOMEM : -EINVAL;
+        }
+        c->zs_initialized = true;
+
+        return 0;
+}
+
+static ssize_t compress_gzip(struct compressor *c, const char *in, size_t len,
+                             char **out, size_t *size)
+{
+        uLong bound;
+
+        if (len > UINT_MAX) {
+                return -E2BIG;
+        }
+
+        deflateReset(&c->zs);
+        bound = deflateBound(&c->zs, (uLong)len);
+        if (!reallocate((void **)out, size, bound)) {
+                return -ENOMEM;
+        }
+
+        c->zs.next_in = (Bytef *)in;
+        c->zs.avail_in = (uInt)len;
+        c->zs.next_out = (Bytef *)*out;
+        c->zs.avail_out = (uInt)(bound < UINT_MAX ? bound : UINT_MAX);
+        if (deflate(&c->zs, Z_FINISH) != Z_STREAM_END) {
+                telem_log(LOG_ERR, "deflate(): Unable to compress body: %s\n",
+                          c->zs.msg ? c->zs.msg : "buffer too small");
+                return -EIO;
+        }
+
+        return (ssize_t)c->zs.total_out;
+}
+
+#ifdef HAVE_ZSTD_H
+/* Reads a dictionary, returns NULL if it can not be read */
+static void *read_dictionary(const char *path, size_t *len)
+{
+        FILE *fp;
+        char *dict = NULL;
+        size_t size = 0;
+
+        fp = fopen(path, "r");
+        if (!fp) {
+                telem_log(LOG_ERR, "Unable to open compression dictionary %s: %s\n",
+                          path, strerror(errno));
+                return NULL;
+        }
+
+        *len = 0;
+        while (1) {
+                size_t n;
+
+                if (!reallocate((void **)&dict, &size, *len + 4096) ||
+                    size > COMPRESS_MAX_DICTIONARY) {
+                        telem_log(LOG_ERR, "Compression dictionary %s too large\n", path);
+                        break;
+                }
+                n = fread(dict + *len, 1, size - *len, fp);
+                *len += n;
+                if (n == 0) {
+                        if (ferror(fp)) {
+                                telem_log(LOG_ERR, "Unable to read compression"
+                                          " dictionary %s\n", path);
+                                break;
+                        }
+                        fclose(fp);
+                        return dict;
+                }
+        }
+
+        fclose(fp);
+        free(dict);
+        return NULL;
+}
+
+static int init_zstd(struct compressor *c, const char *dictionary)
+{
+        void *dict;
+        size_t len;
+
+        if (c->level == 0) {
+                c->level = ZSTD_CLEVEL_DEFAULT;
+        } else if (c->level < ZSTD_minCLevel()) {
+                c->level = ZSTD_minCLevel();
+        } else if (c->level > ZSTD_maxCLevel()) {
+                c->level = ZSTD_maxCLevel();
+        }
+
+        c->cctx = ZSTD_createCCtx();
+        if (!c->cctx) {
+                telem_log(LOG_ERR, "ZSTD_createCCtx(): Unable to initialize zstd\n");
+                return -ENOMEM;
+        }
+
+        // The server decompresses with the same dictionary, found from the
+        // dictionary id of the frame
+        if (dictionary[0] != '\0' && (dict = read_dictionary(dictionary, &len)) != NULL) {
+                c->cdict = ZSTD_createCDict(dict, len, c->level);
+                if (!c->cdict) {
+                        telem_log(LOG_ERR, "Unable to load compression dictionary %s\n",
+                                  dictionary);
+                }
+                free(dict);
+        }
+
+        return 0;
+}
+
+static ssize_t compress_zstd(struct compressor *c, const char *in, size_t len,
+                             char **out, size_t *size)
+{
+        size_t bound = ZSTD_compressBound(len);
+        size_t ret;
+
+        if (!reallocate((void **)out, size, bound)) {
+                return -ENOMEM;
+        }
+
+        if (c->cdict) {
+                ret = ZSTD_compress_usingCDict(c->cctx, *out, *size, in, len, c->cdict);
+        } else {
+                ret = ZSTD_compressCCtx(c->cctx, *out, *size, in, len, c->level);
+        }
+        if (ZSTD_isError(ret)) {
+                telem_log(LOG_ERR, "Unable to compress body: %s\n", ZSTD_getErrorName(ret));
+                return -EIO;
+        }
+
+        return (ssize_t)ret;
+}
+#endif
+
+int compressor_init(struct compressor *c, enum compression method, int level,
+                    const char *dictionary)
+{
+        memset(c, 0, sizeof(struct compressor));
+        c->method = method;
+        c->level = level;
+
+#ifndef HAVE_ZSTD_H
+        if (method == COMPRESSION_ZSTD) {
+                telem_log(LOG_WARNING, "Built without zstd, compressing with gzip\n");
+                c->method = COMPRESSION_GZIP;
+        }
+#endif
+
+        switch (c->method) {
+        case COMPRESSION_GZIP:
+                return init_gzip(c);
+#ifdef HAVE_ZSTD_H
+        case COMPRESSION_ZSTD:
+                return init_zstd(c, dictionary);
+#endif
+        default:
+                return 0;
+        }
+}
+
+const char *compressor_encoding(const struct compressor *c)
+{
+        switch (c->method) {
+        case COMPRESSION_GZIP:
+                return "gzip";
+        case COMPRESSION_ZSTD:
+                return "zstd";
+        default:
+                return NULL;
+        }
+}
+
+ssize_t compressor_compress(struct compressor *c, const char *in, size_t len,
+                            char **out, size_t *size)
+{
+        switch (c->method) {
+        case COMPRESSION_GZIP:
+                return compress_gzip(c, in, len, out, size);
+#ifdef HAVE_ZSTD_H
+        case COMPRESSION_ZSTD:
+                return compress_zstd(c, in, len, out, size);
+#endif
+        default:
+                return -EINVAL;
+        }
+}
+
+void compressor_free(struct compressor *c)
+{
+        if (c->zs_initialized) {
+                deflateEnd(&c->zs);
+                c->zs_initialized = false;
+        }
+#ifdef HAVE_ZSTD_H
+        ZSTD_freeCDict(c->cdict);
+        ZSTD_freeCCtx(c->cctx);
+        c->cdict = NULL;
+        c->cctx = NULL;
+#endif
+        c->method = COMPRESSION_NONE;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,92 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
+#include "configuration.h"
+
+/*
+ * Compresses request bodies for a Content-Encoding. The compression state,
+ * and the zstd dictionary, are kept between bodies. Not thread-safe.
+ */
+struct compressor {
+        enum compression method;
+        int level;
+        z_stream zs;
+        bool zs_initialized;
+#ifdef HAVE_ZSTD_H
+        ZSTD_CCtx *cctx;
+        /* the pre-shared dictionary, digested for level */
+        ZSTD_CDict *cdict;
+#endif
+};
+
+/**
+ * Initialize a compressor
+ *
+ * Without zstd support, zstd falls back to gzip. A dictionary that can not
+ * be read is not used.
+ *
+ * @param c The compressor
+ * @param method The compression method
+ * @param level The compression level, 0 for the default of the method
+ * @param dictionary The path of a zstd dictionary, or ""
+ *
+ * @return 0 on success, a negative errno otherwise
+ */
+int compressor_init(struct compressor *c, enum compression method, int level,
+                    const char *dictionary);
+
+/**
+ * Get the Content-Encoding of the bodies compressed
+ *
+ * @param c The compressor
+ *
+ * @return The encoding, or NULL if bodies are not compressed
+ */
+const char *compressor_encoding(const struct compressor *c);
+
+/**
+ * Compress a body
+ *
+ * @param c The compressor
+ * @param in The body
+ * @param len The length of the body
+ * @param out The buffer the compressed body is written to, grown as needed
+ * @param size The size of the buffer
+ *
+ * @return The length of the compressed body, or a negative errno
+ */
+ssize_t compressor_compress(struct compressor *c, const char *in, size_t len,
+                            char **out, size_t *size);
+
+/**
+ * Free the state of a compressor
+ *
+ * @param c The compressor
+ */
+void compressor_free(struct compressor *c);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "configuration.h"
 #include "util.h"
@@ -44,7 +45,12 @@ static const char *config_key_str[] = { "server",
                                         "spool_dir",
                                         "rate_limit_strategy",
                                         "cainfo",
-                                        "tidheader"};
+                                        "tidheader",
+                                        "durability",
+                                        "handoff_socket_path",
+                                        "batch_format",
+                                        "compression",
+                                        "compression_dictionary" };
 
 static const char *config_key_int[] = { "record_expiry",
                                         "spool_max_size",
@@ -52,24 +58,48 @@ static const char *config_key_int[] = { "record_expiry",
                                         "record_window_length",
                                         "byte_window_length",
                                         "record_burst_limit",
-                                        "byte_burst_limit" };
+                                        "byte_burst_limit",
+                                        "buffer_pool_max_size",
+                                        "memory_release_idle_time",
+                                        "segment_max_size",
+                                        "segment_max_age",
+                                        "durability_group_records",
+                                        "durability_group_interval",
+                                        "peer_max_connections",
+                                        "connection_idle_time",
+                                        "max_concurrent_posts",
+                                        "batch_max_records",
+                                        "batch_max_size",
+                                        "compression_level" };
 
 static const char *config_key_bool[] = { "rate_limit_enabled",
                                          "daemon_recycling_enabled",
                                          "record_retention_enabled",
-                                         "record_server_delivery_enabled" };
+                                         "record_server_delivery_enabled",
+                                         "direct_handoff_enabled" };
+
+static const char *config_key_limit[] = { "record_rate_limits",
+                                          "record_sampling",
+                                          "peer_rate_limits",
+                                          "peer_class_rate_limits" };
 
 static const char *config_str_default[] = { DEFAULT_SERVER_ADDR,
                                             DEFAULT_SOCKET_PATH,
                                             DEFAULT_SPOOL_DIR,
                                             DEFAULT_RATE_LIMIT_STRATEGY,
                                             DEFAULT_CAINFO,
-                                            DEFAULT_TIDHEADER };
+                                            DEFAULT_TIDHEADER,
+                                            DEFAULT_DURABILITY,
+                                            DEFAULT_HANDOFF_SOCKET_PATH,
+                                            DEFAULT_BATCH_FORMAT,
+                                            DEFAULT_COMPRESSION,
+                                            DEFAULT_COMPRESSION_DICTIONARY };
 
 static const bool config_bool_default[] = { DEFAULT_RATE_LIMIT_ENABLED,
                                             DEFAULT_DAEMON_RECYCLING_ENABLED,
                                             DEFAULT_RECORD_RETENTION_ENABLED,
-                                            DEFAULT_RECORD_SERVER_DELIVERY_ENABLED };
+                                            DEFAULT_RECORD_SERVER_DELIVERY_ENABLED,
+                                            DEFAULT_DIRECT_HANDOFF_ENABLED };
 
 static const int config_int_default[] = { DEFAULT_RECORD_EXPIRY,
                                           DEFAULT_SPOOL_MAX_SIZE,
@@ -77,11 +107,27 @@ static const int config_int_default[] = { DEFAULT_RECORD_EXPIRY,
                                           DEFAULT_RECORD_WINDOW_LENGTH,
                                           DEFAULT_BYTE_WINDOW_LENGTH,
                                           DEFAULT_RECORD_BURST_LIMIT,
-                                          DEFAULT_BYTE_BURST_LIMIT };
+                                          DEFAULT_BYTE_BURST_LIMIT,
+                                          DEFAULT_BUFFER_POOL_MAX_SIZE,
+                                          DEFAULT_MEMORY_RELEASE_IDLE_TIME,
+                                          DEFAULT_SEGMENT_MAX_SIZE,
+                                          DEFAULT_SEGMENT_MAX_AGE,
+                                          DEFAULT_DURABILITY_GROUP_RECORDS,
+                                          DEFAULT_DURABILITY_GROUP_INTERVAL,
+                                          DEFAULT_PEER_MAX_CONNECTIONS,
+                                          DEFAULT_CONNECTION_IDLE_TIME,
+                                          DEFAULT_MAX_CONCURRENT_POSTS,
+                                          DEFAULT_BATCH_MAX_RECORDS,
+                                          DEFAULT_BATCH_MAX_SIZE,
+                                          DEFAULT_COMPRESSION_LEVEL };
 
 
 static struct configuration config = { { 0 }, { 0 }, { 0 }, false, NULL };
 
+/* Serializes loading and replacing the configuration. Readers only take it
+ * until the configuration has been loaded once. */
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int validate_config_file(const char *f)
 {
         struct stat sbuf;
@@ -125,8 +171,10 @@ int set_config_file(const char *filename)
                 if (filename1 == NULL) {
                     ret = -errno;
                 } else {
+                    pthread_mutex_lock(&config_lock);
                     config_file = filename1;
                     cmd_line_cfg = true;
+                    pthread_mutex_unlock(&config_lock);
                 }
         }
 
@@ -152,6 +200,18 @@ bool set_default_config_values(struct configuration *config)
         return true;
 }
 
+static void free_class_limits(struct configuration *config)
+{
+        for (int i = 0; i < CONF_LIMIT_MAX; i++) {
+                for (size_t j = 0; j < config->num_limits[i]; j++) {
+                        free(config->limits[i][j].pattern);
+                }
+                free(config->limits[i]);
+                config->limits[i] = NULL;
+                config->num_limits[i] = 0;
+        }
+}
+
 /* Needed for unit testing */
 void free_config_struct(struct configuration *config)
 {
@@ -162,6 +222,84 @@ void free_config_struct(struct configuration *config)
         for (int i = 0; i < CONF_STR_MAX; i++) {
                 free(config->strValues[i]);
         }
+
+        free_class_limits(config);
+}
+
+/**
+ * Parses a limit value: "<records>/<seconds>" for rate limits, or
+ * "<records>" for sampling.
+ *
+ * @return true if the value is valid
+ */
+static bool parse_class_limit(int key, const char *value, struct class_limit *limit)
+{
+        char *end = NULL;
+
+        errno = 0;
+        limit->records = strtoll(value, &end, 10);
+        if (errno != 0 || end == value || limit->records <= 0) {
+                return false;
+        }
+
+        if (key == CONF_RECORD_SAMPLING) {
+                limit->window = 0;
+                return *end == '\0';
+        }
+
+        if (*end != '/') {
+                return false;
+        }
+        value = end + 1;
+        limit->window = strtoll(value, &end, 10);
+
+        return errno == 0 && end != value && *end == '\0' && limit->window > 0;
+}
+
+/**
+ * Reads the per-classification limit sections. Invalid lines are logged and
+ * ignored, so that a bad limit does not stop the probes or daemons.
+ *
+ * @return false if out of memory
+ */
+static bool read_class_limits(NcHashmap *keyfile, struct configuration *config)
+{
+        NcHashmapIter iter;
+        NcHashmap *section;
+        void *key, *value;
+        struct class_limit limit;
+        struct class_limit *limits;
+
+        for (int i = 0; i < CONF_LIMIT_MAX; i++) {
+                section = nc_hashmap_get(keyfile, config_key_limit[i]);
+                if (!section) {
+                        continue;
+                }
+
+                nc_hashmap_iter_init(section, &iter);
+                while (nc_hashmap_iter_next(&iter, &key, &value)) {
+                        if (!parse_class_limit(i, value, &limit)) {
+                                telem_log(LOG_ERR, "Ignoring invalid %s value for %s: %s\n",
+                                          config_key_limit[i], (char *)key, (char *)value);
+                                continue;
+                        }
+
+                        limits = realloc(config->limits[i], (config->num_limits[i] + 1) *
+                                         sizeof(struct class_limit));
+                        if (!limits) {
+                                return false;
+                        }
+                        config->limits[i] = limits;
+
+                        limit.pattern = strdup(key);
+                        if (!limit.pattern) {
+                                return false;
+                        }
+                        limits[config->num_limits[i]++] = limit;
+                }
+        }
+
+        return true;
 }
 
 bool read_config_from_file(char *config_file, struct configuration *config)
@@ -175,6 +313,8 @@ bool read_config_from_file(char *config_file, struct configuration *config)
                 telem_log(LOG_ERR, "Failed to read config file\n");
                 return false;
         } else {
+                free_class_limits(config);
+
                 for (int i = 0; i < CONF_STR_MAX; i++) {
                         char *ptr;
                         ptr = nc_hashmap_get(nc_hashmap_get(keyfile, "settings"), config_key_str[i]);
@@ -224,12 +364,17 @@ bool read_config_from_file(char *config_file, struct configuration *config)
                                 config->boolValues[i] = config_bool_default[i];
                         }
                 }
+
+                if (!read_class_limits(keyfile, config)) {
+                        telem_log(LOG_ERR, "Could not set limits: %s\n", strerror(errno));
+                        return false;
+                }
         }
 
         return true;
 }
 
-static void initialize_config(void)
+static void load_config(void)
 {
         if (config.initialized) {
                 return;
@@ -258,17 +403,30 @@ static void initialize_config(void)
                 }
         }
 
-        config.initialized = true;
+        __atomic_store_n(&config.initialized, true, __ATOMIC_RELEASE);
+}
+
+static void initialize_config(void)
+{
+        if (__atomic_load_n(&config.initialized, __ATOMIC_ACQUIRE)) {
+                return;
+        }
+
+        pthread_mutex_lock(&config_lock);
+        load_config();
+        pthread_mutex_unlock(&config_lock);
 }
 
 void reload_config(void)
 {
+        pthread_mutex_lock(&config_lock);
         config.initialized = false;
 
         if (!cmd_line_cfg) {
                 config_file = NULL;
         }
-        initialize_config();
+        load_config();
+        pthread_mutex_unlock(&config_lock);
 }
 
 __attribute__((destructor))
@@ -282,6 +440,8 @@ void free_configuration(void)
                 free(config.strValues[i]);
         }
 
+        free_class_limits(&config);
+
         if (cmd_line_cfg) {
                 free(config_file);
         }
@@ -417,6 +577,249 @@ int byte_window_length_config()
         return (val < 0 || val >= TM_MAX_WINDOW_LENGTH) ? -1 : (int)val;
 }
 
+int64_t buffer_pool_max_size_config()
+{
+        initialize_config();
+        int64_t val = 0;
+        int64_t clamp = LONG_MAX / 1024;
+
+        val = config.intValues[CONF_BUFFER_POOL_MAX_SIZE];
+
+        /* Converted to bytes by the caller */
+        if (val > clamp) {
+                val = clamp;
+        }
+
+        return (val < 0) ? 0 : val;
+}
+
+int memory_release_idle_time_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_MEMORY_RELEASE_IDLE_TIME];
+
+        if (val < 0) {
+                return -1;
+        } else if (val > INT_MAX) {
+                return INT_MAX;
+        }
+
+        return (val == 0) ? 1 : (int)val;
+}
+
+int64_t segment_max_size_config()
+{
+        initialize_config();
+        int64_t val = 0;
+        int64_t clamp = LONG_MAX / 1024;
+
+        val = config.intValues[CONF_SEGMENT_MAX_SIZE];
+
+        /* Converted to bytes by the caller */
+        if (val > clamp) {
+                val = clamp;
+        }
+
+        return (val < 0) ? 0 : val;
+}
+
+int segment_max_age_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_SEGMENT_MAX_AGE];
+
+        if (val < 0) {
+                return 0;
+        } else if (val > INT_MAX) {
+                return INT_MAX;
+        }
+
+        return (int)val;
+}
+
+enum durability_mode durability_config()
+{
+        initialize_config();
+        enum durability_mode mode;
+
+        /* default durability is "none" */
+        if (!parse_durability_mode(config.strValues[CONF_DURABILITY], &mode)) {
+                mode = DURABILITY_NONE;
+        }
+
+        return mode;
+}
+
+unsigned int durability_group_records_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_DURABILITY_GROUP_RECORDS];
+
+        if (val < 1) {
+                return 1;
+        } else if (val > UINT_MAX) {
+                return UINT_MAX;
+        }
+
+        return (unsigned int)val;
+}
+
+unsigned int durability_group_interval_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_DURABILITY_GROUP_INTERVAL];
+
+        if (val < 0) {
+                return 0;
+        } else if (val > UINT_MAX) {
+                return UINT_MAX;
+        }
+
+        return (unsigned int)val;
+}
+
+unsigned int peer_max_connections_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_PEER_MAX_CONNECTIONS];
+
+        if (val < 0) {
+                return 0;
+        } else if (val > UINT_MAX) {
+                return UINT_MAX;
+        }
+
+        return (unsigned int)val;
+}
+
+int connection_idle_time_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_CONNECTION_IDLE_TIME];
+
+        if (val < 0) {
+                return 0;
+        } else if (val > INT_MAX) {
+                return INT_MAX;
+        }
+
+        return (int)val;
+}
+
+unsigned int max_concurrent_posts_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_MAX_CONCURRENT_POSTS];
+
+        if (val < 1) {
+                return 1;
+        } else if (val > UINT_MAX) {
+                return UINT_MAX;
+        }
+
+        return (unsigned int)val;
+}
+
+enum batch_format batch_format_config()
+{
+        initialize_config();
+        const char *format = config.strValues[CONF_BATCH_FORMAT];
+
+        /* default is one record per request */
+        if (strcmp(format, "json") == 0) {
+                return BATCH_JSON;
+        } else if (strcmp(format, "ndjson") == 0) {
+                return BATCH_NDJSON;
+        }
+
+        return BATCH_NONE;
+}
+
+unsigned int batch_max_records_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_BATCH_MAX_RECORDS];
+
+        if (val < 1) {
+                return 1;
+        } else if (val > UINT_MAX) {
+                return UINT_MAX;
+        }
+
+        return (unsigned int)val;
+}
+
+size_t batch_max_size_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        /* KB */
+        val = config.intValues[CONF_BATCH_MAX_SIZE];
+
+        if (val < 1) {
+                return 1024;
+        } else if (val > (int64_t)(SIZE_MAX / 1024)) {
+                return SIZE_MAX;
+        }
+
+        return (size_t)val * 1024;
+}
+
+enum compression compression_config()
+{
+        initialize_config();
+        const char *compression = config.strValues[CONF_COMPRESSION];
+
+        /* default is no compression */
+        if (strcmp(compression, "gzip") == 0) {
+                return COMPRESSION_GZIP;
+        } else if (strcmp(compression, "zstd") == 0) {
+                return COMPRESSION_ZSTD;
+        }
+
+        return COMPRESSION_NONE;
+}
+
+int compression_level_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        /* Clamped to the levels of the method by the compressor */
+        val = config.intValues[CONF_COMPRESSION_LEVEL];
+
+        if (val < INT_MIN) {
+                return INT_MIN;
+        } else if (val > INT_MAX) {
+                return INT_MAX;
+        }
+
+        return (int)val;
+}
+
+const char *compression_dictionary_config()
+{
+        initialize_config();
+        return config.strValues[CONF_COMPRESSION_DICTIONARY];
+}
+
 bool rate_limit_enabled_config()
 {
         initialize_config();
@@ -462,4 +865,119 @@ bool record_server_delivery_enabled_config(void)
         initialize_config();
         return config.boolValues[CONF_RECORD_SERVER_DELIVERY_ENABLED];
 }
+
+bool direct_handoff_enabled_config(void)
+{
+        initialize_config();
+        return config.boolValues[CONF_DIRECT_HANDOFF_ENABLED];
+}
+
+const char *handoff_socket_path_config(void)
+{
+        initialize_config();
+        return (const char *)config.strValues[CONF_HANDOFF_SOCKET_PATH];
+}
+
+/**
+ * Finds the limit of a section that applies to a classification. An exact
+ * match wins over patterns, and longer patterns win over shorter ones.
+ *
+ * @return The limit, or NULL if none applies
+ */
+static const struct class_limit *find_class_limit(int key, const char *classification)
+{
+        const struct class_limit *best = NULL;
+        size_t best_len = 0;
+
+        for (size_t i = 0; i < config.num_limits[key]; i++) {
+                const char *pattern = config.limits[key][i].pattern;
+                size_t len = strlen(pattern);
+
+                if (len > 0 && pattern[len - 1] == '*') {
+                        if (strncmp(pattern, classification, len - 1) != 0) {
+                                continue;
+                        }
+                } else if (strcmp(pattern, classification) == 0) {
+                        return &config.limits[key][i];
+                } else {
+                        continue;
+                }
+
+                if (!best || len > best_len) {
+                        best = &config.limits[key][i];
+                        best_len = len;
+                }
+        }
+
+        return best;
+}
+
+bool class_limits_enabled_config(void)
+{
+        initialize_config();
+        return config.num_limits[CONF_RECORD_RATE_LIMITS] > 0 ||
+               config.num_limits[CONF_RECORD_SAMPLING] > 0;
+}
+
+/* Gets the rate limit of a section for a classification or a user id, see
+ * find_class_limit() */
+static bool rate_limit_config(int key, const char *name, int64_t *records,
+                              int64_t *window)
+{
+        const struct class_limit *limit;
+
+        initialize_config();
+        limit = find_class_limit(key, name);
+        if (!limit) {
+                return false;
+        }
+
+        *records = limit->records;
+        *window = limit->window;
+
+        return true;
+}
+
+bool record_rate_limit_config(const char *classification, int64_t *records,
+                              int64_t *window)
+{
+        return rate_limit_config(CONF_RECORD_RATE_LIMITS, classification,
+                                 records, window);
+}
+
+int64_t record_sampling_config(const char *classification)
+{
+        const struct class_limit *limit;
+
+        initialize_config();
+        limit = find_class_limit(CONF_RECORD_SAMPLING, classification);
+
+        return limit ? limit->records : 1;
+}
+
+bool peer_rate_limit_config(unsigned int uid, int64_t *records, int64_t *window)
+{
+        char name[SMALL_LINE_BUF];
+
+        snprintf(name, sizeof(name), "%u", uid);
+
+        return rate_limit_config(CONF_PEER_RATE_LIMITS, name, records, window);
+}
+
+const char *peer_class_rate_limit_config(const char *classification,
+                                         int64_t *records, int64_t *window)
+{
+        const struct class_limit *limit;
+
+        initialize_config();
+        limit = find_class_limit(CONF_PEER_CLASS_RATE_LIMITS, classification);
+        if (!limit) {
+                return NULL;
+        }
+
+        *records = limit->records;
+        *window = limit->window;
+
+        return limit->pattern;
+}
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
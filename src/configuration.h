@@ -16,8 +16,11 @@
 
 #pragma once
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "durability.h"
+
 /* Default configuration settings */
 #define DEFAULT_SERVER_ADDR BACKEND_ADDR
 #define DEFAULT_SOCKET_PATH "/run/telem-0"
@@ -25,6 +28,11 @@
 #define DEFAULT_RATE_LIMIT_STRATEGY "spool"
 #define DEFAULT_CAINFO ""
 #define DEFAULT_TIDHEADER "X-Telemetry-TID: 6907c830-eed9-4ce9-81ae-76daf8d88f0f"
+#define DEFAULT_DURABILITY "none"
+#define DEFAULT_HANDOFF_SOCKET_PATH LOCALSTATEDIR "/lib/telemetry/handoff"
+#define DEFAULT_BATCH_FORMAT "none"
+#define DEFAULT_COMPRESSION "none"
+#define DEFAULT_COMPRESSION_DICTIONARY ""
 
 #define DEFAULT_RECORD_EXPIRY 1200
 #define DEFAULT_SPOOL_MAX_SIZE 5120
@@ -33,14 +41,44 @@
 #define DEFAULT_BYTE_WINDOW_LENGTH 20
 #define DEFAULT_RECORD_BURST_LIMIT 1000
 #define DEFAULT_BYTE_BURST_LIMIT -1
+#define DEFAULT_BUFFER_POOL_MAX_SIZE 4096
+#define DEFAULT_MEMORY_RELEASE_IDLE_TIME 60
+#define DEFAULT_SEGMENT_MAX_SIZE 1024
+#define DEFAULT_SEGMENT_MAX_AGE 2
+#define DEFAULT_DURABILITY_GROUP_RECORDS 64
+#define DEFAULT_DURABILITY_GROUP_INTERVAL 100
+#define DEFAULT_PEER_MAX_CONNECTIONS 0
+#define DEFAULT_CONNECTION_IDLE_TIME 30
+#define DEFAULT_MAX_CONCURRENT_POSTS 8
+#define DEFAULT_BATCH_MAX_RECORDS 64
+#define DEFAULT_BATCH_MAX_SIZE 64
+#define DEFAULT_COMPRESSION_LEVEL 0
 
 #define DEFAULT_RATE_LIMIT_ENABLED true
 #define DEFAULT_DAEMON_RECYCLING_ENABLED true
 #define DEFAULT_RECORD_RETENTION_ENABLED false
 #define DEFAULT_RECORD_SERVER_DELIVERY_ENABLED true
+#define DEFAULT_DIRECT_HANDOFF_ENABLED false
 
 #define TM_MAX_WINDOW_LENGTH (1 /*h*/ * 60 /*m*/)
 
+/* How telempostd packs records in the body of a request */
+enum batch_format {
+        /* one record per request, as a JSON object */
+        BATCH_NONE = 0,
+        /* a JSON array of records */
+        BATCH_JSON,
+        /* one JSON record per line */
+        BATCH_NDJSON
+};
+
+/* The Content-Encoding telempostd compresses request bodies with */
+enum compression {
+        COMPRESSION_NONE = 0,
+        COMPRESSION_GZIP,
+        COMPRESSION_ZSTD
+};
+
 enum config_str_keys {
         CONF_SERVER_ADDR = 0,
         CONF_SOCKET_PATH,
@@ -48,6 +86,11 @@ enum config_str_keys {
         CONF_RATE_LIMIT_STRATEGY,
         CONF_CAINFO,
         CONF_TIDHEADER,
+        CONF_DURABILITY,
+        CONF_HANDOFF_SOCKET_PATH,
+        CONF_BATCH_FORMAT,
+        CONF_COMPRESSION,
+        CONF_COMPRESSION_DICTIONARY,
         CONF_STR_MAX
 };
 
@@ -59,6 +102,18 @@ enum config_int_keys {
         CONF_BYTE_WINDOW_LENGTH,
         CONF_RECORD_BURST_LIMIT,
         CONF_BYTE_BURST_LIMIT,
+        CONF_BUFFER_POOL_MAX_SIZE,
+        CONF_MEMORY_RELEASE_IDLE_TIME,
+        CONF_SEGMENT_MAX_SIZE,
+        CONF_SEGMENT_MAX_AGE,
+        CONF_DURABILITY_GROUP_RECORDS,
+        CONF_DURABILITY_GROUP_INTERVAL,
+        CONF_PEER_MAX_CONNECTIONS,
+        CONF_CONNECTION_IDLE_TIME,
+        CONF_MAX_CONCURRENT_POSTS,
+        CONF_BATCH_MAX_RECORDS,
+        CONF_BATCH_MAX_SIZE,
+        CONF_COMPRESSION_LEVEL,
         CONF_INT_MAX
 };
 
@@ -67,15 +122,39 @@ enum config_bool_keys {
         CONF_DAEMON_RECYCLING_ENABLED,
         CONF_RECORD_RETENTION_ENABLED,
         CONF_RECORD_SERVER_DELIVERY_ENABLED,
+        CONF_DIRECT_HANDOFF_ENABLED,
         CONF_BOOL_MAX
 };
 
+/* Sections holding limits that libtelemetry applies per classification, and
+ * that telemprobd applies per sending user */
+enum config_limit_keys {
+        CONF_RECORD_RATE_LIMITS = 0,
+        CONF_RECORD_SAMPLING,
+        CONF_PEER_RATE_LIMITS,
+        CONF_PEER_CLASS_RATE_LIMITS,
+        CONF_LIMIT_MAX
+};
+
+/* A "pattern=value" line of a limit section */
+struct class_limit {
+        /* A classification, or a classification prefix followed by '*'. In
+         * peer_rate_limits, a user id or '*'. */
+        char *pattern;
+        /* Rate limits allow records per window seconds. Sampling keeps one
+         * in records records, and has no window. */
+        int64_t records;
+        int64_t window;
+};
+
 typedef struct configuration {
         char *strValues[CONF_STR_MAX];
         int64_t intValues[CONF_INT_MAX];
         bool boolValues[CONF_BOOL_MAX];
         bool initialized;
         char *config_file;
+        struct class_limit *limits[CONF_LIMIT_MAX];
+        size_t num_limits[CONF_LIMIT_MAX];
 } configuration;
 
 /* Sets the configuration file to be used later */
@@ -131,6 +210,96 @@ int64_t byte_burst_limit_config(void);
 /* Gets the byte window length */
 int byte_window_length_config(void);
 
+/*
+ * Gets the maximum size in KB of the memory telemprobd keeps cached for
+ * client buffers
+ */
+int64_t buffer_pool_max_size_config(void);
+
+/*
+ * Gets the time in seconds telemprobd must be idle before it returns cached
+ * memory to the system, -1 if it never does
+ */
+int memory_release_idle_time_config(void);
+
+/*
+ * Gets the size in KB at which telemprobd seals the segment records are
+ * staged in
+ */
+int64_t segment_max_size_config(void);
+
+/*
+ * Gets the time in seconds after its first record at which telemprobd seals
+ * the segment records are staged in, 0 to seal after every record
+ */
+int segment_max_age_config(void);
+
+/*
+ * Gets when staged records, journal entries and retained records are synced
+ * to disk
+ */
+enum durability_mode durability_config(void);
+
+/*
+ * Gets the maximum number of writes covered by a sync in group durability
+ * mode
+ */
+unsigned int durability_group_records_config(void);
+
+/*
+ * Gets the maximum time in milliseconds a write waits for a sync in group
+ * durability mode
+ */
+unsigned int durability_group_interval_config(void);
+
+/*
+ * Gets the maximum number of connections telemprobd accepts at once from
+ * each user, 0 for no limit
+ */
+unsigned int peer_max_connections_config(void);
+
+/*
+ * Gets the time in seconds without records to post after which telempostd
+ * closes its connections to the backends, 0 to close them after every record
+ */
+int connection_idle_time_config(void);
+
+/*
+ * Gets the maximum number of records telempostd posts at once, at least 1
+ */
+unsigned int max_concurrent_posts_config(void);
+
+/*
+ * Gets how telempostd packs records in the body of a request
+ */
+enum batch_format batch_format_config(void);
+
+/*
+ * Gets the maximum number of records telempostd packs in a request, at least 1
+ */
+unsigned int batch_max_records_config(void);
+
+/*
+ * Gets the size in bytes after which telempostd sends a request it packs
+ * records in
+ */
+size_t batch_max_size_config(void);
+
+/*
+ * Gets the Content-Encoding telempostd compresses request bodies with
+ */
+enum compression compression_config(void);
+
+/*
+ * Gets the compression level, 0 for the default of the compression method
+ */
+int compression_level_config(void);
+
+/*
+ * Gets the path of the zstd dictionary shared with the server, or ""
+ */
+const char *compression_dictionary_config(void);
+
 /* Gets whether rate limiting is enabled */
 bool rate_limit_enabled_config(void);
 
@@ -152,4 +321,44 @@ bool record_retention_enabled_config(void);
 /* Gets whether records should be sent to server_addr */
 bool record_server_delivery_enabled_config(void);
 
+/* Gets whether telemprobd hands records to telempostd over a socket */
+bool direct_handoff_enabled_config(void);
+
+/* Gets the path of the socket records are handed over on */
+const char *handoff_socket_path_config(void);
+
+/* Gets whether any per-classification rate limit or sampling is set */
+bool class_limits_enabled_config(void);
+
+/*
+ * Gets the rate limit for records of a classification. Returns false if they
+ * are not limited, otherwise sets the number of records allowed per window
+ * seconds.
+ */
+bool record_rate_limit_config(const char *classification, int64_t *records,
+                              int64_t *window);
+
+/*
+ * Gets the sampling interval for records of a classification: one record in
+ * the returned number is kept, so 1 keeps every record.
+ */
+int64_t record_sampling_config(const char *classification);
+
+/*
+ * Gets the rate limit telemprobd applies to the records of a user. Returns
+ * false if they are not limited, otherwise sets the number of records allowed
+ * per window seconds.
+ */
+bool peer_rate_limit_config(unsigned int uid, int64_t *records, int64_t *window);
+
+/*
+ * Gets the rate limit telemprobd applies to the records of a classification
+ * sent by each user. Returns NULL if they are not limited, otherwise sets the
+ * number of records allowed per window seconds and returns the pattern that
+ * matched, which is valid until the configuration is reloaded. Records
+ * matching the same pattern share the limit.
+ */
+const char *peer_class_rate_limit_config(const char *classification,
+                                         int64_t *records, int64_t *window);
+
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
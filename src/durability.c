@@ -0,0 +1,135 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "durability.h"
+
+static int64_t elapsed_ms(const struct timespec *since)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (int64_t)(now.tv_sec - since->tv_sec) * 1000 +
+               (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+void sync_policy_init(struct sync_policy *policy, enum durability_mode mode,
+                      unsigned int group_records, unsigned int group_interval)
+{
+        memset(policy, 0, sizeof(*policy));
+        policy->mode = mode;
+        policy->group_records = group_records > 0 ? group_records : 1;
+        policy->group_interval = group_interval;
+}
+
+bool sync_policy_write(struct sync_policy *policy)
+{
+        switch (policy->mode) {
+                case DURABILITY_NONE:
+                        return false;
+                case DURABILITY_PER_RECORD:
+                        policy->pending++;
+                        return true;
+                case DURABILITY_GROUP:
+                        if (policy->pending++ == 0) {
+                                clock_gettime(CLOCK_MONOTONIC, &policy->first_pending);
+                        }
+                        return policy->pending >= policy->group_records ||
+                               sync_policy_due(policy);
+        }
+
+        return false;
+}
+
+bool sync_policy_due(struct sync_policy *policy)
+{
+        return policy->pending > 0 &&
+               elapsed_ms(&policy->first_pending) >= policy->group_interval;
+}
+
+void sync_policy_synced(struct sync_policy *policy)
+{
+        if (policy->pending > 0) {
+                policy->pending = 0;
+                policy->syncs++;
+        }
+}
+
+bool sync_policy_deadline(struct sync_policy *policy, struct timespec *deadline)
+{
+        if (policy->pending == 0) {
+                return false;
+        }
+
+        *deadline = policy->first_pending;
+        deadline->tv_sec += policy->group_interval / 1000;
+        deadline->tv_nsec += (long)(policy->group_interval % 1000) * 1000000;
+        if (deadline->tv_nsec >= 1000000000) {
+                deadline->tv_sec++;
+                deadline->tv_nsec -= 1000000000;
+        }
+
+        return true;
+}
+
+int sync_policy_timeout(struct sync_policy *policy)
+{
+        int64_t remaining;
+
+        if (policy->pending == 0) {
+                return -1;
+        }
+
+        remaining = policy->group_interval - elapsed_ms(&policy->first_pending);
+
+        return remaining > 0 ? (int)remaining : 0;
+}
+
+int sync_policy_flush(struct sync_policy *policy, int fd, bool force)
+{
+        if (policy->pending == 0 || !(force || sync_policy_due(policy))) {
+                return 0;
+        }
+
+        if (fdatasync(fd) == -1) {
+                return -errno;
+        }
+        sync_policy_synced(policy);
+
+        return 0;
+}
+
+bool parse_durability_mode(const char *name, enum durability_mode *mode)
+{
+        if (strcmp(name, "none") == 0) {
+                *mode = DURABILITY_NONE;
+        } else if (strcmp(name, "per-record") == 0) {
+                *mode = DURABILITY_PER_RECORD;
+        } else if (strcmp(name, "group") == 0) {
+                *mode = DURABILITY_GROUP;
+        } else {
+                return false;
+        }
+
+        return true;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,128 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+enum durability_mode {
+        /* writes are left to the kernel writeback */
+        DURABILITY_NONE = 0,
+        /* every write is synced before it is acknowledged */
+        DURABILITY_PER_RECORD,
+        /* writes are synced in batches */
+        DURABILITY_GROUP
+};
+
+/*
+ * Decides when the writes to a file must be synced to disk. The owner of
+ * the file performs the sync, and reports it with sync_policy_synced().
+ */
+struct sync_policy {
+        enum durability_mode mode;
+        /* in group mode, writes are synced once group_records of them are
+         * pending, or group_interval milliseconds after the first one */
+        unsigned int group_records;
+        unsigned int group_interval;
+        /* writes not synced yet, and the time of the first one */
+        unsigned int pending;
+        struct timespec first_pending;
+        /* number of syncs performed */
+        uint64_t syncs;
+};
+
+/**
+ * Initialize a sync policy
+ *
+ * @param policy The policy
+ * @param mode The durability mode
+ * @param group_records Number of writes a group sync covers at most
+ * @param group_interval Milliseconds a write waits at most for a group sync
+ */
+void sync_policy_init(struct sync_policy *policy, enum durability_mode mode,
+                      unsigned int group_records, unsigned int group_interval);
+
+/**
+ * Account for a write
+ *
+ * @param policy The policy
+ *
+ * @return true if the pending writes must be synced now
+ */
+bool sync_policy_write(struct sync_policy *policy);
+
+/**
+ * Check if the pending writes must be synced, because the group interval
+ * elapsed
+ *
+ * @param policy The policy
+ *
+ * @return true if they must be synced
+ */
+bool sync_policy_due(struct sync_policy *policy);
+
+/**
+ * Mark the pending writes as synced
+ *
+ * @param policy The policy
+ */
+void sync_policy_synced(struct sync_policy *policy);
+
+/**
+ * Get the time by which the pending writes must be synced
+ *
+ * @param policy The policy
+ * @param deadline Set to the deadline, on CLOCK_MONOTONIC
+ *
+ * @return false if no write is pending
+ */
+bool sync_policy_deadline(struct sync_policy *policy, struct timespec *deadline);
+
+/**
+ * Get the number of milliseconds until the pending writes must be synced
+ *
+ * @param policy The policy
+ *
+ * @return The timeout, suitable for poll(), or -1 if no write is pending
+ */
+int sync_policy_timeout(struct sync_policy *policy);
+
+/**
+ * Sync a file descriptor as the policy requires after a write
+ *
+ * Convenience for files written through a single descriptor.
+ *
+ * @param policy The policy
+ * @param fd The file written to
+ * @param force Sync the pending writes even if they are not due
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int sync_policy_flush(struct sync_policy *policy, int fd, bool force);
+
+/**
+ * Parse a durability mode name, one of "none", "per-record" or "group"
+ *
+ * @param name The name
+ * @param mode Set to the mode
+ *
+ * @return false if the name is not valid
+ */
+bool parse_durability_mode(const char *name, enum durability_mode *mode);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,155 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "handoff.h"
+
+size_t handoff_frame_iov(struct handoff_frame_header *header,
+                         const struct record_view *record, struct iovec *iov)
+{
+        static char nul[] = "";
+        size_t length = 0;
+        int n = 1;
+
+        /* The fields are not null-terminated, each is followed by a buffer
+         * holding the terminator */
+        iov[n++] = record->cfg_file;
+        iov[n++] = (struct iovec){ nul, 1 };
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                iov[n++] = record->headers[i];
+                iov[n++] = (struct iovec){ nul, 1 };
+        }
+        iov[n++] = record->body;
+        iov[n++] = (struct iovec){ nul, 1 };
+
+        for (int i = 1; i < n; i++) {
+                length += iov[i].iov_len;
+        }
+
+        header->magic = HANDOFF_FRAME_MAGIC;
+        header->length = length > UINT32_MAX ? UINT32_MAX : (uint32_t)length;
+        iov[0] = (struct iovec){ header, sizeof(*header) };
+
+        return sizeof(*header) + length;
+}
+
+bool handoff_parse_frame(char *frame, size_t size, char *headers[], char **body,
+                         char **cfg_file)
+{
+        struct handoff_frame_header header;
+        char *fields[HANDOFF_FIELDS];
+        char *p, *end, *nul;
+
+        if (size < sizeof(header)) {
+                return false;
+        }
+        memcpy(&header, frame, sizeof(header));
+        if (header.magic != HANDOFF_FRAME_MAGIC ||
+            header.length != size - sizeof(header)) {
+                return false;
+        }
+
+        p = frame + sizeof(header);
+        end = frame + size;
+        for (int i = 0; i < HANDOFF_FIELDS; i++) {
+                nul = memchr(p, '\0', (size_t)(end - p));
+                if (!nul) {
+                        return false;
+                }
+                fields[i] = p;
+                p = nul + 1;
+        }
+        if (p != end) {
+                return false;
+        }
+
+        *cfg_file = fields[0][0] != '\0' ? fields[0] : NULL;
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                headers[i] = fields[i + 1];
+        }
+        *body = fields[HANDOFF_FIELDS - 1];
+
+        return true;
+}
+
+static int set_address(struct sockaddr_un *addr, const char *path)
+{
+        memset(addr, 0, sizeof(*addr));
+        addr->sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr->sun_path)) {
+                return -ENAMETOOLONG;
+        }
+        strcpy(addr->sun_path, path);
+
+        return 0;
+}
+
+int handoff_listen(const char *path)
+{
+        struct sockaddr_un addr;
+        int fd, ret;
+
+        if ((ret = set_address(&addr, path)) < 0) {
+                return ret;
+        }
+
+        fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+                return -errno;
+        }
+
+        if ((unlink(path) == -1 && errno != ENOENT) ||
+            bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(fd, 1) == -1) {
+                ret = -errno;
+                close(fd);
+                return ret;
+        }
+
+        return fd;
+}
+
+int handoff_connect(const char *path)
+{
+        struct sockaddr_un addr;
+        int fd, ret;
+
+        if ((ret = set_address(&addr, path)) < 0) {
+                return ret;
+        }
+
+        fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+                return -errno;
+        }
+
+        /* Connecting to a unix socket completes at once, or fails */
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+                ret = -errno;
+                close(fd);
+                return ret;
+        }
+
+        return fd;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,99 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "iorecord.h"
+
+/*
+ * telemprobd hands records over to telempostd on a SOCK_SEQPACKET unix
+ * socket, bypassing the spool directory. Each message is one frame: a
+ * handoff_frame_header followed by HANDOFF_FIELDS null-terminated strings,
+ * the configuration file (empty if none), the NUM_HEADERS headers in
+ * header order, and the body. Messages are sent whole or not at all, a
+ * record that can not be sent right away is staged in the spool instead.
+ */
+
+/* "HDF1", the frame magic also versions the frame format */
+#define HANDOFF_FRAME_MAGIC 0x31464448
+
+#define HANDOFF_FIELDS (NUM_HEADERS + 2)
+
+/* Number of buffers handoff_frame_iov() describes a frame with */
+#define HANDOFF_MAX_IOV (2 * HANDOFF_FIELDS + 1)
+
+/* Largest frame sent, larger records are staged in the spool */
+#define HANDOFF_MAX_FRAME (64 * 1024)
+
+struct handoff_frame_header {
+        uint32_t magic;
+        /* size of the strings following the header */
+        uint32_t length;
+};
+
+/**
+ * Describe a record as a handoff frame
+ *
+ * @param header Set to the frame header, iov[0] points to it
+ * @param record The record
+ * @param iov Set to the buffers of the frame, HANDOFF_MAX_IOV of them
+ *
+ * @return The size of the frame
+ */
+size_t handoff_frame_iov(struct handoff_frame_header *header,
+                         const struct record_view *record, struct iovec *iov);
+
+/**
+ * Parse a handoff frame in place
+ *
+ * The record fields point into the frame, no memory is allocated.
+ *
+ * @param frame The frame
+ * @param size The size of the frame
+ * @param headers Set to the record headers
+ * @param body Set to the record body
+ * @param cfg_file Set to the configuration file of the record, or NULL
+ *
+ * @return false if the frame is malformed
+ */
+bool handoff_parse_frame(char *frame, size_t size, char *headers[], char **body,
+                         char **cfg_file);
+
+/**
+ * Create the listening handoff socket, replacing a stale one
+ *
+ * @param path The socket path
+ *
+ * @return The non-blocking socket, or a negative errno-style value on error
+ */
+int handoff_listen(const char *path);
+
+/**
+ * Connect to the handoff socket
+ *
+ * @param path The socket path
+ *
+ * @return The non-blocking socket, or a negative errno-style value on error
+ */
+int handoff_connect(const char *path);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
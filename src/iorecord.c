@@ -20,6 +20,8 @@
 #include <unistd.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include "log.h"
@@ -27,117 +29,192 @@
 #include "common.h"
 #include "iorecord.h"
 
-bool _fgets(char *s, int n, FILE *stream)
+void record_view_init(struct record_view *view, char *headers[], char *body,
+                      char *cfg_file)
 {
-        char *i;
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                view->headers[i] = (struct iovec){ headers[i], strlen(headers[i]) };
+        }
+        view->body = (struct iovec){ body, strlen(body) };
+        view->cfg_file = (struct iovec){ cfg_file, cfg_file ? strlen(cfg_file) : 0 };
+}
 
-        if (!fgets(s, n, stream)) {
-                return false;
+int record_view_iov(const struct record_view *view, struct iovec *iov)
+{
+        static char newline[] = "\n";
+        static char cfg_prefix[] = CFG_PREFIX;
+        int n = 0;
+
+        // cfg info if exists
+        if (view->cfg_file.iov_base != NULL) {
+                iov[n++] = (struct iovec){ cfg_prefix, CFG_PREFIX_LENGTH };
+                iov[n++] = view->cfg_file;
+                iov[n++] = (struct iovec){ newline, 1 };
         }
-        if ((i = strchr(s, '\n')) != NULL) {
-                *i = '\0';
+
+        // headers
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                iov[n++] = view->headers[i];
+                iov[n++] = (struct iovec){ newline, 1 };
         }
 
-        return true;
+        // body
+        iov[n++] = view->body;
+        iov[n++] = (struct iovec){ newline, 1 };
+
+        return n;
 }
 
-bool read_record(char *fullpath, char *headers[], char **body, char **cfg_file)
+int record_iov(char *headers[], char *body, char *cfg_file, struct iovec *iov)
 {
-        int i = 0;
-        bool result = false;
-        FILE *fp = NULL;
-        long offset;
-#if (LINE_MAX > PATH_MAX)
-        char line[LINE_MAX+1] = { 0 };
-#else
-        char line[PATH_MAX+1] = { 0 };
-#endif
-        long size;
-        uint32_t cfg_prefix = 0;
-
-        fp = fopen(fullpath, "r");
-        if (fp == NULL) {
-                telem_log(LOG_ERR, "Unable to open file %s in staging\n", fullpath);
-                return false;
+        struct record_view view;
+
+        record_view_init(&view, headers, body, cfg_file);
+
+        return record_view_iov(&view, iov);
+}
+
+/* Copies the line at *p without its newline, and moves *p to the next line.
+ * Returns NULL at the end of the data. */
+static char *next_line(const char **p, const char *end)
+{
+        const char *nl;
+        char *line;
+
+        if (*p >= end) {
+                return NULL;
+        }
+
+        nl = memchr(*p, '\n', (size_t)(end - *p));
+        line = strndup(*p, (size_t)((nl ? nl : end) - *p));
+        if (line == NULL) {
+                telem_log(LOG_ERR, "Could not allocate memory for record line\n");
+                exit(EXIT_FAILURE);
         }
+        *p = nl ? nl + 1 : end;
+
+        return line;
+}
+
+bool parse_record(const char *data, size_t size, char *headers[], char **body,
+                  char **cfg_file)
+{
+        const char *p = data;
+        const char *end = data + size;
+        const char *start;
+        char *line = NULL;
+        int i;
 
-        // Get the file size
-        fseek(fp, 0 , SEEK_END);
-        size = ftell(fp);
-        fseek(fp, 0 , SEEK_SET);
+        *body = NULL;
+        *cfg_file = NULL;
 
         // First line may contain configuration file path
-        if (fread(&cfg_prefix, CFG_PREFIX_LENGTH, 1, fp) != 1) {
+        if (size < CFG_PREFIX_LENGTH) {
                 telem_log(LOG_ERR, "Error while parsing staged record configuration info.\n");
-                goto read_error;
+                return false;
         }
 
-        if (cfg_prefix == CFG_PREFIX_32BIT) {
-                if (!_fgets(line, sizeof(line), fp)) {
-                        telem_log(LOG_ERR, "Error while parsing staged record [%x]\n", cfg_prefix);
-                        goto read_error;
-                }
-
-                size_t pathlen = strlen(line);
-                *cfg_file = malloc(pathlen + 1);
+        if (memcmp(p, CFG_PREFIX, CFG_PREFIX_LENGTH) == 0) {
+                p += CFG_PREFIX_LENGTH;
+                *cfg_file = next_line(&p, end);
                 if (*cfg_file == NULL) {
-                        telem_log(LOG_ERR, "Could not allocate memory for config file path\n");
-                        goto read_error;
+                        telem_log(LOG_ERR, "Error while parsing staged record config file\n");
+                        return false;
                 }
-                strcpy (*cfg_file, line);
                 telem_debug("DEBUG: cfg_file specified: %s\n", *cfg_file);
-        } else {
-                telem_debug("DEBUG: no user cfg file specified, cfg_prefix: %08x\n", cfg_prefix);
-                *cfg_file = NULL;
-                rewind(fp);
         }
 
         for (i = 0; i < NUM_HEADERS; i++) {
                 const char *header_name = get_header_name(i);
-                if (!_fgets(line, sizeof(line), fp)) {
+
+                start = p;
+                line = next_line(&p, end);
+                if (line == NULL) {
                         telem_log(LOG_ERR, "Error while parsing staged record\n");
-                        fclose(fp);
-                        return false;
+                        goto parse_error;
+                }
+
+                if (get_header(line, header_name, &headers[i])) {
+                        free(line);
+                        continue;
                 }
-                //Get rid of trailing newline
-                result = get_header(line, header_name, &headers[i]);
-                if (!result) {
-                        telem_log(LOG_ERR, "read_record: Incorrect"
-                                  " headers in record\n");
-                        goto read_error;
+                free(line);
+
+                if (get_default_header(i, &headers[i])) {
+                        /* Staged by an older version, the line belongs to
+                         * what follows the headers */
+                        p = start;
+                        continue;
                 }
+
+                telem_log(LOG_ERR, "read_record: Incorrect"
+                          " headers in record\n");
+                goto parse_error;
         }
 
-        offset = ftell(fp);
-        if (offset == -1) {
-                telem_perror("Failed to get staged file offset of record payload");
-                result = false;
-                goto read_error;
+        if (p == end) {
+                telem_log(LOG_ERR, "Error reading staged record payload\n");
+                goto parse_error;
         }
 
-        size = size - offset + 1;
-        *body = malloc((size_t)size);
+        *body = strndup(p, (size_t)(end - p));
         if (*body == NULL) {
                 telem_log(LOG_ERR, "Could not allocate memory for payload from staged file\n");
-                result = false;
+                goto parse_error;
+        }
+
+        return true;
+
+parse_error:
+        for (int k = 0; k < i; k++) {
+                free(headers[k]);
+                headers[k] = NULL;
+        }
+        free(*cfg_file);
+        *cfg_file = NULL;
+
+        return false;
+}
+
+bool read_record(char *fullpath, char *headers[], char **body, char **cfg_file)
+{
+        bool result = false;
+        struct stat st;
+        char *data = NULL;
+        ssize_t len;
+        int fd;
+
+        *body = NULL;
+        *cfg_file = NULL;
+
+        fd = open(fullpath, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+                telem_log(LOG_ERR, "Unable to open file %s in staging\n", fullpath);
+                return false;
+        }
+
+        if (fstat(fd, &st) == -1) {
+                telem_perror("Unable to stat staged record");
                 goto read_error;
         }
-        memset(*body, 0, (size_t)size);
 
-        //read rest of file. '-1' ensures it's null terminated
-        size_t newlen = fread(*body, sizeof(char), (size_t)size - 1, fp);
-        if (newlen == 0) {
+        data = malloc((size_t)st.st_size + 1);
+        if (data == NULL) {
+                telem_log(LOG_ERR, "Could not allocate memory for staged record\n");
+                goto read_error;
+        }
+
+        len = read(fd, data, (size_t)st.st_size);
+        if (len == -1) {
                 telem_perror("Error reading staged file");
-                result = false;
                 goto read_error;
-        } else {
-                result = true;
         }
 
+        result = parse_record(data, (size_t)len, headers, body, cfg_file);
+
 read_error:
-        if (fp) {
-                fclose(fp);
-        }
+        free(data);
+        close(fd);
 
         return result;
 }
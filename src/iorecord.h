@@ -14,7 +14,25 @@
  * details.
  */
 
+#pragma once
+
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "common.h"
+
+/* Maximum number of buffers record_iov() describes a record with */
+#define RECORD_MAX_IOV (2 * NUM_HEADERS + 5)
+
+/* A record whose fields point into memory owned by someone else, such as
+ * the buffer the record was received in. The fields are not null-terminated,
+ * cfg_file.iov_base is NULL if the record has no configuration file. */
+struct record_view {
+        struct iovec headers[NUM_HEADERS];
+        struct iovec body;
+        struct iovec cfg_file;
+};
 
 /**
  * Reads a telemetry record
@@ -26,3 +44,52 @@
  * @return true if successful otherwise false
  */
 bool read_record(char *fullpath, char *headers[], char **body, char **cfg);
+
+/**
+ * Parses a telemetry record in the staging file layout
+ *
+ * @param data pointer to the record, it does not need to be null-terminated
+ * @param size size of the record
+ * @param headers pointer to array of headers and values
+ * @param body record message content
+ * @param cfg configuration file path, NULL if the record has none
+ *
+ * @return true if successful otherwise false
+ */
+bool parse_record(const char *data, size_t size, char *headers[], char **body,
+                  char **cfg);
+
+/**
+ * Describes a telemetry record in the staging file layout
+ *
+ * @param headers pointer to array of headers and values
+ * @param body record message content
+ * @param cfg_file configuration file path, or NULL
+ * @param iov set to the buffers holding the record, which point to the
+ *        headers, body and cfg_file strings
+ *
+ * @return the number of buffers, at most RECORD_MAX_IOV
+ */
+int record_iov(char *headers[], char *body, char *cfg_file, struct iovec *iov);
+
+/**
+ * Describes a record view in the staging file layout
+ *
+ * @param view the record
+ * @param iov set to the buffers holding the record, which point to the
+ *        memory the view points to
+ *
+ * @return the number of buffers, at most RECORD_MAX_IOV
+ */
+int record_view_iov(const struct record_view *view, struct iovec *iov);
+
+/**
+ * Makes a view of a record held in null-terminated strings
+ *
+ * @param view set to the record
+ * @param headers pointer to array of headers and values
+ * @param body record message content
+ * @param cfg_file configuration file path, or NULL
+ */
+void record_view_init(struct record_view *view, char *headers[], char *body,
+                      char *cfg_file);
@@ -184,17 +184,19 @@ static int get_record_count(struct TelemJournal *telem_journal)
 }
 
 /**
- * Serializes JournalEntry and saves it to file.
+ * Serializes JournalEntry and saves it to file, syncing it as the
+ * journal sync policy requires.
  *
- * @param fptr A FILE pointer.
+ * @param telem_journal A pointer to telemetry journal.
  * @param entry A pointer to data.
  *
  * @return 0 on succes, !=0 on failure
  */
-static int save_entry(FILE *fptr, struct JournalEntry *entry)
+static int save_entry(struct TelemJournal *telem_journal, struct JournalEntry *entry)
 {
         int rc = -1;
         char *serialized_data = NULL;
+        FILE *fptr = telem_journal->fptr;
 
         if (fptr == NULL || entry == NULL) {
                 return rc;
@@ -205,6 +207,11 @@ static int save_entry(FILE *fptr, struct JournalEntry *entry)
                 fprintf(fptr, "%s\n", serialized_data);
                 fflush(fptr);
                 free(serialized_data);
+
+                if (sync_policy_write(&telem_journal->sync) &&
+                    flush_journal(telem_journal, true) != 0) {
+                        telem_perror("Error syncing journal");
+                }
         }
 
         return rc;
@@ -291,10 +298,11 @@ static int skip_n_lines(int n, FILE *fptr, int (*found_record)(char *))
  * Copies contents of fptr to a known location.
  *
  * @param fptr A file pointer from source file.
+ * @param durable Sync the copy to disk before closing it.
  *
  * @returns 0 on success, errno on failure
  */
-static int copy_to_tmp(FILE *fptr, char *tmp_path)
+static int copy_to_tmp(FILE *fptr, char *tmp_path, bool durable)
 {
         int rc = 0;
         size_t len;
@@ -318,6 +326,11 @@ static int copy_to_tmp(FILE *fptr, char *tmp_path)
                 }
         }
 
+        if (rc == 0 && durable && (fflush(fptr_tmp) != 0 || fsync(fileno(fptr_tmp)) != 0)) {
+                rc = errno;
+                telem_perror("Error");
+        }
+
         if (fclose(fptr_tmp) != 0) {
                 rc = errno;
                 telem_perror("Error");
@@ -367,6 +380,7 @@ TelemJournal *open_journal(const char *journal_file)
         telem_journal->record_count_limit = RECORD_LIMIT;
         telem_journal->latest_record_id = NULL;
         telem_journal->prune_entry_callback = NULL;
+        sync_policy_init(&telem_journal->sync, DURABILITY_NONE, 1, 0);
 
         telem_debug("Records in db: %d\n", telem_journal->record_count);
 
@@ -377,6 +391,9 @@ TelemJournal *open_journal(const char *journal_file)
 void close_journal(TelemJournal *telem_journal)
 {
         if (telem_journal) {
+                if (flush_journal(telem_journal, true) != 0) {
+                        telem_perror("Error syncing journal");
+                }
                 free(telem_journal->boot_id);
                 free(telem_journal->journal_file);
                 free(telem_journal->latest_record_id);
@@ -597,7 +614,7 @@ int new_journal_entry(TelemJournal *telem_journal, char *classification,
         entry->boot_id = strndup(boot_id, BOOTID_LEN - 1);
         entry->timestamp = timestamp;
 
-        if ((rc = save_entry(telem_journal->fptr, entry)) == 0) {
+        if ((rc = save_entry(telem_journal, entry)) == 0) {
                 telem_journal->record_count = telem_journal->record_count + 1;
                 telem_debug("DEBUG: %d records in journal\n", telem_journal->record_count);
         }
@@ -611,6 +628,16 @@ quit:
         return rc;
 }
 
+/* Exported function */
+int flush_journal(struct TelemJournal *telem_journal, bool force)
+{
+        if (telem_journal == NULL || telem_journal->fptr == NULL) {
+                return 0;
+        }
+
+        return sync_policy_flush(&telem_journal->sync, fileno(telem_journal->fptr), force);
+}
+
 /* Exported function */
 int prune_journal(struct TelemJournal *telem_journal, char *tmp_dir)
 {
@@ -644,7 +671,8 @@ int prune_journal(struct TelemJournal *telem_journal, char *tmp_dir)
                         }
                 }
                 // create new file with rest of file
-                if ((rc = copy_to_tmp(telem_journal->fptr, tmp_file_path)) != 0) {
+                if ((rc = copy_to_tmp(telem_journal->fptr, tmp_file_path,
+                                      telem_journal->sync.mode != DURABILITY_NONE)) != 0) {
                         telem_log(LOG_ERR, "Error copying partial journal to temp journal file\n");
                         goto quit;
                 }
@@ -658,6 +686,8 @@ int prune_journal(struct TelemJournal *telem_journal, char *tmp_dir)
                         telem_log(LOG_ERR, "Error while overwriting journal file\n");
                         goto quit;
                 }
+                // pending entries were synced with the copy
+                sync_policy_synced(&telem_journal->sync);
                 // reopen file handler
                 telem_journal->fptr = fopen(telem_journal->journal_file, "a+");
                 if (!telem_journal->fptr) {
@@ -24,6 +24,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#include "durability.h"
+
 /* Journal entry type */
 typedef struct JournalEntry {
         time_t timestamp;
@@ -42,6 +44,8 @@ typedef struct TelemJournal {
         int record_count;
         int record_count_limit;
         int (*prune_entry_callback)(char *);
+        /* when entries are synced to disk, DURABILITY_NONE by default */
+        struct sync_policy sync;
 } TelemJournal;
 
 /**
@@ -101,6 +105,17 @@ int print_journal(TelemJournal *telem_journal, char *classification,
 int new_journal_entry(TelemJournal *telem_journal, char *classification,
                       time_t timestamp, char *event_id);
 
+/**
+ * Syncs the journal entries that are not synced yet, if the group
+ * interval of the journal sync policy elapsed.
+ *
+ * @param telem_journal A pointer to telemetry journal.
+ * @param force Sync the pending entries even if they are not due.
+ *
+ * @return 0 on success, a negative errno-style value on failure.
+ */
+int flush_journal(TelemJournal *telem_journal, bool force);
+
 /**
  * Checks number of lines in log and prunes the oldest records
  * if journal grows more than telem_journal->record_count_limit.
@@ -4,12 +4,15 @@ bin_PROGRAMS += \
 %C%_telem_journal_SOURCES = %D%/cli.c \
 	%D%/journal.c \
 	src/util.c \
-	src/common.c
+	src/common.c \
+	src/durability.c
 %C%_telem_journal_CFLAGS = \
 	$(AM_CFLAGS)
+%C%_telem_journal_LDADD = \
+	-lpthread
 
 if LOG_SYSTEMD
 %C%_telem_journal_CFLAGS += $(SYSTEMD_JOURNAL_CFLAGS)
-%C%_telem_journal_LDADD = $(SYSTEMD_JOURNAL_LIBS)
+%C%_telem_journal_LDADD += $(SYSTEMD_JOURNAL_LIBS)
 endif
 # vim: filetype=automake tabstop=8 shiftwidth=8 noexpandtab
@@ -0,0 +1,225 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "jsonenc.h"
+#include "util.h"
+
+#define ONES UINT64_C(0x0101010101010101)
+#define HIGHS UINT64_C(0x8080808080808080)
+
+/* Longest escape of a byte, \u00XX */
+#define MAX_ESCAPE_LEN 6
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Makes room for len more bytes, and the NUL terminator */
+static inline bool reserve(struct json_buffer *buf, size_t len)
+{
+        if (buf->len + len < buf->size) {
+                return true;
+        }
+        return reallocate((void **)&buf->data, &buf->size, buf->len + len + 1) != NULL;
+}
+
+/* Appends bytes the buffer has room for */
+static void append(struct json_buffer *buf, const char *s, size_t len)
+{
+        memcpy(buf->data + buf->len, s, len);
+        buf->len += len;
+}
+
+/*
+ * Flags the high bit of the bytes of the word that are a control character,
+ * a quote or a backslash, the bytes json-c escapes. A borrow may also flag
+ * the bytes after one of them in memory order on little-endian.
+ */
+static inline uint64_t needs_escape(uint64_t w)
+{
+        uint64_t quote = w ^ (ONES * '"');
+        uint64_t backslash = w ^ (ONES * '\\');
+
+        return ((w - ONES * 0x20) | (quote - ONES) | (backslash - ONES)) & ~w & HIGHS;
+}
+
+/* Appends the escape of a byte needing one */
+static void append_escape(struct json_buffer *buf, unsigned char c)
+{
+        char *out = buf->data + buf->len;
+
+        out[0] = '\\';
+        switch (c) {
+        case '\b':
+                out[1] = 'b';
+                break;
+        case '\t':
+                out[1] = 't';
+                break;
+        case '\n':
+                out[1] = 'n';
+                break;
+        case '\f':
+                out[1] = 'f';
+                break;
+        case '\r':
+                out[1] = 'r';
+                break;
+        case '"':
+        case '\\':
+                out[1] = (char)c;
+                break;
+        default:
+                out[1] = 'u';
+                out[2] = '0';
+                out[3] = '0';
+                out[4] = hex_digits[c >> 4];
+                out[5] = hex_digits[c & 0xf];
+                buf->len += MAX_ESCAPE_LEN;
+                return;
+        }
+        buf->len += 2;
+}
+
+/* Escapes the byte at s if needed, after the run of bytes before it */
+static inline bool escape_byte(struct json_buffer *buf, const char **run,
+                               const char *s, const char *end)
+{
+        unsigned char c = (unsigned char)*s;
+
+        if (c >= 0x20 && c != '"' && c != '\\') {
+                return true;
+        }
+
+        /* Room for the run, this escape and the rest as is */
+        if (!reserve(buf, (size_t)(end - *run) + MAX_ESCAPE_LEN + 1)) {
+                return false;
+        }
+        append(buf, *run, (size_t)(s - *run));
+        append_escape(buf, c);
+        *run = s + 1;
+
+        return true;
+}
+
+/* Appends a quoted string, copying the runs that need no escape as they
+ * are */
+static bool append_string(struct json_buffer *buf, const char *s, size_t len)
+{
+        const char *end = s + len;
+        const char *run = s;
+
+        if (!reserve(buf, len + 2)) {
+                return false;
+        }
+        buf->data[buf->len++] = '"';
+
+        /* Most strings have nothing to escape, skip them a word at a time */
+        while (end - s >= 8) {
+                uint64_t w, mask;
+
+                memcpy(&w, s, sizeof(w));
+                mask = needs_escape(w);
+                if (!mask) {
+                        s += 8;
+                        continue;
+                }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                /* Borrows only flag the bytes after the first one needing an
+                 * escape, so the lowest flag is exact */
+                s += __builtin_ctzll(mask) / 8;
+                if (!escape_byte(buf, &run, s++, end)) {
+                        return false;
+                }
+#else
+                for (const char *word_end = s + 8; s < word_end; s++) {
+                        if (!escape_byte(buf, &run, s, end)) {
+                                return false;
+                        }
+                }
+#endif
+        }
+        for (; s < end; s++) {
+                if (!escape_byte(buf, &run, s, end)) {
+                        return false;
+                }
+        }
+
+        append(buf, run, (size_t)(end - run));
+        buf->data[buf->len++] = '"';
+
+        return true;
+}
+
+int json_encode_record(struct json_buffer *buf, char *const headers[],
+                       const char *payload)
+{
+        buf->len = 0;
+        if (!reserve(buf, 1)) {
+                return -ENOMEM;
+        }
+        buf->data[buf->len++] = '{';
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                /* ex: arch: x86_64, split the way strtok(header, ":") then
+                 * strtok(NULL, " ") did */
+                const char *name = headers[i];
+                const char *colon = name + strspn(name, ":");
+                const char *value;
+
+                colon += strcspn(colon, ":");
+                value = *colon ? colon + 1 : colon;
+                value += strspn(value, " ");
+
+                if (!append_string(buf, name, (size_t)(colon - name)) ||
+                    !reserve(buf, 1)) {
+                        return -ENOMEM;
+                }
+                buf->data[buf->len++] = ':';
+                if (!append_string(buf, value, strcspn(value, " ")) ||
+                    !reserve(buf, 1)) {
+                        return -ENOMEM;
+                }
+                buf->data[buf->len++] = ',';
+        }
+
+        if (!reserve(buf, strlen("\"payload\":"))) {
+                return -ENOMEM;
+        }
+        append(buf, "\"payload\":", strlen("\"payload\":"));
+        if (!append_string(buf, payload, strlen(payload)) || !reserve(buf, 1)) {
+                return -ENOMEM;
+        }
+        buf->data[buf->len++] = '}';
+        buf->data[buf->len] = '\0';
+
+        return 0;
+}
+
+void json_buffer_free(struct json_buffer *buf)
+{
+        free(buf->data);
+        buf->data = NULL;
+        buf->len = 0;
+        buf->size = 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
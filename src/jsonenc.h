@@ -0,0 +1,57 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Buffer records are encoded in, reused from one record to the next so
+ * encoding allocates nothing once the buffer fits the largest record. Not
+ * thread-safe.
+ */
+struct json_buffer {
+        /* the encoded record, NUL-terminated */
+        char *data;
+        size_t len;
+        size_t size;
+};
+
+/**
+ * Encode a record as a JSON object
+ *
+ * Each header gives a member named after the text before its first colon,
+ * with the first word after the colon as its value, followed by the payload.
+ * The output is the one json-c gives with JSON_C_TO_STRING_PLAIN and
+ * JSON_C_TO_STRING_NOSLASHESCAPE. The headers are not modified.
+ *
+ * @param buf The buffer, its previous content is replaced
+ * @param headers The NUM_HEADERS headers of the record
+ * @param payload The payload of the record
+ *
+ * @return 0 on success, -ENOMEM if the buffer could not grow
+ */
+int json_encode_record(struct json_buffer *buf, char *const headers[],
+                       const char *payload);
+
+/**
+ * Free a buffer
+ *
+ * @param buf The buffer
+ */
+void json_buffer_free(struct json_buffer *buf);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -17,6 +17,16 @@ bin_PROGRAMS = \
 	%D%/probe.c \
 	%D%/telemdaemon.c \
 	%D%/telemdaemon.h \
+	%D%/admission.c \
+	%D%/admission.h \
+	%D%/bufpool.c \
+	%D%/bufpool.h \
+	%D%/segment.c \
+	%D%/segment.h \
+	%D%/handoff.c \
+	%D%/handoff.h \
+	%D%/iorecord.c \
+	%D%/iorecord.h \
 	%D%/journal/journal.c \
 	%D%/journal/journal.h
 
@@ -52,21 +62,35 @@ endif
 	%D%/post.c \
 	%D%/telempostdaemon.c \
 	%D%/telempostdaemon.h \
+	%D%/backend.c \
+	%D%/backend.h \
+	%D%/uploader.c \
+	%D%/uploader.h \
+	%D%/compress.c \
+	%D%/compress.h \
+	%D%/jsonenc.c \
+	%D%/jsonenc.h \
 	%D%/journal/journal.c \
 	%D%/journal/journal.h \
 	%D%/spool.h \
 	%D%/spool.c \
 	%D%/retention.h \
 	%D%/retention.c \
+	%D%/segment.c \
+	%D%/segment.h \
+	%D%/handoff.c \
+	%D%/handoff.h \
 	%D%/iorecord.c \
 	%D%/iorecord.h
 
-%C%_telempostd_LDADD = $(CURL_LIBS) $(JSON_C_LIBS) \
+%C%_telempostd_LDADD = $(CURL_LIBS) $(JSON_C_LIBS) $(ZLIB_LIBS) $(ZSTD_LIBS) \
 	%D%/libtelem-shared.la \
 	%D%/libtelemetry.la
 
 %C%_telempostd_CFLAGS = \
-	$(AM_CFLAGS)
+	$(AM_CFLAGS) \
+	$(ZLIB_CFLAGS) \
+	$(ZSTD_CFLAGS)
 
 %C%_telempostd_LDFLAGS = \
 	$(AM_LDFLAGS) \
@@ -89,9 +113,9 @@ endif
 endif
 
 # set library version info
-SHAREDLIB_CURRENT=4
-SHAREDLIB_REVISION=1
-SHAREDLIB_AGE=0
+SHAREDLIB_CURRENT=5
+SHAREDLIB_REVISION=0
+SHAREDLIB_AGE=1
 
 noinst_LTLIBRARIES = %D%/libtelem-shared.la
 
@@ -103,7 +127,9 @@ noinst_LTLIBRARIES = %D%/libtelem-shared.la
 	%D%/nica/hashmap.c \
 	%D%/configuration.h \
 	%D%/common.c \
-	%D%/common.h
+	%D%/common.h \
+	%D%/durability.c \
+	%D%/durability.h
 
 %C%_libtelem_shared_la_CFLAGS = \
 	$(AM_CFLAGS)
@@ -111,6 +137,9 @@ noinst_LTLIBRARIES = %D%/libtelem-shared.la
 %C%_libtelem_shared_la_LDFLAGS = \
 	$(AM_LDFLAGS)
 
+%C%_libtelem_shared_la_LIBADD = \
+	-lpthread
+
 lib_LTLIBRARIES = \
 	%D%/libtelemetry.la
 
@@ -134,6 +163,7 @@ EXTRA_DIST += \
 
 %C%_libtelemetry_la_LIBADD = \
 	%D%/libtelem-shared.la \
-	-ldl
+	-ldl \
+	-lpthread
 
 # vim: filetype=automake tabstop=8 shiftwidth=8 noexpandtab
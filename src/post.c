@@ -33,7 +33,7 @@
  *  using pointer to a fake function.
  */
 
-bool (*post_record_ptr)(char *[], char *, char *) = post_record_http;
+void (*post_record_ptr)(char *[], char *, char *, upload_done_fn, void *) = post_record_http;
 
 void print_usage(char *prog)
 {
@@ -14,6 +14,7 @@
  * details.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -28,8 +29,9 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 #include <signal.h>
-#include <malloc.h>
 
 #include "telemetry.h"
 #include "config.h"
@@ -49,6 +51,7 @@
 #endif
 #include "log.h"
 #include "telemdaemon.h"
+#include "segment.h"
 #include "configuration.h"
 
 void print_usage(char *prog)
@@ -59,15 +62,81 @@ void print_usage(char *prog)
         printf("  -V,  --version        Print the program version\n");
 }
 
+/* Every connected probe holds a file descriptor, allow as many as the hard
+ * limit permits */
+static void raise_fd_limit(void)
+{
+        struct rlimit rl;
+
+        if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+                telem_perror("Failed to get the file descriptor limit");
+                return;
+        }
+
+        if (rl.rlim_cur < rl.rlim_max) {
+                rl.rlim_cur = rl.rlim_max;
+                if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+                        telem_perror("Failed to raise the file descriptor limit");
+                }
+        }
+}
+
+/* Arms the timer for the periodic checks, often enough to notice when the
+ * daemon has been idle long enough to release its memory */
+static void arm_timer(int timerfd)
+{
+        struct itimerspec interval;
+        int seconds = spool_process_time_config();
+        int idle_time = memory_release_idle_time_config();
+
+        if (idle_time > 0 && idle_time < seconds) {
+                seconds = idle_time;
+        }
+
+        interval.it_interval.tv_sec = seconds;
+        interval.it_interval.tv_nsec = 0;
+        interval.it_value = interval.it_interval;
+        if (timerfd_settime(timerfd, 0, &interval, NULL) == -1) {
+                telem_perror("Failed to arm timer");
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* Accept pending connections until the backlog is empty or a batch is done */
+static void accept_clients(TelemDaemon *daemon, int sockfd)
+{
+        int fd;
+
+        for (int n = 0; n < TM_ACCEPT_BATCH; n++) {
+                fd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd == -1) {
+                        if (errno == EINTR || errno == ECONNABORTED) {
+                                continue;
+                        }
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                telem_perror("Failed to accept socket");
+                        }
+                        return;
+                }
+                telem_log(LOG_INFO, "New client %d connected\n", fd);
+
+                /* Add the client to the client list and the epoll instance */
+                if (!watch_client(daemon, fd)) {
+                        if (errno != EUSERS) {
+                                telem_log(LOG_ERR, "Unable to add the client to list\n");
+                        }
+                        close(fd);
+                }
+        }
+}
+
 int main(int argc, char **argv)
 {
         struct sockaddr_un addr;
-        int sockfd, fd, sigfd;
+        int sockfd, sigfd, timerfd;
         int ret = 0;
         TelemDaemon daemon;
-        nfds_t i;
-        client *cl = NULL;
-        client *current_client = NULL;
+        struct epoll_event events[TM_EPOLL_EVENTS];
         int c;
         int opt_index = 0;
         sigset_t mask;
@@ -105,8 +174,15 @@ int main(int argc, char **argv)
                                 exit(EXIT_FAILURE);
                 }
         }
+        raise_fd_limit();
         initialize_probe_daemon(&daemon);
 
+        /* Make the records of a previous instance available to telempostd */
+        ret = segment_seal_stale(spool_dir_config());
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Failed to seal stale segments: %s\n", strerror(-ret));
+        }
+
         sigemptyset(&mask);
 
         if (sigaddset(&mask, SIGHUP) != 0) {
@@ -129,17 +205,32 @@ int main(int argc, char **argv)
                 exit(EXIT_FAILURE);
         }
 
+        if (sigaddset(&mask, SIGUSR1) != 0) {
+                telem_perror("Error adding signal SIGUSR1 to mask");
+                exit(EXIT_FAILURE);
+        }
+
         if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
                 telem_perror("Error changing signal mask with SIG_BLOCK");
                 exit(EXIT_FAILURE);
         }
 
-        sigfd = signalfd(-1, &mask, 0);
+        sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
         if (sigfd == -1) {
                 telem_perror("Error creating the signalfd");
                 exit(EXIT_FAILURE);
         }
-        add_pollfd(&daemon, sigfd, POLLIN);
+
+        /*
+         * The signal, listening and timer sources are told apart from the
+         * clients by their event data, which is the address of the variable
+         * holding their fd. Client events carry the client struct, the
+         * segment timer the segment writer, and the machine id watch the
+         * address of daemon.machine_id_fd.
+         */
+        if (add_epollfd(&daemon, sigfd, EPOLLIN, &sigfd) < 0) {
+                exit(EXIT_FAILURE);
+        }
 
 #ifdef HAVE_SYSTEMD_SD_DAEMON_H
         ret = sd_listen_fds(0);
@@ -147,15 +238,13 @@ int main(int argc, char **argv)
                   ret);
 
         if (ret >= 1) {
-                fd = SD_LISTEN_FDS_START + 0;
+                int fd = SD_LISTEN_FDS_START + 0;
 
                 /* Check if the socket is of correct type */
                 if (sd_is_socket_unix(fd, SOCK_STREAM, 1, socket_path_config(), 0)) {
                         telem_log(LOG_INFO, "Socket of type AF_UNIX passed by systemd\n");
-                        add_pollfd(&daemon, fd, POLLIN | POLLPRI);
                 } else if (sd_is_socket(fd, AF_UNSPEC, 0, -1)) {
                         telem_log(LOG_INFO, "Socket of type SOCKET passed by systemd\n");
-                        add_pollfd(&daemon, fd, POLLIN | POLLPRI);
                 } else {
                         telem_log(LOG_ERR, "File descriptor other than socket passed by systemd\n");
                         exit(EXIT_FAILURE);
@@ -168,7 +257,7 @@ int main(int argc, char **argv)
         } else
 #endif
         {
-                sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+                sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
                 if (sockfd < 0) {
                         telem_perror("Socket creation failed");
                         exit(EXIT_FAILURE);
@@ -199,144 +288,157 @@ int main(int argc, char **argv)
                         telem_perror("Failed to mark socket as passive");
                         exit(EXIT_FAILURE);
                 }
+        }
 
-                /*Add listener fd to array of pollfds */
-                add_pollfd(&daemon, sockfd, POLLIN | POLLPRI);
+        /* Connections are accepted until EAGAIN, the listener must not block */
+        if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) == -1) {
+                telem_perror("Failed to set listening socket as nonblocking");
+                exit(EXIT_FAILURE);
+        }
+
+        if (add_epollfd(&daemon, sockfd, EPOLLIN, &sockfd) < 0) {
+                exit(EXIT_FAILURE);
         }
 
         telem_log(LOG_INFO, "Listening on socket...\n");
 
         bool daemon_recycling_enabled = daemon_recycling_enabled_config();
-        int spool_process_time = spool_process_time_config();
         time_t last_record_received = time(NULL);
+        bool memory_released = false;
 
         ret = update_machine_id();
         if (ret == -1) {
                 telem_log(LOG_ERR, "Unable to update machine id\n");
         }
 
-        /* Read the static machine id file if it exists.*/
-        daemon.machine_id_override = read_machine_id_override();
+        /* Cache the static machine id if it exists, or the one just
+         * updated */
+        refresh_probe_daemon_machine_id(&daemon);
 
         time_t last_refresh_time = time(NULL);
 
+        /* Periodic checks for recycling, memory release and machine id
+         * refresh */
+        timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timerfd == -1) {
+                telem_perror("Failed to create timer");
+                exit(EXIT_FAILURE);
+        }
+        arm_timer(timerfd);
+        if (add_epollfd(&daemon, timerfd, EPOLLIN, &timerfd) < 0) {
+                exit(EXIT_FAILURE);
+        }
+
         /* Loop to accept clients */
         while (1) {
-                malloc_trim(0);
-                ret = poll(daemon.pollfds, daemon.nfds, spool_process_time * 1000);
-                if (ret == -1) {
-                        telem_perror("Failed to poll daemon file descriptors");
+                int nevents = epoll_wait(daemon.epollfd, events, TM_EPOLL_EVENTS, -1);
+                if (nevents == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        telem_perror("Failed to wait on daemon file descriptors");
                         break;
-                } else if (ret != 0) {
-                        for (i = 0; i < daemon.nfds; i++) {
-
-                                /* Check if a signal was received */
-                                if (daemon.pollfds[0].revents != 0) {
-                                        struct signalfd_siginfo fdsi;
-                                        ssize_t s;
-
-                                        s = read(sigfd, &fdsi, sizeof(struct signalfd_siginfo));
-                                        if (s != sizeof(struct signalfd_siginfo)) {
-                                                telem_perror("Error while reading from the signal"
-                                                             "file descriptor");
-                                                exit(EXIT_FAILURE);
-                                        }
+                }
 
-                                        if (fdsi.ssi_signo == SIGTERM || fdsi.ssi_signo == SIGINT) {
-                                                telem_log(LOG_INFO, "Received either a "
-                                                                     "SIGINT/SIGTERM signal\n");
-                                                goto clean_exit;
-                                        }
+                for (int i = 0; i < nevents; i++) {
+                        void *source = events[i].data.ptr;
 
-                                        if (fdsi.ssi_signo == SIGHUP) {
-                                                telem_log(LOG_INFO, "Received a SIGHUP signal\n");
-                                                /* reload configuration file */
-                                                reload_config();
-                                        }
-                                }
+                        if (source == &sigfd) {
+                                struct signalfd_siginfo fdsi;
+                                ssize_t s;
 
-                                if (daemon.pollfds[i].revents == 0) {
-                                        continue;
+                                s = read(sigfd, &fdsi, sizeof(struct signalfd_siginfo));
+                                if (s != sizeof(struct signalfd_siginfo)) {
+                                        telem_perror("Error while reading from the signal"
+                                                     "file descriptor");
+                                        exit(EXIT_FAILURE);
                                 }
 
-                                /* Accept connection if data arrives on listening socket */
-                                if (daemon.pollfds[i].fd == sockfd) {
-                                        if ((fd = accept(daemon.pollfds[i].fd, NULL, NULL)) == -1) {
-                                                telem_perror("Failed to accept socket");
-                                                //exit(EXIT_FAILURE);
-                                                break;
-                                        }
-                                        telem_log(LOG_INFO, "New client %d connected\n", fd);
+                                if (fdsi.ssi_signo == SIGTERM || fdsi.ssi_signo == SIGINT) {
+                                        telem_log(LOG_INFO, "Received either a "
+                                                             "SIGINT/SIGTERM signal\n");
+                                        goto clean_exit;
+                                }
 
-                                        /* set socket to non-blocking */
-                                        if (fcntl(fd, F_SETFL, O_NONBLOCK)) {
-                                                telem_perror("Failed to set socket as nonblocking");
-                                                close(fd);
-                                                break;
-                                        }
+                                if (fdsi.ssi_signo == SIGHUP) {
+                                        telem_log(LOG_INFO, "Received a SIGHUP signal\n");
+                                        /* reload configuration file */
+                                        reload_config();
+                                        configure_probe_daemon_memory(&daemon);
+                                        configure_probe_daemon_admission(&daemon);
+                                        configure_probe_daemon_staging(&daemon);
+                                        arm_timer(timerfd);
+                                }
 
-                                        struct timeval timeout;
-                                        timeout.tv_sec = 10;
-                                        timeout.tv_usec = 0;
+                                if (fdsi.ssi_signo == SIGUSR1) {
+                                        log_probe_daemon_memory(&daemon, LOG_NOTICE);
+                                        log_probe_daemon_peers(&daemon, LOG_NOTICE);
+                                }
+                        } else if (source == &sockfd) {
+                                /* Accept connections waiting on the listening socket */
+                                accept_clients(&daemon, sockfd);
+                        } else if (source == &daemon.segment) {
+                                /* The open segment is due to be synced or sealed */
+                                ret = handle_probe_daemon_staging_timer(&daemon);
+                                if (ret < 0) {
+                                        telem_log(LOG_ERR, "Failed to sync or seal segment:"
+                                                  " %s\n", strerror(-ret));
+                                }
+                        } else if (source == &daemon.machine_id_fd) {
+                                /* The machine id or its override changed */
+                                handle_probe_daemon_machine_id_event(&daemon);
+                        } else if (source == &timerfd) {
+                                uint64_t expirations;
+                                time_t now = time(NULL);
+
+                                if (read(timerfd, &expirations, sizeof(expirations)) == -1 &&
+                                    errno != EAGAIN) {
+                                        telem_perror("Failed to read timer");
+                                }
 
-                                        if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
-                                                       sizeof(timeout)) < 0) {
-                                                telem_perror("Failed to set socket timeout");
-                                        }
+                                /* time to recycle the daemon has elapsed*/
+                                if (daemon_recycling_enabled &&
+                                    difftime(now, last_record_received) >= TM_DAEMON_EXIT_TIME) {
+                                        /* Exit */
+                                        telem_log(LOG_INFO, "Daemon exiting for recycling\n");
+                                        goto clean_exit;
+                                }
 
-                                        /* Add the fd to the client list */
-                                        if (!add_client(&(daemon.client_head), fd)) {
-                                                telem_log(LOG_ERR, "Unable to add the client to list\n");
-                                                exit(EXIT_FAILURE);
+                                if (difftime(now, last_refresh_time) >= TM_REFRESH_RATE) {
+                                        ret = update_machine_id();
+                                        if (ret == -1) {
+                                                telem_log(LOG_ERR, "Unable to update machine id\n");
                                         }
+                                        refresh_probe_daemon_machine_id(&daemon);
+                                        last_refresh_time = time(NULL);
+                                }
 
-                                        /* Add fd to the poll array */
-                                        add_pollfd(&daemon, fd, POLLIN | POLLPRI);
-                                } else if (i != 0) {
-                                        /* Lookup client and handle data on client */
-                                        LIST_FOREACH(cl, &(daemon.client_head), client_ptrs) {
-                                                if (cl->fd == daemon.pollfds[i].fd) {
-                                                        current_client = cl;
-                                                        telem_log(LOG_INFO, "Client found: %d\n",
-                                                                  current_client->fd);
-                                                }
-                                        }
-                                        assert(current_client);
-                                        handle_client(&daemon, i, current_client);
-                                        last_record_received = time(NULL);
+                                /* Return cached memory once per idle period */
+                                int idle_time = memory_release_idle_time_config();
+                                if (!memory_released && idle_time >= 0 &&
+                                    difftime(now, last_record_received) >= idle_time) {
+                                        release_probe_daemon_memory(&daemon);
+                                        memory_released = true;
+                                        log_probe_daemon_memory(&daemon, LOG_INFO);
                                 }
+                        } else {
+                                /* Handle data on client */
+                                handle_client(&daemon, (client *)source);
+                                last_record_received = time(NULL);
+                                memory_released = false;
                         }
-                } else {
-                        time_t now = time(NULL);
-                        /* time to recycle the daemon has elapsed*/
-                        if (daemon_recycling_enabled &&
-                            difftime(now, last_record_received) >= TM_DAEMON_EXIT_TIME) {
-                                /* Exit */
-                                telem_log(LOG_INFO, "Daemon exiting for recycling\n");
-                                goto clean_exit;
-                        }
-                }
-                time_t now = time(NULL);
-                if (difftime(now, last_refresh_time) >= TM_REFRESH_RATE) {
-                        int ret = update_machine_id();
-                        if (ret == -1) {
-                                telem_log(LOG_ERR, "Unable to update machine id\n");
-                        }
-                        last_refresh_time = time(NULL);
                 }
         }
 
 clean_exit:
 
         /* Free memory before exiting */
-        while ((cl = LIST_FIRST(&(daemon.client_head))) != NULL) {
-                remove_client(&(daemon.client_head), cl);
-        }
-        free(daemon.pollfds);
-        free(daemon.machine_id_override);
+        free_probe_daemon(&daemon);
         if (LIST_EMPTY(&(daemon.client_head))) {
                 telem_log(LOG_INFO, "Client list cleared\n");
         }
+        close(timerfd);
+        close(sigfd);
 
         return 0;
 }
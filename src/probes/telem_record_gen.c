@@ -386,11 +386,14 @@ static int print_record(char *payload)
         int ret;
 
         if ((ret = instanciate_record(&t_ref, payload)) == 0) {
+                const char *header;
+                size_t len;
                 int i;
                 for (i = 0; i < NUM_HEADERS; i++) {
-                        fprintf(stdout, "%s", t_ref->record->headers[i]);
+                        header = tm_record_header(t_ref->record, i, &len);
+                        fprintf(stdout, "%.*s", (int)len, header);
                 }
-                fprintf(stdout, "%s\n", t_ref->record->payload);
+                fprintf(stdout, "%s\n", tm_record_payload(t_ref->record));
         }
 
         tm_free_record(t_ref);
@@ -0,0 +1,455 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "segment.h"
+
+#define SEGMENT_OPEN_SUFFIX_LEN (sizeof(SEGMENT_OPEN_SUFFIX) - 1)
+
+/* Attempts to find a segment name that is not in use */
+#define SEGMENT_NAME_ATTEMPTS 8
+
+static uint32_t crc_table[256];
+
+static void init_crc_table(void)
+{
+        for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+
+                for (int k = 0; k < 8; k++) {
+                        c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                }
+                crc_table[i] = c;
+        }
+}
+
+/* CRC-32 as used by zlib, crc is 0 for the first buffer */
+static uint32_t checksum(uint32_t crc, const void *buf, size_t len)
+{
+        const uint8_t *p = buf;
+
+        if (crc_table[1] == 0) {
+                init_crc_table();
+        }
+
+        crc = ~crc;
+        while (len--) {
+                crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        }
+
+        return ~crc;
+}
+
+static bool has_suffix(const char *name, const char *suffix, size_t len)
+{
+        size_t n = strlen(name);
+
+        return n >= len && strcmp(name + n - len, suffix) == 0;
+}
+
+bool segment_is_open(const char *name)
+{
+        return strncmp(name, SEGMENT_PREFIX, strlen(SEGMENT_PREFIX)) == 0 &&
+               has_suffix(name, SEGMENT_OPEN_SUFFIX, SEGMENT_OPEN_SUFFIX_LEN);
+}
+
+bool segment_is_sealed(const char *name)
+{
+        return strncmp(name, SEGMENT_PREFIX, strlen(SEGMENT_PREFIX)) == 0 &&
+               !has_suffix(name, SEGMENT_OPEN_SUFFIX, SEGMENT_OPEN_SUFFIX_LEN);
+}
+
+int segment_writer_init(struct segment_writer *writer)
+{
+        memset(writer, 0, sizeof(*writer));
+        writer->fd = -1;
+        sync_policy_init(&writer->sync, DURABILITY_NONE, 1, 0);
+        writer->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (writer->timerfd == -1) {
+                return -errno;
+        }
+
+        return 0;
+}
+
+void segment_writer_close(struct segment_writer *writer)
+{
+        segment_seal(writer);
+        if (writer->timerfd >= 0) {
+                close(writer->timerfd);
+                writer->timerfd = -1;
+        }
+}
+
+/* Gets the name an open segment is sealed under */
+static void sealed_path(const char *path, char *sealed)
+{
+        size_t len = strlen(path) - SEGMENT_OPEN_SUFFIX_LEN;
+
+        memcpy(sealed, path, len);
+        sealed[len] = '\0';
+}
+
+/* Renames an open segment to its sealed name */
+static int seal_path(const char *path)
+{
+        char sealed[PATH_MAX];
+
+        sealed_path(path, sealed);
+        if (rename(path, sealed) == -1) {
+                return -errno;
+        }
+
+        return 0;
+}
+
+static bool is_before(const struct timespec *a, const struct timespec *b)
+{
+        return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Arms the timer for the nearest of the seal and sync deadlines, or disarms
+ * it if there is none */
+static void arm_timer(struct segment_writer *writer)
+{
+        struct itimerspec timer = { { 0, 0 }, { 0, 0 } };
+        struct timespec sync_deadline;
+
+        if (writer->fd >= 0) {
+                timer.it_value = writer->seal_deadline;
+        }
+        if (sync_policy_deadline(&writer->sync, &sync_deadline) &&
+            (timer.it_value.tv_sec == 0 || is_before(&sync_deadline, &timer.it_value))) {
+                timer.it_value = sync_deadline;
+        }
+
+        if (timerfd_settime(writer->timerfd, TFD_TIMER_ABSTIME, &timer, NULL) == -1) {
+                telem_perror("Failed to arm segment timer");
+        }
+}
+
+/* Syncs the directory a new segment was created in, the records of the
+ * segment are lost with its directory entry otherwise. Renaming the segment
+ * when it is sealed needs no sync, a segment left open is sealed on the next
+ * start. */
+static int sync_dir(const char *path)
+{
+        char dir[PATH_MAX];
+        char *slash;
+        int fd, ret = 0;
+
+        strcpy(dir, path);
+        slash = strrchr(dir, '/');
+        if (slash) {
+                *slash = '\0';
+        } else {
+                strcpy(dir, ".");
+        }
+
+        fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+                return -errno;
+        }
+        if (fsync(fd) == -1) {
+                ret = -errno;
+        }
+        close(fd);
+
+        return ret;
+}
+
+static int open_segment(struct segment_writer *writer, const char *dir)
+{
+        char sealed[PATH_MAX];
+        struct stat st;
+        int fd = -1;
+        int ret;
+
+        for (int i = 0; i < SEGMENT_NAME_ATTEMPTS; i++) {
+                ret = snprintf(writer->path, sizeof(writer->path), "%s/%sXXXXXX%s",
+                               dir, SEGMENT_PREFIX, SEGMENT_OPEN_SUFFIX);
+                if (ret < 0 || (size_t)ret >= sizeof(writer->path)) {
+                        return -ENAMETOOLONG;
+                }
+
+                fd = mkostemps(writer->path, SEGMENT_OPEN_SUFFIX_LEN, O_APPEND | O_CLOEXEC);
+                if (fd == -1) {
+                        return -errno;
+                }
+
+                /* The sealed name must not belong to a segment that is
+                 * still waiting to be consumed */
+                sealed_path(writer->path, sealed);
+                if (lstat(sealed, &st) == -1 && errno == ENOENT) {
+                        break;
+                }
+
+                unlink(writer->path);
+                close(fd);
+                fd = -1;
+        }
+
+        if (fd == -1) {
+                return -EEXIST;
+        }
+
+        writer->fd = fd;
+        writer->size = 0;
+        writer->records = 0;
+
+        if (writer->sync.mode != DURABILITY_NONE && (ret = sync_dir(writer->path)) < 0) {
+                telem_log(LOG_ERR, "Failed to sync spool directory: %s\n", strerror(-ret));
+        }
+
+        memset(&writer->seal_deadline, 0, sizeof(writer->seal_deadline));
+        if (writer->max_age > 0) {
+                clock_gettime(CLOCK_MONOTONIC, &writer->seal_deadline);
+                writer->seal_deadline.tv_sec += writer->max_age;
+        }
+        arm_timer(writer);
+
+        return 0;
+}
+
+int segment_append(struct segment_writer *writer, const char *dir,
+                   const struct iovec *iov, int iovcnt)
+{
+        struct iovec frame[SEGMENT_MAX_IOV + 1];
+        struct segment_frame_header header = { SEGMENT_FRAME_MAGIC, 0, 0 };
+        size_t length = 0;
+        ssize_t written;
+        int ret;
+
+        if (iovcnt > SEGMENT_MAX_IOV) {
+                return -EINVAL;
+        }
+
+        for (int i = 0; i < iovcnt; i++) {
+                header.checksum = checksum(header.checksum, iov[i].iov_base, iov[i].iov_len);
+                length += iov[i].iov_len;
+                frame[i + 1] = iov[i];
+        }
+        if (length > UINT32_MAX) {
+                return -EFBIG;
+        }
+        header.length = (uint32_t)length;
+        frame[0].iov_base = &header;
+        frame[0].iov_len = sizeof(header);
+        length += sizeof(header);
+
+        if (writer->fd < 0 && (ret = open_segment(writer, dir)) < 0) {
+                return ret;
+        }
+
+        written = writev(writer->fd, frame, iovcnt + 1);
+        if (written != (ssize_t)length) {
+                ret = (written == -1) ? -errno : -ENOSPC;
+
+                /* Drop a partial frame, so that the next one is readable */
+                if (written > 0 && ftruncate(writer->fd, (off_t)writer->size) == -1) {
+                        telem_perror("Failed to truncate segment");
+                        segment_seal(writer);
+                }
+                return ret;
+        }
+
+        writer->size += length;
+        writer->records++;
+
+        ret = 0;
+        if (sync_policy_write(&writer->sync)) {
+                ret = segment_sync(writer);
+        }
+
+        if (writer->size >= writer->max_size || writer->max_age == 0) {
+                int seal_ret = segment_seal(writer);
+
+                return ret < 0 ? ret : seal_ret;
+        }
+        arm_timer(writer);
+
+        return ret;
+}
+
+int segment_sync(struct segment_writer *writer)
+{
+        if (writer->fd < 0 || writer->sync.pending == 0) {
+                return 0;
+        }
+
+        if (fdatasync(writer->fd) == -1) {
+                int ret = -errno;
+
+                telem_perror("Failed to sync segment");
+                return ret;
+        }
+        sync_policy_synced(&writer->sync);
+
+        return 0;
+}
+
+int segment_seal(struct segment_writer *writer)
+{
+        int sync_ret;
+        int ret;
+
+        if (writer->fd < 0) {
+                return 0;
+        }
+
+        sync_ret = segment_sync(writer);
+
+        /* Close before renaming, telempostd picks up the sealed name */
+        close(writer->fd);
+        writer->fd = -1;
+        /* Records that could not be synced may be lost with the segment,
+         * the error is returned so that they are sent again */
+        writer->sync.pending = 0;
+        arm_timer(writer);
+
+        ret = seal_path(writer->path);
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Failed to seal segment %s: %s\n", writer->path,
+                          strerror(-ret));
+                return ret;
+        }
+        writer->sealed++;
+
+        return sync_ret;
+}
+
+int segment_handle_timer(struct segment_writer *writer)
+{
+        struct timespec now;
+        uint64_t expirations;
+        int ret = 0;
+
+        if (read(writer->timerfd, &expirations, sizeof(expirations)) == -1) {
+                return (errno == EAGAIN) ? 0 : -errno;
+        }
+
+        if (sync_policy_due(&writer->sync)) {
+                ret = segment_sync(writer);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (writer->fd >= 0 && writer->seal_deadline.tv_sec != 0 &&
+            !is_before(&now, &writer->seal_deadline)) {
+                return segment_seal(writer);
+        }
+        arm_timer(writer);
+
+        return ret;
+}
+
+int segment_seal_stale(const char *dir)
+{
+        DIR *d;
+        struct dirent *entry;
+        char path[PATH_MAX];
+        int sealed = 0;
+        int ret;
+
+        d = opendir(dir);
+        if (!d) {
+                return -errno;
+        }
+
+        while ((entry = readdir(d)) != NULL) {
+                if (!segment_is_open(entry->d_name)) {
+                        continue;
+                }
+                ret = snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+                if (ret < 0 || (size_t)ret >= sizeof(path)) {
+                        continue;
+                }
+                if ((ret = seal_path(path)) < 0) {
+                        telem_log(LOG_ERR, "Failed to seal segment %s: %s\n", path,
+                                  strerror(-ret));
+                        continue;
+                }
+                sealed++;
+        }
+        closedir(d);
+
+        return sealed;
+}
+
+int segment_for_each_record(int fd, segment_record_fn fn, void *data)
+{
+        struct segment_frame_header header;
+        struct stat st;
+        const char *map;
+        size_t size, offset = 0;
+        int records = 0;
+        bool corrupt = false;
+
+        if (fstat(fd, &st) == -1) {
+                return -errno;
+        }
+        if (st.st_size == 0) {
+                return 0;
+        }
+        size = (size_t)st.st_size;
+
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+                return -errno;
+        }
+
+        while (size - offset >= sizeof(header)) {
+                memcpy(&header, map + offset, sizeof(header));
+                if (header.magic != SEGMENT_FRAME_MAGIC ||
+                    header.length > size - offset - sizeof(header)) {
+                        break;
+                }
+                offset += sizeof(header);
+
+                if (checksum(0, map + offset, header.length) != header.checksum) {
+                        telem_log(LOG_WARNING, "Checksum mismatch in segment at offset"
+                                  " %zu\n", offset - sizeof(header));
+                        corrupt = true;
+                        break;
+                }
+
+                fn(map + offset, header.length, data);
+                offset += header.length;
+                records++;
+        }
+
+        if (!corrupt && offset < size) {
+                telem_log(LOG_WARNING, "Ignoring %zu bytes of truncated or corrupt"
+                          " records at the end of segment\n", size - offset);
+        }
+
+        munmap((void *)map, size);
+
+        return records;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,193 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "durability.h"
+
+/*
+ * Staged records are appended to segment files in the spool directory.
+ * A segment is named SEGMENT_PREFIX followed by a random suffix, and carries
+ * SEGMENT_OPEN_SUFFIX while telemprobd appends to it. Sealing a segment
+ * renames it to drop the suffix; a sealed segment is never written again and
+ * is consumed as a whole by telempostd.
+ *
+ * A segment is a sequence of frames, each a segment_frame_header followed by
+ * one record in the same layout as a single-record staging file.
+ */
+#define SEGMENT_PREFIX "segment."
+#define SEGMENT_OPEN_SUFFIX ".open"
+
+/* Records that telempostd keeps for a later delivery attempt are moved out
+ * of their segment into single-record files with this prefix */
+#define SPOOLED_RECORD_PREFIX "spooled."
+
+/* "SEG1", the frame magic also versions the segment format */
+#define SEGMENT_FRAME_MAGIC 0x31474553
+
+/* Maximum number of buffers a record can be appended from */
+#define SEGMENT_MAX_IOV 64
+
+struct segment_frame_header {
+        uint32_t magic;
+        /* size of the record following the header */
+        uint32_t length;
+        /* CRC-32 of the record */
+        uint32_t checksum;
+};
+
+struct segment_writer {
+        /* open segment, or -1 if there is none */
+        int fd;
+        char path[PATH_MAX];
+        /* bytes and records appended to the open segment */
+        size_t size;
+        size_t records;
+        /* one-shot timer that expires when the open segment is too old, or
+         * when its pending writes must be synced */
+        int timerfd;
+        /* the open segment is sealed once it holds max_size bytes, or
+         * max_age seconds after its first record, 0 seals every record */
+        size_t max_size;
+        int max_age;
+        /* time at which the open segment is sealed, zero if never */
+        struct timespec seal_deadline;
+        /* when appended records are synced to disk */
+        struct sync_policy sync;
+        /* number of segments sealed */
+        uint64_t sealed;
+};
+
+/**
+ * Initialize a segment writer
+ *
+ * @param writer The writer
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int segment_writer_init(struct segment_writer *writer);
+
+/**
+ * Seal the open segment and release the writer resources
+ *
+ * @param writer The writer
+ */
+void segment_writer_close(struct segment_writer *writer);
+
+/**
+ * Append a record to the open segment
+ *
+ * A segment is opened in dir if none is. The record is written with a
+ * single system call and synced as the sync policy of the writer requires,
+ * and the segment is sealed afterwards if it reached its maximum size. The
+ * record is durable once writer->sync.pending is 0.
+ *
+ * @param writer The writer
+ * @param dir The spool directory
+ * @param iov The buffers holding the record
+ * @param iovcnt The number of buffers, at most SEGMENT_MAX_IOV
+ *
+ * @return 0 on success, or a negative errno-style value on error, in which
+ *     case nothing was appended
+ */
+int segment_append(struct segment_writer *writer, const char *dir,
+                   const struct iovec *iov, int iovcnt);
+
+/**
+ * Sync the records appended to the open segment that are not synced yet
+ *
+ * @param writer The writer
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int segment_sync(struct segment_writer *writer);
+
+/**
+ * Seal the open segment, if any
+ *
+ * Pending records are synced first, unless the sync policy is
+ * DURABILITY_NONE. The segment is sealed even if that sync fails.
+ *
+ * @param writer The writer
+ *
+ * @return 0 on success, or a negative errno-style value if the sync or the
+ *     seal failed
+ */
+int segment_seal(struct segment_writer *writer);
+
+/**
+ * Sync the pending records of the open segment, or seal it, if the
+ * corresponding deadline passed
+ *
+ * Called when the writer timerfd is readable.
+ *
+ * @param writer The writer
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int segment_handle_timer(struct segment_writer *writer);
+
+/**
+ * Seal the segments left open in dir, e.g. by a crashed daemon
+ *
+ * @param dir The spool directory
+ *
+ * @return The number of segments sealed, or a negative errno-style value on
+ *     error
+ */
+int segment_seal_stale(const char *dir);
+
+/**
+ * Check if a spool file name is an open segment
+ */
+bool segment_is_open(const char *name);
+
+/**
+ * Check if a spool file name is a sealed segment
+ */
+bool segment_is_sealed(const char *name);
+
+/**
+ * Callback for segment_for_each_record()
+ *
+ * @param record The record, not null-terminated
+ * @param size The size of the record
+ * @param data The data passed to segment_for_each_record()
+ */
+typedef void (*segment_record_fn)(const char *record, size_t size, void *data);
+
+/**
+ * Call fn for each record of a segment
+ *
+ * Stops at the first frame that is truncated or fails its checksum.
+ *
+ * @param fd The segment, open for reading
+ * @param fn The callback
+ * @param data Passed to the callback
+ *
+ * @return The number of records read, or a negative errno-style value on
+ *     error
+ */
+int segment_for_each_record(int fd, segment_record_fn fn, void *data);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
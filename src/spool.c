@@ -28,6 +28,7 @@
 #include <fcntl.h>
 
 #include "spool.h"
+#include "segment.h"
 #include "telempostdaemon.h"
 #include "log.h"
 #include "configuration.h"
@@ -38,6 +39,10 @@ int directory_filter(const struct dirent *entry)
 {
         if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
                 return 0;
+        } else if (segment_is_open(entry->d_name) || segment_is_sealed(entry->d_name)) {
+                /* Segments are consumed by staging_records_loop(), records
+                 * are spooled in single-record files */
+                return 0;
         } else {
                 return 1;
         }
@@ -82,13 +87,52 @@ long get_spool_dir_size()
         return dir_size;
 }
 
+/* A spooled record being posted */
+struct spooled_post {
+        struct spool_run *run;
+        char *record_path;
+        long size;
+};
+
+static void spooled_record_posted(bool sent, void *data)
+{
+        struct spooled_post *post = data;
+        struct spool_run *run = post->run;
+
+        if (!sent) {
+                telem_log(LOG_DEBUG, "Unable to connect to the server\n");
+                run->post_failed = true;
+        } else {
+                unlink(post->record_path);
+                telem_log(LOG_DEBUG, "Spool record %s transmitted\n",
+                          post->record_path);
+                run->records_sent++;
+
+                /* if spooled record is sent, deduct from tm_spool_dir_size */
+                if (*run->current_spool_size > 0) {
+                        *run->current_spool_size -= post->size;
+                }
+                /*
+                 * If getting the directory size failed earlier due to
+                 * EMFILE/ENFILE, try to calculate again.
+                 * EMFILE - too many file descriptors in use by process
+                 * ENFILE - too many files are open in the system
+                 */
+                if (*run->current_spool_size < 0) {
+                        *run->current_spool_size = get_spool_dir_size();
+                }
+        }
+
+        free(post->record_path);
+        free(post);
+}
+
 void spool_records_loop(long *current_spool_size)
 {
         const char *spool_dir_path;
         int numentries;
         struct dirent **namelist;
-        int records_processed = 0;
-        int records_sent = 0;
+        struct spool_run run = { 0, 0, false, current_spool_size };
 
         spool_dir_path = spool_dir_config();
         numentries = scandir(spool_dir_path, &namelist, directory_filter, NULL);
@@ -107,36 +151,44 @@ void spool_records_loop(long *current_spool_size)
         for (int i = 0; i < numentries; i++) {
                 telem_log(LOG_DEBUG, "Processing spool record: %s\n",
                           namelist[i]->d_name);
-                process_spooled_record(spool_dir_path, namelist[i]->d_name,
-                                       &records_processed, &records_sent, current_spool_size);
+                process_spooled_record(spool_dir_path, namelist[i]->d_name, &run);
 
                 /* If the first send attempt fails, we assume that future send
-                 * attempts may also fail, so abort early.
+                 * attempts may also fail, so abort early. Once a record was
+                 * sent, the others are posted without waiting for each.
                  */
-                if (records_sent == 0) {
+                if (run.records_sent == 0) {
+                        wait_for_posts(0);
+                        if (run.records_sent == 0) {
+                                break;
+                        }
+                }
+
+                if (run.post_failed) {
                         break;
                 }
 
-                if (records_processed == TM_SPOOL_MAX_PROCESS_RECORDS) {
+                if (run.records_processed == TM_SPOOL_MAX_PROCESS_RECORDS) {
                         break;
                 }
         }
 
+        /* The records are removed once their post completes */
+        wait_for_posts(0);
+
         for (int i = 0; i < numentries; i++) {
                 free(namelist[i]);
         }
         free(namelist);
 }
 
-void process_spooled_record(const char *spool_dir, char *name,
-                            int *records_processed, int *records_sent,
-                            long *current_spool_size)
+void process_spooled_record(const char *spool_dir, char *name, struct spool_run *run)
 {
         char *record_name;
         int ret;
         struct stat buf;
         time_t current_time = time(NULL);
-        bool post_succeeded = true;
+        struct spooled_post *post;
 
         if (!strcmp(name, ".") || !strcmp(name, "..")) {
                 return;
@@ -149,7 +201,7 @@ void process_spooled_record(const char *spool_dir, char *name,
                 exit(EXIT_FAILURE);
         }
 
-        (*records_processed)++;
+        run->records_processed++;
         // Use file descriptor to mitigate TOCTOU
         int fd = open(record_name, O_RDONLY | O_NOFOLLOW);
         if (fd == -1) {
@@ -179,42 +231,39 @@ void process_spooled_record(const char *spool_dir, char *name,
             (buf.st_uid != getuid())) {
                 unlink(record_name);
                 close(fd);
-        } else if (post_succeeded && *records_sent <= TM_SPOOL_MAX_SEND_RECORDS) {
+        } else if (!run->post_failed && run->records_sent <= TM_SPOOL_MAX_SEND_RECORDS) {
                 close(fd);
-                transmit_spooled_record(record_name, &post_succeeded, buf.st_size);
 
-                if (!post_succeeded) {
-                        telem_log(LOG_DEBUG, "Unable to connect to the server\n");
-                } else {
-                        telem_log(LOG_DEBUG, "Spool record %s transmitted\n",
-                                  record_name);
-                        (*records_sent)++;
-
-                        /* if spooled record is sent, deduct from tm_spool_dir_size */
-                        if (*current_spool_size > 0) {
-                                *current_spool_size -= (buf.st_blocks * 512);
-                        }
-                        /*
-                         * If getting the directory size failed earlier due to
-                         * EMFILE/ENFILE, try to calculate again.
-                         * EMFILE - too many file descriptors in use by process
-                         * ENFILE - too many files are open in the system
-                         */
-                        if (*current_spool_size < 0) {
-                                *current_spool_size = get_spool_dir_size();
-                        }
+                post = malloc(sizeof(struct spooled_post));
+                if (!post) {
+                        telem_log(LOG_ERR, "Unable to allocate memory for"
+                                  " record in spool, exiting\n");
+                        exit(EXIT_FAILURE);
                 }
+                post->run = run;
+                post->record_path = record_name;
+                post->size = buf.st_blocks * 512;
+                if (transmit_spooled_record(record_name, buf.st_size,
+                                            spooled_record_posted, post)) {
+                        /* Freed once posted */
+                        return;
+                }
+                free(post);
+                /* A record that can not be read does not stop the spool */
+                run->records_sent++;
         }
 exit:
         free(record_name);
 }
 
-void transmit_spooled_record(char *record_path, bool *post_succeeded, long size)
+bool transmit_spooled_record(char *record_path, long size, upload_done_fn done,
+                             void *data)
 {
         FILE *fp = NULL;
         char *headers[NUM_HEADERS];
         char *payload = NULL;
         int num_headers = 0, k;
+        bool posted = false;
 #if (LINE_MAX > PATH_MAX)
         char line[LINE_MAX+1] = { 0 };
 #else
@@ -227,7 +276,7 @@ void transmit_spooled_record(char *record_path, bool *post_succeeded, long size)
         fp = fopen(record_path, "r");
         if (fp == NULL) {
                 telem_log(LOG_ERR, "Unable to open file %s in spool\n", record_path);
-                return;
+                return false;
         }
 
         // First line optionally contains configuration file path
@@ -264,6 +313,7 @@ void transmit_spooled_record(char *record_path, bool *post_succeeded, long size)
 
         for (num_headers = 0; num_headers < NUM_HEADERS; num_headers++) {
                 const char *header_name = get_header_name(num_headers);
+                offset = ftell(fp);
                 if (!fgets(line, sizeof(line), fp)) {
                         telem_log(LOG_ERR, "Error while parsing record file\n");
                         goto read_error;
@@ -272,6 +322,11 @@ void transmit_spooled_record(char *record_path, bool *post_succeeded, long size)
                 strtok(line, "\n");
                 if (get_header(line, header_name, &headers[num_headers])) {
                         continue;
+                } else if (get_default_header(num_headers, &headers[num_headers])) {
+                        /* Spooled by an older version, the line belongs to
+                         * the payload */
+                        fseek(fp, offset, SEEK_SET);
+                        continue;
                 } else {
                         telem_log(LOG_ERR, "transmit_spooled_record: Incorrect"
                                   " headers in record\n");
@@ -302,10 +357,8 @@ void transmit_spooled_record(char *record_path, bool *post_succeeded, long size)
                 goto read_error;
         }
 
-        *post_succeeded = post_record_http(headers, payload, cfg_file);
-        if (*post_succeeded) {
-                unlink(record_path);
-        }
+        post_record_http(headers, payload, cfg_file, done, data);
+        posted = true;
 read_error:
         if (payload) {
                 free(payload);
@@ -322,6 +375,8 @@ read_error:
         if (cfg_file) {
                 free(cfg_file);
         }
+
+        return posted;
 }
 
 int spool_record_compare(const void *entrya, const void *entryb, void *path)
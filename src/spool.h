@@ -16,31 +16,51 @@
 
 #pragma once
 
+#include <stdbool.h>
+
+#include "uploader.h"
+
+/* Progress of a run of the spool record loop */
+struct spool_run {
+        int records_processed;
+        /* records sent to the backend, updated as their post completes */
+        int records_sent;
+        bool post_failed;
+        long *current_spool_size;
+};
+
 /**
  * Run the spool record loop periodically
+ *
+ * Once a record was sent, the records are posted without waiting for the
+ * response to the previous one. Returns once all posts completed.
  */
 void spool_records_loop(long *current_spool_size);
 
 /**
  * Process the spooled record
  *
+ * The record is removed once it is sent.
+ *
  * @param spool_dir Path of the spool directory
  * @param name File name of the spooled record
- * @param records_processed Number of records processed till now
- * @param records_sent Number of records sent to the backend
+ * @param run Progress of the spool record loop
  */
-void process_spooled_record(const char *spool_dir, char *name,
-                            int *records_processed, int *records_sent,
-                            long *current_spool_size);
+void process_spooled_record(const char *spool_dir, char *name, struct spool_run *run);
 
 /**
  * Send the spooled record to the backend
  *
  * @param record_path Path of the spooled record
- * @param post_succeeded bool indicating if the previous post was successful
  * @param sz Size of the file in bytes
+ * @param done Called once the post completed
+ * @param data Passed to done
+ *
+ * @return false if the record could not be read, in which case done is not
+ *         called
  */
-void transmit_spooled_record(char *record_path, bool *post_succeeded, long sz);
+bool transmit_spooled_record(char *record_path, long sz, upload_done_fn done,
+                             void *data);
 
 /**
  * Comparison function used for qsort
@@ -28,24 +28,222 @@
 #include <time.h>
 #include <malloc.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
 
 #include "iorecord.h"
+#include "segment.h"
+#include "handoff.h"
 #include "telemdaemon.h"
+#include "telemetry.h"
 #include "common.h"
 #include "util.h"
 #include "log.h"
 #include "configuration.h"
 
-static void process_record(TelemDaemon *daemon, client *cl);
+static enum tm_ack_status process_record(TelemDaemon *daemon, struct peer *peer,
+                                         uint8_t *record, size_t size,
+                                         uint32_t *retry_after);
+static void watch_machine_id(TelemDaemon *daemon);
+static void ack_synced_records(TelemDaemon *daemon, int ret);
 
 void initialize_probe_daemon(TelemDaemon *daemon)
 {
         client_list_head head;
         LIST_INIT(&head);
-        daemon->nfds = 0;
-        daemon->pollfds = NULL;
+        daemon->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (daemon->epollfd == -1) {
+                telem_perror("Failed to create epoll instance");
+                exit(EXIT_FAILURE);
+        }
+        daemon->nclients = 0;
         daemon->client_head = head;
+        LIST_INIT(&daemon->sync_waiters);
+        LIST_INIT(&daemon->ack_waiters);
+        daemon->handoff_fd = -1;
+        daemon->handoff_attempt_time = 0;
+        daemon->handed_off = 0;
+        daemon->handoff_overflows = 0;
+        daemon->machine_id_override = NULL;
+        daemon->machine_id_fd = -1;
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                daemon->default_headers[i] = NULL;
+                if (get_header_default(i) && !get_default_header(i, &daemon->default_headers[i])) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        daemon->memory_releases = 0;
+        buffer_pool_init(&daemon->pool, 0);
+        configure_probe_daemon_memory(daemon);
+        admission_init(&daemon->admission);
+        configure_probe_daemon_admission(daemon);
+
+        if (segment_writer_init(&daemon->segment) < 0) {
+                telem_perror("Failed to create segment timer");
+                exit(EXIT_FAILURE);
+        }
+        configure_probe_daemon_staging(daemon);
+        if (add_epollfd(daemon, daemon->segment.timerfd, EPOLLIN, &daemon->segment) < 0) {
+                exit(EXIT_FAILURE);
+        }
+
+        refresh_probe_daemon_machine_id(daemon);
+        watch_machine_id(daemon);
+}
+
+void free_probe_daemon(TelemDaemon *daemon)
+{
+        client *cl;
+
+        ack_synced_records(daemon, segment_sync(&daemon->segment));
+        while ((cl = LIST_FIRST(&(daemon->client_head))) != NULL) {
+                remove_client(&(daemon->client_head), cl);
+        }
+        daemon->nclients = 0;
+        segment_writer_close(&daemon->segment);
+        while ((cl = LIST_FIRST(&(daemon->sync_waiters))) != NULL) {
+                remove_client(&(daemon->sync_waiters), cl);
+        }
+        if (daemon->handoff_fd >= 0) {
+                close(daemon->handoff_fd);
+                daemon->handoff_fd = -1;
+        }
+        if (daemon->machine_id_fd >= 0) {
+                close(daemon->machine_id_fd);
+                daemon->machine_id_fd = -1;
+        }
+        if (daemon->epollfd >= 0) {
+                close(daemon->epollfd);
+                daemon->epollfd = -1;
+        }
+        free(daemon->machine_id_override);
         daemon->machine_id_override = NULL;
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                free(daemon->default_headers[i]);
+                daemon->default_headers[i] = NULL;
+        }
+        admission_free(&daemon->admission);
+        buffer_pool_shrink(&daemon->pool, 0);
+}
+
+void configure_probe_daemon_memory(TelemDaemon *daemon)
+{
+        daemon->pool.max_cached = (size_t)buffer_pool_max_size_config() * 1024;
+        buffer_pool_shrink(&daemon->pool, daemon->pool.max_cached);
+}
+
+void configure_probe_daemon_admission(TelemDaemon *daemon)
+{
+        admission_configure(&daemon->admission);
+}
+
+void configure_probe_daemon_staging(TelemDaemon *daemon)
+{
+        int ret;
+
+        daemon->segment.max_size = (size_t)segment_max_size_config() * 1024;
+        daemon->segment.max_age = segment_max_age_config();
+
+        /* Records staged under the previous policy are synced with it */
+        ret = segment_sync(&daemon->segment);
+        sync_policy_init(&daemon->segment.sync, durability_config(),
+                         durability_group_records_config(),
+                         durability_group_interval_config());
+        ack_synced_records(daemon, ret);
+
+        /* Records handed over are only held in memory by telempostd, so
+         * they bypass the durability policy */
+        daemon->handoff_enabled = direct_handoff_enabled_config() &&
+                                  daemon->segment.sync.mode == DURABILITY_NONE;
+        if (!daemon->handoff_enabled && daemon->handoff_fd >= 0) {
+                close(daemon->handoff_fd);
+                daemon->handoff_fd = -1;
+        }
+}
+
+/* Closes the connections of the clients that were waiting for the
+ * acknowledgements of their records */
+static void release_sync_waiters(TelemDaemon *daemon)
+{
+        client *cl;
+
+        while ((cl = LIST_FIRST(&(daemon->sync_waiters))) != NULL) {
+                LIST_REMOVE(cl, client_ptrs);
+                close(cl->fd);
+                buffer_pool_put(&daemon->pool, cl, sizeof(client));
+        }
+}
+
+int handle_probe_daemon_staging_timer(TelemDaemon *daemon)
+{
+        int ret = segment_handle_timer(&daemon->segment);
+
+        ack_synced_records(daemon, ret);
+
+        return ret;
+}
+
+void release_probe_daemon_memory(TelemDaemon *daemon)
+{
+        buffer_pool_shrink(&daemon->pool, 0);
+        malloc_trim(0);
+        daemon->memory_releases++;
+}
+
+/* Returns the resident set size of the daemon in kB, or -1 on error */
+static long resident_size(void)
+{
+        FILE *fp;
+        long pages = -1;
+
+        fp = fopen("/proc/self/statm", "r");
+        if (!fp) {
+                return -1;
+        }
+        if (fscanf(fp, "%*s %ld", &pages) != 1) {
+                pages = -1;
+        }
+        fclose(fp);
+
+        return pages < 0 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void log_probe_daemon_memory(TelemDaemon *daemon, int priority)
+{
+        struct rusage usage;
+        long max_rss = -1;
+
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+                max_rss = usage.ru_maxrss;
+        }
+
+        telem_log(priority, "Buffer pool: %.1f%% hit rate (%" PRIu64 " hits, %"
+                  PRIu64 " misses), %zu of %zu kB cached; %" PRIu64
+                  " memory releases; %zu clients; RSS %ld kB, peak %ld kB\n",
+                  buffer_pool_hit_rate(&daemon->pool), daemon->pool.hits,
+                  daemon->pool.misses, daemon->pool.cached / 1024,
+                  daemon->pool.max_cached / 1024, daemon->memory_releases,
+                  daemon->nclients, resident_size(), max_rss);
+}
+
+void log_probe_daemon_peers(TelemDaemon *daemon, int priority)
+{
+        admission_log(&daemon->admission, priority);
+}
+
+static void init_client(client *cl, int fd)
+{
+        cl->fd = fd;
+        cl->state = CLIENT_READ_SIZE;
+        cl->record_size = 0;
+        cl->offset = 0;
+        cl->size = 0;
+        cl->buf = NULL;
+        cl->acks = false;
+        cl->held_acks = 0;
+        cl->peer = NULL;
 }
 
 client *add_client(client_list_head *client_head, int fd)
@@ -54,10 +252,7 @@ client *add_client(client_list_head *client_head, int fd)
 
         cl = (client *)malloc(sizeof(client));
         if (cl) {
-                cl->fd = fd;
-                cl->offset = 0;
-                cl->buf = NULL;
-
+                init_client(cl, fd);
                 LIST_INSERT_HEAD(client_head, cl, client_ptrs);
         }
         return cl;
@@ -83,15 +278,98 @@ bool is_client_list_empty(client_list_head *client_head)
 }
 
 
-static void terminate_client(TelemDaemon *daemon, client *cl, nfds_t index)
+/* Accounts a connection to the user of the connected process. Returns
+ * -EUSERS if the user has too many connections open. */
+static int admit_client(TelemDaemon *daemon, int fd, struct peer **peer)
 {
-        /* Remove fd from the pollfds array */
-        del_pollfd(daemon, index);
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        int ret;
+
+        *peer = NULL;
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+                /* Not a local socket, there is no user to account it to */
+                telem_log(LOG_WARNING, "Failed to get credentials of client %d: %s\n",
+                          fd, strerror(errno));
+                return 0;
+        }
+
+        ret = admission_connect(&daemon->admission, cred.uid, peer);
+        if (ret == -EUSERS) {
+                telem_debug("DEBUG: Refused client %d of uid %u: too many connections\n",
+                            fd, (unsigned int)cred.uid);
+        }
+
+        return ret;
+}
+
+client *watch_client(TelemDaemon *daemon, int fd)
+{
+        client *cl;
+        struct peer *peer;
+        size_t capacity;
+        int ret;
+
+        /* Connections over the limit are refused before anything is
+         * allocated for them */
+        if ((ret = admit_client(daemon, fd, &peer)) < 0) {
+                errno = -ret;
+                return NULL;
+        }
+
+        cl = buffer_pool_get(&daemon->pool, sizeof(client), &capacity);
+        if (!cl) {
+                goto fail;
+        }
+        init_client(cl, fd);
+        cl->peer = peer;
+
+        if (add_epollfd(daemon, fd, EPOLLIN, cl) < 0) {
+                /* Let the caller close fd */
+                buffer_pool_put(&daemon->pool, cl, sizeof(client));
+                goto fail;
+        }
+        LIST_INSERT_HEAD(&(daemon->client_head), cl, client_ptrs);
+        daemon->nclients++;
+
+        return cl;
+
+fail:
+        if (peer) {
+                admission_disconnect(peer);
+        }
+        return NULL;
+}
+
+static void terminate_client(TelemDaemon *daemon, client *cl)
+{
+        /* Stop watching the fd before it is closed */
+        del_epollfd(daemon, cl->fd);
+        if (daemon->nclients > 0) {
+                daemon->nclients--;
+        }
 
         telem_log(LOG_INFO, "Removing client: %d\n", cl->fd);
 
-        /* Remove client from the client list */
-        remove_client(&(daemon->client_head), cl);
+        if (cl->peer) {
+                admission_disconnect(cl->peer);
+                cl->peer = NULL;
+        }
+
+        /* Remove client from the client list, and keep its memory */
+        LIST_REMOVE(cl, client_ptrs);
+        buffer_pool_put(&daemon->pool, cl->buf, cl->size);
+        cl->buf = NULL;
+        cl->size = 0;
+
+        /* A client done sending still reads the acknowledgements held for
+         * it, the connection is closed once they are sent */
+        if (cl->held_acks > 0) {
+                LIST_INSERT_HEAD(&(daemon->sync_waiters), cl, client_ptrs);
+                return;
+        }
+        close(cl->fd);
+        buffer_pool_put(&daemon->pool, cl, sizeof(client));
 }
 
 /*
@@ -113,73 +391,280 @@ static void terminate_client(TelemDaemon *daemon, client *cl, nfds_t index)
 
 #define MAX_RECORD_SIZE (2*sizeof(uint32_t) + CFG_PREFIX_LENGTH + PATH_MAX + \
         MAX_PAYLOAD_LENGTH + NUM_HEADERS*80)
-bool handle_client(TelemDaemon *daemon, nfds_t index, client *cl)
+/* Free space kept in a client buffer for each recv, so that a batch of small
+ * records can be drained with few recv calls */
+#define CLIENT_RECV_CHUNK MAX_RECORD_SIZE
+/* Maximum number of recv calls for a client per wakeup, so that a client that
+ * keeps sending can not starve the others */
+#define CLIENT_READ_BUDGET 16
+
+/* Tells a client that asked for acknowledgements what became of a record.
+ * Returns false if the client does not read them. */
+static bool send_record_ack(client *cl, enum tm_ack_status status, uint32_t retry_after)
 {
-        /* For now  read data from fd */
-        ssize_t len;
-        size_t buf_size;
-        bool processed = false;
-        uint32_t record_size;
+        struct record_ack ack = { (uint32_t)status, retry_after };
+        ssize_t sent;
 
-        if (cl->buf != NULL) {
-                free(cl->buf);
-                cl->buf = NULL;
+        if (!cl->acks) {
+                return true;
         }
 
-        malloc_trim(0);
-        len = recv(cl->fd, &record_size, RECORD_SIZE_LEN, MSG_PEEK | MSG_DONTWAIT);
-        if (len < 0) {
-                telem_log(LOG_ERR, "Failed to talk to client %d: %s\n", cl->fd,
-                          strerror(errno));
-                goto end_client;
-        } else if (len == 0) {
-                /* Connection closed by client, most likely */
-                telem_log(LOG_INFO, "No data to receive from client %d\n",
-                          cl->fd);
-                goto end_client;
-        }
-
-        /* Read the record size first */
-        len = recv(cl->fd, &record_size, RECORD_SIZE_LEN, 0);
-        if (len < 0) {
-                telem_log(LOG_ERR, "Failed to receive data from client"
-                                  " %d: %s\n", cl->fd, strerror(errno));
-                goto end_client;
-        } else if (len == 0) {
-                telem_log(LOG_DEBUG, "End of transmission for client"
-                          " %d\n", cl->fd);
-                goto end_client;
+        do {
+                sent = send(cl->fd, &ack, sizeof(ack), MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while (sent == -1 && errno == EINTR);
+
+        if (sent != (ssize_t)sizeof(ack)) {
+                telem_log(LOG_ERR, "Failed to acknowledge record of client %d: %s\n",
+                          cl->fd, sent == -1 ? strerror(errno) : "short write");
+                return false;
         }
 
-        /* Now that we know the record size, allocate a new buffer
-         * for the record body. We don't need to record size itself in the body.
-         */
+        return true;
+}
+
+/* Sends the acknowledgements held for records accepted, with status. A
+ * client that does not read them is shut down, and removed by the event
+ * loop. */
+static void release_held_acks(TelemDaemon *daemon, enum tm_ack_status status)
+{
+        uint32_t retry_after = status == TM_ACK_RETRY_AFTER ? TM_RECORD_RETRY_AFTER : 0;
+        client *cl;
 
-        if (record_size <= RECORD_SIZE_LEN || record_size > MAX_RECORD_SIZE) {
-                telem_log(LOG_ERR, "Record size %u greater tham maximum allowed %lu."
-                                    "Recored ignored\n", record_size,
-                                    MAX_RECORD_SIZE);
-                goto end_client;      
+        while ((cl = LIST_FIRST(&(daemon->ack_waiters))) != NULL) {
+                LIST_REMOVE(cl, ack_ptrs);
+                for (; cl->held_acks > 0; cl->held_acks--) {
+                        if (!send_record_ack(cl, status, retry_after)) {
+                                shutdown(cl->fd, SHUT_RDWR);
+                                cl->held_acks = 0;
+                                break;
+                        }
+                }
         }
+}
 
-        buf_size = record_size - RECORD_SIZE_LEN;
-        cl->buf = calloc(1, buf_size);
-        if (!cl->buf) {
-                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
-                exit(EXIT_FAILURE);
+/* Sends the acknowledgements held, and closes the clients waiting for a
+ * sync, once no staged record waits for one. ret is the result of the
+ * segment operation that synced them, if it failed the records were sealed
+ * unsynced and are to be sent again. */
+static void ack_synced_records(TelemDaemon *daemon, int ret)
+{
+        if (daemon->segment.sync.pending == 0) {
+                release_held_acks(daemon, ret < 0 ? TM_ACK_RETRY_AFTER : TM_ACK_ACCEPTED);
+                release_sync_waiters(daemon);
         }
-        cl->size = buf_size;
-        cl->offset = 0;
+}
+
+/* Acknowledges a record. In group durability mode a record accepted is
+ * acknowledged once the sync that covers it is done, and the records after
+ * it are acknowledged in order. Returns false if the client does not read
+ * its acknowledgements. */
+static bool ack_record(TelemDaemon *daemon, client *cl, enum tm_ack_status status,
+                       uint32_t retry_after)
+{
+        int ret;
+
+        if (!cl->acks) {
+                return true;
+        }
+
+        if (status == TM_ACK_ACCEPTED && daemon->segment.sync.pending > 0) {
+                if (cl->held_acks++ == 0) {
+                        LIST_INSERT_HEAD(&(daemon->ack_waiters), cl, ack_ptrs);
+                }
+                return true;
+        }
+
+        /* An acknowledgement can not overtake the ones held, sync now */
+        if (cl->held_acks > 0) {
+                ret = segment_sync(&daemon->segment);
+                if (ret < 0) {
+                        release_held_acks(daemon, TM_ACK_RETRY_AFTER);
+                }
+                ack_synced_records(daemon, ret);
+        }
+
+        return send_record_ack(cl, status, retry_after);
+}
+
+/**
+ * Process every complete record buffered for a client.
+ *
+ * Advances the client state machine over the cl->offset bytes buffered in
+ * cl->buf: in CLIENT_READ_SIZE it waits for the size of the next record, in
+ * CLIENT_READ_RECORD for the rest of that record, which is then dispatched
+ * to process_record(). Bytes of an incomplete record are kept at the start
+ * of the buffer for the next call. A RECORD_ACK_REQUEST in place of a record
+ * size turns on acknowledgements for the records that follow. A record over
+ * the rate limit of the user is acknowledged as throttled as soon as its
+ * size is known, and its bytes are dropped in CLIENT_SKIP_RECORD as they
+ * arrive.
+ *
+ * @param daemon The pointer to the daemon
+ * @param cl The client
+ * @param processed Set to true if at least one record was processed
+ *
+ * @return false if the client sent an invalid record size or does not read
+ *     its acknowledgements, true otherwise
+ */
+static bool process_client_records(TelemDaemon *daemon, client *cl, bool *processed)
+{
+        enum tm_ack_status status;
+        uint32_t retry_after;
+        size_t pos = 0;
+
+        while (1) {
+                size_t avail = cl->offset - pos;
+
+                if (cl->state == CLIENT_READ_SIZE) {
+                        if (avail < RECORD_SIZE_LEN) {
+                                break;
+                        }
+                        memcpy(&cl->record_size, cl->buf + pos, RECORD_SIZE_LEN);
+
+                        if (cl->record_size == RECORD_ACK_REQUEST) {
+                                cl->acks = true;
+                                pos += RECORD_SIZE_LEN;
+                                continue;
+                        }
+                        if (cl->record_size <= RECORD_SIZE_LEN ||
+                            cl->record_size > MAX_RECORD_SIZE) {
+                                telem_log(LOG_ERR, "Record size %u greater tham maximum allowed %lu."
+                                                    "Recored ignored\n", cl->record_size,
+                                                    MAX_RECORD_SIZE);
+                                ack_record(daemon, cl, TM_ACK_REJECTED, 0);
+                                return false;
+                        }
+                        if (cl->peer && !admission_record(cl->peer, &retry_after)) {
+                                if (!ack_record(daemon, cl, TM_ACK_THROTTLED, retry_after)) {
+                                        return false;
+                                }
+                                pos += RECORD_SIZE_LEN;
+                                cl->record_size -= (uint32_t)RECORD_SIZE_LEN;
+                                cl->state = CLIENT_SKIP_RECORD;
+                                continue;
+                        }
+                        cl->state = CLIENT_READ_RECORD;
+                } else if (cl->state == CLIENT_SKIP_RECORD) {
+                        if (avail == 0) {
+                                break;
+                        }
+                        if (avail > cl->record_size) {
+                                avail = cl->record_size;
+                        }
+                        pos += avail;
+                        cl->record_size -= (uint32_t)avail;
+                        if (cl->record_size == 0) {
+                                cl->state = CLIENT_READ_SIZE;
+                        }
+                } else {
+                        if (avail < cl->record_size) {
+                                /* Rest of the record has not arrived yet */
+                                break;
+                        }
+
+                        /* The record ends with a null byte, enforce it so the
+                         * strings in it can not run into the next record */
+                        cl->buf[pos + cl->record_size - 1] = '\0';
+                        retry_after = 0;
+                        status = process_record(daemon, cl->peer,
+                                                cl->buf + pos + RECORD_SIZE_LEN,
+                                                cl->record_size - RECORD_SIZE_LEN,
+                                                &retry_after);
+                        *processed = true;
+                        if (!ack_record(daemon, cl, status, retry_after)) {
+                                return false;
+                        }
+                        telem_debug("DEBUG: Record processed for client %d\n", cl->fd);
+                        pos += cl->record_size;
+                        cl->state = CLIENT_READ_SIZE;
+                }
+        }
+
+        /* Keep the partial record, if any, at the start of the buffer */
+        if (pos > 0) {
+                memmove(cl->buf, cl->buf + pos, cl->offset - pos);
+                cl->offset -= pos;
+        }
+
+        return true;
+}
+
+/**
+ * Make room in a client buffer for the next recv.
+ *
+ * The buffer holds at most one partial record, plus CLIENT_RECV_CHUNK bytes
+ * of free space, and is grown to the full size of the record being received.
+ * Buffers come from the daemon buffer pool.
+ *
+ * @param daemon The pointer to the daemon
+ * @param cl The client
+ *
+ * @return false if memory could not be allocated, true otherwise
+ */
+static bool reserve_client_buffer(TelemDaemon *daemon, client *cl)
+{
+        size_t needed = cl->offset + CLIENT_RECV_CHUNK;
+        uint8_t *buf;
+
+        if (cl->state == CLIENT_READ_RECORD && cl->record_size > needed) {
+                needed = cl->record_size;
+        }
+        if (needed <= cl->size) {
+                return true;
+        }
+
+        buf = buffer_pool_get(&daemon->pool, needed, &needed);
+        if (!buf) {
+                return false;
+        }
+        if (cl->offset > 0) {
+                memcpy(buf, cl->buf, cl->offset);
+        }
+        buffer_pool_put(&daemon->pool, cl->buf, cl->size);
+        cl->buf = buf;
+        cl->size = needed;
+
+        return true;
+}
+
+bool handle_client(TelemDaemon *daemon, client *cl)
+{
+        ssize_t len;
+        bool processed = false;
+
+        /*
+         * A client may send any number of records over one connection (see
+         * tm_open_session and tm_send_records), and may write them in pieces
+         * of any size. Whatever is available on the socket is appended to the
+         * client buffer and process_client_records() dispatches the records
+         * it completes; one recv may return several records, or part of one.
+         * The socket is non-blocking: EAGAIN means the rest of the data has
+         * not arrived yet, and the partial record stays buffered until the
+         * socket becomes readable again. The connection is kept open until
+         * the client closes it.
+         */
+        for (int reads = 0; reads < CLIENT_READ_BUDGET; reads++) {
+                if (!reserve_client_buffer(daemon, cl)) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
 
-        /* Read the actual record*/
-        do {
-                malloc_trim(0);
                 len = recv(cl->fd, cl->buf + cl->offset, cl->size - cl->offset, 0);
                 if (len < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                /* Nothing more to read for now */
+                                break;
+                        } else if (errno == EINTR) {
+                                continue;
+                        }
                         telem_log(LOG_ERR, "Failed to receive data from client"
                                   " %d: %s\n", cl->fd, strerror(errno));
                         goto end_client;
                 } else if (len == 0) {
+                        if (cl->offset > 0) {
+                                telem_log(LOG_ERR, "Client %d closed the connection"
+                                          " in the middle of a record\n", cl->fd);
+                        }
                         telem_log(LOG_DEBUG, "End of transmission for client"
                                   " %d\n", cl->fd);
                         goto end_client;
@@ -187,19 +672,23 @@ bool handle_client(TelemDaemon *daemon, nfds_t index, client *cl)
 
                 cl->offset += (size_t)len;
 
-                if (cl->offset == cl->size) {
-                        process_record(daemon, cl);
-                        free(cl->buf);
-                        cl->buf = NULL;
-                        processed = true;
-                        telem_debug("DEBUG: Record processed for client %d\n", cl->fd);
-                        break;
+                if (!process_client_records(daemon, cl, &processed)) {
+                        goto end_client;
                 }
-        } while (len > 0);
+        }
+
+        /* Do not hold on to the buffer while the session is idle */
+        if (cl->offset == 0) {
+                buffer_pool_put(&daemon->pool, cl->buf, cl->size);
+                cl->buf = NULL;
+                cl->size = 0;
+        }
+
+        return processed;
 
 end_client:
         telem_log(LOG_DEBUG, "Processed client %d: %s\n", cl->fd, processed ? "true" : "false");
-        terminate_client(daemon, cl, index);
+        terminate_client(daemon, cl);
         return processed;
 }
 
@@ -249,14 +738,16 @@ char *read_machine_id_override()
         return machine_override;
 }
 
-static void machine_id_replace(char **machine_header, char *machine_id_override)
+void refresh_probe_daemon_machine_id(TelemDaemon *daemon)
 {
         char machine_id[33] = { 0 };
-        char *old_header;
-        int ret;
+        int len;
+
+        free(daemon->machine_id_override);
+        daemon->machine_id_override = read_machine_id_override();
 
-        if (machine_id_override) {
-                strncpy(machine_id, machine_id_override, sizeof(machine_id)-1);
+        if (daemon->machine_id_override) {
+                strncpy(machine_id, daemon->machine_id_override, sizeof(machine_id)-1);
         } else {
                 if (!get_machine_id(machine_id)) {
                         // TODO: decide if error handling is needed here
@@ -264,189 +755,381 @@ static void machine_id_replace(char **machine_header, char *machine_id_override)
                 }
         }
 
-        old_header = *machine_header;
-        ret = asprintf(machine_header, "%s: %s", TM_MACHINE_ID_STR, machine_id);
+        len = snprintf(daemon->machine_id_header, sizeof(daemon->machine_id_header),
+                       "%s: %s", TM_MACHINE_ID_STR, machine_id);
+        daemon->machine_id_header_len = (size_t)len;
+}
 
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Failed to write machine id header\n");
-                exit(EXIT_FAILURE);
+/* Events on the directory of a machine id file that may change the file,
+ * which can be written in place, replaced or removed */
+#define MACHINE_ID_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+/* Watches the directory holding path, since the file may not exist yet */
+static void watch_machine_id_file(int fd, const char *path)
+{
+        char dir[PATH_MAX];
+        char *slash;
+
+        strncpy(dir, path, sizeof(dir) - 1);
+        dir[sizeof(dir) - 1] = '\0';
+        slash = strrchr(dir, '/');
+        if (slash == NULL) {
+                return;
+        }
+        *slash = '\0';
+
+        if (inotify_add_watch(fd, dir, MACHINE_ID_EVENTS) == -1) {
+                telem_log(LOG_INFO, "Unable to watch %s for machine id changes: %s\n",
+                          dir, strerror(errno));
         }
-        free(old_header);
 }
 
-static void stage_record(char *filepath, char *headers[], char *body, char *cfg_file)
+/* Watches the machine id files, so that the machine id is reloaded when they
+ * change. Without the watch, it is only reloaded after a periodic refresh. */
+static void watch_machine_id(TelemDaemon *daemon)
 {
-        int tmpfd;
-        FILE *tmpfile = NULL;
-
-        telem_debug("DEBUG: filepath:%s\n", filepath);
-        telem_debug("DEBUG: body:%s\n", body);
-        telem_debug("DEBUG: cfg:%s\n", cfg_file);
+        int fd;
 
-        if (filepath == NULL) {
-                telem_log(LOG_ERR, "filepath value must be provided, aborting\n");
-                exit(EXIT_FAILURE);
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd == -1) {
+                telem_perror("Failed to watch machine id files");
+                return;
         }
+        watch_machine_id_file(fd, TM_MACHINE_ID_FILE);
+        watch_machine_id_file(fd, TM_MACHINE_ID_OVERRIDE);
 
-        tmpfd = mkstemp(filepath);
-        if (tmpfd < 0) {
-                telem_perror("Error opening staging file");
-                goto clean_exit;
+        if (add_epollfd(daemon, fd, EPOLLIN, &daemon->machine_id_fd) < 0) {
+                close(fd);
+                return;
         }
+        daemon->machine_id_fd = fd;
+}
 
-        // access the opened file as a stream
-        tmpfile = fdopen(tmpfd, "a");
-        if (!tmpfile) {
-                telem_perror("Error opening temp stage file");
-                close(tmpfd);
-                if (unlink(filepath)) {
-                        telem_perror("Error deleting temp stage file");
+/* Returns whether an inotify event concerns the file at path */
+static bool is_event_for(const struct inotify_event *event, const char *path)
+{
+        const char *name = strrchr(path, '/');
+
+        return event->len > 0 && strcmp(event->name, name ? name + 1 : path) == 0;
+}
+
+bool handle_probe_daemon_machine_id_event(TelemDaemon *daemon)
+{
+        char buffer[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+        bool changed = false;
+        ssize_t length;
+
+        while ((length = read(daemon->machine_id_fd, buffer, sizeof(buffer))) > 0) {
+                ssize_t i = 0;
+
+                while (i < length) {
+                        struct inotify_event *event = (struct inotify_event *)&buffer[i];
+
+                        if ((event->mask & IN_Q_OVERFLOW) ||
+                            is_event_for(event, TM_MACHINE_ID_FILE) ||
+                            is_event_for(event, TM_MACHINE_ID_OVERRIDE)) {
+                                changed = true;
+                        }
+                        i += (ssize_t)(sizeof(struct inotify_event) + event->len);
                 }
-                goto clean_exit;
+        }
+        if (length == -1 && errno != EAGAIN && errno != EINTR) {
+                telem_perror("Error while reading machine id file events");
         }
 
-        // write cfg info if exists
-        if (cfg_file != NULL) {
-                fprintf(tmpfile, "%s%s\n", CFG_PREFIX, cfg_file);
+        if (changed) {
+                telem_log(LOG_INFO, "Machine id file changed, reloading it\n");
+                refresh_probe_daemon_machine_id(daemon);
         }
 
-        // write headers
+        return changed;
+}
+
+/* Points header to the machine id header the record is staged with */
+static void machine_id_replace(TelemDaemon *daemon, struct iovec *header)
+{
+        header->iov_base = daemon->machine_id_header;
+        header->iov_len = daemon->machine_id_header_len;
+}
+
+/**
+ * Parse the header block of a record in place.
+ *
+ * The lines of the block are matched against the expected headers in a
+ * single pass, and record->headers is set to views of them in the block;
+ * nothing is copied. The machine id header is replaced with the one held
+ * by the daemon, and headers omitted by older libraries point to their
+ * default lines.
+ *
+ * @param daemon The pointer to the daemon
+ * @param data The header block, it does not need to be null-terminated
+ * @param size The size of the header block
+ * @param record Set to the headers of the record
+ *
+ * @return false if the headers are malformed
+ */
+static bool parse_headers(TelemDaemon *daemon, char *data, size_t size,
+                          struct record_view *record)
+{
+        char *p = data;
+        char *end = data + size;
+        char *line = NULL;
+        size_t len = 0;
+
         for (int i = 0; i < NUM_HEADERS; i++) {
-                fprintf(tmpfile, "%s\n", headers[i]);
+                const char *header_name = get_header_name(i);
+                size_t name_len = strlen(header_name);
+
+                /* Move to the next non-empty line, unless the current one
+                 * was not consumed by the previous header */
+                while (line == NULL && p < end) {
+                        char *nl = memchr(p, '\n', (size_t)(end - p));
+
+                        line = p;
+                        len = (size_t)((nl ? nl : end) - p);
+                        p = nl ? nl + 1 : end;
+                        if (len == 0) {
+                                line = NULL;
+                        }
+                }
+
+                if (line && len >= name_len && memcmp(line, header_name, name_len) == 0) {
+                        /* The line is staged as is, it must not end early */
+                        if (strnlen(line, len) != len) {
+                                return false;
+                        }
+                        record->headers[i] = (struct iovec){ line, len };
+                        if (i == TM_MACHINE_ID) {
+                                machine_id_replace(daemon, &record->headers[i]);
+                        }
+                        line = NULL;
+                } else if (daemon->default_headers[i]) {
+                        /* Sent by an older library, the line is not consumed */
+                        record->headers[i] = (struct iovec){ daemon->default_headers[i],
+                                                             strlen(daemon->default_headers[i]) };
+                } else {
+                        return false;
+                }
         }
 
-        // write body
-        fprintf(tmpfile, "%s\n", body);
-        fflush(tmpfile);
-        fclose(tmpfile);
+        return true;
+}
 
-clean_exit:
+/* Sends the record to telempostd. Returns false if the record must be
+ * staged in the spool instead, because telempostd is not running or is
+ * behind. */
+static bool hand_off_record(TelemDaemon *daemon, const struct record_view *record)
+{
+        struct handoff_frame_header header;
+        struct iovec iov[HANDOFF_MAX_IOV];
+        struct msghdr msg = { 0 };
+        size_t size;
+        ssize_t sent;
+        time_t now;
+        int fd;
+
+        if (!daemon->handoff_enabled) {
+                return false;
+        }
+
+        if (daemon->handoff_fd < 0) {
+                /* telempostd is started by the records staged in the spool,
+                 * connecting is attempted at most once per second */
+                now = time(NULL);
+                if (now == daemon->handoff_attempt_time) {
+                        goto overflow;
+                }
+                daemon->handoff_attempt_time = now;
+
+                fd = handoff_connect(handoff_socket_path_config());
+                if (fd < 0) {
+                        telem_debug("DEBUG: Unable to connect to handoff socket: %s\n",
+                                    strerror(-fd));
+                        goto overflow;
+                }
+                telem_log(LOG_INFO, "Handing records over to telempostd\n");
+                daemon->handoff_fd = fd;
+        }
 
-        return;
+        size = handoff_frame_iov(&header, record, iov);
+        if (size > HANDOFF_MAX_FRAME) {
+                goto overflow;
+        }
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = HANDOFF_MAX_IOV;
+        sent = sendmsg(daemon->handoff_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent == (ssize_t)size) {
+                daemon->handed_off++;
+                return true;
+        }
+
+        if (sent != -1 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)) {
+                telem_log(LOG_INFO, "Stopped handing records over to telempostd: %s\n",
+                          sent == -1 ? strerror(errno) : "short write");
+                close(daemon->handoff_fd);
+                daemon->handoff_fd = -1;
+        }
+
+overflow:
+        daemon->handoff_overflows++;
+        return false;
 }
 
-static void process_record(TelemDaemon *daemon, client *cl)
+/* Hands the record over to telempostd, or appends it to the open segment in
+ * the single-record staging file layout. Returns the status the record is
+ * acknowledged with. */
+static enum tm_ack_status stage_record(TelemDaemon *daemon, const struct record_view *record)
 {
-        int i = 0;
-        int ret = 0;
-        char *headers[NUM_HEADERS];
-        char *tok = NULL;
+        struct iovec iov[RECORD_MAX_IOV];
+        int n;
+        int ret;
+
+        telem_debug("DEBUG: body:%.*s\n", (int)record->body.iov_len,
+                    (char *)record->body.iov_base);
+
+        if (hand_off_record(daemon, record)) {
+                return TM_ACK_ACCEPTED;
+        }
+
+        n = record_view_iov(record, iov);
+        ret = segment_append(&daemon->segment, spool_dir_config(), iov, n);
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Failed to stage record: %s\n", strerror(-ret));
+        }
+
+        ack_synced_records(daemon, ret);
+
+        if (ret == -ENOSPC || ret == -EDQUOT) {
+                return TM_ACK_SPOOL_FULL;
+        } else if (ret < 0) {
+                return TM_ACK_RETRY_AFTER;
+        }
+        return TM_ACK_ACCEPTED;
+}
+
+/* Applies the classification rate limit of the user that sent a record */
+static bool admit_record_class(struct peer *peer, const struct record_view *record,
+                               uint32_t *retry_after)
+{
+        const struct iovec *line = &record->headers[TM_CLASSIFICATION];
+        /* The value follows "classification: " */
+        size_t offset = sizeof(TM_CLASSIFICATION_STR) + 1;
+        char classification[MAX_CLASS_LENGTH + 1];
+        size_t len = 0;
+
+        if (line->iov_len > offset) {
+                len = line->iov_len - offset;
+                if (len > MAX_CLASS_LENGTH) {
+                        len = MAX_CLASS_LENGTH;
+                }
+                memcpy(classification, (char *)line->iov_base + offset, len);
+        }
+        classification[len] = '\0';
+
+        return admission_class_record(peer, classification, retry_after);
+}
+
+static enum tm_ack_status process_record(TelemDaemon *daemon, struct peer *peer,
+                                         uint8_t *record, size_t size,
+                                         uint32_t *retry_after)
+{
+        enum tm_ack_status status;
+        struct record_view view;
         size_t header_size = 0;
         size_t message_size = 0;
-        char *temp_headers = NULL;
+        size_t cfg_info_size = 0;
         char *msg;
         char *body;
-        char *recordpath = NULL;
-        char *cfg_file = NULL;;
-        size_t cfg_info_size = 0;
         uint8_t *buf;
 
-        buf = cl->buf;
+        buf = record;
+        view.cfg_file = (struct iovec){ NULL, 0 };
 
         /* Check for an optional CFG_PREFIX in the first 32 bits */
         if (*(uint32_t *)buf == CFG_PREFIX_32BIT) {
-                char *cfg  = (char *)cl->buf;
+                char *cfg_file = (char *)record + CFG_PREFIX_LENGTH;
 
-                cfg_file = cfg + CFG_PREFIX_LENGTH;
-                cfg_info_size = CFG_PREFIX_LENGTH + strlen(cfg_file) + 1;
+                view.cfg_file = (struct iovec){ cfg_file, strlen(cfg_file) };
+                cfg_info_size = CFG_PREFIX_LENGTH + view.cfg_file.iov_len + 1;
                 telem_debug("DEBUG: cfg_file: %s\n", cfg_file);
         }
 
+        /* The record must hold the header size after the cfg file */
+        if (cfg_info_size + sizeof(uint32_t) >= size) {
+                return TM_ACK_REJECTED;
+        }
         buf += cfg_info_size;
         header_size = *(uint32_t *)buf;
         /* Header size can not be bigger than buffer size bail out early */
-        if ((uint32_t)header_size >= (uint32_t)cl->size) {
-                return;
+        if ((uint32_t)header_size >= (uint32_t)size) {
+                return TM_ACK_REJECTED;
         }
-        message_size = cl->size - (cfg_info_size + header_size);
-        telem_debug("DEBUG: cl->size: %ld\n", cl->size);
+        message_size = size - (cfg_info_size + header_size);
+        telem_debug("DEBUG: size: %ld\n", size);
         telem_debug("DEBUG: header_size: %ld\n", header_size);
         telem_debug("DEBUG: message_size: %ld\n", message_size);
         telem_debug("DEBUG: cfg_info_size: %ld\n", cfg_info_size);
         telem_debug("Total: %zu\n", header_size + cfg_info_size + message_size);
-        /* Check message size bounds */
-        if (message_size <= 0 || message_size > MAX_PAYLOAD_LENGTH) {
+        /* Check message size bounds, the message holds at least the header
+         * size and the null byte ending the record */
+        if (message_size <= sizeof(uint32_t) || message_size > MAX_PAYLOAD_LENGTH) {
                 telem_log(LOG_INFO, "Record message size out of bounds\n");
-                return;
+                return TM_ACK_REJECTED;
         }
         msg = (char *)buf + sizeof(uint32_t);
 
-        /* Copying the headers as strtok modifies the orginal buffer */
-        temp_headers = strndup(msg, header_size);
-        tok = strtok(temp_headers, "\n");
-
-        for (i = 0; i < NUM_HEADERS; i++) {
-                const char *header_name = get_header_name(i);
-
-                if (get_header(tok, header_name, &headers[i])) {
-                        if (strcmp(header_name, TM_MACHINE_ID_STR) == 0) {
-                                machine_id_replace(&headers[i], daemon->machine_id_override);
-                        }
-
-                        tok = strtok(NULL, "\n");
-                } else {
-                        telem_log(LOG_ERR, "process_record: Incorrect headers in record\n");
-                        goto end;
-                }
+        /* The headers are parsed in place, the record is staged from the
+         * receive buffer */
+        if (!parse_headers(daemon, msg, header_size, &view)) {
+                telem_log(LOG_ERR, "process_record: Incorrect headers in record\n");
+                return TM_ACK_REJECTED;
         }
         /* TODO : check if the body is within the limits. */
         body = msg + header_size;
+        view.body = (struct iovec){ body, strlen(body) };
+
+        if (peer && !admit_record_class(peer, &view, retry_after)) {
+                return TM_ACK_THROTTLED;
+        }
 
         /* Save record to stage */
-        ret = asprintf(&recordpath, "%s/XXXXXX", spool_dir_config());
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Failed to allocate memory for record name in staging folder, aborting\n");
-                exit(EXIT_FAILURE);
+        status = stage_record(daemon, &view);
+        if (status == TM_ACK_RETRY_AFTER) {
+                *retry_after = TM_RECORD_RETRY_AFTER;
         }
 
-        stage_record(recordpath, headers, body, cfg_file);
-        free(recordpath);
-end:
-        free(temp_headers);
-        for (int k = 0; k < i; k++)
-                free(headers[k]);
-        return;
+        return status;
 }
 
-void add_pollfd(TelemDaemon *daemon, int fd, short events)
+int add_epollfd(TelemDaemon *daemon, int fd, uint32_t events, void *ptr)
 {
+        struct epoll_event ev = { 0 };
+
         assert(daemon);
         assert(fd >= 0);
 
-        if (!daemon->pollfds) {
-                daemon->pollfds = (struct pollfd *)malloc(sizeof(struct pollfd));
-                if (!daemon->pollfds) {
-                        telem_log(LOG_ERR, "Unable to allocate memory for"
-                                  " pollfds array, exiting\n");
-                        exit(EXIT_FAILURE);
-                }
-                daemon->current_alloc = sizeof(struct pollfd);
-        } else {
-                /* Reallocate here */
-                if (!reallocate((void **)&(daemon->pollfds),
-                                &(daemon->current_alloc),
-                                ((daemon->nfds + 1) * sizeof(struct pollfd)))) {
-                        telem_log(LOG_ERR, "Unable to realloc, exiting\n");
-                        exit(EXIT_FAILURE);
-                }
+        ev.events = events;
+        ev.data.ptr = ptr;
+        if (epoll_ctl(daemon->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                int ret = -errno;
+                telem_perror("Failed to add file descriptor to epoll");
+                return ret;
         }
 
-        daemon->pollfds[daemon->nfds].fd = fd;
-        daemon->pollfds[daemon->nfds].events = events;
-        daemon->pollfds[daemon->nfds].revents = 0;
-        daemon->nfds++;
+        return 0;
 }
 
-void del_pollfd(TelemDaemon *daemon, nfds_t i)
+void del_epollfd(TelemDaemon *daemon, int fd)
 {
         assert(daemon);
-        assert(i < daemon->nfds);
+        assert(fd >= 0);
 
-        if (i < daemon->nfds - 1) {
-                memmove(&(daemon->pollfds[i]), &(daemon->pollfds[i + 1]),
-                        (sizeof(struct pollfd) * (daemon->nfds - i - 1)));
+        /* Closing fd would remove it as well, unless it was duplicated */
+        if (epoll_ctl(daemon->epollfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+                telem_perror("Failed to remove file descriptor from epoll");
         }
-        daemon->nfds--;
 }
 
 bool get_machine_id(char *machine_id)
@@ -502,17 +1185,13 @@ file_error:
 int generate_machine_id(void)
 {
         int result = 0;
-        char *new_id = NULL;
+        char new_id[RANDOM_ID_LEN + 1];
 
-        if ((result = get_random_id(&new_id)) != 0) {
-                goto rand_err;
+        if ((result = fill_random_id(new_id)) != 0) {
+                return result;
         }
 
-        result = machine_id_write(new_id);
-rand_err:
-        free(new_id);
-
-        return result;
+        return machine_id_write(new_id);
 }
 
 int update_machine_id()
@@ -18,11 +18,16 @@
 #define _GNU_SOURCE     /* for strchrnul() */
 #define __STDC_FORMAT_MACROS    /* for PRIu64 */
 
-#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/queue.h>
 #include <stdbool.h>
 #include <inttypes.h>
 
+#include "admission.h"
+#include "bufpool.h"
+#include "segment.h"
+#include "common.h"
+
 #define TM_MACHINE_ID_EXPIRY (3 /*d*/ * 24 /*h*/ * 60 /*m*/ * 60 /*s*/)
 
 #define TM_MACHINE_ID_FILE LOCALSTATEDIR "/lib/telemetry/machine_id"
@@ -35,26 +40,85 @@
 
 #define TM_RECORD_COUNTER (1)
 
+/* Maximum number of events returned by one epoll_wait call */
+#define TM_EPOLL_EVENTS (64)
+
+/* Maximum number of connections accepted per listening socket wakeup, so that
+ * a burst of new clients can not starve the connected ones */
+#define TM_ACCEPT_BATCH (256)
+
+/* Milliseconds a client is asked to wait before sending again a record that
+ * could not be staged */
+#define TM_RECORD_RETRY_AFTER (1000)
+
+/* Record reassembly state of a client, see handle_client() */
+enum client_state {
+        /* Waiting for the size of the next record */
+        CLIENT_READ_SIZE = 0,
+        /* Waiting for the rest of a record of record_size bytes */
+        CLIENT_READ_RECORD,
+        /* Discarding the record_size bytes left of a throttled record */
+        CLIENT_SKIP_RECORD
+};
+
 typedef struct client {
         int fd;
+        enum client_state state;
+        uint32_t record_size;
+        /* received bytes not processed yet, and the buffer size */
         uint8_t *buf;
         size_t offset;
         size_t size;
+        /* whether each record is acknowledged, see RECORD_ACK_REQUEST, and
+         * the records accepted whose acknowledgement waits for a group sync */
+        bool acks;
+        uint32_t held_acks;
+        LIST_ENTRY(client) ack_ptrs;
+        /* user the connection is accounted to, or NULL */
+        struct peer *peer;
         LIST_ENTRY(client) client_ptrs;
 } client;
 
 typedef LIST_HEAD (client_list_head, client) client_list_head;
 
 typedef struct TelemDaemon {
-        /* array of fd's being polled */
-        struct pollfd  *pollfds;
-        /* number of fds being polled */
-        nfds_t nfds;
-        /* current number of allocated fds */
-        size_t current_alloc;
+        /* epoll instance watching the daemon sources and client sockets */
+        int epollfd;
+        /* number of clients registered with the epoll instance */
+        size_t nclients;
         /* client list head */
         client_list_head client_head;
         char *machine_id_override;
+        /* machine id header records are staged with, kept up to date with
+         * the machine id and override files, and the inotify instance
+         * watching them or -1 */
+        char machine_id_header[sizeof(TM_MACHINE_ID_STR) + 2 + 32];
+        size_t machine_id_header_len;
+        int machine_id_fd;
+        /* header lines that records sent by older libraries omit */
+        char *default_headers[NUM_HEADERS];
+        /* cache of client structs and receive buffers */
+        struct buffer_pool pool;
+        /* number of times cached memory was returned to the system */
+        uint64_t memory_releases;
+        /* segment the records are staged in */
+        struct segment_writer segment;
+        /* clients done sending, whose connection is closed once the
+         * acknowledgements held for them are sent */
+        client_list_head sync_waiters;
+        /* clients with acknowledgements held until the records they accept
+         * are synced to disk */
+        client_list_head ack_waiters;
+        /* whether records are handed over to telempostd, the connection they
+         * are sent on or -1, and the time of the last connection attempt */
+        bool handoff_enabled;
+        int handoff_fd;
+        time_t handoff_attempt_time;
+        /* records handed over, and staged in the spool instead */
+        uint64_t handed_off;
+        uint64_t handoff_overflows;
+        /* connection and rate limits per user */
+        struct admission admission;
 } TelemDaemon;
 
 /**
@@ -65,35 +129,161 @@ typedef struct TelemDaemon {
 void initialize_probe_daemon(TelemDaemon *daemon);
 
 /**
- * Add poll fd struct to the array of pollfds.
+ * Release the resources held by the daemon struct
+ *
+ * Closes every client connection and the epoll instance, and seals the
+ * open segment.
+ *
+ * @param daemon A pointer to the daemon structure.
+ */
+void free_probe_daemon(TelemDaemon *daemon);
+
+/**
+ * Apply the memory settings of the configuration to the daemon
+ *
+ * Sets the high-water mark of the buffer pool, freeing cached memory above
+ * it.
+ *
+ * @param daemon A pointer to the daemon structure.
+ */
+void configure_probe_daemon_memory(TelemDaemon *daemon);
+
+/**
+ * Apply the admission settings of the configuration to the daemon
+ *
+ * Sets the connection and rate limits of the users sending records. Rate
+ * limits restart with full buckets.
+ *
+ * @param daemon A pointer to the daemon structure.
+ */
+void configure_probe_daemon_admission(TelemDaemon *daemon);
+
+/**
+ * Apply the staging settings of the configuration to the daemon
+ *
+ * Sets the size and age at which the open segment is sealed, the
+ * durability policy of staged records, and whether records are handed over
+ * to telempostd. A segment that is already open keeps the age limit it was
+ * opened with.
+ *
+ * @param daemon A pointer to the daemon structure.
+ */
+void configure_probe_daemon_staging(TelemDaemon *daemon);
+
+/**
+ * Handle the expiration of the segment timer
+ *
+ * Syncs or seals the open segment as due, and closes the connections of
+ * the clients whose records are now synced.
+ *
+ * @param daemon A pointer to the daemon structure.
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int handle_probe_daemon_staging_timer(TelemDaemon *daemon);
+
+/**
+ * Reload the machine id records are staged with
+ *
+ * Reads the machine id override file, or the machine id file if there is
+ * no override. Called after the machine id is rotated.
+ *
+ * @param daemon A pointer to the daemon structure.
+ */
+void refresh_probe_daemon_machine_id(TelemDaemon *daemon);
+
+/**
+ * Handle changes to the machine id and override files
+ *
+ * Reads the pending inotify events and reloads the machine id if one of
+ * the files was written, replaced or removed.
+ *
+ * @param daemon A pointer to the daemon structure.
+ *
+ * @return true if the machine id was reloaded
+ */
+bool handle_probe_daemon_machine_id_event(TelemDaemon *daemon);
+
+/**
+ * Return the memory cached by the daemon to the system
+ *
+ * Empties the buffer pool and trims the heap. Called once the daemon has
+ * been idle for memory_release_idle_time seconds.
+ *
+ * @param daemon A pointer to the daemon structure.
+ */
+void release_probe_daemon_memory(TelemDaemon *daemon);
+
+/**
+ * Log the buffer pool counters and the memory used by the daemon
+ *
+ * @param daemon A pointer to the daemon structure.
+ * @param priority The log priority, e.g. LOG_INFO
+ */
+void log_probe_daemon_memory(TelemDaemon *daemon, int priority);
+
+/**
+ * Log the connection and record counters of every user that connected
+ *
+ * @param daemon A pointer to the daemon structure.
+ * @param priority The log priority, e.g. LOG_INFO
+ */
+void log_probe_daemon_peers(TelemDaemon *daemon, int priority);
+
+/**
+ * Watch a file descriptor with the daemon epoll instance
  *
  * @param daemon The pointer to the daemon struct
  * @param fd The file descriptor to add
- * @param events The events to poll for
+ * @param events The epoll events to wait for
+ * @param ptr Returned in epoll_event.data.ptr when fd is ready
  *
+ * @return 0 on success, or a negative errno-style value on error
  */
-void add_pollfd(TelemDaemon *daemon, int fd, short events);
+int add_epollfd(TelemDaemon *daemon, int fd, uint32_t events, void *ptr);
 
 /**
- *  Delete poll fd struct at index i of the array
+ * Stop watching a file descriptor
  *
  * @param daemon The pointer to the daemon
- * @param i The index of the file decriptor to be deleted
+ * @param fd The file descriptor to remove
  *
  */
-void del_pollfd(TelemDaemon *daemon, nfds_t i);
+void del_epollfd(TelemDaemon *daemon, int fd);
+
+/**
+ * Start handling a new client connection
+ *
+ * Accounts the connection to the user of the connected process, adds the
+ * client to the client list and registers its socket with the epoll
+ * instance, with the client as the event data.
+ *
+ * @param daemon The pointer to the daemon
+ * @param fd The connected socket, in non-blocking mode
+ *
+ * @return Pointer to the client struct if successfully added,
+ *    NULL otherwise, with errno set to EUSERS if the user has too many
+ *    connections open
+ */
+client *watch_client(TelemDaemon *daemon, int fd);
 
 /**
  * Handle data received on a client connection
  *
+ * Processes every complete record available on the connection. Partial
+ * records are buffered in the client until the rest arrives, and at most a
+ * fixed number of reads is done per call so that other clients are served
+ * in between. The client is kept open until it closes the connection or
+ * sends invalid data, so a single connection can carry many records.
+ * Records over the rate limit of the user are discarded as they arrive,
+ * without being buffered or parsed.
+ *
  * @param daemon The pointer to the daemon
- * @param ind The index of the client's file desciptor in the
- *    pollfd array
  * @param cl Pointer to the client structure in the client list
  *
- * @return true on success, false on failure
+ * @return true if at least one record was processed, false otherwise
  */
-bool handle_client(TelemDaemon *daemon, nfds_t ind, client *cl);
+bool handle_client(TelemDaemon *daemon, client *cl);
 
 /**
  *  Add a client to the client list
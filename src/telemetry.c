@@ -26,10 +26,17 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 #include <sys/un.h>
 #include <limits.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
 
 #include "util.h"
 #include "common.h"
@@ -58,32 +65,280 @@ static int version_file(void)
 }
 
 /**
- * Helper function for the set_*_header functions that actually sets
- * the header and increments the header size. These headers become attributes
- * on an HTTP_POST transaction.
+ * Helper function for the host info set_*_header functions that actually
+ * sets the header. These headers become attributes on an HTTP_POST
+ * transaction.
  *
  * @param dest The header string, which will be "prefix: dest\n"
  * @param prefix Identifies the header.
  * @param value The value of this particular header.
- * @param header_size Is incremented if header is successfully initialized.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int set_header(char **dest, const char *prefix, char *value, size_t *header_size)
+static int set_header(char **dest, const char *prefix, char *value)
 {
-        int rc;
-
-        rc = asprintf(dest, "%s: %s\n", prefix, value);
-
-        if (rc < 0) {
+        if (asprintf(dest, "%s: %s\n", prefix, value) < 0) {
                 telem_log(LOG_CRIT, "CRIT: Out of memory\n");
                 return -ENOMEM;
+        }
+
+        return 0;
+
+}
+
+/* Size of the record allocations kept in the per-thread arena. Large enough
+ * for the headers and a small payload; records that need more are grown. */
+#define TM_BLOCK_SIZE 4096
+
+#define TM_BLOCK_CAPACITY (TM_BLOCK_SIZE - sizeof(struct telem_record))
+
+/* Number of free blocks a thread keeps for reuse */
+#define TM_ARENA_CACHE 16
+
+/* Files the host info headers are derived from. uname() values are not
+ * listed, since the running kernel can not change without a reboot.
+ */
+static const char *host_info_sources[] = {
+        TM_SITE_VERSION_FILE,
+        TM_DIST_VERSION_FILE,
+        "/sys/class/dmi/id/sys_vendor",
+        "/sys/class/dmi/id/product_name",
+        "/sys/class/dmi/id/product_version",
+        "/sys/class/dmi/id/board_name",
+        "/sys/class/dmi/id/board_vendor",
+        "/sys/class/dmi/id/bios_version"
+};
+
+#define NUM_HOST_INFO_SOURCES (sizeof(host_info_sources) / sizeof(char *))
+
+/* Identity of a source file at the time the host info was collected */
+struct host_info_stamp {
+        bool exists;
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;
+};
+
+/*
+ * Host info headers collected at one point in time. A snapshot is shared by
+ * the threads of the process and never modified once published.
+ */
+struct host_info {
+        /* headers by header index */
+        char *headers[NUM_HEADERS];
+        struct host_info_stamp stamps[NUM_HOST_INFO_SOURCES];
+        /* value of host_info_generation the snapshot was collected for */
+        unsigned long generation;
+        /* threads using the snapshot, plus one while it is the current one */
+        unsigned long refs;
+};
+
+/*
+ * State private to each thread using the library. Record creation only
+ * touches this, so threads never contend with each other on that path.
+ */
+struct tm_thread {
+        /* host info snapshot headers are copied from */
+        struct host_info *host_info;
+        time_t host_info_last_check;
+        /* free record allocations */
+        struct telem_record *blocks[TM_ARENA_CACHE];
+        size_t nblocks;
+        bool registered;
+};
+
+static __thread struct tm_thread tm_thread;
+static pthread_key_t tm_thread_key;
+static pthread_once_t tm_thread_once = PTHREAD_ONCE_INIT;
+
+/* Bumped by tm_refresh_host_info(), or once a thread sees the host info
+ * changed, to make the next record collect a new snapshot */
+static unsigned long host_info_generation = 0;
+
+/* The current snapshot, replaced under host_info_lock */
+static struct host_info *host_info_current = NULL;
+static pthread_mutex_t host_info_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void put_host_info(struct host_info *info);
+
+static void tm_thread_release(void *arg)
+{
+        struct tm_thread *t = arg;
+
+        while (t->nblocks > 0) {
+                free(t->blocks[--t->nblocks]);
+        }
+        put_host_info(t->host_info);
+        t->host_info = NULL;
+        t->registered = false;
+}
+
+static void tm_thread_key_create(void)
+{
+        if (pthread_key_create(&tm_thread_key, tm_thread_release) != 0) {
+                telem_log(LOG_ERR, "Failed to create thread key\n");
+        }
+}
+
+/**
+ * Make sure the calling thread's state is released when the thread exits.
+ */
+static void tm_thread_register(void)
+{
+        if (tm_thread.registered) {
+                return;
+        }
+
+        pthread_once(&tm_thread_once, tm_thread_key_create);
+        if (pthread_setspecific(tm_thread_key, &tm_thread) == 0) {
+                tm_thread.registered = true;
+        }
+}
+
+/**
+ * Allocate an empty record, reusing one of the thread's free allocations
+ * when possible. The record has room for the header size field.
+ *
+ * @return The record, or NULL if out of memory.
+ *
+ */
+static struct telem_record *tm_record_alloc(void)
+{
+        struct telem_record *record;
+
+        tm_thread_register();
+
+        if (tm_thread.nblocks > 0) {
+                record = tm_thread.blocks[--tm_thread.nblocks];
+        } else {
+                record = malloc(TM_BLOCK_SIZE);
+                if (!record) {
+                        telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                        return NULL;
+                }
+        }
+
+        memset(record, 0, sizeof(struct telem_record));
+        record->capacity = TM_BLOCK_CAPACITY;
+        record->size = RECORD_SIZE_LEN;
+        record->header_offset[0] = RECORD_SIZE_LEN;
+
+        return record;
+}
+
+/**
+ * Release a record, keeping it for reuse by the calling thread if it has the
+ * default size and the cache is not full.
+ *
+ * @param record The record.
+ *
+ */
+static void tm_record_release(struct telem_record *record)
+{
+        if (record->capacity == TM_BLOCK_CAPACITY &&
+            tm_thread.nblocks < TM_ARENA_CACHE) {
+                tm_thread_register();
+                tm_thread.blocks[tm_thread.nblocks++] = record;
         } else {
-                *header_size += (size_t)rc;
+                free(record);
+        }
+}
+
+/**
+ * Grow a record so that at least len more bytes fit in its data. The record
+ * may move; since it only holds offsets, nothing inside it needs fixing.
+ *
+ * @param t_ref Reference to the record.
+ * @param len Number of bytes needed past record->size.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int tm_record_reserve(struct telem_ref *t_ref, size_t len)
+{
+        struct telem_record *record = t_ref->record;
+        size_t alloc_size = sizeof(struct telem_record) + record->capacity;
+        size_t needed = sizeof(struct telem_record) + record->size + len;
+
+        if (needed <= alloc_size) {
                 return 0;
         }
 
+        while (alloc_size < needed) {
+                alloc_size *= 2;
+        }
+
+        record = realloc(record, alloc_size);
+        if (!record) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                return -ENOMEM;
+        }
+
+        record->capacity = alloc_size - sizeof(struct telem_record);
+        t_ref->record = record;
+
+        return 0;
+}
+
+/**
+ * Mark the header that was just written at the end of the record's data as
+ * header index. Headers must be added in index order.
+ *
+ * @param record The record.
+ * @param index The header index.
+ * @param len Length of the header line.
+ *
+ */
+static void tm_record_end_header(struct telem_record *record, int index, size_t len)
+{
+        record->header_offset[index] = (uint32_t)record->size;
+        record->size += len;
+        record->header_offset[index + 1] = (uint32_t)record->size;
+        record->header_size += len;
+}
+
+/**
+ * Format a header line into the record's data.
+ *
+ * @param t_ref Reference to the record.
+ * @param index The header index.
+ * @param fmt printf-style format of the whole "name: value\n" line.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+__attribute__((format(printf, 3, 4)))
+static int tm_record_add_header(struct telem_ref *t_ref, int index,
+                                const char *fmt, ...)
+{
+        struct telem_record *record = t_ref->record;
+        va_list ap;
+        size_t avail;
+        int rc;
+
+        for (;;) {
+                avail = record->capacity - record->size;
+
+                va_start(ap, fmt);
+                rc = vsnprintf(record->data + record->size, avail, fmt, ap);
+                va_end(ap);
+
+                if (rc < 0) {
+                        return -EINVAL;
+                } else if ((size_t)rc < avail) {
+                        break;
+                }
+
+                if ((rc = tm_record_reserve(t_ref, (size_t)rc + 1)) < 0) {
+                        return rc;
+                }
+                record = t_ref->record;
+        }
+
+        tm_record_end_header(record, index, (size_t)rc);
+
+        return 0;
 }
 
 /**
@@ -98,10 +353,6 @@ static int set_header(char **dest, const char *prefix, char *value, size_t *head
  */
 static int set_severity_header(struct telem_ref *t_ref, uint32_t severity)
 {
-        char *buf = NULL;
-        int status = 0;
-        int rc = 0;
-
         /* clamp severity to 1-4 */
 
         if (severity > 4) {
@@ -112,17 +363,8 @@ static int set_severity_header(struct telem_ref *t_ref, uint32_t severity)
                 severity = 1;
         }
 
-        rc = asprintf(&buf, "%" PRIu32, severity);
-
-        if (rc < 0) {
-                return -ENOMEM;
-        } else {
-                status = set_header(&(t_ref->record->headers[TM_SEVERITY]),
-                                    TM_SEVERITY_STR, buf, &(t_ref->record->header_size));
-                free(buf);
-        }
-
-        return status;
+        return tm_record_add_header(t_ref, TM_SEVERITY, "%s: %" PRIu32 "\n",
+                                    TM_SEVERITY_STR, severity);
 }
 
 /**
@@ -143,9 +385,8 @@ static int set_classification_header(struct telem_ref *t_ref, char *classificati
                 return -EINVAL;
         }
 
-        return set_header(&(t_ref->record->headers[TM_CLASSIFICATION]),
-                          TM_CLASSIFICATION_STR, classification,
-                          &(t_ref->record->header_size));
+        return tm_record_add_header(t_ref, TM_CLASSIFICATION, "%s: %s\n",
+                                    TM_CLASSIFICATION_STR, classification);
 }
 
 /**
@@ -161,35 +402,20 @@ static int set_classification_header(struct telem_ref *t_ref, char *classificati
  */
 static int set_record_format_header(struct telem_ref *t_ref)
 {
-        char *buf = NULL;
-        int rc;
-        int status = 0;
-
-        rc = asprintf(&buf, "%" PRIu32, RECORD_FORMAT_VERSION);
-
-        if (rc < 0) {
-                return -ENOMEM;
-        } else {
-                status = set_header(&(t_ref->record->headers[TM_RECORD_VERSION]),
-                                    TM_RECORD_VERSION_STR, buf,
-                                    &(t_ref->record->header_size));
-
-                free(buf);
-        }
-
-        return status;
+        return tm_record_add_header(t_ref, TM_RECORD_VERSION, "%s: %" PRIu32 "\n",
+                                    TM_RECORD_VERSION_STR, RECORD_FORMAT_VERSION);
 }
 
 /**
  * Sets the architecture header. Specifically the 'machine' field
  * of struct utsname, or 'unknown' if that field cannot be read.
  *
- * @param t_ref Telemetry Record reference obtained from tm_create_record.
+ * @param header Set to the allocated header line.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int set_arch_header(struct telem_ref *t_ref)
+static int set_arch_header(char **header)
 {
         struct utsname uts_buf;
         char *buf = NULL;
@@ -207,8 +433,7 @@ static int set_arch_header(struct telem_ref *t_ref)
         if (rc < 0) {
                 return -ENOMEM;
         } else {
-                status = set_header(&(t_ref->record->headers[TM_ARCH]), TM_ARCH_STR,
-                                    buf, &(t_ref->record->header_size));
+                status = set_header(header, TM_ARCH_STR, buf);
 
                 free(buf);
         }
@@ -221,12 +446,12 @@ static int set_arch_header(struct telem_ref *t_ref)
  * os-release file that lives in either /etc or the stateless dist-provided
  * location.
  *
- * @param t_ref Telemetry Record reference obtained from tm_create_record.
+ * @param header Set to the allocated header line.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int set_system_name_header(struct telem_ref *t_ref)
+static int set_system_name_header(char **header)
 {
         FILE *fs = NULL;
         int fd;
@@ -273,9 +498,7 @@ static int set_system_name_header(struct telem_ref *t_ref)
                 }
         }
 
-        return set_header(&(t_ref->record->headers[TM_SYSTEM_NAME]),
-                          TM_SYSTEM_NAME_STR, buf,
-                          &(t_ref->record->header_size));
+        return set_header(header, TM_SYSTEM_NAME_STR, buf);
 
 }
 
@@ -284,12 +507,12 @@ static int set_system_name_header(struct telem_ref *t_ref)
  * comes from os-release on Clear Linux. On non-Clear systems this field
  * is probably not defined in the os-release file, in which case we report 0.
  *
- * @param t_ref Telemetry Record reference obtained from tm_create_record.
+ * @param header Set to the allocated header line.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int set_system_build_header(struct telem_ref *t_ref)
+static int set_system_build_header(char **header)
 {
         FILE *fs = NULL;
         int fd;
@@ -318,8 +541,7 @@ static int set_system_build_header(struct telem_ref *t_ref)
                 fclose(fs);
         }
 
-        return set_header(&(t_ref->record->headers[TM_SYSTEM_BUILD]),
-                          TM_SYSTEM_BUILD_STR, version, &(t_ref->record->header_size));
+        return set_header(header, TM_SYSTEM_BUILD_STR, version);
 
 }
 
@@ -337,24 +559,11 @@ static int set_system_build_header(struct telem_ref *t_ref)
 static int set_machine_id_header(struct telem_ref *t_ref)
 {
         uint64_t new_id = 0;
-        int rc = 0;
-        char *buf = NULL;
-        int status = 0;
 
         new_id = 0xFFFFFFFF;
 
-        rc = asprintf(&buf, "%zX", new_id);
-
-        if (rc < 0) {
-                return -ENOMEM;
-        } else {
-                status = set_header(&(t_ref->record->headers[TM_MACHINE_ID]),
-                                    TM_MACHINE_ID_STR, buf, &(t_ref->record->header_size));
-
-                free(buf);
-        }
-
-        return status;
+        return tm_record_add_header(t_ref, TM_MACHINE_ID, "%s: %" PRIX64 "\n",
+                                    TM_MACHINE_ID_STR, new_id);
 }
 
 /**
@@ -368,35 +577,20 @@ static int set_machine_id_header(struct telem_ref *t_ref)
  */
 static int set_timestamp_header(struct telem_ref *t_ref)
 {
-
-        time_t *t = NULL;
-        char *buf;
-        int rc = 0;
-        int status = 0;
-
-        rc = asprintf(&buf, "%zd", time(t));
-
-        if (rc < 0) {
-                return -ENOMEM;
-        } else {
-                status = set_header(&(t_ref->record->headers[TM_TIMESTAMP]),
-                                    TM_TIMESTAMP_STR, buf, &(t_ref->record->header_size));
-                free(buf);
-        }
-
-        return status;
+        return tm_record_add_header(t_ref, TM_TIMESTAMP, "%s: %jd\n",
+                                    TM_TIMESTAMP_STR, (intmax_t)time(NULL));
 }
 
 /**
  * Sets cpu model for telemetry record. The information from cpu is extracted
  * from /proc/cpuinfo, specifically "model name" attribute.
  *
- * @param t_ref Telemetry Record reference obtained from tm_create_record.
+ * @param header Set to the allocated header line.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int set_cpu_model_header(struct telem_ref *t_ref)
+static int set_cpu_model_header(char **header)
 {
         FILE *fs = NULL;
         char buf[SMALL_LINE_BUF] = { 0 };
@@ -428,10 +622,7 @@ static int set_cpu_model_header(struct telem_ref *t_ref)
                         telem_log(LOG_NOTICE, "NOTICE: Unable to find attribute:%s\n", attr_name);
                 }
 
-                status = set_header(
-                        &(t_ref->record->headers[TM_CPU_MODEL]),
-                        TM_CPU_MODEL_STR, model_name,
-                        &(t_ref->record->header_size));
+                status = set_header(header, TM_CPU_MODEL_STR, model_name);
 
         } else {
                 telem_log(LOG_NOTICE, "NOTICE: Unable to open /proc/cpuinfo\n");
@@ -533,12 +724,12 @@ static int get_dmi_value(const char *source, const char *key, char **buf)
  * board name and board vendor. This information is read from dmi filesystem
  * Board Name (board_name) and Board Vendor (board_vendor).
  *
- * @param t_ref Telemetry Record reference obtained from tm_create_record.
+ * @param header Set to the allocated header line.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int set_board_name_header(struct telem_ref *t_ref)
+static int set_board_name_header(char **header)
 {
         int status = 0;
         int rc;
@@ -564,10 +755,7 @@ static int set_board_name_header(struct telem_ref *t_ref)
                 status = -ENOMEM;
                 goto cleanup;
         } else {
-                status = set_header(
-                        &(t_ref->record->headers[TM_BOARD_NAME]),
-                        TM_BOARD_NAME_STR, buf,
-                        &(t_ref->record->header_size));
+                status = set_header(header, TM_BOARD_NAME_STR, buf);
                 free(buf);
         }
 
@@ -587,12 +775,12 @@ cleanup:
  * Sets BIOS version header for telemetry record, this information is
  * read from dmi filesystem BIOS Version (bios_version).
  *
- * @param t_ref Telemetry Record reference obtained from tm_create_record.
+ * @param header Set to the allocated header line.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int set_bios_version_header(struct telem_ref *t_ref)
+static int set_bios_version_header(char **header)
 {
         int status = 0;
         int rc = 0;
@@ -602,10 +790,7 @@ static int set_bios_version_header(struct telem_ref *t_ref)
         if (rc < 0) {
                 status = rc;
         } else {
-                status = set_header(
-                        &(t_ref->record->headers[TM_BIOS_VERSION]),
-                        TM_BIOS_VERSION_STR, bios_version,
-                        &(t_ref->record->header_size));
+                status = set_header(header, TM_BIOS_VERSION_STR, bios_version);
                 free(bios_version);
         }
 
@@ -625,17 +810,14 @@ static int set_bios_version_header(struct telem_ref *t_ref)
 static int set_event_id_header(struct telem_ref *t_ref)
 {
         int rc = 0;
-        char *buff = NULL;
+        char buff[RANDOM_ID_LEN + 1];
 
-        rc = get_random_id(&buff);
+        rc = fill_random_id(buff);
 
         if (rc == 0) {
-                rc = set_header(
-                        &(t_ref->record->headers[TM_EVENT_ID]),
-                        TM_EVENT_ID_STR, buff,
-                        &(t_ref->record->header_size));
+                rc = tm_record_add_header(t_ref, TM_EVENT_ID, "%s: %s\n",
+                                          TM_EVENT_ID_STR, buff);
         }
-        free(buff);
 
         return rc;
 }
@@ -646,12 +828,12 @@ static int set_event_id_header(struct telem_ref *t_ref)
  * (product_name), and Product Version (product_version). The values are
  * separated by pipes.  e.g., <sv|pn|pvr>
  *
- * @param t_ref Telemetry Record reference obtained from tm_create_record.
+ * @param header Set to the allocated header line.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int set_host_type_header(struct telem_ref *t_ref)
+static int set_host_type_header(char **header)
 {
         char *buf = NULL;
         char *sv  = NULL;
@@ -684,8 +866,7 @@ static int set_host_type_header(struct telem_ref *t_ref)
                 status = -ENOMEM;
                 goto cleanup;
         } else {
-                status = set_header(&(t_ref->record->headers[TM_HOST_TYPE]),
-                                    TM_HOST_TYPE_STR, buf, &(t_ref->record->header_size));
+                status = set_header(header, TM_HOST_TYPE_STR, buf);
                 free(buf);
         }
 
@@ -710,12 +891,12 @@ cleanup:
  * access the results of the uname system call, the function will gracefully
  * fail and report "unknown".
  *
- * @param t_ref Telemetry Record reference obtained from tm_create_record.
+ * @param header Set to the allocated header line.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int set_kernel_version_header(struct telem_ref *t_ref)
+static int set_kernel_version_header(char **header)
 {
         struct utsname uts_buf;
         char *buf = NULL;
@@ -733,10 +914,7 @@ static int set_kernel_version_header(struct telem_ref *t_ref)
         if (rc < 0) {
                 return -ENOMEM;
         } else {
-                status = set_header(
-                        &(t_ref->record->headers[TM_KERNEL_VERSION]),
-                        TM_KERNEL_VERSION_STR, buf,
-                        &(t_ref->record->header_size));
+                status = set_header(header, TM_KERNEL_VERSION_STR, buf);
                 free(buf);
         }
 
@@ -755,190 +933,589 @@ static int set_kernel_version_header(struct telem_ref *t_ref)
  */
 static int set_payload_format_header(struct telem_ref *t_ref, uint32_t payload_version)
 {
-        char *buf = NULL;
-        int rc;
-        int status = 0;
-
-        rc = asprintf(&buf, "%" PRIu32, payload_version);
-
-        if (rc < 0) {
-                return -ENOMEM;
-        } else {
-                status = set_header(
-                        &(t_ref->record->headers[TM_PAYLOAD_VERSION]),
-                        TM_PAYLOAD_VERSION_STR, buf,
-                        &(t_ref->record->header_size));
-                free(buf);
-        }
-
-        return status;
+        return tm_record_add_header(t_ref, TM_PAYLOAD_VERSION, "%s: %" PRIu32 "\n",
+                                    TM_PAYLOAD_VERSION_STR, payload_version);
 }
 
-int tm_set_config_file(const char *c_file)
+/**
+ * Sets the dropped count header, the number of records of the same
+ * classification that the client-side rate limit dropped since the previous
+ * record.
+ *
+ * @param t_ref Telemetry Record reference obtained from tm_create_record.
+ * @param dropped Number of dropped records.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int set_dropped_count_header(struct telem_ref *t_ref, uint64_t dropped)
 {
-        return set_config_file(c_file);
+        return tm_record_add_header(t_ref, TM_DROPPED_COUNT, "%s: %" PRIu64 "\n",
+                                    TM_DROPPED_COUNT_STR, dropped);
 }
 
 /**
- * Helper function for tm_create_record().  Allocate all of the headers
- * for a new telemetrics record. The parameters are passed through from
- * tm_create_record to this function.
+ * Sets the sample rate header. A rate of 1/N means that the record was kept
+ * by client-side sampling along with one in N records of its classification.
  *
  * @param t_ref Telemetry Record reference obtained from tm_create_record.
- * @param severity Severity field value. Accepted values are in the range 1-4,
- *     with 1 being the lowest severity, and 4 being the highest severity.
- * @param classification Classification field value. It should have the form
- *     DOMAIN/PROBENAME/REST: DOMAIN is the reverse domain to use as a namespace
- *     for the probe (e.g. org.clearlinux); PROBENAME is the name of the probe;
- *     and REST is an arbitrary value that the probe should use to classify the
- *     record.
- * @param payload_version Payload format version. The only supported value right
- *     now is 1, which indicates that the payload is a freely-formatted
- *     (unstructured) string. Values greater than 1 are reserved for future use.
- *
+ * @param sample The sampling interval N.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-int allocate_header(struct telem_ref *t_ref, uint32_t severity,
-                    char *classification, uint32_t payload_version)
+static int set_sample_rate_header(struct telem_ref *t_ref, uint64_t sample)
 {
+        return tm_record_add_header(t_ref, TM_SAMPLE_RATE, "%s: 1/%" PRIu64 "\n",
+                                    TM_SAMPLE_RATE_STR, sample);
+}
 
-        int k, i = 0;
-        int ret = 0;
+int tm_set_config_file(const char *c_file)
+{
+        return set_config_file(c_file);
+}
 
-        /* The order we create the headers matters */
+/* Minimum number of seconds between checks of the host info source files */
+#define TM_HOST_INFO_CHECK_INTERVAL 60
 
-        if ((ret = set_record_format_header(t_ref)) < 0) {
-                goto free_and_fail;
-        }
+/* Headers describing the host. Their values only change when the files they
+ * are read from change, so they are collected once per process into a
+ * snapshot the threads share, and copied into every new record.
+ */
+static const int host_info_headers[] = {
+        TM_ARCH,
+        TM_HOST_TYPE,
+        TM_SYSTEM_BUILD,
+        TM_KERNEL_VERSION,
+        TM_SYSTEM_NAME,
+        TM_BOARD_NAME,
+        TM_CPU_MODEL,
+        TM_BIOS_VERSION
+};
+
+#define NUM_HOST_INFO_HEADERS (sizeof(host_info_headers) / sizeof(int))
+
+static void get_host_info_stamp(const char *source, struct host_info_stamp *stamp)
+{
+        struct stat buf;
 
-        i++;
+        memset(stamp, 0, sizeof(struct host_info_stamp));
 
-        if ((ret = set_classification_header(t_ref, classification)) < 0) {
-                goto free_and_fail;
+        if (stat(source, &buf) == 0) {
+                stamp->exists = true;
+                stamp->dev = buf.st_dev;
+                stamp->ino = buf.st_ino;
+                stamp->mtime = buf.st_mtim;
         }
+}
 
-        i++;
-
-        if ((ret = set_severity_header(t_ref, severity)) < 0) {
-                goto free_and_fail;
+/**
+ * Checks if any of the host info source files was created, removed,
+ * replaced or modified since a snapshot was collected.
+ *
+ * @param info The snapshot.
+ *
+ * @return true if the snapshot is out of date.
+ *
+ */
+static bool host_info_changed(const struct host_info *info)
+{
+        struct host_info_stamp stamp;
+        const struct host_info_stamp *old;
+
+        for (size_t i = 0; i < NUM_HOST_INFO_SOURCES; i++) {
+                get_host_info_stamp(host_info_sources[i], &stamp);
+                old = &info->stamps[i];
+
+                if (stamp.exists != old->exists ||
+                    stamp.dev != old->dev ||
+                    stamp.ino != old->ino ||
+                    stamp.mtime.tv_sec != old->mtime.tv_sec ||
+                    stamp.mtime.tv_nsec != old->mtime.tv_nsec) {
+                        return true;
+                }
         }
 
-        i++;
+        return false;
+}
 
-        if ((ret = set_machine_id_header(t_ref)) < 0) {
-                goto free_and_fail;
+/**
+ * Drops a reference to a snapshot, freeing it with the last one.
+ *
+ * @param info The snapshot, or NULL.
+ *
+ */
+static void put_host_info(struct host_info *info)
+{
+        if (info == NULL || __atomic_sub_fetch(&info->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+                return;
         }
 
-        i++;
-
-        if ((ret = set_timestamp_header(t_ref)) < 0) {
-                goto free_and_fail;
+        for (size_t i = 0; i < NUM_HOST_INFO_HEADERS; i++) {
+                free(info->headers[host_info_headers[i]]);
         }
+        free(info);
+}
 
-        i++;
+/**
+ * Releases the main thread's snapshot and the current one at exit; other
+ * threads release theirs through tm_thread_release().
+ */
+__attribute__((destructor))
+static void free_host_info(void)
+{
+        put_host_info(tm_thread.host_info);
+        tm_thread.host_info = NULL;
 
-        if ((ret = set_arch_header(t_ref)) < 0) {
-                goto free_and_fail;
-        }
+        pthread_mutex_lock(&host_info_lock);
+        put_host_info(host_info_current);
+        host_info_current = NULL;
+        pthread_mutex_unlock(&host_info_lock);
+}
 
-        i++;
+/**
+ * Collects a snapshot of the host info headers. The source files are
+ * stamped before they are read, so that a change racing with the read is
+ * picked up by the next check.
+ *
+ * @param generation The value of host_info_generation it is collected for.
+ * @param info Set to the snapshot, with a reference for the caller.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int load_host_info(unsigned long generation, struct host_info **info)
+{
+        struct host_info *new = calloc(1, sizeof(struct host_info));
+        char **headers;
+        int ret = 0;
 
-        if ((ret = set_host_type_header(t_ref)) < 0) {
-                goto free_and_fail;
+        if (!new) {
+                return -ENOMEM;
         }
+        headers = new->headers;
+        new->generation = generation;
+        new->refs = 1;
 
-        i++;
-
-        if ((ret = set_system_build_header(t_ref)) < 0) {
-                goto free_and_fail;
+        for (size_t i = 0; i < NUM_HOST_INFO_SOURCES; i++) {
+                get_host_info_stamp(host_info_sources[i], &new->stamps[i]);
         }
 
-        i++;
-
-        if ((ret = set_kernel_version_header(t_ref)) < 0) {
-                goto free_and_fail;
+        if ((ret = set_arch_header(&headers[TM_ARCH])) < 0 ||
+            (ret = set_host_type_header(&headers[TM_HOST_TYPE])) < 0 ||
+            (ret = set_system_build_header(&headers[TM_SYSTEM_BUILD])) < 0 ||
+            (ret = set_kernel_version_header(&headers[TM_KERNEL_VERSION])) < 0 ||
+            (ret = set_system_name_header(&headers[TM_SYSTEM_NAME])) < 0 ||
+            (ret = set_board_name_header(&headers[TM_BOARD_NAME])) < 0 ||
+            (ret = set_cpu_model_header(&headers[TM_CPU_MODEL])) < 0 ||
+            (ret = set_bios_version_header(&headers[TM_BIOS_VERSION])) < 0) {
+                put_host_info(new);
+                return ret;
         }
 
-        i++;
-
-        if ((ret = set_payload_format_header(t_ref, payload_version)) < 0) {
-                goto free_and_fail;
-        }
+        *info = new;
 
-        i++;
+        return 0;
+}
 
-        if ((ret = set_system_name_header(t_ref)) < 0) {
-                goto free_and_fail;
-        }
+/**
+ * Points the calling thread at the current snapshot, collecting a new one
+ * first if it is missing or older than host_info_generation.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int use_current_host_info(void)
+{
+        struct host_info *info;
+        unsigned long generation;
+        int ret = 0;
 
-        i++;
+        tm_thread_register();
 
-        if ((ret = set_board_name_header(t_ref)) < 0) {
-                goto free_and_fail;
+        pthread_mutex_lock(&host_info_lock);
+        generation = __atomic_load_n(&host_info_generation, __ATOMIC_ACQUIRE);
+        if (host_info_current == NULL || host_info_current->generation != generation) {
+                if ((ret = load_host_info(generation, &info)) < 0) {
+                        pthread_mutex_unlock(&host_info_lock);
+                        return ret;
+                }
+                put_host_info(host_info_current);
+                host_info_current = info;
         }
+        info = host_info_current;
+        __atomic_add_fetch(&info->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&host_info_lock);
 
-        i++;
+        put_host_info(tm_thread.host_info);
+        tm_thread.host_info = info;
+        tm_thread.host_info_last_check = time(NULL);
 
-        if ((ret = set_cpu_model_header(t_ref)) < 0) {
-                goto free_and_fail;
-        }
+        return 0;
+}
 
-        i++;
+/**
+ * Makes sure the calling thread uses a snapshot of the host info that is
+ * reasonably fresh. The source files are checked for changes at most every
+ * TM_HOST_INFO_CHECK_INTERVAL seconds per thread.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int get_host_info(void)
+{
+        time_t now;
 
-        if ((ret = set_bios_version_header(t_ref)) < 0) {
-                goto free_and_fail;
+        if (tm_thread.host_info == NULL ||
+            tm_thread.host_info->generation !=
+            __atomic_load_n(&host_info_generation, __ATOMIC_ACQUIRE)) {
+                return use_current_host_info();
         }
 
-        i++;
+        now = time(NULL);
+        if (now - tm_thread.host_info_last_check < TM_HOST_INFO_CHECK_INTERVAL &&
+            now >= tm_thread.host_info_last_check) {
+                return 0;
+        }
 
-        if ((ret = set_event_id_header(t_ref)) < 0) {
-                goto free_and_fail;
+        tm_thread.host_info_last_check = now;
+        if (host_info_changed(tm_thread.host_info)) {
+                telem_log(LOG_INFO, "INFO: Host info changed, reloading\n");
+                __atomic_add_fetch(&host_info_generation, 1, __ATOMIC_RELEASE);
+                return use_current_host_info();
         }
 
-        i++; /* Not necessary, but including for future expansion */
+        return 0;
+}
 
-        return ret;
+int tm_refresh_host_info(void)
+{
+        __atomic_add_fetch(&host_info_generation, 1, __ATOMIC_RELEASE);
+
+        return use_current_host_info();
+}
+
+/**
+ * Copies a cached host info header into a record.
+ *
+ * @param t_ref Telemetry Record reference obtained from tm_create_record.
+ * @param index The header index, one of host_info_headers.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int set_host_info_header(struct telem_ref *t_ref, int index)
+{
+        char *header = tm_thread.host_info->headers[index];
+        size_t len = strlen(header);
+        int ret;
+
+        if ((ret = tm_record_reserve(t_ref, len)) < 0) {
+                return ret;
+        }
+
+        memcpy(t_ref->record->data + t_ref->record->size, header, len);
+        tm_record_end_header(t_ref->record, index, len);
+
+        return 0;
+}
+
+/*
+ * Client-side rate limit and sampling state of a classification that has
+ * limits in the configuration. Shared by all threads, the token bucket under
+ * the lock of the entry.
+ */
+struct tm_class_limit {
+        char *classification;
+        /* keep one record in sample */
+        uint64_t sample;
+        /* token bucket, if rate limited */
+        bool rate_limited;
+        pthread_mutex_t lock;
+        double tokens;
+        double capacity;
+        double refill_rate;
+        struct timespec last_refill;
+        /* records dropped by the rate limit since the last one let through */
+        uint64_t dropped;
+        struct tm_class_limit *next;
+};
+
+/* Entries are only ever added, at the head, so they are looked up without a
+ * lock */
+static struct tm_class_limit *tm_class_limits = NULL;
+
+/**
+ * Finds the limit state of a classification in the entries from head on.
+ *
+ * @param head The first entry to look at.
+ * @param classification The classification.
+ *
+ * @return The state, or NULL if there is none yet.
+ *
+ */
+static struct tm_class_limit *tm_class_limit_find(struct tm_class_limit *head,
+                                                  const char *classification)
+{
+        for (struct tm_class_limit *l = head; l; l = l->next) {
+                if (strcmp(l->classification, classification) == 0) {
+                        return l;
+                }
+        }
+
+        return NULL;
+}
+
+/**
+ * Finds the limit state of a classification, creating it from the
+ * configuration the first time.
+ *
+ * @param classification The classification.
+ * @param limit Set to the state, or NULL if the classification has no
+ *     limits.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int tm_class_limit_get(const char *classification, struct tm_class_limit **limit)
+{
+        struct tm_class_limit *head, *l;
+        int64_t records, window;
+        int64_t sample;
+        bool rate_limited;
+
+        head = __atomic_load_n(&tm_class_limits, __ATOMIC_ACQUIRE);
+        if ((*limit = tm_class_limit_find(head, classification))) {
+                return 0;
+        }
+
+        rate_limited = record_rate_limit_config(classification, &records, &window);
+        sample = record_sampling_config(classification);
+        if (!rate_limited && sample <= 1) {
+                return 0;
+        }
+
+        l = calloc(1, sizeof(struct tm_class_limit));
+        if (!l || !(l->classification = strdup(classification))) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                free(l);
+                return -ENOMEM;
+        }
+
+        if (rate_limited) {
+                l->rate_limited = true;
+                l->capacity = (double)records;
+                l->tokens = l->capacity;
+                l->refill_rate = (double)records / (double)window;
+                clock_gettime(CLOCK_MONOTONIC, &l->last_refill);
+        }
+        l->sample = sample > 1 ? (uint64_t)sample : 1;
+        pthread_mutex_init(&l->lock, NULL);
+
+        /* Another thread may add the same classification meanwhile, only
+         * the entries it added need to be looked at again */
+        l->next = head;
+        while (!__atomic_compare_exchange_n(&tm_class_limits, &l->next, l, false,
+                                            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                if ((*limit = tm_class_limit_find(l->next, classification))) {
+                        pthread_mutex_destroy(&l->lock);
+                        free(l->classification);
+                        free(l);
+                        return 0;
+                }
+        }
+        *limit = l;
+
+        return 0;
+}
+
+/**
+ * Applies the client-side rate limit and sampling configured for a
+ * classification, before a record of that classification is built. Records
+ * are sampled first, and the records kept are rate limited.
+ *
+ * @param classification The classification of the record.
+ * @param dropped Set to the number of records dropped by the rate limit
+ *     since the previous record let through.
+ * @param sample Set to the sampling interval.
+ *
+ * @return 0 if the record may be created, -EAGAIN if it is dropped, or
+ *     another negative errno-style value.
+ *
+ */
+static int tm_class_limit_check(const char *classification, uint64_t *dropped,
+                                uint64_t *sample)
+{
+        struct tm_class_limit *limit;
+        struct timespec now;
+        uint64_t r;
+        double elapsed;
+        int ret;
+
+        *dropped = 0;
+        *sample = 1;
+
+        if (!class_limits_enabled_config()) {
+                return 0;
+        }
+
+        if (validate_classification((char *)classification) != 0) {
+                return -EINVAL;
+        }
+
+        if ((ret = tm_class_limit_get(classification, &limit)) < 0 || !limit) {
+                return ret;
+        }
+
+        if (limit->sample > 1) {
+                if (get_random_u64(&r) != 0) {
+                        return -EIO;
+                }
+                if (r % limit->sample != 0) {
+                        return -EAGAIN;
+                }
+        }
+        *sample = limit->sample;
+
+        if (!limit->rate_limited) {
+                return 0;
+        }
+
+        pthread_mutex_lock(&limit->lock);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (double)(now.tv_sec - limit->last_refill.tv_sec) +
+                  (double)(now.tv_nsec - limit->last_refill.tv_nsec) / 1e9;
+        limit->last_refill = now;
+        limit->tokens += elapsed * limit->refill_rate;
+        if (limit->tokens > limit->capacity) {
+                limit->tokens = limit->capacity;
+        }
 
-free_and_fail:
-        for (k = 0; k < i; k++) {
-                free(t_ref->record->headers[k]);
+        if (limit->tokens < 1.0) {
+                limit->dropped++;
+                ret = -EAGAIN;
+        } else {
+                limit->tokens -= 1.0;
+                *dropped = limit->dropped;
+                limit->dropped = 0;
         }
+        pthread_mutex_unlock(&limit->lock);
+
         return ret;
+}
+
+__attribute__((destructor))
+static void free_class_limits(void)
+{
+        struct tm_class_limit *limit;
+
+        while ((limit = tm_class_limits)) {
+                tm_class_limits = limit->next;
+                pthread_mutex_destroy(&limit->lock);
+                free(limit->classification);
+                free(limit);
+        }
+}
+
+/**
+ * Helper function for tm_create_record().  Allocate all of the headers
+ * for a new telemetrics record. The parameters are passed through from
+ * tm_create_record to this function.
+ *
+ * @param t_ref Telemetry Record reference obtained from tm_create_record.
+ * @param severity Severity field value. Accepted values are in the range 1-4,
+ *     with 1 being the lowest severity, and 4 being the highest severity.
+ * @param classification Classification field value. It should have the form
+ *     DOMAIN/PROBENAME/REST: DOMAIN is the reverse domain to use as a namespace
+ *     for the probe (e.g. org.clearlinux); PROBENAME is the name of the probe;
+ *     and REST is an arbitrary value that the probe should use to classify the
+ *     record.
+ * @param payload_version Payload format version. The only supported value right
+ *     now is 1, which indicates that the payload is a freely-formatted
+ *     (unstructured) string. Values greater than 1 are reserved for future use.
+ * @param dropped Dropped count field value.
+ * @param sample Sampling interval for the sample rate field.
+ *
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+int allocate_header(struct telem_ref *t_ref, uint32_t severity,
+                    char *classification, uint32_t payload_version,
+                    uint64_t dropped, uint64_t sample)
+{
+
+        struct telem_record *record;
+        uint32_t header_size;
+        int ret = 0;
+
+        if ((ret = get_host_info()) < 0) {
+                return ret;
+        }
 
+        /* The order we create the headers matters */
+
+        if ((ret = set_record_format_header(t_ref)) < 0 ||
+            (ret = set_classification_header(t_ref, classification)) < 0 ||
+            (ret = set_severity_header(t_ref, severity)) < 0 ||
+            (ret = set_machine_id_header(t_ref)) < 0 ||
+            (ret = set_timestamp_header(t_ref)) < 0 ||
+            (ret = set_host_info_header(t_ref, TM_ARCH)) < 0 ||
+            (ret = set_host_info_header(t_ref, TM_HOST_TYPE)) < 0 ||
+            (ret = set_host_info_header(t_ref, TM_SYSTEM_BUILD)) < 0 ||
+            (ret = set_host_info_header(t_ref, TM_KERNEL_VERSION)) < 0 ||
+            (ret = set_payload_format_header(t_ref, payload_version)) < 0 ||
+            (ret = set_host_info_header(t_ref, TM_SYSTEM_NAME)) < 0 ||
+            (ret = set_host_info_header(t_ref, TM_BOARD_NAME)) < 0 ||
+            (ret = set_host_info_header(t_ref, TM_CPU_MODEL)) < 0 ||
+            (ret = set_host_info_header(t_ref, TM_BIOS_VERSION)) < 0 ||
+            (ret = set_event_id_header(t_ref)) < 0 ||
+            (ret = set_dropped_count_header(t_ref, dropped)) < 0 ||
+            (ret = set_sample_rate_header(t_ref, sample)) < 0) {
+                return ret;
+        }
+
+        /* Store the header size in front of the headers, and terminate the
+         * (still empty) payload */
+        if ((ret = tm_record_reserve(t_ref, 1)) < 0) {
+                return ret;
+        }
+
+        record = t_ref->record;
+        header_size = (uint32_t)record->header_size;
+        memcpy(record->data, &header_size, sizeof(header_size));
+        record->data[record->size++] = '\0';
+
+        return ret;
 }
 
 int tm_create_record(struct telem_ref **t_ref, uint32_t severity,
                      char *classification, uint32_t payload_version)
 {
+        uint64_t dropped, sample;
         int ret = 0;
 
+        /* Rate limited and sampled out records are not even built */
+        if ((ret = tm_class_limit_check(classification, &dropped, &sample)) < 0) {
+                return ret;
+        }
+
         *t_ref = (struct telem_ref *)malloc(sizeof(struct telem_ref));
         if (*t_ref == NULL) {
                 telem_log(LOG_CRIT, "CRIT: Out of memory\n");
                 return -ENOMEM;
         }
 
-        (*t_ref)->record = (struct telem_record *)malloc(sizeof(struct telem_record));
+        (*t_ref)->record = tm_record_alloc();
         if ((*t_ref)->record == NULL) {
-                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
                 free(*t_ref);
                 return -ENOMEM;
         }
 
-        // Need to initialize header size, since it is only incremented elsewhere
-        (*t_ref)->record->header_size = 0;
-
-        /* tm_set_payload() may not be called (e.g. in our test suite); in this
-         * case, initialize the payload member to NULL so that we can properly
-         * detect a non-NULL value in tm_free_record().
-         */
-        (*t_ref)->record->payload = NULL;
-
         /* Set up the headers */
-        if ((ret = allocate_header(*t_ref, severity, classification, payload_version)) < 0) {
-                free((*t_ref)->record);
+        if ((ret = allocate_header(*t_ref, severity, classification, payload_version,
+                                   dropped, sample)) < 0) {
+                tm_record_release((*t_ref)->record);
                 free(*t_ref);
         }
 
@@ -971,9 +1548,9 @@ int payload_is_ascii(char *payload, size_t len)
         return ret;
 }
 
-// TODO: Consider simply setting a pointer to point to data provide in payload instead of copying it?
 int tm_set_payload(struct telem_ref *t_ref, char *payload)
 {
+        struct telem_record *record;
         size_t payload_len;
         int ret = 0;
 
@@ -988,14 +1565,22 @@ int tm_set_payload(struct telem_ref *t_ref, char *payload)
                 return -EINVAL;
         }
 
-        t_ref->record->payload = strndup(payload, payload_len);
+        /* The payload is the last thing in the record, a new payload
+         * replaces the previous one in place */
+        record = t_ref->record;
+        record->size = record->header_offset[NUM_HEADERS];
+        record->payload_size = 0;
 
-        if (!t_ref->record->payload) {
-                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
-                return -ENOMEM;
+        if ((ret = tm_record_reserve(t_ref, payload_len + 1)) < 0) {
+                record->data[record->size++] = '\0';
+                return ret;
         }
 
-        t_ref->record->payload_size = payload_len;
+        record = t_ref->record;
+        memcpy(record->data + record->size, payload, payload_len);
+        record->size += payload_len;
+        record->data[record->size++] = '\0';
+        record->payload_size = payload_len;
 
         return ret;
 }
@@ -1039,13 +1624,12 @@ int tm_set_event_id(struct telem_ref *t_ref, char *event_id)
 
         if (!validate_event_id(event_id)) {
                 if (t_ref && t_ref->record) {
-                        // free default id before overriding
-                        free(t_ref->record->headers[TM_EVENT_ID]);
-                        // set new event_id
-                        if (asprintf(&(t_ref->record->headers[TM_EVENT_ID]),
-                                     "%s: %s\n", TM_EVENT_ID_STR, event_id) > 0) {
-                                rc = 0;
-                        }
+                        // event ids have a fixed length, overwrite the
+                        // default id in place
+                        memcpy(t_ref->record->data +
+                               t_ref->record->header_offset[TM_EVENT_ID] +
+                               strlen(TM_EVENT_ID_STR) + 2, event_id, EVENT_ID_LEN);
+                        rc = 0;
                 }
         }
 
@@ -1053,291 +1637,1537 @@ int tm_set_event_id(struct telem_ref *t_ref, char *event_id)
 }
 
 /**
- * Write nbytes from buf to fd. Used to send records to telemprobd.
+ * Replace the value of a header, moving the headers and payload after it if
+ * the length changes.
  *
- * @param fd Socket fd obtained from tm_get_socket.
- * @param buf Data to be written to the socket.
- * @param nbytes Number of bytes to write out of buf.
+ * @param t_ref Reference to the record.
+ * @param index The header index.
+ * @param value The new value, without the header name and newline.
+ * @param len Length of value.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int tm_write_socket(int fd, char *buf, size_t nbytes)
+static int tm_record_set_value(struct telem_ref *t_ref, int index,
+                               const char *value, size_t len)
 {
-        size_t nbytes_out = 0;
-        int k = 0;
-        int ret = 0;
-
-        while (nbytes_out != nbytes) {
-                ssize_t b;
-                b = write(fd, buf + nbytes_out, nbytes - nbytes_out);
-
-                if (b == -1 && errno != EAGAIN) {
-                        ret = -errno;
-                        telem_perror("Error writing to daemon socket");
+        struct telem_record *record = t_ref->record;
+        size_t start = record->header_offset[index] + strlen(get_header_name(index)) + 2;
+        size_t end = record->header_offset[index + 1] - 1;
+        uint32_t header_size;
+        int ret;
+
+        if (len > end - start) {
+                if ((ret = tm_record_reserve(t_ref, len - (end - start))) < 0) {
                         return ret;
-                } else if (b == -1 &&
-                           (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                        if (++k > 100) {
-                                ret = -errno;
-                                return ret;
-                        }
-                } else {
-                        nbytes_out += (size_t)b;
-                        k = 0;
                 }
+                record = t_ref->record;
         }
 
-        return ret;
+        if (len != end - start) {
+                memmove(record->data + start + len, record->data + end,
+                        record->size - end);
+                record->size = record->size + len - (end - start);
+                record->header_size = record->header_size + len - (end - start);
+                for (int i = index + 1; i <= NUM_HEADERS; i++) {
+                        record->header_offset[i] =
+                                (uint32_t)(record->header_offset[i] + len - (end - start));
+                }
+                header_size = (uint32_t)record->header_size;
+                memcpy(record->data, &header_size, sizeof(header_size));
+        }
+
+        memcpy(record->data + start, value, len);
+
+        return 0;
 }
 
+struct tm_template {
+        /* the prepared record, without a payload */
+        struct telem_ref ref;
+        uint32_t severity;
+        char *classification;
+        uint32_t payload_version;
+        /* generation of the host info the record was built with, the same
+         * in every thread until the host info changes */
+        unsigned long host_info_generation;
+};
+
 /**
- * Obtain a file descriptor for a unix domain socket.
- * Connect to the socket in a non-blocking fashion.
+ * (Re)build the record of a template.
  *
- * @return A valid file descriptor, or a negative errno-style value on error.
+ * @param tmpl The template.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int tm_get_socket(void)
+static int tm_template_build(struct tm_template *tmpl)
 {
-        int sfd = -1;
-        int ret = 0;
-        struct sockaddr_un addr;
-        long sflags = 0;
-        int res = 0;
-        struct timeval tv;
-        fd_set fdset;
-        socklen_t lon = 0;
-        int valopt = 0;
+        struct telem_ref ref;
+        int ret;
 
-        sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ref.record = tm_record_alloc();
+        if (!ref.record) {
+                return -ENOMEM;
+        }
 
-        if (sfd == -1) {
-                ret = -errno;
-                telem_perror("Attempt to allocate socket fd failed");
+        if ((ret = allocate_header(&ref, tmpl->severity, tmpl->classification,
+                                   tmpl->payload_version, 0, 1)) < 0) {
+                tm_record_release(ref.record);
                 return ret;
         }
 
-        /* Set timeout for the socket first */
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-
-        if (setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tv,
-                       sizeof(tv)) < 0) {
-                ret = -errno;
-                telem_perror("Failed to set socket timeout");
-                goto out1;
+        if (tmpl->ref.record) {
+                tm_record_release(tmpl->ref.record);
         }
+        tmpl->ref.record = ref.record;
+        tmpl->host_info_generation = tm_thread.host_info->generation;
 
-        /* Construct server address, and make the connection */
-        memset(&addr, 0, sizeof(struct sockaddr_un));
-        addr.sun_family = AF_UNIX;
-        strncpy(addr.sun_path, socket_path_config(),
-                sizeof(addr.sun_path) - 1);
+        return 0;
+}
 
-        res = connect(sfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un));
+int tm_prepare_record(struct tm_template **tmpl, uint32_t severity,
+                      char *classification, uint32_t payload_version)
+{
+        int ret;
 
-        if (res < 0) {
-                // Socket still connecting. Try to select it with a 1 second.
-                // failure to select() is a sign of problems - bail out.
-                if (errno == EINPROGRESS) {
-                        do {
-                                tv.tv_sec = 1;
-                                tv.tv_usec = 0;
-                                FD_ZERO(&fdset);
-                                FD_SET(sfd, &fdset);
-                                res = select(sfd + 1, NULL, &fdset, NULL, &tv);
+        *tmpl = calloc(1, sizeof(struct tm_template));
+        if (*tmpl == NULL) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                return -ENOMEM;
+        }
 
-                                if (res < 0 && errno != EINTR) {
-                                        // connection error or resume-after-interrupt
-                                        ret = -errno;
-                                        goto out1;
-                                } else if (res > 0) {
-                                        // Socket was selected for a write
-                                        lon = sizeof(int);
-                                        if (getsockopt(sfd, SOL_SOCKET, SO_ERROR,
-                                                       (void *)(&valopt), &lon) < 0) {
-                                                ret = -errno;
-                                                goto out1;
-                                        }
-                                        if (valopt) {
-                                                // errors in socket
-                                                ret = -valopt;
-                                                goto out1;
-                                        }
-                                        break;
-                                } else {
-                                        // We timed out.
-                                        ret = -ETIMEDOUT;
-                                        goto out1;
-                                }
-                        } while (1);
-                } else {
-                        ret = -errno;
-                        goto out1;
-                }
+        (*tmpl)->severity = severity;
+        (*tmpl)->payload_version = payload_version;
+        (*tmpl)->classification = strdup(classification);
+        if ((*tmpl)->classification == NULL) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                ret = -ENOMEM;
+                goto fail;
         }
 
-        // Set non-blocking after the connect() succeeded
-        if ((sflags = fcntl(sfd, F_GETFL, NULL)) < 0) {
-                ret = -errno;
-                telem_log(LOG_ERR, "Failed to get socket flags\n");
-                goto out1;
+        if ((ret = tm_template_build(*tmpl)) < 0) {
+                goto fail;
         }
 
-        sflags |= O_NONBLOCK;
+        return 0;
 
-        if (fcntl(sfd, F_SETFL, sflags) < 0) {
-                ret = -errno;
+fail:
+        free((*tmpl)->classification);
+        free(*tmpl);
+        *tmpl = NULL;
+        return ret;
+}
+
+int tm_record_from_template(struct tm_template *tmpl, struct telem_ref **t_ref)
+{
+        struct telem_record *src;
+        struct telem_record *record;
+        char timestamp[32];
+        char event_id[RANDOM_ID_LEN + 1];
+        char value[32];
+        uint64_t dropped, sample;
+        size_t capacity;
+        int len;
+        int ret;
+
+        if ((ret = tm_class_limit_check(tmpl->classification, &dropped, &sample)) < 0) {
+                return ret;
+        }
+
+        /* The template's host info headers must be as fresh as those of a
+         * record built from scratch */
+        if ((ret = get_host_info()) < 0) {
+                return ret;
+        }
+        if (tmpl->host_info_generation != tm_thread.host_info->generation &&
+            (ret = tm_template_build(tmpl)) < 0) {
+                return ret;
+        }
+        src = tmpl->ref.record;
+
+        *t_ref = (struct telem_ref *)malloc(sizeof(struct telem_ref));
+        if (*t_ref == NULL) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                return -ENOMEM;
+        }
+
+        (*t_ref)->record = tm_record_alloc();
+        if ((*t_ref)->record == NULL) {
+                ret = -ENOMEM;
+                goto fail;
+        }
+
+        if ((ret = tm_record_reserve(*t_ref, src->size)) < 0) {
+                goto fail;
+        }
+
+        /* Copy the prepared header block. The machine id is a placeholder
+         * set by the daemon, so only the timestamp, event id and client-side
+         * limit annotations change. */
+        record = (*t_ref)->record;
+        capacity = record->capacity;
+        memcpy(record, src, sizeof(struct telem_record) + src->size);
+        record->capacity = capacity;
+
+        len = snprintf(timestamp, sizeof(timestamp), "%jd", (intmax_t)time(NULL));
+        if ((ret = tm_record_set_value(*t_ref, TM_TIMESTAMP, timestamp, (size_t)len)) < 0) {
+                goto fail;
+        }
+
+        if (fill_random_id(event_id) != 0) {
+                ret = -1;
+                goto fail;
+        }
+        if ((ret = tm_record_set_value(*t_ref, TM_EVENT_ID, event_id, EVENT_ID_LEN)) < 0) {
+                goto fail;
+        }
+
+        if (dropped != 0) {
+                len = snprintf(value, sizeof(value), "%" PRIu64, dropped);
+                if ((ret = tm_record_set_value(*t_ref, TM_DROPPED_COUNT, value, (size_t)len)) < 0) {
+                        goto fail;
+                }
+        }
+
+        if (sample != 1) {
+                len = snprintf(value, sizeof(value), "1/%" PRIu64, sample);
+                if ((ret = tm_record_set_value(*t_ref, TM_SAMPLE_RATE, value, (size_t)len)) < 0) {
+                        goto fail;
+                }
+        }
+
+        return 0;
+
+fail:
+        if ((*t_ref)->record) {
+                tm_record_release((*t_ref)->record);
+        }
+        free(*t_ref);
+        *t_ref = NULL;
+        return ret;
+}
+
+void tm_free_template(struct tm_template *tmpl)
+{
+        if (tmpl == NULL) {
+                return;
+        }
+
+        if (tmpl->ref.record) {
+                tm_record_release(tmpl->ref.record);
+        }
+        free(tmpl->classification);
+        free(tmpl);
+}
+
+/* Milliseconds to wait for the daemon to drain a full socket buffer */
+#define TM_SOCKET_WRITE_TIMEOUT 1000
+
+/* Milliseconds to wait for the daemon to acknowledge a record, on top of
+ * the group sync interval in group durability mode */
+#define TM_SOCKET_ACK_TIMEOUT 1000
+
+/* Times a record acknowledged with TM_ACK_RETRY_AFTER is sent again, and the
+ * longest delay asked for by the daemon that is honoured, in milliseconds */
+#define TM_ACK_RETRIES 3
+#define TM_ACK_MAX_RETRY_AFTER 10000
+
+/**
+ * Write a vector of buffers to fd with as few system calls as possible. Used
+ * to send records to telemprobd.
+ *
+ * @param fd Socket fd obtained from tm_get_socket.
+ * @param iov Buffers to be written to the socket, in order. The array is
+ *     modified to track partial writes.
+ * @param iovcnt Number of entries in iov.
+ * @param sent If not NULL, set to the number of bytes written, also when the
+ *     write fails.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int tm_writev_socket(int fd, struct iovec *iov, size_t iovcnt, size_t *sent)
+{
+        struct msghdr msg;
+        struct pollfd pfd;
+        int ret = 0;
+
+        if (sent) {
+                *sent = 0;
+        }
+
+        while (iovcnt > 0) {
+                ssize_t b;
+
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+
+                b = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+                if (b == -1 && errno == EINTR) {
+                        continue;
+                } else if (b == -1 &&
+                           (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        /* Socket buffer is full, wait until the daemon
+                         * drains it */
+                        pfd.fd = fd;
+                        pfd.events = POLLOUT;
+                        pfd.revents = 0;
+
+                        ret = poll(&pfd, 1, TM_SOCKET_WRITE_TIMEOUT);
+                        if (ret == -1 && errno == EINTR) {
+                                continue;
+                        } else if (ret == -1) {
+                                ret = -errno;
+                                telem_perror("Error waiting for daemon socket");
+                                return ret;
+                        } else if (ret == 0) {
+                                telem_log(LOG_ERR, "Timed out writing to daemon socket\n");
+                                return -ETIMEDOUT;
+                        }
+                        ret = 0;
+                } else if (b == -1) {
+                        ret = -errno;
+                        telem_perror("Error writing to daemon socket");
+                        return ret;
+                } else {
+                        size_t written = (size_t)b;
+
+                        if (sent) {
+                                *sent += written;
+                        }
+                        /* Skip the buffers that were fully written */
+                        while (iovcnt > 0 && written >= iov->iov_len) {
+                                written -= iov->iov_len;
+                                iov++;
+                                iovcnt--;
+                        }
+                        if (iovcnt > 0) {
+                                iov->iov_base = (char *)iov->iov_base + written;
+                                iov->iov_len -= written;
+                        }
+                }
+        }
+
+        return ret;
+}
+
+/**
+ * Obtain a file descriptor for a unix domain socket.
+ * Connect to the socket in a non-blocking fashion.
+ *
+ * @return A valid file descriptor, or a negative errno-style value on error.
+ *
+ */
+static int tm_get_socket(void)
+{
+        int sfd = -1;
+        int ret = 0;
+        struct sockaddr_un addr;
+        long sflags = 0;
+        int res = 0;
+        struct timeval tv;
+        fd_set fdset;
+        socklen_t lon = 0;
+        int valopt = 0;
+
+        sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (sfd == -1) {
+                ret = -errno;
+                telem_perror("Attempt to allocate socket fd failed");
+                return ret;
+        }
+
+        /* Set timeout for the socket first */
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+
+        if (setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+                       sizeof(tv)) < 0) {
+                ret = -errno;
+                telem_perror("Failed to set socket timeout");
+                goto out1;
+        }
+
+        /* Construct server address, and make the connection */
+        memset(&addr, 0, sizeof(struct sockaddr_un));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path_config(),
+                sizeof(addr.sun_path) - 1);
+
+        res = connect(sfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un));
+
+        if (res < 0) {
+                // Socket still connecting. Try to select it with a 1 second.
+                // failure to select() is a sign of problems - bail out.
+                if (errno == EINPROGRESS) {
+                        do {
+                                tv.tv_sec = 1;
+                                tv.tv_usec = 0;
+                                FD_ZERO(&fdset);
+                                FD_SET(sfd, &fdset);
+                                res = select(sfd + 1, NULL, &fdset, NULL, &tv);
+
+                                if (res < 0 && errno != EINTR) {
+                                        // connection error or resume-after-interrupt
+                                        ret = -errno;
+                                        goto out1;
+                                } else if (res > 0) {
+                                        // Socket was selected for a write
+                                        lon = sizeof(int);
+                                        if (getsockopt(sfd, SOL_SOCKET, SO_ERROR,
+                                                       (void *)(&valopt), &lon) < 0) {
+                                                ret = -errno;
+                                                goto out1;
+                                        }
+                                        if (valopt) {
+                                                // errors in socket
+                                                ret = -valopt;
+                                                goto out1;
+                                        }
+                                        break;
+                                } else {
+                                        // We timed out.
+                                        ret = -ETIMEDOUT;
+                                        goto out1;
+                                }
+                        } while (1);
+                } else {
+                        ret = -errno;
+                        goto out1;
+                }
+        }
+
+        // Set non-blocking after the connect() succeeded
+        if ((sflags = fcntl(sfd, F_GETFL, NULL)) < 0) {
+                ret = -errno;
+                telem_log(LOG_ERR, "Failed to get socket flags\n");
+                goto out1;
+        }
+
+        sflags |= O_NONBLOCK;
+
+        if (fcntl(sfd, F_SETFL, sflags) < 0) {
+                ret = -errno;
                 telem_log(LOG_ERR, "Failed to set socket flags\n");
                 goto out1;
         }
 
-        return sfd;
+        return sfd;
+
+out1:
+        close(sfd);
+        return ret;
+}
+
+/**
+ * Read the acknowledgement of a record from telemprobd.
+ *
+ * @param fd Socket fd the record was sent on.
+ * @param first Whether the record is the first one sent with acknowledgement
+ *     on fd.
+ * @param ack Filled in with the acknowledgement.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int tm_read_ack(int fd, bool first, struct tm_ack *ack)
+{
+        struct record_ack wire;
+        struct pollfd pfd;
+        size_t got = 0;
+        ssize_t b;
+        int timeout = TM_SOCKET_ACK_TIMEOUT;
+        int ret;
+
+        /* Records accepted are acknowledged once synced */
+        if (durability_config() == DURABILITY_GROUP) {
+                unsigned int interval = durability_group_interval_config();
+
+                timeout = interval < INT_MAX - TM_SOCKET_ACK_TIMEOUT ?
+                          (int)interval + TM_SOCKET_ACK_TIMEOUT : INT_MAX;
+        }
+
+        while (got < sizeof(wire)) {
+                b = recv(fd, (char *)&wire + got, sizeof(wire) - got, 0);
+
+                if (b > 0) {
+                        got += (size_t)b;
+                        continue;
+                } else if ((b == 0 || errno == ECONNRESET) && first && got == 0) {
+                        /* Older daemons close the connection when asked for
+                         * acknowledgements */
+                        return -EPROTONOSUPPORT;
+                } else if (b == 0) {
+                        return -ECONNRESET;
+                } else if (errno == EINTR) {
+                        continue;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        ret = -errno;
+                        telem_perror("Error reading from daemon socket");
+                        return ret;
+                }
+
+                pfd.fd = fd;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+
+                ret = poll(&pfd, 1, timeout);
+                if (ret == -1 && errno == EINTR) {
+                        continue;
+                } else if (ret == -1) {
+                        ret = -errno;
+                        telem_perror("Error waiting for daemon socket");
+                        return ret;
+                } else if (ret == 0) {
+                        telem_log(LOG_ERR, "Timed out waiting for record acknowledgement\n");
+                        return -ETIMEDOUT;
+                }
+        }
+
+        if (wire.status > TM_ACK_RETRY_AFTER) {
+                telem_log(LOG_ERR, "Invalid record acknowledgement status %u\n",
+                          wire.status);
+                return -EPROTO;
+        }
+
+        ack->status = (enum tm_ack_status)wire.status;
+        ack->retry_after = wire.retry_after;
+
+        return 0;
+}
+
+/* Waits before a record acknowledged with TM_ACK_RETRY_AFTER is sent again */
+static void tm_wait_retry(uint32_t retry_after)
+{
+        struct timespec ts;
+
+        if (retry_after > TM_ACK_MAX_RETRY_AFTER) {
+                retry_after = TM_ACK_MAX_RETRY_AFTER;
+        }
+        ts.tv_sec = retry_after / 1000;
+        ts.tv_nsec = (long)(retry_after % 1000) * 1000000;
+
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+                continue;
+        }
+}
+
+int tm_is_opted_in(void)
+{
+        struct stat unused;
+
+        if (stat(TM_OPT_IN_FILE, &unused) == -1) {
+                return 0;
+        }
+
+        return 1;
+}
+
+/*
+ * A record is sent as:
+ * <uint32_t record_size>     : so recv knows how much to read
+ * <custom cfg file field>    : optional
+ * <uint32_t header_size>
+ * <headers + Payload>
+ * <null-byte>
+ * The additional char at the end ensures null termination
+ */
+#define TM_FRAME_IOV_MAX 4
+
+struct tm_frame {
+        uint32_t record_size;
+        struct iovec iov[TM_FRAME_IOV_MAX];
+        size_t iovcnt;
+};
+
+static char tm_frame_cfg_prefix[] = CFG_PREFIX;
+
+/**
+ * Frame a record in the wire format expected by telemprobd. The record data
+ * is already laid out as the daemon expects it, so the frame only adds the
+ * record size and config file fields in front of it. Nothing is copied; the
+ * record must stay alive and unchanged until the frame has been written.
+ *
+ * @param t_ref The record to frame.
+ * @param frame The frame to fill in.
+ *
+ */
+static void tm_frame_record(struct telem_ref *t_ref, struct tm_frame *frame)
+{
+        size_t total_size = 0;
+        size_t cfg_file_name_size = 0;
+        const char *cfg_file_name = NULL;
+        struct iovec *iov = frame->iov;
+
+        total_size = t_ref->record->size;
+
+        /*
+         * The user may want to use a custom (cmd line specified) config file.
+         * If that is the case, we need to include the absolute path in the data packet.
+         * We optionally add the string CFG:<absolute path> as the first string
+         * in the data. If the receiving end sees this in the data, it should
+         * use the config file specified to override any default telemetrics.conf
+         * files.
+         */
+
+        cfg_file_name = get_cmd_line_config_file();
+        if (cfg_file_name != NULL) {
+                cfg_file_name_size = strlen(cfg_file_name) + 1;
+                total_size += (cfg_file_name_size + CFG_PREFIX_LENGTH);
+                telem_debug("DEBUG: CFG field size : %zu\n", cfg_file_name_size + CFG_PREFIX_LENGTH);
+                telem_debug("DEBUG: CFG file name : %s\n", cfg_file_name);
+        }
+
+        telem_debug("DEBUG: Header size : %zu\n", t_ref->record->header_size);
+        telem_debug("DEBUG: Payload size : %zu\n", t_ref->record->payload_size);
+        telem_debug("DEBUG: Total size : %zu\n", total_size);
+
+        frame->record_size = (uint32_t)(sizeof(uint32_t) + total_size);
+
+        iov->iov_base = &frame->record_size;
+        iov->iov_len = sizeof(uint32_t);
+        iov++;
+
+        if (cfg_file_name != NULL) {
+                iov->iov_base = tm_frame_cfg_prefix;
+                iov->iov_len = CFG_PREFIX_LENGTH;
+                iov++;
+                iov->iov_base = (void *)cfg_file_name;
+                iov->iov_len = cfg_file_name_size;
+                iov++;
+        }
+
+        iov->iov_base = t_ref->record->data;
+        iov->iov_len = t_ref->record->size;
+        iov++;
+
+        frame->iovcnt = (size_t)(iov - frame->iov);
+}
+
+int tm_send_record(struct telem_ref *t_ref)
+{
+        int sfd;
+        struct tm_frame frame;
+        int ret = 0;
+
+        if (tm_is_opted_in() == 0) {
+                // Bail early if opt-in is not existent
+                return -ECONNREFUSED;
+        }
+
+        /* Records are synced in groups, wait until the one covering this
+         * record is done */
+        if (durability_config() == DURABILITY_GROUP) {
+                struct tm_ack ack;
+
+                ret = tm_send_record_acked(t_ref, &ack);
+                if (ret == 0 && ack.status == TM_ACK_RETRY_AFTER) {
+                        ret = -EAGAIN;
+                }
+                if (ret != -EPROTONOSUPPORT) {
+                        return ret;
+                }
+        }
+
+        sfd = tm_get_socket();
+
+        if (sfd < 0) {
+                telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                          strerror(-sfd));
+                return sfd;
+        }
+
+        tm_frame_record(t_ref, &frame);
+
+        if ((ret = tm_writev_socket(sfd, frame.iov, frame.iovcnt, NULL)) == 0) {
+                telem_log(LOG_INFO, "INFO: Successfully sent record over the socket\n");
+        } else {
+                telem_log(LOG_ERR, "Error while writing data to socket\n");
+        }
+
+        close(sfd);
+
+        return ret;
+}
+
+/**
+ * Write a record to telemprobd for acknowledgement.
+ *
+ * @param fd Socket fd obtained from tm_get_socket.
+ * @param request Whether to ask for acknowledgements first, which is needed
+ *     once per connection.
+ * @param t_ref The record to send.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int tm_write_acked(int fd, bool request, struct telem_ref *t_ref)
+{
+        uint32_t ack_request = RECORD_ACK_REQUEST;
+        struct iovec iov[TM_FRAME_IOV_MAX + 1];
+        struct tm_frame frame;
+        size_t iovcnt = 0;
+
+        tm_frame_record(t_ref, &frame);
+
+        if (request) {
+                iov[iovcnt].iov_base = &ack_request;
+                iov[iovcnt].iov_len = sizeof(ack_request);
+                iovcnt++;
+        }
+        memcpy(iov + iovcnt, frame.iov, frame.iovcnt * sizeof(struct iovec));
+        iovcnt += frame.iovcnt;
+
+        return tm_writev_socket(fd, iov, iovcnt, NULL);
+}
+
+int tm_send_record_acked(struct telem_ref *t_ref, struct tm_ack *ack)
+{
+        int sfd;
+        int ret = 0;
+
+        if (t_ref == NULL || ack == NULL) {
+                return -EINVAL;
+        }
+
+        if (tm_is_opted_in() == 0) {
+                return -ECONNREFUSED;
+        }
+
+        for (int tries = 0; ; tries++) {
+                sfd = tm_get_socket();
+                if (sfd < 0) {
+                        telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                                  strerror(-sfd));
+                        return sfd;
+                }
+
+                if ((ret = tm_write_acked(sfd, true, t_ref)) == 0) {
+                        ret = tm_read_ack(sfd, true, ack);
+                }
+                close(sfd);
+
+                if (ret < 0) {
+                        telem_log(LOG_ERR, "Error while sending record for acknowledgement: %s\n",
+                                  strerror(-ret));
+                        return ret;
+                }
+                if (ack->status != TM_ACK_RETRY_AFTER || tries == TM_ACK_RETRIES) {
+                        break;
+                }
+                tm_wait_retry(ack->retry_after);
+        }
+
+        telem_log(LOG_INFO, "INFO: Record acknowledged with status %d\n", ack->status);
+
+        return 0;
+}
+
+/**
+ * Frame several records into a single iovec array.
+ *
+ * @param refs The records to frame.
+ * @param n Number of records in refs.
+ * @param frames Array of at least n frames.
+ * @param iov Array of at least n * TM_FRAME_IOV_MAX entries.
+ *
+ * @return The number of entries used in iov.
+ *
+ */
+static size_t tm_frame_records(struct telem_ref **refs, size_t n,
+                               struct tm_frame *frames, struct iovec *iov)
+{
+        size_t iovcnt = 0;
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+                tm_frame_record(refs[i], &frames[i]);
+                memcpy(iov + iovcnt, frames[i].iov,
+                       frames[i].iovcnt * sizeof(struct iovec));
+                iovcnt += frames[i].iovcnt;
+        }
+
+        return iovcnt;
+}
+
+/**
+ * Count the records whose frame was fully written.
+ *
+ * @param frames The frames written, in order.
+ * @param n Number of frames.
+ * @param sent Number of bytes written.
+ *
+ * @return The number of complete frames.
+ *
+ */
+static size_t tm_frames_written(const struct tm_frame *frames, size_t n, size_t sent)
+{
+        size_t i, k, len;
+
+        for (i = 0; i < n; i++) {
+                for (k = 0, len = 0; k < frames[i].iovcnt; k++) {
+                        len += frames[i].iov[k].iov_len;
+                }
+                if (sent < len) {
+                        break;
+                }
+                sent -= len;
+        }
+
+        return i;
+}
+
+/**
+ * Write records over a long lived connection to telemprobd.
+ *
+ * telemprobd drops idle connections when it exits for recycling or is
+ * restarted. In that case reconnect once and resend the records whose frame
+ * was not fully written; the daemon discards any partially received record
+ * on the old socket. A connection left in the middle of a frame by any other
+ * error is closed, so the next call starts over on a new one.
+ *
+ * @param fd The connection, replaced if a reconnect was needed. A negative
+ *     value means there is no connection yet.
+ * @param refs The records to send.
+ * @param n Number of records in refs.
+ * @param frames Array of at least n frames.
+ * @param iov Array of at least n * TM_FRAME_IOV_MAX entries.
+ * @param done Set to the number of records whose frame was fully written.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int tm_write_records(int *fd, struct telem_ref **refs, size_t n,
+                            struct tm_frame *frames, struct iovec *iov, size_t *done)
+{
+        size_t iovcnt;
+        size_t sent = 0;
+        int ret;
+
+        *done = 0;
+
+        if (*fd >= 0) {
+                iovcnt = tm_frame_records(refs, n, frames, iov);
+                ret = tm_writev_socket(*fd, iov, iovcnt, &sent);
+                if (ret < 0) {
+                        *done = tm_frames_written(frames, n, sent);
+                }
+        } else {
+                ret = -ENOTCONN;
+        }
+
+        if (ret == -EPIPE || ret == -ECONNRESET || ret == -ENOTCONN) {
+                if (*fd >= 0) {
+                        close(*fd);
+                }
+                *fd = tm_get_socket();
+                if (*fd < 0) {
+                        ret = *fd;
+                        telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                                  strerror(-ret));
+                } else {
+                        iovcnt = tm_frame_records(refs + *done, n - *done, frames, iov);
+                        ret = tm_writev_socket(*fd, iov, iovcnt, &sent);
+                        if (ret < 0) {
+                                *done += tm_frames_written(frames, n - *done, sent);
+                        }
+                }
+        }
+
+        if (ret == 0) {
+                *done = n;
+        } else if (sent > 0 && *fd >= 0) {
+                /* The daemon would read the rest of the stream from the
+                 * middle of a frame */
+                close(*fd);
+                *fd = -1;
+        }
+
+        return ret;
+}
+
+/**
+ * Read the acknowledgements of records sent with a single write.
+ *
+ * @param fd Socket fd the records were sent on, asking for acknowledgements
+ *     first.
+ * @param n Number of records sent.
+ *
+ * @return 0 if all records were acknowledged, -EAGAIN if the daemon asked to
+ *     retry one of them, or a negative errno-style value if not.
+ *
+ */
+static int tm_read_acks(int fd, size_t n)
+{
+        struct tm_ack ack;
+        size_t i;
+        int ret = 0;
+
+        for (i = 0; i < n; i++) {
+                if ((ret = tm_read_ack(fd, i == 0, &ack)) < 0) {
+                        return ret;
+                }
+                if (ack.status == TM_ACK_RETRY_AFTER) {
+                        ret = -EAGAIN;
+                }
+        }
+
+        return ret;
+}
+
+int tm_send_records(struct telem_ref **refs, size_t n)
+{
+        int sfd;
+        struct tm_frame *frames = NULL;
+        struct iovec *iov = NULL;
+        uint32_t ack_request = RECORD_ACK_REQUEST;
+        bool acks = durability_config() == DURABILITY_GROUP;
+        size_t iovcnt = 0;
+        size_t i;
+        int ret = 0;
+
+        if (refs == NULL || n == 0) {
+                return -EINVAL;
+        }
+
+        for (i = 0; i < n; i++) {
+                if (refs[i] == NULL) {
+                        return -EINVAL;
+                }
+        }
+
+        if (tm_is_opted_in() == 0) {
+                return -ECONNREFUSED;
+        }
+
+        frames = calloc(n, sizeof(struct tm_frame));
+        iov = calloc(n * TM_FRAME_IOV_MAX + 1, sizeof(struct iovec));
+        if (!frames || !iov) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                ret = -ENOMEM;
+                goto out;
+        }
+
+retry:
+        /* Records are synced in groups, ask for their acknowledgements to
+         * wait until the sync covering them is done. The array is framed
+         * again for each attempt, since a write consumes it. */
+        iov[0].iov_base = &ack_request;
+        iov[0].iov_len = sizeof(ack_request);
+        iovcnt = tm_frame_records(refs, n, frames, iov + 1);
+
+        sfd = tm_get_socket();
+        if (sfd < 0) {
+                telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                          strerror(-sfd));
+                ret = sfd;
+                goto out;
+        }
+
+        if (acks) {
+                ret = tm_writev_socket(sfd, iov, iovcnt + 1, NULL);
+        } else {
+                ret = tm_writev_socket(sfd, iov + 1, iovcnt, NULL);
+        }
+        if (ret == 0 && acks) {
+                ret = tm_read_acks(sfd, n);
+        }
 
-out1:
         close(sfd);
-        return ret;
-}
 
-int tm_is_opted_in(void)
-{
-        struct stat unused;
+        if (ret == -EPROTONOSUPPORT) {
+                /* The daemon closed the connection when asked for
+                 * acknowledgements, send the records again without */
+                acks = false;
+                goto retry;
+        }
 
-        if (stat(TM_OPT_IN_FILE, &unused) == -1) {
-                return 0;
+        if (ret == 0) {
+                telem_log(LOG_INFO, "INFO: Successfully sent %zu records over the socket\n", n);
+        } else {
+                telem_log(LOG_ERR, "Error while sending records to socket: %s\n",
+                          strerror(-ret));
         }
 
-        return 1;
+out:
+        free(iov);
+        free(frames);
+
+        return ret;
 }
 
-int tm_send_record(struct telem_ref *t_ref)
+struct tm_session {
+        int fd;
+        /* whether acknowledgements were requested on fd */
+        bool acks;
+};
+
+int tm_open_session(struct tm_session **session)
 {
-        int i;
-        size_t record_size = 0;
-        size_t total_size = 0;
+        struct tm_session *s = NULL;
         int sfd;
-        char *data = NULL;
-        size_t offset = 0;
-        int ret = 0;
-        size_t cfg_file_name_size = 0;
-        const char *cfg_file_name = NULL;
+
+        if (session == NULL) {
+                return -EINVAL;
+        }
 
         if (tm_is_opted_in() == 0) {
-                // Bail early if opt-in is not existent
                 return -ECONNREFUSED;
         }
 
-        sfd = tm_get_socket();
+        s = malloc(sizeof(struct tm_session));
+        if (!s) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                return -ENOMEM;
+        }
 
+        sfd = tm_get_socket();
         if (sfd < 0) {
                 telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
                           strerror(-sfd));
+                free(s);
                 return sfd;
         }
 
-        total_size = t_ref->record->header_size + t_ref->record->payload_size;
+        s->fd = sfd;
+        s->acks = false;
+        *session = s;
 
-        /*
-         * The user may want to use a custom (cmd line specified) config file.
-         * If that is the case, we need to include the absolute path in the data packet.
-         * We optionally add the string CFG:<absolute path> as the first string
-         * in the data. If the receiving end sees this in the data, it should
-         * use the config file specified to override any default telemetrics.conf
-         * files.
-         */
+        return 0;
+}
 
-        cfg_file_name = get_cmd_line_config_file();
-        if (cfg_file_name != NULL) {
-                cfg_file_name_size = strlen(cfg_file_name) + 1;
-                total_size += (cfg_file_name_size + CFG_PREFIX_LENGTH);
+/**
+ * Write a record over a session and read its acknowledgement, reconnecting
+ * once if the daemon dropped the connection, see tm_write_records().
+ *
+ * @param session The session.
+ * @param t_ref The record to send.
+ * @param ack Filled in with the acknowledgement.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int tm_session_write_acked(struct tm_session *session, struct telem_ref *t_ref,
+                                  struct tm_ack *ack)
+{
+        bool request;
+        int ret = -ENOTCONN;
+
+        for (int tries = 0; tries < 2; tries++) {
+                if (tries > 0 || session->fd < 0) {
+                        if (session->fd >= 0) {
+                                close(session->fd);
+                        }
+                        session->acks = false;
+                        session->fd = tm_get_socket();
+                        if (session->fd < 0) {
+                                ret = session->fd;
+                                telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                                          strerror(-ret));
+                                return ret;
+                        }
+                }
+
+                request = !session->acks;
+                if ((ret = tm_write_acked(session->fd, request, t_ref)) == 0) {
+                        session->acks = true;
+                        ret = tm_read_ack(session->fd, request, ack);
+                }
+
+                if (ret != -EPIPE && ret != -ECONNRESET && ret != -ENOTCONN) {
+                        break;
+                }
         }
 
-        if (cfg_file_name != NULL) {
-                telem_debug("DEBUG: CFG field size : %zu\n", cfg_file_name_size + CFG_PREFIX_LENGTH);
-                telem_debug("DEBUG: CFG file name : %s\n", cfg_file_name);
+        if (ret < 0) {
+                /* An acknowledgement that comes late would be taken for the
+                 * one of the next record, start over on a new connection.
+                 * If the daemon closed the connection because it does not
+                 * acknowledge records, the next ones are sent without. */
+                close(session->fd);
+                session->fd = -1;
+                session->acks = false;
         }
 
-        telem_debug("DEBUG: Header size : %zu\n", t_ref->record->header_size);
-        telem_debug("DEBUG: Payload size : %zu\n", t_ref->record->payload_size);
+        return ret;
+}
 
-        telem_debug("DEBUG: Total size : %zu\n", total_size);
+int tm_session_send_acked(struct tm_session *session, struct telem_ref *t_ref,
+                          struct tm_ack *ack)
+{
+        int ret = 0;
 
-        /*
-         * Allocating buffer for what we intend to send.  Buffer layout is:
-         * <uint32_t record_size>     : so recv knows how much to read
-         * <custom cfg file field>    : optional
-         * <uint32_t header_size>
-         * <headers + Payload>
-         * <null-byte>
-         * The additional char at the end ensures null termination
-         */
-        record_size = (2 * sizeof(uint32_t)) + total_size + 1;
+        if (session == NULL || t_ref == NULL || ack == NULL) {
+                return -EINVAL;
+        }
+
+        for (int tries = 0; ; tries++) {
+                if ((ret = tm_session_write_acked(session, t_ref, ack)) < 0) {
+                        telem_log(LOG_ERR, "Error while sending record for acknowledgement: %s\n",
+                                  strerror(-ret));
+                        return ret;
+                }
+                if (ack->status != TM_ACK_RETRY_AFTER || tries == TM_ACK_RETRIES) {
+                        break;
+                }
+                tm_wait_retry(ack->retry_after);
+        }
+
+        return 0;
+}
+
+int tm_session_send(struct tm_session *session, struct telem_ref *t_ref)
+{
+        struct tm_frame frame;
+        struct iovec iov[TM_FRAME_IOV_MAX];
+        struct tm_ack ack;
+        size_t done;
+        int ret = 0;
+
+        if (session == NULL || t_ref == NULL) {
+                return -EINVAL;
+        }
+
+        /* The daemon acknowledges every record once asked to */
+        if (session->acks) {
+                return tm_session_send_acked(session, t_ref, &ack);
+        }
+
+        if ((ret = tm_write_records(&session->fd, &t_ref, 1, &frame, iov, &done)) == 0) {
+                telem_log(LOG_INFO, "INFO: Successfully sent record over the session\n");
+        } else {
+                telem_log(LOG_ERR, "Error while writing data to session\n");
+        }
+
+        return ret;
+}
+
+void tm_close_session(struct tm_session *session)
+{
+        if (session == NULL) {
+                return;
+        }
+
+        if (session->fd >= 0) {
+                close(session->fd);
+        }
+
+        free(session);
+}
+
+/*
+ * Asynchronous sender
+ *
+ * Records are handed to a library owned thread through a bounded lock-free
+ * multi-producer queue (a ring of cells with per-cell sequence numbers). The
+ * thread drains the queue in batches and writes them to telemprobd over a
+ * long lived connection, so the caller only pays for the enqueue.
+ */
+
+#define TM_ASYNC_DEFAULT_QUEUE_SIZE 1024
+#define TM_ASYNC_BATCH 64
+#define TM_CACHELINE 64
+
+struct tm_async_cell {
+        size_t seq;
+        struct telem_ref *ref;
+};
+
+struct tm_async {
+        /* written by producers */
+        size_t enqueue_pos __attribute__((aligned(TM_CACHELINE)));
+        /* written by the sender thread, and by producers dropping the oldest */
+        size_t dequeue_pos __attribute__((aligned(TM_CACHELINE)));
+        struct tm_async_cell *cells __attribute__((aligned(TM_CACHELINE)));
+        size_t mask;
+        enum tm_async_overflow policy;
+        /* sender thread is about to sleep on wake_fd */
+        int sleeping;
+        int stopping;
+        int wake_fd;
+        int event_fd;
+        int sock_fd;
+        pthread_t thread;
+        /* producers waiting for room with TM_ASYNC_BLOCK */
+        int blocked;
+        pthread_mutex_t lock;
+        pthread_cond_t room;
+        struct tm_async_stats stats;
+        struct telem_ref *batch[TM_ASYNC_BATCH];
+        struct tm_frame frames[TM_ASYNC_BATCH];
+        struct iovec iov[TM_ASYNC_BATCH * TM_FRAME_IOV_MAX];
+};
+
+static struct tm_async *tm_async = NULL;
+
+static bool tm_async_enqueue(struct tm_async *a, struct telem_ref *ref)
+{
+        struct tm_async_cell *cell;
+        size_t pos, seq;
+        intptr_t dif;
+
+        pos = __atomic_load_n(&a->enqueue_pos, __ATOMIC_RELAXED);
+        for (;;) {
+                cell = &a->cells[pos & a->mask];
+                seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+                dif = (intptr_t)seq - (intptr_t)pos;
+                if (dif == 0) {
+                        if (__atomic_compare_exchange_n(&a->enqueue_pos, &pos, pos + 1,
+                                                        true, __ATOMIC_RELAXED,
+                                                        __ATOMIC_RELAXED)) {
+                                break;
+                        }
+                } else if (dif < 0) {
+                        /* full */
+                        return false;
+                } else {
+                        pos = __atomic_load_n(&a->enqueue_pos, __ATOMIC_RELAXED);
+                }
+        }
+
+        cell->ref = ref;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+        return true;
+}
+
+static struct telem_ref *tm_async_dequeue(struct tm_async *a)
+{
+        struct tm_async_cell *cell;
+        struct telem_ref *ref;
+        size_t pos, seq;
+        intptr_t dif;
+
+        pos = __atomic_load_n(&a->dequeue_pos, __ATOMIC_RELAXED);
+        for (;;) {
+                cell = &a->cells[pos & a->mask];
+                seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+                dif = (intptr_t)seq - (intptr_t)(pos + 1);
+                if (dif == 0) {
+                        if (__atomic_compare_exchange_n(&a->dequeue_pos, &pos, pos + 1,
+                                                        true, __ATOMIC_RELAXED,
+                                                        __ATOMIC_RELAXED)) {
+                                break;
+                        }
+                } else if (dif < 0) {
+                        /* empty */
+                        return NULL;
+                } else {
+                        pos = __atomic_load_n(&a->dequeue_pos, __ATOMIC_RELAXED);
+                }
+        }
+
+        ref = cell->ref;
+        __atomic_store_n(&cell->seq, pos + a->mask + 1, __ATOMIC_RELEASE);
+
+        return ref;
+}
+
+static void tm_async_notify(int fd)
+{
+        uint64_t one = 1;
+
+        if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                telem_perror("Failed to write to eventfd");
+        }
+}
+
+static void tm_async_drop(struct tm_async *a, struct telem_ref *ref)
+{
+        tm_free_record(ref);
+        __atomic_add_fetch(&a->stats.dropped, 1, __ATOMIC_RELAXED);
+        tm_async_notify(a->event_fd);
+}
+
+static void tm_async_wake_sender(struct tm_async *a)
+{
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&a->sleeping, 0, __ATOMIC_SEQ_CST)) {
+                tm_async_notify(a->wake_fd);
+        }
+}
+
+static void tm_async_wake_producers(struct tm_async *a)
+{
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&a->blocked, __ATOMIC_SEQ_CST) > 0) {
+                pthread_mutex_lock(&a->lock);
+                pthread_cond_broadcast(&a->room);
+                pthread_mutex_unlock(&a->lock);
+        }
+}
+
+static void *tm_async_sender(void *arg)
+{
+        struct tm_async *a = arg;
+        struct pollfd pfd;
+        uint64_t val;
+        size_t n, i, done;
+        int ret;
+
+        pfd.fd = a->wake_fd;
+        pfd.events = POLLIN;
+
+        for (;;) {
+                n = 0;
+                while (n < TM_ASYNC_BATCH &&
+                       (a->batch[n] = tm_async_dequeue(a)) != NULL) {
+                        n++;
+                }
+
+                if (n == 0) {
+                        if (__atomic_load_n(&a->stopping, __ATOMIC_ACQUIRE)) {
+                                break;
+                        }
+
+                        /* Announce that we are going to sleep, then look at
+                         * the queue once more so a record enqueued meanwhile
+                         * is not left behind */
+                        __atomic_store_n(&a->sleeping, 1, __ATOMIC_SEQ_CST);
+                        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                        if ((a->batch[0] = tm_async_dequeue(a)) == NULL &&
+                            !__atomic_load_n(&a->stopping, __ATOMIC_ACQUIRE)) {
+                                pfd.revents = 0;
+                                if (poll(&pfd, 1, -1) > 0 &&
+                                    read(a->wake_fd, &val, sizeof(val)) < 0 &&
+                                    errno != EAGAIN) {
+                                        telem_perror("Failed to read from eventfd");
+                                }
+                        }
+                        __atomic_store_n(&a->sleeping, 0, __ATOMIC_SEQ_CST);
+                        if (a->batch[0] == NULL) {
+                                continue;
+                        }
+                        n = 1;
+                }
+
+                tm_async_wake_producers(a);
+
+                ret = tm_write_records(&a->sock_fd, a->batch, n, a->frames, a->iov,
+                                       &done);
+                __atomic_add_fetch(&a->stats.sent, done, __ATOMIC_RELAXED);
+                if (ret < 0) {
+                        telem_log(LOG_ERR, "Failed to send %zu queued records: %s\n",
+                                  n - done, strerror(-ret));
+                        __atomic_add_fetch(&a->stats.failed, n - done, __ATOMIC_RELAXED);
+                }
+
+                for (i = 0; i < n; i++) {
+                        tm_free_record(a->batch[i]);
+                }
+                tm_async_notify(a->event_fd);
+        }
+
+        return NULL;
+}
+
+static void tm_async_free(struct tm_async *a)
+{
+        if (a->wake_fd >= 0) {
+                close(a->wake_fd);
+        }
+        if (a->event_fd >= 0) {
+                close(a->event_fd);
+        }
+        if (a->sock_fd >= 0) {
+                close(a->sock_fd);
+        }
+        pthread_mutex_destroy(&a->lock);
+        pthread_cond_destroy(&a->room);
+        free(a->cells);
+        free(a);
+}
+
+int tm_async_start(size_t queue_size, enum tm_async_overflow policy)
+{
+        struct tm_async *a = NULL;
+        sigset_t all, old;
+        size_t capacity = 2;
+        size_t i;
+        int ret;
+
+        if (tm_async) {
+                return -EALREADY;
+        }
 
-        data = (char *)calloc(sizeof(char), record_size);
-        if (!data) {
+        if (policy != TM_ASYNC_DROP_NEWEST && policy != TM_ASYNC_DROP_OLDEST &&
+            policy != TM_ASYNC_BLOCK) {
+                return -EINVAL;
+        }
+
+        if (tm_is_opted_in() == 0) {
+                return -ECONNREFUSED;
+        }
+
+        if (queue_size == 0) {
+                queue_size = TM_ASYNC_DEFAULT_QUEUE_SIZE;
+        }
+        while (capacity < queue_size) {
+                capacity <<= 1;
+        }
+
+        if (posix_memalign((void **)&a, TM_CACHELINE, sizeof(struct tm_async))) {
                 telem_log(LOG_CRIT, "CRIT: Out of memory\n");
-                close(sfd);
                 return -ENOMEM;
         }
+        memset(a, 0, sizeof(struct tm_async));
+        a->wake_fd = a->event_fd = a->sock_fd = -1;
+        a->mask = capacity - 1;
+        a->policy = policy;
+        pthread_mutex_init(&a->lock, NULL);
+        pthread_cond_init(&a->room, NULL);
 
-        memcpy(data, &record_size, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+        a->cells = calloc(capacity, sizeof(struct tm_async_cell));
+        if (!a->cells) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                ret = -ENOMEM;
+                goto fail;
+        }
+        for (i = 0; i < capacity; i++) {
+                a->cells[i].seq = i;
+        }
 
-        if (cfg_file_name != NULL) {
-                memcpy(data + offset, CFG_PREFIX, CFG_PREFIX_LENGTH);
-                offset += CFG_PREFIX_LENGTH;
-                memcpy(data + offset, cfg_file_name, cfg_file_name_size);
-                offset += cfg_file_name_size;
+        a->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        a->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (a->wake_fd < 0 || a->event_fd < 0) {
+                ret = -errno;
+                telem_perror("Failed to create eventfd");
+                goto fail;
         }
 
-        memcpy(data + offset, &t_ref->record->header_size, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+        /* A failure to connect is not fatal, the sender thread connects on
+         * its first batch */
+        a->sock_fd = tm_get_socket();
 
-        size_t len = 0;
-        for (i = 0; i < NUM_HEADERS; i++) {
-                len = strlen(t_ref->record->headers[i]);
-                memcpy(data + offset, t_ref->record->headers[i], len);
-                offset += len;
+        /* Keep the application's signals away from the sender thread */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        ret = -pthread_create(&a->thread, NULL, tm_async_sender, a);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Failed to create sender thread: %s\n",
+                          strerror(-ret));
+                goto fail;
         }
 
-        memcpy(data + offset, t_ref->record->payload, t_ref->record->payload_size);
+        tm_async = a;
 
-        telem_debug("DEBUG: Data to be sent :\n\n%s\n", data + 2 * sizeof(uint32_t));
-        if ((ret = tm_write_socket(sfd, data, record_size)) == 0) {
-                telem_log(LOG_INFO, "INFO: Successfully sent record over the socket\n");
-        } else {
-                telem_log(LOG_ERR, "Error while writing data to socket\n");
+        return 0;
+fail:
+        tm_async_free(a);
+        return ret;
+}
+
+int tm_async_send(struct telem_ref *t_ref)
+{
+        struct tm_async *a = tm_async;
+        struct telem_ref *oldest;
+        int ret = 0;
+
+        if (a == NULL || t_ref == NULL) {
+                return -EINVAL;
         }
 
-        close(sfd);
-        free(data);
+        __atomic_add_fetch(&a->stats.queued, 1, __ATOMIC_RELAXED);
+
+        while (!tm_async_enqueue(a, t_ref)) {
+                if (a->policy == TM_ASYNC_DROP_NEWEST) {
+                        tm_async_drop(a, t_ref);
+                        return -ENOBUFS;
+                } else if (a->policy == TM_ASYNC_DROP_OLDEST) {
+                        if ((oldest = tm_async_dequeue(a)) != NULL) {
+                                tm_async_drop(a, oldest);
+                        }
+                } else {
+                        pthread_mutex_lock(&a->lock);
+                        __atomic_add_fetch(&a->blocked, 1, __ATOMIC_SEQ_CST);
+                        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                        while (!(ret = tm_async_enqueue(a, t_ref)) &&
+                               !__atomic_load_n(&a->stopping, __ATOMIC_ACQUIRE)) {
+                                pthread_cond_wait(&a->room, &a->lock);
+                        }
+                        __atomic_sub_fetch(&a->blocked, 1, __ATOMIC_SEQ_CST);
+                        pthread_mutex_unlock(&a->lock);
+                        if (!ret) {
+                                tm_async_drop(a, t_ref);
+                                return -ECANCELED;
+                        }
+                        ret = 0;
+                        break;
+                }
+        }
+
+        tm_async_wake_sender(a);
 
         return ret;
 }
 
-void tm_free_record(struct telem_ref *t_ref)
+int tm_async_eventfd(void)
 {
+        if (tm_async == NULL) {
+                return -EINVAL;
+        }
 
-        int k;
+        return tm_async->event_fd;
+}
 
-        if (t_ref == NULL) {
-                return;
+int tm_async_get_stats(struct tm_async_stats *stats)
+{
+        if (tm_async == NULL || stats == NULL) {
+                return -EINVAL;
         }
 
-        if (t_ref->record == NULL) {
-                return;
+        stats->queued = __atomic_load_n(&tm_async->stats.queued, __ATOMIC_RELAXED);
+        stats->sent = __atomic_load_n(&tm_async->stats.sent, __ATOMIC_RELAXED);
+        stats->dropped = __atomic_load_n(&tm_async->stats.dropped, __ATOMIC_RELAXED);
+        stats->failed = __atomic_load_n(&tm_async->stats.failed, __ATOMIC_RELAXED);
+
+        return 0;
+}
+
+int tm_async_stop(void)
+{
+        struct tm_async *a = tm_async;
+        struct telem_ref *oldest;
+
+        if (a == NULL) {
+                return -EINVAL;
         }
 
-        for (k = 0; k < NUM_HEADERS; k++) {
-                free(t_ref->record->headers[k]);
+        /* The sender thread flushes the queue before it exits */
+        __atomic_store_n(&a->stopping, 1, __ATOMIC_RELEASE);
+        tm_async_notify(a->wake_fd);
+        pthread_mutex_lock(&a->lock);
+        pthread_cond_broadcast(&a->room);
+        pthread_mutex_unlock(&a->lock);
+        pthread_join(a->thread, NULL);
+
+        /* Records from producers that raced with the shutdown */
+        while ((oldest = tm_async_dequeue(a)) != NULL) {
+                tm_async_drop(a, oldest);
+        }
+
+        tm_async = NULL;
+        tm_async_free(a);
+
+        return 0;
+}
+
+void tm_free_record(struct telem_ref *t_ref)
+{
+        if (t_ref == NULL) {
+                return;
         }
 
-        if (t_ref->record->payload) {
-                free(t_ref->record->payload);
+        if (t_ref->record == NULL) {
+                return;
         }
 
-        free(t_ref->record);
+        tm_record_release(t_ref->record);
         free(t_ref);
 }
 
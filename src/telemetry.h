@@ -42,12 +42,20 @@
  *
  * API documentation is included in @link telemetry.h @endlink.
  *
+ * @section thread_safety Thread safety
+ *
+ * All functions may be called from several threads at once, with two
+ * exceptions: tm_set_config_file() should be called before other threads
+ * use the library, and a given telem_ref or tm_template must not be used by
+ * two threads at the same time. Record creation uses per-thread caches and takes no locks.
+ *
  * @copyright Copyright 2015 Intel Corporation, under terms of the GNU Lesser
  * General Public License 2.1, or (at your option) any later version.
  */
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -55,6 +63,61 @@ struct telem_ref {
         struct telem_record *record;
 };
 
+struct tm_session;
+
+struct tm_template;
+
+/**
+ * What tm_async_send() does when the queue is full
+ */
+enum tm_async_overflow {
+        /** Discard the record being queued */
+        TM_ASYNC_DROP_NEWEST = 0,
+        /** Discard the oldest queued record to make room */
+        TM_ASYNC_DROP_OLDEST,
+        /** Wait until the sender thread makes room */
+        TM_ASYNC_BLOCK
+};
+
+/**
+ * Counters for the asynchronous sender
+ */
+struct tm_async_stats {
+        /** Records handed to tm_async_send() */
+        uint64_t queued;
+        /** Records written to the daemon */
+        uint64_t sent;
+        /** Records discarded by the overflow policy */
+        uint64_t dropped;
+        /** Records that could not be written to the daemon */
+        uint64_t failed;
+};
+
+/**
+ * What the daemon did with a record sent with acknowledgement
+ */
+enum tm_ack_status {
+        /** The record was staged for delivery */
+        TM_ACK_ACCEPTED = 0,
+        /** The record is malformed and was dropped */
+        TM_ACK_REJECTED,
+        /** The sender is over its quota and the record was dropped */
+        TM_ACK_THROTTLED,
+        /** The spool has no room left and the record was dropped */
+        TM_ACK_SPOOL_FULL,
+        /** The record could not be staged for now and was dropped */
+        TM_ACK_RETRY_AFTER
+};
+
+/**
+ * Acknowledgement of a record by the daemon
+ */
+struct tm_ack {
+        enum tm_ack_status status;
+        /** Milliseconds to wait before sending the next record, or 0 */
+        uint32_t retry_after;
+};
+
 /**
  * Set the configuration file name to use
  *
@@ -83,11 +146,57 @@ int tm_set_config_file(const char *c_file);
  *     now is 1, which indicates that the payload is a freely-formatted
  *     (unstructured) string. Values greater than 1 are reserved for future use.
  *
- * @return 0 on success, or a negative errno-style value on error
+ * @return 0 on success, -EAGAIN if the record was dropped by a rate limit or
+ *     sampled out (see the record_rate_limits and record_sampling sections of
+ *     telemetrics.conf), or another negative errno-style value on error
  */
 int tm_create_record(struct telem_ref **t_ref, uint32_t severity,
                      char *classification, uint32_t payload_version);
 
+/**
+ * Prepare a template for records that share a classification
+ *
+ * The headers of a record are serialized once into the template. Records
+ * created from it with tm_record_from_template() only get a new timestamp
+ * and event_id, which is much cheaper than tm_create_record(). A template
+ * must not be used by two threads at the same time.
+ *
+ * @param tmpl A pointer to a tm_template struct pointer declared by the
+ *     caller. The template is initialized if the function returns success.
+ * @param severity Severity field value, as for tm_create_record().
+ * @param classification Classification field value, as for
+ *     tm_create_record().
+ * @param payload_version Payload format version, as for tm_create_record().
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_prepare_record(struct tm_template **tmpl, uint32_t severity,
+                      char *classification, uint32_t payload_version);
+
+/**
+ * Create a new telemetrics record from a template
+ *
+ * The record is equivalent to one returned by tm_create_record() with the
+ * template's parameters, and is freed with tm_free_record().
+ *
+ * @param tmpl The template returned by tm_prepare_record()
+ * @param t_ref A pointer to a telem_ref struct pointer declared by the caller.
+ *     The struct is initialized if the function returns success.
+ *
+ * @return 0 on success, -EAGAIN if the record was dropped by a rate limit or
+ *     sampled out, or another negative errno-style value on error
+ */
+int tm_record_from_template(struct tm_template *tmpl, struct telem_ref **t_ref);
+
+/**
+ * Release a template
+ *
+ * Records created from the template are not affected.
+ *
+ * @param tmpl The template returned by tm_prepare_record()
+ */
+void tm_free_template(struct tm_template *tmpl);
+
 /**
  * Sets the event_id to a user defined id
  *
@@ -114,12 +223,160 @@ int tm_set_payload(struct telem_ref *t_ref, char *payload);
 /**
  * Send a record to the telemetrics daemon for delivery
  *
+ * With group durability in telemetrics.conf, this waits until the daemon
+ * acknowledges the record, once the sync covering it is done.
+ *
  * @param t_ref The handle returned by tm_create_record()
  *
- * @return 0 on success, or a negative errno-style value on error
+ * @return 0 on success, -EAGAIN if the daemon could not sync the record, or
+ *     another negative errno-style value on error
  */
 int tm_send_record(struct telem_ref *t_ref);
 
+/**
+ * Send several records to the telemetrics daemon at once
+ *
+ * All records are sent over a single connection with one vectored write,
+ * which is cheaper than calling tm_send_record() for each of them. Like
+ * tm_send_record(), this waits for the sync covering the records with group
+ * durability.
+ *
+ * @param refs An array of handles returned by tm_create_record()
+ * @param n The number of handles in refs
+ *
+ * @return 0 on success, -EAGAIN if the daemon could not sync one of the
+ *     records, or another negative errno-style value on error
+ */
+int tm_send_records(struct telem_ref **refs, size_t n);
+
+/**
+ * Send a record to the telemetrics daemon and wait for its acknowledgement
+ *
+ * Unlike tm_send_record(), which succeeds once the record is written to the
+ * daemon socket, this reports what the daemon did with the record. A record
+ * acknowledged with TM_ACK_RETRY_AFTER is sent again after the delay asked
+ * for by the daemon, a few times at most, before the status is returned.
+ *
+ * @param t_ref The handle returned by tm_create_record()
+ * @param ack Filled in with the acknowledgement of the record
+ *
+ * @return 0 when the record was acknowledged, whatever its status,
+ *     -EPROTONOSUPPORT if the daemon does not acknowledge records, or another
+ *     negative errno-style value on error
+ */
+int tm_send_record_acked(struct telem_ref *t_ref, struct tm_ack *ack);
+
+/**
+ * Open a session with the telemetrics daemon
+ *
+ * A session keeps a single connection to the daemon open so that many
+ * records can be sent without connecting for each of them.
+ *
+ * @param session A pointer to a tm_session struct pointer declared by the
+ *     caller. The session is initialized if the function returns success.
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_open_session(struct tm_session **session);
+
+/**
+ * Send a record over an open session
+ *
+ * If the daemon has closed the connection, the session reconnects once and
+ * sends the record again.
+ *
+ * @param session The session returned by tm_open_session()
+ * @param t_ref The handle returned by tm_create_record()
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_session_send(struct tm_session *session, struct telem_ref *t_ref);
+
+/**
+ * Send a record over an open session and wait for its acknowledgement
+ *
+ * See tm_send_record_acked(). Once a record has been sent with
+ * acknowledgement, tm_session_send() also waits for the acknowledgement of
+ * each record on the session, and discards it.
+ *
+ * @param session The session returned by tm_open_session()
+ * @param t_ref The handle returned by tm_create_record()
+ * @param ack Filled in with the acknowledgement of the record
+ *
+ * @return 0 when the record was acknowledged, whatever its status,
+ *     -EPROTONOSUPPORT if the daemon does not acknowledge records, or another
+ *     negative errno-style value on error
+ */
+int tm_session_send_acked(struct tm_session *session, struct telem_ref *t_ref,
+                          struct tm_ack *ack);
+
+/**
+ * Close a session and release its resources
+ *
+ * @param session The session returned by tm_open_session()
+ */
+void tm_close_session(struct tm_session *session);
+
+/**
+ * Start the asynchronous sender
+ *
+ * Records passed to tm_async_send() are queued and written to the daemon in
+ * batches by a thread owned by the library, so the caller never waits on the
+ * daemon unless the TM_ASYNC_BLOCK policy is used and the queue is full.
+ *
+ * @param queue_size Number of records the queue can hold, rounded up to a
+ *     power of two. Zero selects the default of 1024.
+ * @param policy What to do when the queue is full.
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_async_start(size_t queue_size, enum tm_async_overflow policy);
+
+/**
+ * Queue a record for the asynchronous sender
+ *
+ * The library takes ownership of the record and frees it once it has been
+ * sent or dropped; the caller must not use t_ref afterwards, even on error.
+ * Must not be called concurrently with tm_async_stop().
+ *
+ * @param t_ref The handle returned by tm_create_record()
+ *
+ * @return 0 when queued, -ENOBUFS when dropped by TM_ASYNC_DROP_NEWEST, or
+ *     another negative errno-style value on error
+ */
+int tm_async_send(struct telem_ref *t_ref);
+
+/**
+ * Get the asynchronous sender notification file descriptor
+ *
+ * The eventfd becomes readable whenever queued records have been sent,
+ * failed or dropped. Read it to reset it and call tm_async_get_stats() to
+ * find out what happened. The descriptor is owned by the library and closed
+ * by tm_async_stop().
+ *
+ * @return The file descriptor, or a negative errno-style value on error
+ */
+int tm_async_eventfd(void);
+
+/**
+ * Get the asynchronous sender counters
+ *
+ * @param stats Filled in with the counters since tm_async_start().
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_async_get_stats(struct tm_async_stats *stats);
+
+/**
+ * Stop the asynchronous sender
+ *
+ * Sends every queued record, then stops the sender thread and releases its
+ * resources.
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_async_stop(void);
+
 /**
  * Checks if telemetry was opted in
  *
@@ -127,6 +384,18 @@ int tm_send_record(struct telem_ref *t_ref);
  */
 int tm_is_opted_in(void);
 
+/**
+ * Refresh the host information used to fill in record headers
+ *
+ * The architecture, host type, build, kernel version, system name, board
+ * name, cpu model and bios version headers are collected once per process
+ * and reused for every record. They are reloaded automatically when their
+ * source files change; this function forces an immediate reload.
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_refresh_host_info(void);
+
 /**
  * Release the memory allocated to a telemetrics record.
  *
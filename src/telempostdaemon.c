@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <signal.h>
 #include <dirent.h>
@@ -25,16 +26,27 @@
 #include <stdbool.h>
 #include <sys/stat.h>
 #include <curl/curl.h>
-#include <json-c/json.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
 
 #include "log.h"
 #include "util.h"
 #include "spool.h"
+#include "uploader.h"
 #include "iorecord.h"
+#include "segment.h"
+#include "handoff.h"
 #include "retention.h"
+#include "jsonenc.h"
 #include "telempostdaemon.h"
 
+/* Posts the records delivered as they arrive and the records sent from the
+ * spool */
+static struct uploader uploader;
+
+/* Records are encoded in this buffer before they are posted */
+static struct json_buffer json_message;
+
 /* spool window check */
 static bool inside_direct_spool_window(TelemPostDaemon *daemon, time_t current_time)
 {
@@ -159,6 +171,37 @@ static void initialize_signals(TelemPostDaemon *daemon)
         set_pollfd(daemon, sigfd, signlfd, POLLIN);
 }
 
+static void initialize_handoff(TelemPostDaemon *daemon)
+{
+        int fd;
+
+        daemon->pollfds[handofflfd].fd = -1;
+        daemon->pollfds[handoffcfd].fd = -1;
+        daemon->handoff_frame = NULL;
+        daemon->handoff_copy = NULL;
+        daemon->handed_off = 0;
+
+        if (!direct_handoff_enabled_config()) {
+                return;
+        }
+
+        /* Records keep arriving through the spool if this fails */
+        fd = handoff_listen(handoff_socket_path_config());
+        if (fd < 0) {
+                telem_log(LOG_ERR, "Unable to listen on handoff socket %s: %s\n",
+                          handoff_socket_path_config(), strerror(-fd));
+                return;
+        }
+
+        daemon->handoff_frame = malloc(HANDOFF_MAX_FRAME);
+        daemon->handoff_copy = malloc(HANDOFF_MAX_FRAME);
+        if (!daemon->handoff_frame || !daemon->handoff_copy) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        set_pollfd(daemon, fd, handofflfd, POLLIN);
+}
+
 static void initialize_rate_limit(TelemPostDaemon *daemon)
 {
         for (int i = 0; i < TM_RATE_LIMIT_SLOTS; i++) {
@@ -175,8 +218,20 @@ static void initialize_rate_limit(TelemPostDaemon *daemon)
 
 static void initialize_record_delivery(TelemPostDaemon *daemon)
 {
+        enum durability_mode mode = durability_config();
+        unsigned int group_records = durability_group_records_config();
+        unsigned int group_interval = durability_group_interval_config();
+
         daemon->record_retention_enabled = record_retention_enabled_config();
         daemon->record_server_delivery_enabled = record_server_delivery_enabled_config();
+
+        if (daemon->record_journal != NULL) {
+                sync_policy_init(&daemon->record_journal->sync, mode, group_records,
+                                 group_interval);
+        }
+        sync_policy_init(&daemon->retention_sync, mode, group_records, group_interval);
+        daemon->retention_nfds = 0;
+        daemon->retention_dirfd = -1;
 }
 
 void initialize_post_daemon(TelemPostDaemon *daemon)
@@ -191,10 +246,20 @@ void initialize_post_daemon(TelemPostDaemon *daemon)
                 telem_perror("Error initializing inotify");
                 exit(EXIT_FAILURE);
         }
-        daemon->wd = inotify_add_watch(daemon->fd, spool_dir_config(), IN_CLOSE_WRITE);
+        /* Single-record files are complete once closed, segments once sealed */
+        daemon->wd = inotify_add_watch(daemon->fd, spool_dir_config(),
+                                       IN_CLOSE_WRITE | IN_MOVED_TO);
 
         initialize_signals(daemon);
         set_pollfd(daemon, daemon->fd, watchfd, POLLIN);
+        if (uploader_init(&uploader, max_concurrent_posts_config()) < 0) {
+                telem_perror("Error initializing uploader");
+                exit(EXIT_FAILURE);
+        }
+        uploader_set_batch(&uploader, batch_format_config(), batch_max_records_config(),
+                           batch_max_size_config());
+        set_pollfd(daemon, uploader.epfd, uploadfd, POLLIN);
+        initialize_handoff(daemon);
 
         initialize_rate_limit(daemon);
         initialize_record_delivery(daemon);
@@ -205,57 +270,37 @@ void initialize_post_daemon(TelemPostDaemon *daemon)
         daemon->current_spool_size = 0;
 }
 
-size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
-{
-        telem_log(LOG_DEBUG, "Received data:\n%s\n", ptr);
-        return size * nmemb;
-}
-
-char *create_json_message(char *tm_headers[], char *tm_payload)
+char *create_json_message(char *const tm_headers[], const char *tm_payload)
 {
-        /*
-         * Embed the telemetry record headers and the telemetry payload into a
-         * JSON object string.
-         */
-        char *json_string = NULL;
-        json_object *root = json_object_new_object();
-
-        /* Add the telemetry record headers */
+        char *json_string;
 
-        for (int i = 0; i < NUM_HEADERS; i++) {
-                /* ex: arch: x86_64 */
-
-                /* Split the header field into name/value */
-                strtok(tm_headers[i], ":");
-                json_object *value = json_object_new_string(strtok(NULL, " "));
-                json_object_object_add(root, tm_headers[i], value);
+        /* Encoded in a buffer reused by every record, and copied for the
+         * uploader that owns the body */
+        if (json_encode_record(&json_message, tm_headers, tm_payload) < 0) {
+                return NULL;
+        }
+        json_string = malloc(json_message.len + 1);
+        if (json_string) {
+                memcpy(json_string, json_message.data, json_message.len + 1);
         }
-        json_object *payload = json_object_new_string(tm_payload);
-        json_object_object_add(root, "payload", payload);
-
-        /* Keep our own copy of the json string */
-        json_string = strdup(json_object_to_json_string_ext(root,
-                                                            JSON_C_TO_STRING_PLAIN |
-                                                            JSON_C_TO_STRING_NOSLASHESCAPE));
-
-        /* Free the memory associated with the JSON objects */
-        json_object_put(root);
 
         return json_string;
 }
 
-bool post_record_http(char *headers[], char *body, char *cfg)
+void post_record_http(char *headers[], char *body, char *cfg,
+                      upload_done_fn done, void *data)
 {
-        CURL *curl;
-        int res = 0;
-        char *content = "Content-Type: application/json";
-        struct curl_slist *custom_headers = NULL;
-        char errorbuf[CURL_ERROR_SIZE];
+        int ret;
         char *json_body = NULL;
-        long http_response = 0;
-        const char *cert_file = get_cainfo_config();
-        const char *tid_header = get_tidheader_config();
         const char *saved_config_file = NULL;
+        struct backend_config backend;
+
+        // The completions of other records run with the configuration
+        // restored, wait for them before it is overridden
+        if (uploader_wait(&uploader, uploader.max_in_flight - 1) < 0) {
+                done(false, data);
+                return;
+        }
 
         if (cfg != NULL) {
                 saved_config_file = get_config_file();
@@ -265,8 +310,8 @@ bool post_record_http(char *headers[], char *body, char *cfg)
                        // record out. We don't want to send the record out with different
                        // settings than explicitly requested.
                        // However, report success so the record gets deleted.
-                       res = 0;
-                       goto done;
+                       done(true, data);
+                       return;
                 }
                 reload_config();
                 telem_debug("DEBUG: override server_addr:%s\n", server_addr_config());
@@ -275,107 +320,101 @@ bool post_record_http(char *headers[], char *body, char *cfg)
         // Generate the JSON message body
         json_body = create_json_message(headers, body);
 
-        // Initialize the libcurl global environment once per POST. This lets us
-        // clean up the environment after each POST so that when the daemon is
-        // sitting idle, it will be consuming as little memory as possible.
-        curl_global_init(CURL_GLOBAL_ALL);
+        // Records to the same backend reuse its connections and TLS session
+        // until the daemon is idle for connection_idle_time
+        ret = -ENOMEM;
+        if (json_body) {
+                backend.url = server_addr_config();
+                backend.cainfo = get_cainfo_config();
+                backend.tidheader = get_tidheader_config();
+                backend.compression = compression_config();
+                backend.compression_level = compression_level_config();
+                backend.dictionary = compression_dictionary_config();
+
+                telem_log(LOG_DEBUG, "Starting curl operation...\n");
+                ret = uploader_submit(&uploader, &backend, json_body, done, data);
+        }
 
-        curl = curl_easy_init();
-        if (!curl) {
-                telem_log(LOG_ERR, "curl_easy_init(): Unable to start libcurl"
-                          " easy session, exiting\n");
-                exit(EXIT_FAILURE);
-                /* TODO: check if memory needs to be released */
-        }
-
-        custom_headers = curl_slist_append(custom_headers, tid_header);
-        // This should be set by probes/libtelemetry in the future
-        custom_headers = curl_slist_append(custom_headers, content);
-
-        // Errors for any curl_easy_* functions will store nice error messages
-        // in errorbuf, so send log messages with errorbuf contents
-        if (curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorbuf) != CURLE_OK ||
-            curl_easy_setopt(curl, CURLOPT_URL, server_addr_config()) != CURLE_OK ||
-            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L) != CURLE_OK ||
-            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L) != CURLE_OK ||
-            curl_easy_setopt(curl, CURLOPT_POST, 1) != CURLE_OK ||
-#ifdef DEBUG
-            curl_easy_setopt(curl, CURLOPT_VERBOSE, 1) != CURLE_OK ||
-#endif
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback) != CURLE_OK ||
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, custom_headers) != CURLE_OK ||
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_body) != CURLE_OK ||
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, strlen(json_body)) != CURLE_OK ||
-            curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY) != CURLE_OK) {
-                telem_log(LOG_ERR, "curl_easy_setopt(): Failed to set one or more options\n");
-                goto exit;
-        }
-
-        if (strlen(cert_file) > 0) {
-                if (access(cert_file, F_OK) != -1) {
-                        if (curl_easy_setopt(curl, CURLOPT_CAINFO, cert_file) != CURLE_OK) {
-                                telem_log(LOG_ERR, "curl_easy_setopt(): Failed to set CAINFO\n");
-                                goto exit;
-                        }
-                        telem_log(LOG_INFO, "cafile was set to %s\n", cert_file);
+        if (saved_config_file != NULL) {
+                if (set_config_file(saved_config_file) != 0) {
+                        telem_log(LOG_ERR, "set-config_file(): Failed to set %s",
+                                  saved_config_file);
                 }
+                reload_config();
+                telem_debug("DEBUG: restored server_addr:%s\n", server_addr_config());
+        }
+
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Unable to post record: %s\n", strerror(-ret));
+                done(false, data);
         }
+}
 
-        telem_log(LOG_DEBUG, "Executing curl operation...\n");
-        errorbuf[0] = 0;
-        res = curl_easy_perform(curl);
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_response);
+void wait_for_posts(unsigned int in_flight)
+{
+        uploader_flush(&uploader);
+        uploader_wait(&uploader, in_flight);
+}
 
-        if (res) {
-                size_t len = strlen(errorbuf);
-                if (len) {
-                        telem_log(LOG_DEBUG, "Failed sending record: %s%s", errorbuf,
-                                  ((errorbuf[len - 1] != '\n') ? "\n" : ""));
-                } else {
-                        telem_log(LOG_DEBUG, "Failed sending record: %s\n",
-                                  curl_easy_strerror(res));
+/* Syncs the local copies not synced yet, and the directory holding them. In
+ * group mode the copies are kept open until then, and closed once synced. */
+static void sync_local_copies(TelemPostDaemon *daemon)
+{
+        for (unsigned int i = 0; i < daemon->retention_nfds; i++) {
+                if (fdatasync(daemon->retention_fds[i]) == -1) {
+                        telem_perror("Error syncing local record copy");
                 }
-        } else if (http_response != 201 && http_response != 200) {
-                /*  201 means the record was  successfully created
-                 *  200 is a generic "ok".
-                 */
-                telem_log(LOG_ERR, "Encountered error %ld on the server\n",
-                          http_response);
-                // We treat HTTP error codes the same as libcurl errors
-                res = 1;
-        } else {
-                telem_log(LOG_INFO, "Record sent successfully\n");
+                close(daemon->retention_fds[i]);
         }
+        daemon->retention_nfds = 0;
 
-exit:
-        curl_slist_free_all(custom_headers);
-        curl_easy_cleanup(curl);
-        curl_global_cleanup();
+        if (daemon->retention_dirfd == -1) {
+                daemon->retention_dirfd = open(RECORD_RETENTION_DIR,
+                                               O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        if (daemon->retention_dirfd == -1) {
+                telem_perror("Error opening local record copies directory");
+        } else if (fsync(daemon->retention_dirfd) == -1) {
+                telem_perror("Error syncing local record copies directory");
+        }
+        sync_policy_synced(&daemon->retention_sync);
+}
 
-done:
-        if (json_body) {
-                free(json_body);
-                json_body = NULL;
+void sync_post_daemon(TelemPostDaemon *daemon, bool force)
+{
+        if (flush_journal(daemon->record_journal, force) != 0) {
+                telem_perror("Error syncing journal");
         }
 
-        if (saved_config_file != NULL) {
-                if (set_config_file(saved_config_file) != 0) {
-                        telem_log(LOG_ERR, "set-config_file(): Failed to set %s",
-                                  saved_config_file);
-                        res = 1;
-                }
-                reload_config();
-                telem_debug("DEBUG: restored server_addr:%s\n", server_addr_config());
+        if (daemon->retention_sync.pending > 0 &&
+            (force || sync_policy_due(&daemon->retention_sync))) {
+                sync_local_copies(daemon);
+        }
+}
+
+/* Returns the time in milliseconds until journal entries or local copies
+ * must be synced, -1 if none is pending */
+static int sync_post_daemon_timeout(TelemPostDaemon *daemon)
+{
+        int journal_timeout = -1;
+        int retention_timeout = sync_policy_timeout(&daemon->retention_sync);
+
+        if (daemon->record_journal != NULL) {
+                journal_timeout = sync_policy_timeout(&daemon->record_journal->sync);
+        }
+
+        if (journal_timeout < 0 || (retention_timeout >= 0 && retention_timeout < journal_timeout)) {
+                return retention_timeout;
         }
 
-        return res ? false : true;
+        return journal_timeout;
 }
 
 static void save_local_copy(TelemPostDaemon *daemon, char *body)
 {
         int ret = 0;
         char *tmpbuf = NULL;
-        FILE *tmpfile = NULL;
+        int fd;
 
         if (daemon == NULL || daemon->record_journal == NULL ||
             daemon->record_journal->latest_record_id == NULL) {
@@ -389,34 +428,43 @@ static void save_local_copy(TelemPostDaemon *daemon, char *body)
                 return;
         }
 
-        tmpfile = fopen(tmpbuf, "w");
-        if (!tmpfile) {
+        fd = open(tmpbuf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd == -1) {
                 telem_perror("Error opening local record copy temp file");
                 goto save_err;
         }
 
         // Save body
-        fprintf(tmpfile, "%s\n", body);
-        fclose(tmpfile);
+        dprintf(fd, "%s\n", body);
+
+        // Group syncs cover the copies written since the previous one
+        if (daemon->retention_sync.mode == DURABILITY_GROUP) {
+                daemon->retention_fds[daemon->retention_nfds++] = fd;
+        } else {
+                if (daemon->retention_sync.mode == DURABILITY_PER_RECORD &&
+                    fdatasync(fd) == -1) {
+                        telem_perror("Error syncing local record copy");
+                }
+                close(fd);
+        }
+        if (sync_policy_write(&daemon->retention_sync) ||
+            daemon->retention_nfds == RETENTION_MAX_UNSYNCED) {
+                sync_local_copies(daemon);
+        }
 
 save_err:
         free(tmpbuf);
         return;
 }
 
-static void save_entry_to_journal(TelemPostDaemon *daemon, time_t t_stamp, char *headers[])
+static void save_entry_to_journal(TelemPostDaemon *daemon, time_t t_stamp,
+                                  char *classification_value, char *event_id_value)
 {
-        char *classification_value = NULL;
-        char *event_id_value = NULL;
-
-        if (get_header_value(headers[TM_CLASSIFICATION], &classification_value) &&
-            get_header_value(headers[TM_EVENT_ID], &event_id_value)) {
+        if (classification_value != NULL && event_id_value != NULL) {
                 if (new_journal_entry(daemon->record_journal, classification_value, t_stamp, event_id_value) != 0) {
                         telem_log(LOG_INFO, "new_journal_entry in process_record: failed saving record entry\n");
                 }
         }
-        free(classification_value);
-        free(event_id_value);
 }
 
 /* Check window length conf values */
@@ -473,76 +521,364 @@ static void apply_retention_policies(TelemPostDaemon *daemon, char *body)
         }
 }
 
-/* Deliver record to backend if rate limiting policies are met otherwise
- * spool record for future delivery */
-static bool deliver_record(TelemPostDaemon *daemon, char *headers[], char *body, char* cfg_file)
+/* Where a record comes from, so that it can be removed or spooled once its
+ * post completes */
+struct record_source {
+        /* single-record file, removed once the record is delivered */
+        const char *path;
+        /* record, or handoff frame, spooled if the record is not delivered */
+        const char *data;
+        size_t size;
+        bool frame;
+        /* staging time of the record */
+        time_t mtime;
+};
+
+/* What is left to do with a record once its post completes */
+struct delivery {
+        TelemPostDaemon *daemon;
+        /* time the record was processed, and its minute for rate limiting */
+        time_t time;
+        int minute;
+        /* size of the record in the spool */
+        long size;
+        char *classification;
+        char *event_id;
+        /* copies kept while the post is in flight */
+        char *body;
+        struct record_source source;
+        /* set while post_record_ptr() runs, the post can complete before it
+         * returns */
+        bool posting;
+        bool completed;
+        bool sent;
+        struct delivery *next;
+};
+
+enum record_status {
+        /* the record can be removed */
+        RECORD_REMOVE,
+        /* the record is kept for a later delivery attempt */
+        RECORD_KEEP,
+        /* the record is removed or spooled once its post completes */
+        RECORD_POSTING
+};
+
+/* Records being posted */
+static struct delivery *deliveries = NULL;
+
+/* Keeps a record for a later delivery attempt, in a single-record file
+ * handled by the spool loop */
+static void spool_record(const struct iovec *iov, int iovcnt, time_t mtime)
 {
+        struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+        char *path = NULL;
+        size_t size = 0;
+        int fd;
 
-        bool ret = false;
-        int current_minute;
-        bool do_spool = false;
-        bool record_sent = false;
-        time_t temp = time(NULL);
-        struct tm *tm_s = localtime(&temp);
-        current_minute = tm_s->tm_min;
-        /* Checks flags */
-        bool record_check_passed = true;
-        bool byte_check_passed = true;
-        bool record_burst_enabled = burst_limit_enabled(daemon->record_burst_limit);
-        bool byte_burst_enabled =  burst_limit_enabled(daemon->byte_burst_limit);
+        if (asprintf(&path, "%s/%sXXXXXX", spool_dir_config(), SPOOLED_RECORD_PREFIX) == -1) {
+                telem_log(LOG_ERR, "Failed to allocate memory for record full path, aborting\n");
+                exit(EXIT_FAILURE);
+        }
 
-        /* Perform record and byte rate limiting checks */
-        rate_limit_checks(daemon, &record_check_passed, &byte_check_passed);
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd == -1) {
+                telem_perror("Unable to create spooled record, dropping record");
+                free(path);
+                return;
+        }
 
-        /* Sends record if rate limiting is disabled, or all checks passed */
-        if (!daemon->rate_limit_enabled || (record_check_passed && byte_check_passed)) {
-                /* Send the record as https post */
-                record_sent = post_record_ptr(headers, body, cfg_file);
-                /**
-                 * This is the only point where an error condition could be returned
-                 * if the record was not sent
-                 * */
-                ret = record_sent;
+        for (int i = 0; i < iovcnt; i++) {
+                size += iov[i].iov_len;
+        }
+
+        /* Keep the staging time, the spool expires and orders records by
+         * modification time */
+        if (writev(fd, iov, iovcnt) != (ssize_t)size || futimens(fd, times) == -1) {
+                telem_perror("Unable to write spooled record, dropping record");
+                unlink(path);
+        }
+        close(fd);
+        free(path);
+}
+
+/* Spools the record of a post that failed */
+static void spool_source(struct record_source *source)
+{
+        char *headers[NUM_HEADERS];
+        char *body = NULL;
+        char *cfg_file = NULL;
+        struct iovec iov[RECORD_MAX_IOV];
+
+        if (source->frame) {
+                /* The frame was parsed before, it is in its own copy */
+                handoff_parse_frame((char *)source->data, source->size, headers,
+                                    &body, &cfg_file);
+                spool_record(iov, record_iov(headers, body, cfg_file, iov),
+                             source->mtime);
+        } else {
+                struct iovec record = { (void *)source->data, source->size };
+
+                spool_record(&record, 1, source->mtime);
+        }
+}
+
+static bool is_posting(const char *path)
+{
+        for (struct delivery *d = deliveries; d; d = d->next) {
+                if (d->source.path && strcmp(d->source.path, path) == 0) {
+                        return true;
+                }
         }
+
+        return false;
+}
+
+static void free_delivery(struct delivery *d)
+{
+        free(d->classification);
+        free(d->event_id);
+        free(d->body);
+        free((char *)d->source.path);
+        free((char *)d->source.data);
+        free(d);
+}
+
+/* Applies the rate limiting strategy once the post of a record completed,
+ * returns true if the record can be removed */
+static bool record_delivered(TelemPostDaemon *daemon, bool record_sent, int current_minute)
+{
+        bool do_spool = false;
+
         // Get rate-limit strategy
         do_spool = spool_strategy_selected(daemon);
 
         // Drop record
         if (!record_sent && !do_spool) {
                 // Not an error condition
-                ret = true;
+                return true;
         }
         // Spool Record
         else if (!record_sent && do_spool) {
                 start_network_bypass(daemon);
                 telem_log(LOG_INFO, "process_record: initializing direct-spool window\n");
                 // False will keep record around
-                ret = false;
-        } else {
-                /* Updates rate limiting arrays if record sent */
-                if (record_burst_enabled) {
-                        rate_limit_update(current_minute, daemon->record_window_length,
-                                          daemon->record_burst_array, TM_RECORD_COUNTER);
+                return false;
+        }
+
+        /* Updates rate limiting arrays if record sent */
+        if (burst_limit_enabled(daemon->record_burst_limit)) {
+                rate_limit_update(current_minute, daemon->record_window_length,
+                                  daemon->record_burst_array, TM_RECORD_COUNTER);
+        }
+        if (burst_limit_enabled(daemon->byte_burst_limit)) {
+                rate_limit_update(current_minute, daemon->byte_window_length,
+                                  daemon->byte_burst_array, RECORD_SIZE_LEN);
+        }
+
+        return true;
+}
+
+/* Saves a record once it is properly delivered, if record is spooled the
+ * record is not saved to journal until delievered on a re-try */
+static enum record_status record_processed(struct delivery *d, char *body, bool ret)
+{
+        TelemPostDaemon *daemon = d->daemon;
+
+        if (ret) {
+                /** Save to journal **/
+                save_entry_to_journal(daemon, d->time, d->classification, d->event_id);
+                /** Record retention **/
+                apply_retention_policies(daemon, body);
+                /** Update spool size if record will be removed **/
+                daemon->current_spool_size -= d->size;
+        }
+        telem_log(LOG_DEBUG, "spool_size: %ld\n", daemon->current_spool_size);
+
+        return ret ? RECORD_REMOVE : RECORD_KEEP;
+}
+
+/* Completes a record once its post completed */
+static void record_posted(bool sent, void *data)
+{
+        struct delivery *d = data;
+        struct delivery **prev;
+
+        if (d->posting) {
+                d->completed = true;
+                d->sent = sent;
+                return;
+        }
+
+        for (prev = &deliveries; *prev != d; prev = &(*prev)->next) {
+        }
+        *prev = d->next;
+
+        if (record_processed(d, d->body, record_delivered(d->daemon, sent, d->minute)) ==
+            RECORD_REMOVE) {
+                if (d->source.path) {
+                        unlink(d->source.path);
                 }
-                if (byte_burst_enabled) {
-                        rate_limit_update(current_minute, daemon->byte_window_length,
-                                          daemon->byte_burst_array, RECORD_SIZE_LEN);
+        } else if (d->source.data) {
+                spool_source(&d->source);
+        }
+        free_delivery(d);
+}
+
+/* Keeps what is needed to complete a record once its post completes */
+static void keep_delivery(struct delivery *d, char *body, const struct record_source *source)
+{
+        d->source = *source;
+        d->source.path = NULL;
+        d->source.data = NULL;
+        if (d->daemon->record_retention_enabled && (d->body = strdup(body)) == NULL) {
+                goto oom;
+        }
+        if (source->path && (d->source.path = strdup(source->path)) == NULL) {
+                goto oom;
+        }
+        if (source->data) {
+                d->source.data = malloc(source->size);
+                if (!d->source.data) {
+                        goto oom;
                 }
+                memcpy((char *)d->source.data, source->data, source->size);
         }
 
-        return ret;
+        d->next = deliveries;
+        deliveries = d;
+
+        return;
+oom:
+        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+        exit(EXIT_FAILURE);
 }
 
-bool process_staged_record(char *filename, TelemPostDaemon *daemon)
+/* Deliver record to backend if rate limiting policies are met otherwise
+ * spool record for future delivery */
+static enum record_status deliver_record(struct delivery *d, char *headers[], char *body,
+                                         char *cfg_file, const struct record_source *source)
+{
+        TelemPostDaemon *daemon = d->daemon;
+        enum record_status ret;
+        /* Checks flags */
+        bool record_check_passed = true;
+        bool byte_check_passed = true;
+
+        /* Perform record and byte rate limiting checks */
+        rate_limit_checks(daemon, &record_check_passed, &byte_check_passed);
+
+        /* Sends record if rate limiting is disabled, or all checks passed */
+        if (daemon->rate_limit_enabled && !(record_check_passed && byte_check_passed)) {
+                ret = record_processed(d, body, record_delivered(daemon, false, d->minute));
+                free_delivery(d);
+                return ret;
+        }
+
+        /* Send the record as https post, the headers are modified */
+        get_header_value(headers[TM_CLASSIFICATION], &d->classification);
+        get_header_value(headers[TM_EVENT_ID], &d->event_id);
+        d->posting = true;
+        post_record_ptr(headers, body, cfg_file, record_posted, d);
+        d->posting = false;
+
+        if (d->completed) {
+                ret = record_processed(d, body, record_delivered(daemon, d->sent, d->minute));
+                free_delivery(d);
+                return ret;
+        }
+
+        keep_delivery(d, body, source);
+
+        return RECORD_POSTING;
+}
+
+/* Applies the delivery and spool policies to a record that uses size bytes
+ * of the spool */
+static enum record_status process_record(TelemPostDaemon *daemon, char *headers[], char *body,
+                                         char *cfg_file, long size,
+                                         const struct record_source *source)
+{
+        struct delivery *d;
+        time_t current_time = time(NULL);
+        struct tm *tm_s = localtime(&current_time);
+        int64_t max_spool_size = 0;
+        enum record_status ret;
+
+        /** Update spool directory size **/
+        daemon->current_spool_size += size;
+
+        /** Spool policies **/
+        if (daemon->record_server_delivery_enabled &&
+            inside_direct_spool_window(daemon, time(NULL))) {
+                telem_log(LOG_INFO, "process_record: delivering directly to spool\n");
+                /* Check spool max size conf */
+                max_spool_size = spool_max_size_config();
+                if (max_spool_size != -1 &&
+                    daemon->current_spool_size >= (max_spool_size * 1024)) {
+                        // Drop record
+                        telem_log(LOG_INFO, "Spool dir full, dropping record\n");
+                        daemon->current_spool_size -= size;
+                        ret = RECORD_REMOVE;
+                } else {
+                        // Keep record, non error condition
+                        ret = RECORD_KEEP;
+                }
+                telem_log(LOG_DEBUG, "spool_size: %ld\n", daemon->current_spool_size);
+                return ret;
+        }
+
+        d = calloc(1, sizeof(struct delivery));
+        if (!d) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        d->daemon = daemon;
+        d->time = current_time;
+        d->minute = tm_s->tm_min;
+        d->size = size;
+
+        /** Record delivery **/
+        if (!daemon->record_server_delivery_enabled) {
+                telem_log(LOG_INFO, "record server delivery disabled\n");
+                get_header_value(headers[TM_CLASSIFICATION], &d->classification);
+                get_header_value(headers[TM_EVENT_ID], &d->event_id);
+                // Not an error condition
+                ret = record_processed(d, body, true);
+                free_delivery(d);
+                return ret;
+        }
+
+        /** Check window_length **/
+        if (windows_length_value_check(daemon) == false) {
+                exit(EXIT_FAILURE);
+        }
+
+        /** Deliver or spool **/
+        return deliver_record(d, headers, body, cfg_file, source);
+}
+
+/* Checks that a staged file is a regular file of the daemon user that has
+ * not expired */
+static bool is_staged_file_valid(struct stat *buf)
+{
+        time_t current_time = time(NULL);
+
+        return S_ISREG(buf->st_mode) &&
+               (current_time - buf->st_mtime <= (record_expiry_config() * 60)) &&
+               (buf->st_uid == getuid());
+}
+
+/* Processes a file holding a single record */
+static bool process_record_file(char *filename, TelemPostDaemon *daemon)
 {
         int k;
         bool ret = false;
         char *headers[NUM_HEADERS];
         char *body = NULL;
         struct stat buf = { 0 };
-        time_t current_time = time(NULL);
-        int64_t max_spool_size = 0;
         char *cfg_file = NULL;
+        struct record_source source = { 0 };
 
         for (k = 0; k < NUM_HEADERS; k++) {
                 headers[k] = NULL;
@@ -562,82 +898,219 @@ bool process_staged_record(char *filename, TelemPostDaemon *daemon)
                 goto end_processing_file;
         }
 
-        /** Update spool directory size **/
-        daemon->current_spool_size += (buf.st_blocks * 512);
-
         /** Check that record is not expired **/
-        if (!S_ISREG(buf.st_mode) ||
-            (current_time - buf.st_mtime > (record_expiry_config() * 60)) ||
-            (buf.st_uid  != getuid())) {
+        if (!is_staged_file_valid(&buf)) {
                 ret = true; // Expired, true to remove it
                 goto end_processing_file;
         }
 
-        /** Record delivery **/
-        if (!daemon->record_server_delivery_enabled) {
-                telem_log(LOG_INFO, "record server delivery disabled\n");
-                // Not an error condition
-                ret = true;
-                goto end_record_delivery;
+        source.path = filename;
+        ret = process_record(daemon, headers, body, cfg_file, buf.st_blocks * 512,
+                             &source) == RECORD_REMOVE;
+
+end_processing_file:
+        free(body);
+
+        for (k = 0; k < NUM_HEADERS; k++) {
+                free(headers[k]);
         }
 
-        /** Spool policies **/
-        if (inside_direct_spool_window(daemon, time(NULL))) {
-                telem_log(LOG_INFO, "process_record: delivering directly to spool\n");
-                /* Check spool max size conf */
-                max_spool_size = spool_max_size_config();
-                if (max_spool_size != -1 &&
-                    daemon->current_spool_size >= (max_spool_size * 1024)) {
-                        // Drop record
-                        telem_log(LOG_INFO, "Spool dir full, dropping record\n");
-                        ret = true;
-                } else {
-                        // Keep record, non error condition
-                        ret = false;
+        if (cfg_file != NULL) {
+                free(cfg_file);
+        }
+        return ret;
+}
+
+/* Processes the record of the frame in daemon->handoff_frame */
+static void process_handoff_frame(TelemPostDaemon *daemon, size_t size)
+{
+        char *headers[NUM_HEADERS];
+        char *body = NULL;
+        char *cfg_file = NULL;
+        struct iovec iov[RECORD_MAX_IOV];
+        struct record_source source = { NULL, daemon->handoff_frame, size, true, time(NULL) };
+
+        /* Delivery modifies the headers, the frame is kept intact in case
+         * the record must be spooled */
+        memcpy(daemon->handoff_copy, daemon->handoff_frame, size);
+        if (!handoff_parse_frame(daemon->handoff_copy, size, headers, &body, &cfg_file)) {
+                telem_log(LOG_WARNING, "Ignoring malformed record handed over\n");
+                return;
+        }
+        daemon->handed_off++;
+
+        if (process_record(daemon, headers, body, cfg_file, (long)size,
+                           &source) != RECORD_KEEP) {
+                return;
+        }
+
+        handoff_parse_frame(daemon->handoff_frame, size, headers, &body, &cfg_file);
+        spool_record(iov, record_iov(headers, body, cfg_file, iov), time(NULL));
+}
+
+static void close_handoff_connection(TelemPostDaemon *daemon)
+{
+        close(daemon->pollfds[handoffcfd].fd);
+        daemon->pollfds[handoffcfd].fd = -1;
+        daemon->pollfds[handoffcfd].revents = 0;
+}
+
+/* Accepts the connection of telemprobd, which replaces a previous one */
+static void accept_handoff_connection(TelemPostDaemon *daemon)
+{
+        int fd;
+
+        fd = accept4(daemon->pollfds[handofflfd].fd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        telem_perror("Failed to accept handoff connection");
                 }
-                goto end_processing_file;
+                return;
         }
 
-        /** Check window_length **/
-        if (windows_length_value_check(daemon) == false) {
-                exit(EXIT_FAILURE);
+        if (daemon->pollfds[handoffcfd].fd >= 0) {
+                close_handoff_connection(daemon);
         }
+        set_pollfd(daemon, fd, handoffcfd, POLLIN);
+}
 
-        /** Deliver or spool **/
-        ret = deliver_record(daemon, headers, body, cfg_file);
+int receive_handoff_records(TelemPostDaemon *daemon)
+{
+        int received = 0;
+        ssize_t len;
+
+        for (int i = 0; i < HANDOFF_RECEIVE_BUDGET; i++) {
+                /* MSG_TRUNC gets the size of frames too large for the buffer */
+                len = recv(daemon->pollfds[handoffcfd].fd, daemon->handoff_frame,
+                           HANDOFF_MAX_FRAME, MSG_DONTWAIT | MSG_TRUNC);
+                if (len == -1) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                break;
+                        } else if (errno == EINTR) {
+                                continue;
+                        }
+                        telem_perror("Failed to receive records handed over");
+                        close_handoff_connection(daemon);
+                        break;
+                } else if (len == 0) {
+                        /* telemprobd exited */
+                        close_handoff_connection(daemon);
+                        break;
+                } else if (len > HANDOFF_MAX_FRAME) {
+                        telem_log(LOG_WARNING, "Ignoring oversized record handed over\n");
+                        continue;
+                }
 
-end_record_delivery:
-        /** Save record once it is properly delivered, if record
-         *  is spooled the record is not saved to journal until
-         *  delievered on a re-try **/
-        if (ret) {
-                /** Save to journal **/
-                save_entry_to_journal(daemon, current_time, headers);
-                /** Record retention **/
-                apply_retention_policies(daemon, body);
+                process_handoff_frame(daemon, (size_t)len);
+                received++;
         }
 
-end_processing_file:
-        /** Update spool size if record will be removed **/
-        if (ret) {
-                daemon->current_spool_size -= (buf.st_blocks * 512);
+        return received;
+}
+
+struct segment_context {
+        TelemPostDaemon *daemon;
+        time_t mtime;
+};
+
+static void process_segment_record(const char *record, size_t size, void *data)
+{
+        struct segment_context *ctx = data;
+        char *headers[NUM_HEADERS] = { NULL };
+        char *body = NULL;
+        char *cfg_file = NULL;
+        struct record_source source = { 0 };
+
+        if (!parse_record(record, size, headers, &body, &cfg_file)) {
+                telem_log(LOG_WARNING, "unable to read record in segment\n");
+                return;
         }
-        telem_log(LOG_DEBUG, "spool_size: %ld\n", daemon->current_spool_size);
-        free(body);
 
-        for (k = 0; k < NUM_HEADERS; k++) {
+        source.data = record;
+        source.size = size;
+        source.mtime = ctx->mtime;
+        if (process_record(ctx->daemon, headers, body, cfg_file, (long)size,
+                           &source) == RECORD_KEEP) {
+                struct iovec iov = { (void *)record, size };
+
+                spool_record(&iov, 1, ctx->mtime);
+        }
+
+        free(body);
+        for (int k = 0; k < NUM_HEADERS; k++) {
                 free(headers[k]);
         }
+        free(cfg_file);
+}
 
-        if (cfg_file != NULL) {
-                free(cfg_file);
+/* Processes every record of a sealed segment, the segment can be removed once
+ * its records are posted or spooled, and is kept if it could not be read */
+static bool process_segment(char *filename, TelemPostDaemon *daemon)
+{
+        struct segment_context ctx = { daemon, 0 };
+        struct stat buf;
+        int fd, ret;
+
+        fd = open(filename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+                /* Nothing to keep if it is gone or not a file */
+                bool remove = errno == ENOENT || errno == ELOOP;
+
+                telem_perror("Unable to open segment");
+                return remove;
         }
-        return ret;
+
+        if (fstat(fd, &buf) == -1) {
+                telem_perror("Unable to stat segment");
+                close(fd);
+                return false;
+        }
+
+        /** Check that records are not expired **/
+        if (!is_staged_file_valid(&buf)) {
+                close(fd);
+                return true;
+        }
+
+        ctx.mtime = buf.st_mtime;
+        ret = segment_for_each_record(fd, process_segment_record, &ctx);
+        close(fd);
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Unable to read segment %s: %s\n", filename,
+                          strerror(-ret));
+                return false;
+        }
+        telem_log(LOG_DEBUG, "Processed %d records from segment %s\n", ret, filename);
+
+        /* The records are only in memory until their post completes, the
+         * ones that fail are spooled on completion */
+        wait_for_posts(0);
+
+        return true;
 }
 
+bool process_staged_record(char *filename, TelemPostDaemon *daemon)
+{
+        const char *name = strrchr(filename, '/');
+
+        name = name ? name + 1 : filename;
+
+        if (segment_is_open(name)) {
+                /* Still written by telemprobd */
+                return false;
+        } else if (segment_is_sealed(name)) {
+                return process_segment(filename, daemon);
+        }
+
+        return process_record_file(filename, daemon);
+}
+
+/* Skips the segments that are still open, they are processed once sealed */
 static int directory_dot_filter(const struct dirent *entry)
 {
-        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0) ||
+            segment_is_open(entry->d_name)) {
                 return 0;
         } else {
                 return 1;
@@ -647,12 +1120,13 @@ static int directory_dot_filter(const struct dirent *entry)
 int staging_records_loop(TelemPostDaemon *daemon)
 {
         int ret;
-        int processed;
+        int remaining;
         int numentries;
+        int dirfd;
         struct dirent **namelist;
 
         numentries = scandir(spool_dir_config(), &namelist, directory_dot_filter, NULL);
-        processed = 0;
+        remaining = 0;
 
         if (numentries == 0) {
                 telem_log(LOG_DEBUG, "No entries in staging\n");
@@ -671,19 +1145,46 @@ int staging_records_loop(TelemPostDaemon *daemon)
                         telem_log(LOG_ERR, "Failed to allocate memory for staging record full path\n");
                         exit(EXIT_FAILURE);
                 }
-                if (process_staged_record(record_path, daemon)) {
+                /* Already posted when it was staged */
+                if (!is_posting(record_path) && process_staged_record(record_path, daemon)) {
                         unlink(record_path);
-                        processed++;
                 }
                 free(record_path);
         }
 
+        /* Records posted are removed once their post completes */
+        wait_for_posts(0);
+        dirfd = open(spool_dir_config(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
         for (int i = 0; i < numentries; i++) {
+                if (dirfd == -1 ||
+                    faccessat(dirfd, namelist[i]->d_name, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+                        remaining++;
+                }
                 free(namelist[i]);
         }
         free(namelist);
+        if (dirfd != -1) {
+                close(dirfd);
+        }
 
-        return numentries - processed;
+        return remaining;
+}
+
+/* Checks if an inotify event makes records available. Records spooled by
+ * the daemon itself are left to the spool loop. */
+static bool is_staging_event(const struct inotify_event *event)
+{
+        if (event->mask & IN_ISDIR) {
+                return false;
+        } else if (segment_is_sealed(event->name)) {
+                return event->mask & IN_MOVED_TO;
+        } else if (segment_is_open(event->name) ||
+                   strncmp(event->name, SPOOLED_RECORD_PREFIX,
+                           strlen(SPOOLED_RECORD_PREFIX)) == 0) {
+                return false;
+        }
+
+        return event->mask & IN_CLOSE_WRITE;
 }
 
 void run_daemon(TelemPostDaemon *daemon)
@@ -708,6 +1209,8 @@ void run_daemon(TelemPostDaemon *daemon)
 
         while (1) {
                 int retry_delay = spool_process_time;
+                int timeout, sync_timeout, upload_timeout;
+                bool early_wakeup;
                 malloc_trim(0);
 
                 /* check if we need to retry sending spooled records */
@@ -718,7 +1221,22 @@ void run_daemon(TelemPostDaemon *daemon)
                                   retry_delay);
                 }
 
-                ret = poll(daemon->pollfds, NFDS, retry_delay * 1000);
+                /* Wake up early if writes are due to be synced, posts need
+                 * attention, or the connections to the backends are to be
+                 * closed */
+                timeout = retry_delay * 1000;
+                sync_timeout = sync_post_daemon_timeout(daemon);
+                early_wakeup = sync_timeout >= 0 && sync_timeout < timeout;
+                if (early_wakeup) {
+                        timeout = sync_timeout;
+                }
+                upload_timeout = uploader_timeout(&uploader, connection_idle_time_config());
+                if (upload_timeout >= 0 && upload_timeout < timeout) {
+                        timeout = upload_timeout;
+                        early_wakeup = true;
+                }
+
+                ret = poll(daemon->pollfds, NFDS, timeout);
                 if (ret == -1) {
                         telem_perror("Failed to poll daemon file descriptors");
                         break;
@@ -757,7 +1275,7 @@ void run_daemon(TelemPostDaemon *daemon)
                                         struct inotify_event *event = (struct inotify_event *)&buffer[i];
 
                                         if (event->len) {
-                                                if (event->mask & IN_CLOSE_WRITE && !(event->mask & IN_ISDIR)) {
+                                                if (is_staging_event(event)) {
                                                         char *record_name = NULL;
 
                                                         /* Retrieve foldername from watch id?  */
@@ -778,7 +1296,16 @@ void run_daemon(TelemPostDaemon *daemon)
                                         i += (ssize_t)EVENT_SIZE + event->len;
                                 }
                         }
-                } else {
+
+                        if (daemon->pollfds[handofflfd].revents != 0) {
+                                accept_handoff_connection(daemon);
+                        }
+                        if (daemon->pollfds[handoffcfd].fd >= 0 &&
+                            daemon->pollfds[handoffcfd].revents != 0 &&
+                            receive_handoff_records(daemon) > 0) {
+                                last_record_received = time(NULL);
+                        }
+                } else if (!early_wakeup) {
                         time_t now = time(NULL);
                         /* time to recycle the daemon has elapsed*/
                         if (daemon_recycling_enabled &&
@@ -811,6 +1338,13 @@ void run_daemon(TelemPostDaemon *daemon)
                         }
                 }
 
+                /* Send the records received since the last wakeup, and
+                 * complete the posts of the records that got a response */
+                uploader_flush(&uploader);
+                uploader_perform(&uploader);
+                sync_post_daemon(daemon, false);
+                uploader_expire(&uploader, connection_idle_time_config(), time(NULL));
+
                 /* Check journal records and prune if needed */
                 ret = prune_journal(daemon->record_journal, JOURNAL_TMPDIR);
                 if (ret != 0) {
@@ -829,6 +1363,27 @@ void close_daemon(TelemPostDaemon *daemon)
                 close(daemon->fd);
         }
 
+        if (daemon->pollfds[handoffcfd].fd >= 0) {
+                close_handoff_connection(daemon);
+        }
+        if (daemon->pollfds[handofflfd].fd >= 0) {
+                close(daemon->pollfds[handofflfd].fd);
+                daemon->pollfds[handofflfd].fd = -1;
+        }
+        free(daemon->handoff_frame);
+        free(daemon->handoff_copy);
+        daemon->handoff_frame = NULL;
+        daemon->handoff_copy = NULL;
+
+        /* The records posted are saved, or spooled, once their post
+         * completes */
+        uploader_close(&uploader);
+        json_buffer_free(&json_message);
+        sync_post_daemon(daemon, true);
+        if (daemon->retention_dirfd != -1) {
+                close(daemon->retention_dirfd);
+                daemon->retention_dirfd = -1;
+        }
         close_journal(daemon->record_journal);
 }
 
@@ -16,7 +16,13 @@
 
 #define EVENT_SIZE sizeof(struct inotify_event)
 #define BUFFER_LEN 1024 * (EVENT_SIZE + 16)
-#define NFDS 2
+#define NFDS 5
+/* Maximum number of records received per wakeup of the handoff connection,
+ * so that it can not starve the spool */
+#define HANDOFF_RECEIVE_BUDGET 64
+/* Maximum number of local copies kept open for a group sync, which is done
+ * early once they are reached */
+#define RETENTION_MAX_UNSYNCED 64
 #define TM_RATE_LIMIT_SLOTS (1 /*h*/ * 60 /*m*/)
 #define TM_RECORD_COUNTER (1)
 #define MAX_RETRY_ATTEMPTS 8
@@ -29,8 +35,9 @@
 #include "common.h"
 #include "journal/journal.h"
 #include "configuration.h"
+#include "uploader.h"
 
-enum fdindex {signlfd, watchfd};
+enum fdindex {signlfd, watchfd, handofflfd, handoffcfd, uploadfd};
 
 typedef struct TelemPostDaemon {
         int fd;
@@ -58,6 +65,18 @@ typedef struct TelemPostDaemon {
         /* Record local copy and delivery  */
         bool record_retention_enabled;
         bool record_server_delivery_enabled;
+        /* Frame received on the handoff connection, and the copy it is
+         * processed from */
+        char *handoff_frame;
+        char *handoff_copy;
+        /* Records handed over by telemprobd */
+        uint64_t handed_off;
+        /* Durability of local copies, the copies written since the last
+         * group sync, and the directory synced for them */
+        struct sync_policy retention_sync;
+        int retention_fds[RETENTION_MAX_UNSYNCED];
+        unsigned int retention_nfds;
+        int retention_dirfd;
 } TelemPostDaemon;
 
 /**
@@ -81,11 +100,35 @@ void run_daemon(TelemPostDaemon *daemon);
  */
 void close_daemon(TelemPostDaemon *daemon);
 
+/**
+ * Syncs the journal entries and local record copies not synced yet
+ *
+ * @param daemon a pointer to telemetry post daemon
+ * @param force sync them even if the group interval did not elapse
+ */
+void sync_post_daemon(TelemPostDaemon *daemon, bool force);
+
+/**
+ * Processes the records telemprobd handed over on the handoff connection
+ *
+ * Records that are kept for a later delivery attempt are written to the
+ * spool.
+ *
+ * @param daemon a pointer to telemetry post daemon
+ * @return the number of records received
+ */
+int receive_handoff_records(TelemPostDaemon *daemon);
+
 /**
  * Processed record written on disk
  *
+ * The file is either a sealed segment, all records of which are processed,
+ * or a single-record file. Open segments are left alone. A single-record file
+ * posted is removed once its post completes, if the record was delivered.
+ *
  * @param filename a pointor to record on disk
  * @param daemon post to telemetry post daemon
+ * @return true if the file can be removed, false to keep it
  */
 bool process_staged_record(char *filename, TelemPostDaemon *daemon);
 
@@ -98,16 +141,35 @@ bool process_staged_record(char *filename, TelemPostDaemon *daemon);
  */
 int staging_records_loop(TelemPostDaemon *daemon);
 
+/**
+ * Encodes a record as the JSON object posted to the backend
+ *
+ * @param tm_headers the headers of the record, not modified
+ * @param tm_payload the payload of the record
+ *
+ * @return the JSON object, to be freed by the caller, or NULL if memory could
+ *         not be allocated
+ */
+char *create_json_message(char *const tm_headers[], const char *tm_payload);
+
 /**
  * Posts a record to backend
  *
+ * The record is posted without waiting for the response, up to
+ * max_concurrent_posts at once. With batch_format set, it is packed with the
+ * records posted after it in a request, sent once full or when the daemon
+ * waits for its next event.
+ *
  * @param headers a pointer to an array with keys and values
  * @param body a pointer to the payload
  * @param cfg_file a pointer to a non-default configuration
  *        file to be used.
- * @return true if successful, false otherwise
+ * @param done called once the post completed, possibly before the function
+ *        returns, with true if successful, false otherwise
+ * @param data passed to done
  */
-bool post_record_http(char *headers[], char *body, char *cfg_file);
+void post_record_http(char *headers[], char *body, char *cfg_file,
+                      upload_done_fn done, void *data);
 
 /**
  * Pointer to function to isolate backend call during
@@ -116,7 +178,16 @@ bool post_record_http(char *headers[], char *body, char *cfg_file);
  * @param headers pointer to array of keys
  * @param body a pinter to payload
  * */
-extern bool (*post_record_ptr)(char *headers[], char *body, char *cfg_file);
+extern void (*post_record_ptr)(char *headers[], char *body, char *cfg_file,
+                               upload_done_fn done, void *data);
+
+/**
+ * Sends the records waiting to fill a batch, and waits for the records being
+ * posted
+ *
+ * @param in_flight the number of posts that may be left in flight
+ */
+void wait_for_posts(unsigned int in_flight);
 
 /** Helper functions **/
 /* rate limit check */
@@ -0,0 +1,685 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <json-c/json.h>
+
+#include "uploader.h"
+#include "log.h"
+
+/* Maximum number of socket events handled per call of uploader_perform() */
+#define UPLOADER_MAX_EVENTS 32
+
+/* Size of the response of a batch that is kept, well above the status of the
+ * records of any batch */
+#define UPLOADER_MAX_RESPONSE (1024 * 1024)
+
+static int64_t monotonic_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+        struct upload *upload = userdata;
+        size_t len = size * nmemb;
+        char *response;
+
+        telem_log(LOG_DEBUG, "Received data:\n%.*s\n", (int)len, ptr);
+
+        /* Only the response of a batch is read, for the status of its
+         * records */
+        if (!upload->batch || upload->response_len + len > UPLOADER_MAX_RESPONSE) {
+                return len;
+        }
+
+        response = realloc(upload->response, upload->response_len + len + 1);
+        if (!response) {
+                return len;
+        }
+        memcpy(response + upload->response_len, ptr, len);
+        upload->response_len += len;
+        response[upload->response_len] = 0;
+        upload->response = response;
+
+        return len;
+}
+
+/* Watches the sockets libcurl asks for */
+static int socket_callback(CURL *easy, curl_socket_t s, int what, void *userp,
+                           void *socketp)
+{
+        struct uploader *up = userp;
+        struct epoll_event event = { 0 };
+
+        if (what == CURL_POLL_REMOVE) {
+                /* Fails if libcurl already closed the socket */
+                epoll_ctl(up->epfd, EPOLL_CTL_DEL, s, NULL);
+                return 0;
+        }
+
+        if (what & CURL_POLL_IN) {
+                event.events |= EPOLLIN;
+        }
+        if (what & CURL_POLL_OUT) {
+                event.events |= EPOLLOUT;
+        }
+        event.data.fd = s;
+
+        if (epoll_ctl(up->epfd, EPOLL_CTL_MOD, s, &event) == -1 &&
+            (errno != ENOENT || epoll_ctl(up->epfd, EPOLL_CTL_ADD, s, &event) == -1)) {
+                telem_perror("Unable to watch upload socket");
+                return -1;
+        }
+
+        return 0;
+}
+
+static int timer_callback(CURLM *multi, long timeout_ms, void *userp)
+{
+        struct uploader *up = userp;
+
+        up->deadline = timeout_ms < 0 ? -1 : monotonic_ms() + timeout_ms;
+
+        return 0;
+}
+
+static bool open_multi(struct uploader *up)
+{
+        up->multi = curl_multi_init();
+        if (!up->multi) {
+                telem_log(LOG_ERR, "curl_multi_init(): Unable to start libcurl"
+                          " multi session\n");
+                return false;
+        }
+
+        if (curl_multi_setopt(up->multi, CURLMOPT_SOCKETFUNCTION, socket_callback) != CURLM_OK ||
+            curl_multi_setopt(up->multi, CURLMOPT_SOCKETDATA, up) != CURLM_OK ||
+            curl_multi_setopt(up->multi, CURLMOPT_TIMERFUNCTION, timer_callback) != CURLM_OK ||
+            curl_multi_setopt(up->multi, CURLMOPT_TIMERDATA, up) != CURLM_OK ||
+            curl_multi_setopt(up->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX) != CURLM_OK) {
+                telem_log(LOG_ERR, "curl_multi_setopt(): Failed to set one or more options\n");
+                curl_multi_cleanup(up->multi);
+                up->multi = NULL;
+                return false;
+        }
+
+        return true;
+}
+
+static void free_upload(struct upload *upload)
+{
+        if (upload->curl) {
+                curl_easy_cleanup(upload->curl);
+        }
+        free(upload->body);
+        free(upload->records);
+        free(upload->response);
+        free(upload->encoded);
+        free(upload);
+}
+
+/* Gets a request to the backend, reusing the handle of an idle one */
+static struct upload *get_upload(struct uploader *up, struct backend *backend)
+{
+        struct upload **prev, *upload;
+        unsigned int max_records;
+
+        for (prev = &up->idle; (upload = *prev) != NULL; prev = &upload->next) {
+                if (upload->backend == backend) {
+                        *prev = upload->next;
+                        up->nidle--;
+                        return upload;
+                }
+        }
+
+        upload = calloc(1, sizeof(struct upload));
+        if (!upload) {
+                telem_log(LOG_ERR, "Unable to allocate memory for upload\n");
+                return NULL;
+        }
+        upload->backend = backend;
+        upload->batch = up->batch_format != BATCH_NONE;
+        max_records = upload->batch ? up->batch_records : 1;
+        upload->records = calloc(max_records, sizeof(struct upload_record));
+        if (!upload->records) {
+                telem_log(LOG_ERR, "Unable to allocate memory for upload\n");
+                free_upload(upload);
+                return NULL;
+        }
+        upload->curl = backend_handle(&up->cache, backend, upload->errorbuf);
+        if (!upload->curl ||
+            curl_easy_setopt(upload->curl, CURLOPT_PRIVATE, upload) != CURLE_OK ||
+            curl_easy_setopt(upload->curl, CURLOPT_WRITEFUNCTION, write_callback) != CURLE_OK ||
+            curl_easy_setopt(upload->curl, CURLOPT_WRITEDATA, upload) != CURLE_OK ||
+            (up->batch_format == BATCH_NDJSON &&
+             curl_easy_setopt(upload->curl, CURLOPT_HTTPHEADER,
+                              backend->ndjson_headers) != CURLE_OK)) {
+                free_upload(upload);
+                return NULL;
+        }
+
+        return upload;
+}
+
+/* Frees the body of a request, unless it is the buffer batches are packed
+ * in, and keeps its handle for the next one unless enough are kept */
+static void release_upload(struct uploader *up, struct upload *upload)
+{
+        curl_easy_setopt(upload->curl, CURLOPT_POSTFIELDS, NULL);
+        if (!upload->batch) {
+                free(upload->body);
+                upload->body = NULL;
+        }
+        upload->len = 0;
+        upload->nrecords = 0;
+        /* The buffer is kept for the next response, not its content */
+        upload->response_len = 0;
+        if (upload->response) {
+                upload->response[0] = 0;
+        }
+
+        if (up->nidle >= up->max_in_flight) {
+                free_upload(upload);
+                return;
+        }
+        upload->next = up->idle;
+        up->idle = upload;
+        up->nidle++;
+}
+
+/* Returns whether a record was accepted, given its status in the response
+ * to a batch */
+static bool record_status_sent(json_object *status)
+{
+        int code = json_object_get_int(status);
+
+        return code == 201 || code == 200;
+}
+
+/* Calls the completion of the records of a request. The response to a batch
+ * may hold a JSON array of the status of each record, otherwise the records
+ * share the outcome of the request. */
+static void complete_records(struct upload *upload, bool sent)
+{
+        json_object *statuses = NULL;
+        unsigned int rejected = 0;
+
+        if (sent && upload->batch && upload->response_len > 0) {
+                statuses = json_tokener_parse(upload->response);
+                if (statuses && (!json_object_is_type(statuses, json_type_array) ||
+                                 json_object_array_length(statuses) != upload->nrecords)) {
+                        telem_log(LOG_WARNING, "Ignoring the status of the records"
+                                  " of a batch of %u\n", upload->nrecords);
+                        json_object_put(statuses);
+                        statuses = NULL;
+                }
+        }
+
+        for (unsigned int i = 0; i < upload->nrecords; i++) {
+                bool record_sent = sent;
+
+                if (statuses) {
+                        record_sent = record_status_sent(json_object_array_get_idx(statuses, i));
+                        if (!record_sent) {
+                                rejected++;
+                        }
+                }
+                upload->records[i].done(record_sent, upload->records[i].data);
+        }
+
+        if (rejected > 0) {
+                telem_log(LOG_ERR, "The server rejected %u of %u records\n",
+                          rejected, upload->nrecords);
+        }
+        json_object_put(statuses);
+}
+
+/* Starts sending a request, waiting for a request in flight to complete first
+ * if max_in_flight are */
+static int send_upload(struct uploader *up, struct upload *upload)
+{
+        char *postfields = upload->body;
+        size_t postsize = upload->len;
+        int ret;
+
+        if (up->in_flight >= up->max_in_flight) {
+                ret = uploader_wait(up, up->max_in_flight - 1);
+                if (ret < 0) {
+                        return ret;
+                }
+        }
+
+        if (upload->backend->compressor.method != COMPRESSION_NONE) {
+                ssize_t len = compressor_compress(&upload->backend->compressor,
+                                                  upload->body, upload->len,
+                                                  &upload->encoded,
+                                                  &upload->encoded_size);
+                if (len < 0) {
+                        return (int)len;
+                }
+                telem_debug("DEBUG: Compressed %zu bytes to %zd\n", upload->len, len);
+                postfields = upload->encoded;
+                postsize = (size_t)len;
+        }
+
+        upload->errorbuf[0] = 0;
+        if (curl_easy_setopt(upload->curl, CURLOPT_POSTFIELDS, postfields) != CURLE_OK ||
+            curl_easy_setopt(upload->curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                             (curl_off_t)postsize) != CURLE_OK) {
+                telem_log(LOG_ERR, "curl_easy_setopt(): Failed to set one or more options\n");
+                return -EINVAL;
+        }
+
+        if (curl_multi_add_handle(up->multi, upload->curl) != CURLM_OK) {
+                telem_log(LOG_ERR, "curl_multi_add_handle(): Unable to start request\n");
+                return -EIO;
+        }
+        up->in_flight++;
+
+        return 0;
+}
+
+/* Sends a batch, whose records fail at once if it can not be sent */
+static void send_batch(struct uploader *up, struct upload *upload)
+{
+        int ret;
+
+        if (up->batch_format == BATCH_JSON) {
+                upload->body[upload->len++] = ']';
+                upload->body[upload->len] = 0;
+        }
+
+        telem_log(LOG_DEBUG, "Sending a batch of %u records\n", upload->nrecords);
+        ret = send_upload(up, upload);
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Unable to post records: %s\n", strerror(-ret));
+                complete_records(upload, false);
+                release_upload(up, upload);
+        }
+}
+
+/* Removes the batch of a backend from the batches not sent yet, and returns
+ * it */
+static struct upload *take_batch(struct uploader *up, struct backend *backend)
+{
+        struct upload **prev, *upload;
+
+        for (prev = &up->pending; (upload = *prev) != NULL; prev = &upload->next) {
+                if (upload->backend == backend) {
+                        *prev = upload->next;
+                        upload->next = NULL;
+                        return upload;
+                }
+        }
+
+        return NULL;
+}
+
+/* Adds a record to the batch of its backend, and sends the batch once it is
+ * full. No more than one batch is sent: the caller made room for one request
+ * without waiting, and waiting here would run the completions of other
+ * records under the configuration of this one. A batch full after another
+ * was sent is left for uploader_flush(). The record body is freed. */
+static int add_to_batch(struct uploader *up, struct backend *backend, char *body,
+                        upload_done_fn done, void *data)
+{
+        struct upload *upload;
+        size_t len = strlen(body);
+        /* The separator and the end of the batch */
+        size_t overhead = up->batch_format == BATCH_JSON ? 2 : 1;
+        size_t needed;
+        bool sent = false;
+
+        upload = take_batch(up, backend);
+        if (upload && (upload->nrecords >= up->batch_records ||
+                       upload->len + len + overhead > up->batch_size)) {
+                send_batch(up, upload);
+                upload = NULL;
+                sent = true;
+        }
+        if (!upload) {
+                upload = get_upload(up, backend);
+                if (!upload) {
+                        free(body);
+                        return -ENOMEM;
+                }
+        }
+
+        needed = upload->len + len + 3;
+        if (needed > upload->size) {
+                size_t size = upload->size ? upload->size : 4096;
+                char *buf;
+
+                while (size < needed) {
+                        size *= 2;
+                }
+                buf = realloc(upload->body, size);
+                if (!buf) {
+                        telem_log(LOG_ERR, "Unable to allocate memory for batch\n");
+                        free(body);
+                        if (upload->nrecords > 0) {
+                                send_batch(up, upload);
+                        } else {
+                                release_upload(up, upload);
+                        }
+                        return -ENOMEM;
+                }
+                upload->body = buf;
+                upload->size = size;
+        }
+
+        if (up->batch_format == BATCH_JSON) {
+                upload->body[upload->len++] = upload->nrecords == 0 ? '[' : ',';
+        }
+        memcpy(upload->body + upload->len, body, len);
+        upload->len += len;
+        if (up->batch_format == BATCH_NDJSON) {
+                upload->body[upload->len++] = '\n';
+        }
+        upload->body[upload->len] = 0;
+        free(body);
+
+        upload->records[upload->nrecords].done = done;
+        upload->records[upload->nrecords].data = data;
+        upload->nrecords++;
+
+        if (!sent && (upload->nrecords >= up->batch_records ||
+                      upload->len >= up->batch_size)) {
+                send_batch(up, upload);
+        } else {
+                upload->next = up->pending;
+                up->pending = upload;
+        }
+
+        return 0;
+}
+
+static void complete_upload(struct uploader *up, CURL *curl, CURLcode res)
+{
+        struct upload *upload = NULL;
+        long http_response = 0;
+        bool sent = false;
+
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&upload);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_response);
+        curl_multi_remove_handle(up->multi, curl);
+        up->in_flight--;
+
+        if (res != CURLE_OK) {
+                size_t len = strlen(upload->errorbuf);
+                if (len) {
+                        telem_log(LOG_DEBUG, "Failed sending record: %s%s", upload->errorbuf,
+                                  ((upload->errorbuf[len - 1] != '\n') ? "\n" : ""));
+                } else {
+                        telem_log(LOG_DEBUG, "Failed sending record: %s\n",
+                                  curl_easy_strerror(res));
+                }
+        } else if (http_response != 201 && http_response != 200) {
+                /*  201 means the record was  successfully created
+                 *  200 is a generic "ok".
+                 */
+                telem_log(LOG_ERR, "Encountered error %ld on the server\n",
+                          http_response);
+        } else if (upload->batch) {
+                telem_log(LOG_INFO, "Batch of %u records sent\n", upload->nrecords);
+                sent = true;
+        } else {
+                telem_log(LOG_INFO, "Record sent successfully\n");
+                sent = true;
+        }
+
+        /* Connections are closed once idle since the last response */
+        up->cache.last_used = time(NULL);
+
+        complete_records(upload, sent);
+        release_upload(up, upload);
+}
+
+/* Closes the connections to the backends, no request may be in flight */
+static void close_connections(struct uploader *up)
+{
+        struct upload *upload;
+
+        while ((upload = up->idle) != NULL) {
+                up->idle = upload->next;
+                free_upload(upload);
+        }
+        up->nidle = 0;
+
+        if (up->multi) {
+                curl_multi_cleanup(up->multi);
+                up->multi = NULL;
+        }
+        up->deadline = -1;
+
+        backend_cache_clear(&up->cache);
+}
+
+/* Returns the time in milliseconds until libcurl must be called, -1 if
+ * never */
+static int perform_timeout(struct uploader *up)
+{
+        int64_t remaining;
+
+        if (!up->multi || up->deadline < 0) {
+                return -1;
+        }
+
+        remaining = up->deadline - monotonic_ms();
+        if (remaining <= 0) {
+                return 0;
+        }
+
+        return remaining < INT32_MAX ? (int)remaining : INT32_MAX;
+}
+
+int uploader_init(struct uploader *up, unsigned int max_in_flight)
+{
+        memset(up, 0, sizeof(struct uploader));
+        up->deadline = -1;
+        up->max_in_flight = max_in_flight > 0 ? max_in_flight : 1;
+
+        up->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (up->epfd == -1) {
+                return -errno;
+        }
+
+        return 0;
+}
+
+void uploader_set_batch(struct uploader *up, enum batch_format format,
+                        unsigned int max_records, size_t max_size)
+{
+        up->batch_format = format;
+        up->batch_records = max_records > 0 ? max_records : 1;
+        up->batch_size = max_size;
+}
+
+int uploader_submit(struct uploader *up, const struct backend_config *config,
+                    char *body, upload_done_fn done, void *data)
+{
+        struct backend *backend;
+        struct upload *upload;
+        int ret;
+
+        if (up->batch_format == BATCH_NONE && up->in_flight >= up->max_in_flight) {
+                ret = uploader_wait(up, up->max_in_flight - 1);
+                if (ret < 0) {
+                        free(body);
+                        return ret;
+                }
+        }
+
+        backend = backend_get(&up->cache, config);
+        if (!backend || (!up->multi && !open_multi(up))) {
+                free(body);
+                return -ENOMEM;
+        }
+
+        if (up->batch_format != BATCH_NONE) {
+                return add_to_batch(up, backend, body, done, data);
+        }
+
+        upload = get_upload(up, backend);
+        if (!upload) {
+                free(body);
+                return -ENOMEM;
+        }
+
+        upload->body = body;
+        upload->len = strlen(body);
+        upload->records[0].done = done;
+        upload->records[0].data = data;
+        upload->nrecords = 1;
+
+        ret = send_upload(up, upload);
+        if (ret < 0) {
+                upload->nrecords = 0;
+                release_upload(up, upload);
+        }
+
+        return ret;
+}
+
+void uploader_flush(struct uploader *up)
+{
+        struct upload *upload;
+
+        while ((upload = up->pending) != NULL) {
+                up->pending = upload->next;
+                upload->next = NULL;
+                send_batch(up, upload);
+        }
+}
+
+void uploader_perform(struct uploader *up)
+{
+        struct epoll_event events[UPLOADER_MAX_EVENTS];
+        CURLMsg *msg;
+        int running, left, n;
+
+        if (!up->multi) {
+                return;
+        }
+
+        n = epoll_wait(up->epfd, events, UPLOADER_MAX_EVENTS, 0);
+        for (int i = 0; i < n; i++) {
+                int flags = 0;
+
+                if (events[i].events & EPOLLIN) {
+                        flags |= CURL_CSELECT_IN;
+                }
+                if (events[i].events & EPOLLOUT) {
+                        flags |= CURL_CSELECT_OUT;
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                        flags |= CURL_CSELECT_ERR;
+                }
+                curl_multi_socket_action(up->multi, events[i].data.fd, flags, &running);
+        }
+
+        /* The timer is only set again if libcurl needs it */
+        if (up->deadline >= 0 && monotonic_ms() >= up->deadline) {
+                up->deadline = -1;
+                curl_multi_socket_action(up->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
+
+        while (up->multi && (msg = curl_multi_info_read(up->multi, &left)) != NULL) {
+                if (msg->msg == CURLMSG_DONE) {
+                        complete_upload(up, msg->easy_handle, msg->data.result);
+                }
+        }
+}
+
+int uploader_wait(struct uploader *up, unsigned int in_flight)
+{
+        struct pollfd pfd = { up->epfd, POLLIN, 0 };
+        int timeout;
+
+        while (up->in_flight > in_flight) {
+                /* libcurl always has a timeout while requests are in flight,
+                 * this is only a safeguard */
+                timeout = perform_timeout(up);
+                if (timeout < 0 || timeout > 1000) {
+                        timeout = 1000;
+                }
+
+                if (poll(&pfd, 1, timeout) == -1 && errno != EINTR) {
+                        int ret = -errno;
+                        telem_perror("Failed to poll uploads");
+                        return ret;
+                }
+                uploader_perform(up);
+        }
+
+        return 0;
+}
+
+int uploader_timeout(struct uploader *up, int idle_time)
+{
+        int timeout = perform_timeout(up);
+        int idle_timeout;
+
+        if (up->pending) {
+                return 0;
+        }
+        if (up->in_flight > 0) {
+                return timeout;
+        }
+
+        idle_timeout = backend_cache_timeout(&up->cache, idle_time, time(NULL));
+        if (timeout < 0 || (idle_timeout >= 0 && idle_timeout < timeout)) {
+                return idle_timeout;
+        }
+
+        return timeout;
+}
+
+void uploader_expire(struct uploader *up, int idle_time, time_t now)
+{
+        if (up->in_flight == 0 && !up->pending && up->cache.backends &&
+            backend_cache_timeout(&up->cache, idle_time, now) == 0) {
+                telem_debug("DEBUG: Closing idle backend connections\n");
+                close_connections(up);
+        }
+}
+
+void uploader_close(struct uploader *up)
+{
+        uploader_flush(up);
+        if (uploader_wait(up, 0) < 0) {
+                telem_log(LOG_ERR, "Abandoning %u records posted\n", up->in_flight);
+        }
+        if (up->in_flight == 0) {
+                close_connections(up);
+        }
+
+        if (up->epfd >= 0) {
+                close(up->epfd);
+                up->epfd = -1;
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
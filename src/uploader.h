@@ -0,0 +1,200 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include "backend.h"
+#include "configuration.h"
+
+/**
+ * Called once the POST of a record completed
+ *
+ * @param sent Whether the backend accepted the record
+ * @param data The data given with the record
+ */
+typedef void (*upload_done_fn)(bool sent, void *data);
+
+/* A record of a request, and its completion */
+struct upload_record {
+        upload_done_fn done;
+        void *data;
+};
+
+/* A POST request, with the handle it is sent with */
+struct upload {
+        CURL *curl;
+        struct backend *backend;
+        /* the request body, and the space allocated for it if it is a
+         * batch */
+        char *body;
+        size_t len;
+        size_t size;
+        /* the records of the body, one unless it is a batch */
+        struct upload_record *records;
+        unsigned int nrecords;
+        /* whether the body is a batch of records, whose response holds the
+         * status of each record */
+        bool batch;
+        char *response;
+        size_t response_len;
+        /* the body compressed for the backend, and the space allocated for
+         * it */
+        char *encoded;
+        size_t encoded_size;
+        char errorbuf[CURL_ERROR_SIZE];
+        struct upload *next;
+};
+
+/*
+ * Posts records without blocking, through the libcurl multi interface. Up to
+ * max_in_flight requests are sent at once; the sockets of the requests are
+ * watched by an epoll instance, which the caller polls along with its own
+ * file descriptors. Connections, and libcurl, are kept until no record was
+ * posted for idle_time seconds. Records may be packed in batches, one
+ * request for several records. Not thread-safe.
+ */
+struct uploader {
+        struct backend_cache cache;
+        CURLM *multi;
+        /* epoll instance watching the sockets of the requests */
+        int epfd;
+        /* CLOCK_MONOTONIC time in milliseconds at which libcurl must be
+         * called, -1 if none */
+        int64_t deadline;
+        unsigned int max_in_flight;
+        unsigned int in_flight;
+        /* requests not in flight, which keep their handle */
+        struct upload *idle;
+        unsigned int nidle;
+        /* how records are packed in a request, and when a batch is full */
+        enum batch_format batch_format;
+        unsigned int batch_records;
+        size_t batch_size;
+        /* batches not sent yet, one per backend */
+        struct upload *pending;
+};
+
+/**
+ * Initialize an uploader
+ *
+ * @param up The uploader
+ * @param max_in_flight The maximum number of requests sent at once
+ *
+ * @return 0 on success, a negative errno if the epoll instance could not be
+ *         created
+ */
+int uploader_init(struct uploader *up, unsigned int max_in_flight);
+
+/**
+ * Pack the records posted in batches
+ *
+ * A batch is sent once it holds max_records records, or its body reaches
+ * max_size bytes, or uploader_flush() is called. The server answers a batch
+ * with a JSON array of the HTTP status of each record; if it does not, the
+ * status of the request applies to all the records. Called before records
+ * are posted.
+ *
+ * @param up The uploader
+ * @param format How records are packed, BATCH_NONE to post each on its own
+ * @param max_records The maximum number of records of a batch
+ * @param max_size The size in bytes after which a batch is sent
+ */
+void uploader_set_batch(struct uploader *up, enum batch_format format,
+                        unsigned int max_records, size_t max_size);
+
+/**
+ * Start posting a record
+ *
+ * Waits for a request to complete first if max_in_flight are in flight, in
+ * which case the completion of other records is called. With batching, the
+ * record is added to the batch of its backend, which is only sent once full.
+ *
+ * @param up The uploader
+ * @param config The settings the record is posted with
+ * @param body The request body, which the uploader frees
+ * @param done Called once the request completed, unless an error is returned
+ * @param data Passed to done
+ *
+ * @return 0 on success, a negative errno if the request could not be started
+ */
+int uploader_submit(struct uploader *up, const struct backend_config *config,
+                    char *body, upload_done_fn done, void *data);
+
+/**
+ * Send the batches not full yet
+ *
+ * @param up The uploader
+ */
+void uploader_flush(struct uploader *up);
+
+/**
+ * Make progress on the requests in flight without blocking
+ *
+ * Called when the epoll instance is readable, or the timeout returned by
+ * uploader_timeout() elapsed. Calls the completion of the requests that
+ * completed.
+ *
+ * @param up The uploader
+ */
+void uploader_perform(struct uploader *up);
+
+/**
+ * Wait until at most in_flight requests are in flight
+ *
+ * Batches not sent yet are not waited for, see uploader_flush().
+ *
+ * @param up The uploader
+ * @param in_flight The number of requests left in flight
+ *
+ * @return 0 on success, a negative errno if polling failed
+ */
+int uploader_wait(struct uploader *up, unsigned int in_flight);
+
+/**
+ * Get the time until uploader_flush(), uploader_perform() or uploader_expire()
+ * must be called
+ *
+ * @param up The uploader
+ * @param idle_time The idle time in seconds after which connections are closed
+ *
+ * @return The time in milliseconds, or -1 if nothing is pending
+ */
+int uploader_timeout(struct uploader *up, int idle_time);
+
+/**
+ * Close the connections and release libcurl if no record was posted for
+ * idle_time seconds
+ *
+ * @param up The uploader
+ * @param idle_time The idle time in seconds
+ * @param now The current time
+ */
+void uploader_expire(struct uploader *up, int idle_time, time_t now);
+
+/**
+ * Send the batches not sent yet, wait for the requests in flight, then close
+ * the uploader
+ *
+ * @param up The uploader
+ */
+void uploader_close(struct uploader *up);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -16,8 +16,6 @@
 
 #define _GNU_SOURCE
 
-#define RANDOM_ID_LEN 32
-
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
@@ -30,11 +28,16 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "util.h"
 #include "log.h"
 
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
 bool get_header(const char *haystack, const char *needle, char **line)
 {
         size_t len = strlen(needle);
@@ -46,6 +49,21 @@ bool get_header(const char *haystack, const char *needle, char **line)
         return false;
 }
 
+bool get_default_header(int ind, char **line)
+{
+        const char *value = get_header_default(ind);
+
+        if (value == NULL) {
+                return false;
+        }
+
+        if (asprintf(line, "%s: %s", get_header_name(ind), value) < 0) {
+                return false;
+        }
+
+        return true;
+}
+
 bool get_header_value(const char *header, char **value)
 {
         char *sep = NULL;
@@ -131,6 +149,156 @@ long get_directory_size(const char *dir_path)
         return total_size;
 }
 
+/* Random bytes fetched from the kernel at once, enough for 256 ids */
+#define RANDOM_POOL_SIZE 4096
+
+/* Each thread draws ids from its own pool, so no locking is needed */
+static __thread struct {
+        uint8_t bytes[RANDOM_POOL_SIZE];
+        size_t avail;
+} random_pool;
+
+/* Two hex digits for each byte value */
+static char hex_pairs[256][2];
+
+static pthread_once_t random_once = PTHREAD_ONCE_INIT;
+
+/* A forked child must not hand out the ids left in its parent's pool */
+static void random_pool_atfork_child(void)
+{
+        random_pool.avail = 0;
+}
+
+static void random_init(void)
+{
+        const char digits[] = "0123456789abcdef";
+
+        for (int i = 0; i < 256; i++) {
+                hex_pairs[i][0] = digits[i >> 4];
+                hex_pairs[i][1] = digits[i & 0xf];
+        }
+
+        pthread_atfork(NULL, NULL, random_pool_atfork_child);
+}
+
+/**
+ * Refill the calling thread's random pool, from getrandom() if available
+ * and /dev/urandom otherwise.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int fill_random_pool(void)
+{
+        size_t len = 0;
+        ssize_t rc;
+        int fd;
+
+#ifdef HAVE_GETRANDOM
+        while (len < RANDOM_POOL_SIZE) {
+                rc = getrandom(random_pool.bytes + len, RANDOM_POOL_SIZE - len, 0);
+                if (rc < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        } else if (errno == ENOSYS) {
+                                break;
+                        }
+                        return -1;
+                }
+                len += (size_t)rc;
+        }
+
+        if (len == RANDOM_POOL_SIZE) {
+                random_pool.avail = RANDOM_POOL_SIZE;
+                return 0;
+        }
+#endif
+
+        fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return -1;
+        }
+
+        while (len < RANDOM_POOL_SIZE) {
+                rc = read(fd, random_pool.bytes + len, RANDOM_POOL_SIZE - len);
+                if (rc < 0 && errno == EINTR) {
+                        continue;
+                } else if (rc <= 0) {
+                        close(fd);
+                        return -1;
+                }
+                len += (size_t)rc;
+        }
+
+        close(fd);
+        random_pool.avail = RANDOM_POOL_SIZE;
+
+        return 0;
+}
+
+/**
+ * Take len random bytes from the calling thread's pool.
+ *
+ * @return The bytes, or NULL on failure
+ */
+static const uint8_t *take_random_bytes(size_t len)
+{
+        const uint8_t *bytes;
+
+        pthread_once(&random_once, random_init);
+
+        if (random_pool.avail < len && fill_random_pool() != 0) {
+                return NULL;
+        }
+
+        bytes = random_pool.bytes + RANDOM_POOL_SIZE - random_pool.avail;
+        random_pool.avail -= len;
+
+        return bytes;
+}
+
+/**
+ * Generates a random number, for sampling
+ *
+ * @param value pointer to copy the number to
+ *
+ * @return 0 on success, -1 on failure
+ */
+int get_random_u64(uint64_t *value)
+{
+        const uint8_t *bytes = take_random_bytes(sizeof(uint64_t));
+
+        if (bytes == NULL) {
+                return -1;
+        }
+
+        memcpy(value, bytes, sizeof(uint64_t));
+
+        return 0;
+}
+
+/**
+ * Generates a 32 characters random id in place
+ *
+ * @param buff pointer to RANDOM_ID_LEN + 1 bytes to copy the id to
+ *
+ * @return 0 on success, -1 on failure
+ */
+int fill_random_id(char *buff)
+{
+        const uint8_t *bytes = take_random_bytes(RANDOM_ID_LEN / 2);
+
+        if (bytes == NULL) {
+                return -1;
+        }
+
+        for (int i = 0; i < RANDOM_ID_LEN / 2; i++) {
+                memcpy(buff + 2 * i, hex_pairs[bytes[i]], 2);
+        }
+        buff[RANDOM_ID_LEN] = '\0';
+
+        return 0;
+}
+
 /**
  * Generates a 32 characters random id
  *
@@ -139,24 +307,18 @@ long get_directory_size(const char *dir_path)
  */
 int get_random_id(char **buff)
 {
-        int result = -1;
-        int frandom = -1;
-        uint64_t random_id[2] = { '\0' };
-
-        frandom = open("/dev/urandom", O_RDONLY);
-        if (frandom < 0) {
+        *buff = malloc(RANDOM_ID_LEN + 1);
+        if (*buff == NULL) {
                 return -1;
         }
 
-        if (read(frandom, &random_id, sizeof(random_id)) == sizeof(random_id)) {
-                if (asprintf(buff, "%.16" PRIx64 "%.16" PRIx64, random_id[0], random_id[1]) == RANDOM_ID_LEN) {
-                        result = 0;
-                }
+        if (fill_random_id(*buff) != 0) {
+                free(*buff);
+                *buff = NULL;
+                return -1;
         }
 
-        close(frandom);
-
-        return result;
+        return 0;
 }
 
 /**
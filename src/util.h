@@ -17,6 +17,10 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+
+/* Length of the ids made by fill_random_id() and get_random_id() */
+#define RANDOM_ID_LEN 32
 
 /* Increase memory allocated */
 void *reallocate(void **addr, size_t *allocated, size_t requested);
@@ -24,12 +28,21 @@ void *reallocate(void **addr, size_t *allocated, size_t requested);
 /* Check if haystacks begins with needle and return a copy of haystack */
 bool get_header(const char *haystack, const char *needle, char **line);
 
+/* Set line to header ind with its default value, if the header has one */
+bool get_default_header(int ind, char **line);
+
 /* Get the value of a header */
 bool get_header_value(const char *header, char **value);
 
 /* Get the size of the directory */
 long get_directory_size(const char *sdir);
 
+/* Write a random id of RANDOM_ID_LEN hex digits and a null byte to buff */
+int fill_random_id(char *buff);
+
+/* Get a random number, for sampling */
+int get_random_u64(uint64_t *value);
+
 /* Initialize buff and copy generated id */
 int get_random_id(char **buff);
 
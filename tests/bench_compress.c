@@ -0,0 +1,299 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Measures the bytes on the wire and the CPU time per record of each
+ * Content-Encoding telempostd can post with.
+ *
+ * Records like the ones create_json_message() encodes are generated, with
+ * the fields a fleet shares and the ones that differ per machine and per
+ * event, and compressed one request at a time, one record per request and
+ * then in JSON batches. The bytes exclude the Content-Encoding header, 24
+ * bytes per request. With zstd, a dictionary is also trained on other
+ * records, the way a backend would train the one it shares with clients:
+ * bench_compress [records]
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_ZDICT_H
+#include <zdict.h>
+#endif
+
+#include "compress.h"
+
+#define DEFAULT_RECORDS 2000
+#define BATCH_RECORDS 32
+#define RECORD_SIZE 4096
+#define TRAINING_RECORDS 2000
+#define DICTIONARY_SIZE (64 * 1024)
+
+struct method {
+        const char *name;
+        enum compression method;
+        int level;
+        bool dictionary;
+};
+
+static const struct method methods[] = {
+        { "none", COMPRESSION_NONE, 0, false },
+        { "gzip 1", COMPRESSION_GZIP, 1, false },
+        { "gzip 6", COMPRESSION_GZIP, 6, false },
+        { "gzip 9", COMPRESSION_GZIP, 9, false },
+        { "zstd 1", COMPRESSION_ZSTD, 1, false },
+        { "zstd 3", COMPRESSION_ZSTD, 3, false },
+        { "zstd 19", COMPRESSION_ZSTD, 19, false },
+        { "zstd 3 + dictionary", COMPRESSION_ZSTD, 3, true },
+};
+
+static const char *classifications[] = {
+        "org.clearlinux/crash/clr", "org.clearlinux/kernel/warning",
+        "org.clearlinux/swupd/error", "org.clearlinux/hello/world",
+};
+
+static const char *payloads[] = {
+        "hello\\n",
+        "Process: /usr/bin/gnome-shell\\nPID: %u\\nSignal: 11\\nBacktrace (reliable):\\n"
+        "#0 g_main_context_dispatch() - [libglib-2.0.so.0]\\n#1 g_main_loop_run() -"
+        " [libglib-2.0.so.0]\\n#2 meta_run() - [libmutter-5.so.0]\\n",
+        "WARNING: CPU: %u PID: 1 at drivers/gpu/drm/i915/intel_pm.c:3471 "
+        "skl_update_other_pipe_wm+0x15e/0x170\\nModules linked in: i915 e1000e\\n",
+        "swupd update failed: error code %u\\nversion: 31000 -> 31010\\n",
+};
+
+static unsigned int seed = 1;
+
+static unsigned int next_random(void)
+{
+        seed = seed * 1103515245 + 12345;
+        return seed >> 8;
+}
+
+/* Generates a record, the ids and timestamps differ per record */
+static size_t generate_record(char *record)
+{
+        unsigned int kind = next_random() % 4;
+        char payload[512];
+        int len;
+
+        snprintf(payload, sizeof(payload), payloads[kind], next_random() % 4096);
+        len = snprintf(record, RECORD_SIZE,
+                       "{\"record_format_version\":\"5\",\"classification\":\"%s\","
+                       "\"severity\":\"%u\",\"machine_id\":\"%08x%08x%08x%08x\","
+                       "\"creation_timestamp\":\"%u\",\"arch\":\"x86_64\",\"host_type\":"
+                       "\"blank|blank|blank\",\"build\":\"%u\",\"kernel_version\":"
+                       "\"5.4.%u-1-native\",\"payload_format_version\":\"1\","
+                       "\"system_name\":\"clear-linux-os\",\"board_name\":\"Qemu|Intel\","
+                       "\"cpu_model\":\"Intel(R) Core(TM) i7-5650U CPU\",\"bios_version\":"
+                       "\"Qemu\",\"event_id\":\"%08x%08x%08x%08x\",\"dropped_count\":\"0\","
+                       "\"sample_rate\":\"1\",\"payload\":\"%s\"}", classifications[kind],
+                       next_random() % 4 + 1, next_random() % 64, next_random(),
+                       next_random(), next_random(), 1418672344 + next_random() % 86400,
+                       31000 + next_random() % 4 * 10, next_random() % 30, next_random(),
+                       next_random(), next_random(), next_random(), payload);
+
+        return (size_t)len;
+}
+
+static double cpu_time(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+#ifdef HAVE_ZDICT_H
+/* Trains a dictionary on records the measured ones are not part of */
+static int train_dictionary(const char *path)
+{
+        char *samples = malloc(TRAINING_RECORDS * RECORD_SIZE);
+        size_t sizes[TRAINING_RECORDS];
+        char *dict = malloc(DICTIONARY_SIZE);
+        size_t len = 0, ret;
+        FILE *fp;
+
+        if (!samples || !dict) {
+                free(samples);
+                free(dict);
+                return -1;
+        }
+        for (int i = 0; i < TRAINING_RECORDS; i++) {
+                sizes[i] = generate_record(samples + len);
+                len += sizes[i];
+        }
+        ret = ZDICT_trainFromBuffer(dict, DICTIONARY_SIZE, samples, sizes,
+                                    TRAINING_RECORDS);
+        free(samples);
+        if (ZDICT_isError(ret) || (fp = fopen(path, "w")) == NULL) {
+                free(dict);
+                return -1;
+        }
+        fwrite(dict, 1, ret, fp);
+        fclose(fp);
+        free(dict);
+
+        return 0;
+}
+#endif
+
+/* Compresses the records in requests of batch records each */
+static int run(const struct method *m, const char *dictionary, char **records,
+               size_t *lens, int nrecords, int batch)
+{
+        struct compressor c;
+        char *body = malloc((size_t)batch * (RECORD_SIZE + 1) + 2);
+        char *out = NULL;
+        size_t size = 0, raw = 0, wire = 0;
+        double start, elapsed;
+        int ret = 0;
+
+        if (!body || compressor_init(&c, m->method, m->level, m->dictionary ?
+                                     dictionary : "") < 0) {
+                free(body);
+                return -1;
+        }
+
+        start = cpu_time();
+        for (int i = 0; i < nrecords; i += batch) {
+                size_t len = 0;
+                ssize_t n;
+
+                /* One record, or a JSON array of them */
+                if (batch == 1) {
+                        memcpy(body, records[i], lens[i]);
+                        len = lens[i];
+                } else {
+                        body[len++] = '[';
+                        for (int j = i; j < i + batch && j < nrecords; j++) {
+                                if (j > i) {
+                                        body[len++] = ',';
+                                }
+                                memcpy(body + len, records[j], lens[j]);
+                                len += lens[j];
+                        }
+                        body[len++] = ']';
+                }
+                raw += len;
+
+                if (m->method == COMPRESSION_NONE) {
+                        wire += len;
+                        continue;
+                }
+                n = compressor_compress(&c, body, len, &out, &size);
+                if (n < 0) {
+                        ret = -1;
+                        break;
+                }
+                wire += (size_t)n;
+        }
+        elapsed = cpu_time() - start;
+
+        if (ret == 0) {
+                printf("%-20s %8.1f bytes/record %6.1f%% %8.2f us/record\n", m->name,
+                       (double)wire / nrecords, 100.0 * (double)wire / (double)raw,
+                       elapsed * 1e6 / nrecords);
+        }
+
+        compressor_free(&c);
+        free(out);
+        free(body);
+        return ret;
+}
+
+int main(int argc, char **argv)
+{
+        int nrecords = argc > 1 ? atoi(argv[1]) : DEFAULT_RECORDS;
+        char dictionary[] = "/tmp/bench_compress_dictXXXXXX";
+        char **records;
+        size_t *lens, total = 0;
+        int ret = EXIT_SUCCESS;
+
+        if (nrecords <= 0) {
+                fprintf(stderr, "Usage: %s [records]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+#ifdef HAVE_ZDICT_H
+        int fd = mkstemp(dictionary);
+        if (fd < 0) {
+                perror("mkstemp");
+                return EXIT_FAILURE;
+        }
+        close(fd);
+        if (train_dictionary(dictionary) < 0) {
+                fprintf(stderr, "Unable to train a dictionary\n");
+                dictionary[0] = '\0';
+        }
+#else
+        dictionary[0] = '\0';
+#endif
+
+        records = calloc((size_t)nrecords, sizeof(char *));
+        lens = calloc((size_t)nrecords, sizeof(size_t));
+        if (!records || !lens) {
+                perror("calloc");
+                return EXIT_FAILURE;
+        }
+        for (int i = 0; i < nrecords; i++) {
+                records[i] = malloc(RECORD_SIZE);
+                if (!records[i]) {
+                        perror("malloc");
+                        return EXIT_FAILURE;
+                }
+                lens[i] = generate_record(records[i]);
+                total += lens[i];
+        }
+
+        for (int batch = 1; batch <= BATCH_RECORDS; batch *= BATCH_RECORDS) {
+                printf("%d records of %zu bytes on average, %d per request\n", nrecords,
+                       total / (size_t)nrecords, batch);
+                for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+#ifndef HAVE_ZSTD_H
+                        if (methods[i].method == COMPRESSION_ZSTD) {
+                                continue;
+                        }
+#endif
+                        if (methods[i].dictionary && dictionary[0] == '\0') {
+                                continue;
+                        }
+                        if (run(&methods[i], dictionary, records, lens, nrecords,
+                                batch) < 0) {
+                                fprintf(stderr, "%s: Unable to compress\n",
+                                        methods[i].name);
+                                ret = EXIT_FAILURE;
+                        }
+                }
+        }
+
+        if (dictionary[0] != '\0') {
+                unlink(dictionary);
+        }
+        for (int i = 0; i < nrecords; i++) {
+                free(records[i]);
+        }
+        free(records);
+        free(lens);
+
+        return ret;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
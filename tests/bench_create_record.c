@@ -0,0 +1,118 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Measures how many records per second tm_create_record() can build.
+ *
+ * The "uncached" run forces a host info reload before every record, which is
+ * what record creation cost before the host info cache was introduced. The
+ * "cached" run is the normal code path, and the "template" run creates the
+ * records from a template prepared with tm_prepare_record().
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "telemetry.h"
+
+#define DEFAULT_ITERATIONS 20000
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double run(long iterations, int refresh)
+{
+        struct telem_ref *ref = NULL;
+        double start, elapsed;
+
+        start = now();
+        for (long i = 0; i < iterations; i++) {
+                if (refresh && tm_refresh_host_info() < 0) {
+                        fprintf(stderr, "tm_refresh_host_info() failed\n");
+                        exit(EXIT_FAILURE);
+                }
+                if (tm_create_record(&ref, 1, "org.clearlinux/bench/create", 1) < 0) {
+                        fprintf(stderr, "tm_create_record() failed\n");
+                        exit(EXIT_FAILURE);
+                }
+                tm_free_record(ref);
+        }
+        elapsed = now() - start;
+
+        return (double)iterations / elapsed;
+}
+
+static double run_template(long iterations)
+{
+        struct tm_template *tmpl = NULL;
+        struct telem_ref *ref = NULL;
+        double start, elapsed;
+
+        if (tm_prepare_record(&tmpl, 1, "org.clearlinux/bench/create", 1) < 0) {
+                fprintf(stderr, "tm_prepare_record() failed\n");
+                exit(EXIT_FAILURE);
+        }
+
+        start = now();
+        for (long i = 0; i < iterations; i++) {
+                if (tm_record_from_template(tmpl, &ref) < 0) {
+                        fprintf(stderr, "tm_record_from_template() failed\n");
+                        exit(EXIT_FAILURE);
+                }
+                tm_free_record(ref);
+        }
+        elapsed = now() - start;
+
+        tm_free_template(tmpl);
+
+        return (double)iterations / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+        long iterations = DEFAULT_ITERATIONS;
+        double uncached, cached, from_template;
+
+        if (argc > 1) {
+                iterations = strtol(argv[1], NULL, 10);
+                if (iterations <= 0) {
+                        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        uncached = run(iterations, 1);
+        cached = run(iterations, 0);
+        from_template = run_template(iterations);
+
+        printf("tm_create_record, %ld iterations\n", iterations);
+        printf("  uncached host info: %12.0f records/s\n", uncached);
+        printf("  cached host info:   %12.0f records/s\n", cached);
+        printf("  speedup:            %12.1fx\n", cached / uncached);
+        printf("  from template:      %12.0f records/s\n", from_template);
+        printf("  template speedup:   %12.1fx\n", from_template / cached);
+
+        return EXIT_SUCCESS;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
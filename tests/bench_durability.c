@@ -0,0 +1,184 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Measures the staging throughput of each durability mode, against the
+ * records that a crash could lose.
+ *
+ * Records are appended to a segment as telemprobd stages them, under each
+ * policy in turn. The loss window is the largest number of appended records
+ * that were not synced yet at any time, and for how long the oldest of them
+ * waited. With "none" the window is only bounded by the kernel writeback.
+ *
+ * Run it on the file system of the spool directory, tmpfs makes syncs free:
+ * bench_durability [records] [directory]
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "segment.h"
+
+#define DEFAULT_RECORDS 2000
+#define DEFAULT_DIR "/var/tmp"
+#define RECORD_SIZE 1024
+
+struct policy {
+        const char *name;
+        enum durability_mode mode;
+        unsigned int group_records;
+        unsigned int group_interval;
+};
+
+static const struct policy policies[] = {
+        { "none", DURABILITY_NONE, 1, 0 },
+        { "per-record", DURABILITY_PER_RECORD, 1, 0 },
+        { "group 16/10ms", DURABILITY_GROUP, 16, 10 },
+        { "group 64/100ms", DURABILITY_GROUP, 64, 100 },
+        { "group 256/1000ms", DURABILITY_GROUP, 256, 1000 },
+};
+
+static char record[RECORD_SIZE];
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what)
+{
+        fprintf(stderr, "%s failed\n", what);
+        exit(EXIT_FAILURE);
+}
+
+static void remove_segments(const char *dir)
+{
+        DIR *d = opendir(dir);
+        struct dirent *entry;
+        char path[PATH_MAX];
+
+        if (!d) {
+                return;
+        }
+        while ((entry = readdir(d)) != NULL) {
+                int ret;
+
+                if (!segment_is_open(entry->d_name) && !segment_is_sealed(entry->d_name)) {
+                        continue;
+                }
+                ret = snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+                if (ret > 0 && (size_t)ret < sizeof(path)) {
+                        unlink(path);
+                }
+        }
+        closedir(d);
+}
+
+static void run(const struct policy *policy, long records, const char *dir)
+{
+        struct segment_writer writer;
+        struct iovec iov = { record, sizeof(record) };
+        unsigned int max_pending = 0;
+        double first_pending = 0, max_wait = 0;
+        double start, elapsed;
+
+        if (segment_writer_init(&writer) < 0) {
+                fail("segment_writer_init()");
+        }
+        /* Keep every record in one segment */
+        writer.max_size = (size_t)records * (RECORD_SIZE + 64);
+        writer.max_age = 3600;
+        sync_policy_init(&writer.sync, policy->mode, policy->group_records,
+                         policy->group_interval);
+
+        start = now();
+        for (long i = 0; i < records; i++) {
+                double t = now();
+
+                if (writer.sync.pending == 0) {
+                        first_pending = t;
+                }
+                if (segment_append(&writer, dir, &iov, 1) < 0) {
+                        fail("segment_append()");
+                }
+                if (writer.sync.pending > max_pending) {
+                        max_pending = writer.sync.pending;
+                }
+                if (writer.sync.pending == 0 && policy->mode != DURABILITY_NONE) {
+                        t = now() - first_pending;
+                        if (t > max_wait) {
+                                max_wait = t;
+                        }
+                }
+        }
+        elapsed = now() - start;
+
+        if (policy->mode == DURABILITY_NONE) {
+                printf("  %-17s %10.0f records/s %8d syncs   unbounded\n", policy->name,
+                       (double)records / elapsed, 0);
+        } else {
+                printf("  %-17s %10.0f records/s %8" PRIu64 " syncs %6u records %8.2f ms\n",
+                       policy->name, (double)records / elapsed, writer.sync.syncs,
+                       max_pending, max_wait * 1000);
+        }
+
+        segment_writer_close(&writer);
+        remove_segments(dir);
+}
+
+int main(int argc, char **argv)
+{
+        long records = DEFAULT_RECORDS;
+        const char *base = DEFAULT_DIR;
+        char dir[PATH_MAX];
+
+        if (argc > 1) {
+                records = strtol(argv[1], NULL, 10);
+                if (records <= 0) {
+                        fprintf(stderr, "Usage: %s [records] [directory]\n", argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (argc > 2) {
+                base = argv[2];
+        }
+
+        snprintf(dir, sizeof(dir), "%s/bench_durability.XXXXXX", base);
+        if (!mkdtemp(dir)) {
+                fail("mkdtemp()");
+        }
+
+        memset(record, 'x', sizeof(record));
+        printf("durability, %ld records of %d bytes in %s\n", records, RECORD_SIZE, base);
+        printf("  %-17s %20s %14s %24s\n", "mode", "throughput", "", "max unsynced");
+        for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+                run(&policies[i], records, dir);
+        }
+
+        rmdir(dir);
+
+        return EXIT_SUCCESS;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
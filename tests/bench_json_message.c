@@ -0,0 +1,246 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Measures how many records per second telempostd encodes as JSON.
+ *
+ * Each record is encoded the way create_json_message() used to, with a
+ * json-c object per header, and then with the streaming encoder into a
+ * reused buffer, both followed by the copy handed to the uploader. The
+ * json-c encoding splits the headers in place, so it first restores them,
+ * which costs less than the strdup() of each header it required. The two
+ * outputs are checked to be the same. Records are the samples of
+ * tests/telempostd that parse, then records with their headers and generated
+ * payloads of several sizes, plain text and text with many characters to
+ * escape:
+ * bench_json_message [iterations]
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <json-c/json.h>
+
+#include "common.h"
+#include "iorecord.h"
+#include "jsonenc.h"
+
+#define DEFAULT_ITERATIONS 20000
+#define HEADER_SIZE 256
+
+struct sample {
+        char name[32];
+        char **headers;
+        char *payload;
+};
+
+static char scratch[NUM_HEADERS][HEADER_SIZE];
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* The encoding create_json_message() had, on a copy of the headers */
+static char *encode_json_c(char *headers[], const char *payload)
+{
+        char *tm_headers[NUM_HEADERS];
+        char *json_string;
+        json_object *root = json_object_new_object();
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                tm_headers[i] = scratch[i];
+                strcpy(tm_headers[i], headers[i]);
+                strtok(tm_headers[i], ":");
+                json_object *value = json_object_new_string(strtok(NULL, " "));
+                json_object_object_add(root, tm_headers[i], value);
+        }
+        json_object *json_payload = json_object_new_string(payload);
+        json_object_object_add(root, "payload", json_payload);
+
+        json_string = strdup(json_object_to_json_string_ext(root,
+                                                            JSON_C_TO_STRING_PLAIN |
+                                                            JSON_C_TO_STRING_NOSLASHESCAPE));
+        json_object_put(root);
+
+        return json_string;
+}
+
+static char *encode_stream(struct json_buffer *buf, char *headers[], const char *payload)
+{
+        char *json_string;
+
+        if (json_encode_record(buf, headers, payload) < 0) {
+                return NULL;
+        }
+        json_string = malloc(buf->len + 1);
+        if (json_string) {
+                memcpy(json_string, buf->data, buf->len + 1);
+        }
+
+        return json_string;
+}
+
+/* Generates a payload of len bytes, one in every escape_every needing an
+ * escape, or none if 0 */
+static char *generate_payload(size_t len, size_t escape_every)
+{
+        static const char text[] = "kernel: BUG: unable to handle page fault at "
+                                   "ffffffffc0a1b2c3 /usr/lib/modules ";
+        static const char escaped[] = "\n\t\"\\";
+        char *payload = malloc(len + 1);
+
+        if (!payload) {
+                return NULL;
+        }
+        for (size_t i = 0; i < len; i++) {
+                if (escape_every && i % escape_every == escape_every - 1) {
+                        payload[i] = escaped[i / escape_every % 4];
+                } else {
+                        payload[i] = text[i % (sizeof(text) - 1)];
+                }
+        }
+        payload[len] = '\0';
+
+        return payload;
+}
+
+static int run(const struct sample *sample, int iterations)
+{
+        struct json_buffer buf = { NULL, 0, 0 };
+        double start, json_c, stream;
+        char *expected, *json;
+        int ret = 0;
+
+        expected = encode_json_c(sample->headers, sample->payload);
+        json = encode_stream(&buf, sample->headers, sample->payload);
+        if (!expected || !json || strcmp(expected, json) != 0) {
+                fprintf(stderr, "%s: the encodings differ\n", sample->name);
+                ret = -1;
+        }
+        free(expected);
+        free(json);
+
+        if (ret == 0) {
+                start = now();
+                for (int i = 0; i < iterations; i++) {
+                        free(encode_json_c(sample->headers, sample->payload));
+                }
+                json_c = now() - start;
+
+                start = now();
+                for (int i = 0; i < iterations; i++) {
+                        free(encode_stream(&buf, sample->headers, sample->payload));
+                }
+                stream = now() - start;
+
+                printf("%-24s %6zu bytes %8.0f records/s %8.0f records/s %5.1fx\n",
+                       sample->name, buf.len, iterations / json_c,
+                       iterations / stream, json_c / stream);
+        }
+
+        json_buffer_free(&buf);
+        return ret;
+}
+
+/* Reads a sample, returns false if it is not a valid record */
+static bool read_sample(const char *file, char *headers[], char **payload)
+{
+        char path[PATH_MAX];
+        char *cfg_file;
+
+        snprintf(path, sizeof(path), "%s/tests/telempostd/%s", ABSTOPSRCDIR, file);
+        if (!read_record(path, headers, payload, &cfg_file)) {
+                return false;
+        }
+        free(cfg_file);
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                if (strlen(headers[i]) >= HEADER_SIZE) {
+                        fprintf(stderr, "%s: Header too long\n", file);
+                        for (int k = 0; k < NUM_HEADERS; k++) {
+                                free(headers[k]);
+                        }
+                        free(*payload);
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+int main(int argc, char **argv)
+{
+        int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+        static const char *files[] = { "correct_message", "empty_message",
+                                       "incorrect_headers", "incorrect_message" };
+        static const size_t sizes[] = { 64, 1024, 8192 };
+        static char *headers[sizeof(files) / sizeof(files[0])][NUM_HEADERS];
+        struct sample samples[16];
+        size_t nsamples = 0, nfiles = 0;
+        int ret = EXIT_SUCCESS;
+
+        if (iterations <= 0) {
+                fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+                if (read_sample(files[i], headers[nfiles], &samples[nsamples].payload)) {
+                        snprintf(samples[nsamples].name, sizeof(samples[0].name), "%s",
+                                 files[i]);
+                        samples[nsamples++].headers = headers[nfiles++];
+                }
+        }
+        if (nfiles == 0) {
+                fprintf(stderr, "No valid sample in %s/tests/telempostd\n", ABSTOPSRCDIR);
+                return EXIT_FAILURE;
+        }
+
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                snprintf(samples[nsamples].name, sizeof(samples[0].name), "text %zu",
+                         sizes[i]);
+                samples[nsamples].headers = headers[0];
+                samples[nsamples++].payload = generate_payload(sizes[i], 0);
+                snprintf(samples[nsamples].name, sizeof(samples[0].name),
+                         "escaped text %zu", sizes[i]);
+                samples[nsamples].headers = headers[0];
+                samples[nsamples++].payload = generate_payload(sizes[i], 16);
+        }
+
+        printf("%-24s %12s %18s %18s\n", "record", "", "json-c tree", "streaming");
+        for (size_t i = 0; i < nsamples; i++) {
+                if (!samples[i].payload || run(&samples[i], iterations) < 0) {
+                        ret = EXIT_FAILURE;
+                }
+                free(samples[i].payload);
+        }
+        for (size_t i = 0; i < nfiles; i++) {
+                for (int k = 0; k < NUM_HEADERS; k++) {
+                        free(headers[i][k]);
+                }
+        }
+
+        return ret;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
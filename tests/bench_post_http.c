@@ -0,0 +1,138 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Measures the records per second telempostd can post to a backend.
+ *
+ * Records are posted one at a time, first with a new connection for each
+ * record the way telempostd used to, which costs a TCP connect, a TLS
+ * handshake and a read of the CA bundle per record, then over the kept
+ * connection of the backend, then with several posts in flight at once, then
+ * packed in batches of records. A local HTTPS server answering POST requests
+ * with 200 is required, with a certificate the CA bundle verifies:
+ * bench_post_http [records] [url] [cainfo] [in_flight]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "uploader.h"
+
+#define DEFAULT_RECORDS 500
+#define DEFAULT_URL "https://localhost:8443/"
+#define DEFAULT_CA_BUNDLE "/tmp/cacert.crt"
+#define DEFAULT_IN_FLIGHT 8
+#define BATCH_RECORDS 32
+#define BATCH_SIZE (64 * 1024)
+#define TIDHEADER "X-Telemetry-TID: 6907c830-eed9-4ce9-81ae-76daf8d88f0f"
+
+/* A typical record, as create_json_message() encodes it */
+static const char json_body[] =
+        "{\"record_format_version\":\"5\",\"classification\":\"org.clearlinux/hello/world\","
+        "\"severity\":\"1\",\"machine_id\":\"6907c830eed94ce981ae76daf8d88f0f\","
+        "\"creation_timestamp\":\"1418672344\",\"arch\":\"x86_64\",\"host_type\":"
+        "\"blank|blank|blank\",\"build\":\"31000\",\"kernel_version\":\"5.4.0-1-native\","
+        "\"payload_format_version\":\"1\",\"system_name\":\"clear-linux-os\","
+        "\"board_name\":\"Qemu|Intel\",\"cpu_model\":\"Intel(R) Core(TM) i7-5650U CPU\","
+        "\"bios_version\":\"Qemu\",\"event_id\":\"3a2d799826edc6266d72824d2aac6763\","
+        "\"dropped_count\":\"0\",\"sample_rate\":\"1\",\"payload\":\"hello\\n\"}";
+
+static int failed = 0;
+
+static void count_failed(bool sent, void *data)
+{
+        if (!sent) {
+                failed++;
+        }
+}
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int run(const char *name, int records, const char *url, const char *cainfo,
+               unsigned int in_flight, bool reuse, enum batch_format format)
+{
+        struct uploader up;
+        struct backend_config config = { url, cainfo, TIDHEADER, COMPRESSION_NONE, 0, "" };
+        double start, elapsed;
+
+        if (uploader_init(&up, in_flight) < 0) {
+                return -1;
+        }
+        uploader_set_batch(&up, format, BATCH_RECORDS, BATCH_SIZE);
+
+        failed = 0;
+        start = now();
+        for (int i = 0; i < records; i++) {
+                if (uploader_submit(&up, &config, strdup(json_body), count_failed,
+                                    NULL) < 0) {
+                        break;
+                }
+                if (!reuse) {
+                        uploader_close(&up);
+                        uploader_init(&up, in_flight);
+                }
+        }
+        uploader_flush(&up);
+        uploader_wait(&up, 0);
+        elapsed = now() - start;
+        uploader_close(&up);
+
+        if (failed > 0) {
+                fprintf(stderr, "%s: %d POST requests failed\n", name, failed);
+                return -1;
+        }
+        printf("%-20s %8.0f records/s %8.1f us/record\n", name,
+               records / elapsed, elapsed * 1e6 / records);
+
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int records = argc > 1 ? atoi(argv[1]) : DEFAULT_RECORDS;
+        const char *url = argc > 2 ? argv[2] : DEFAULT_URL;
+        const char *cainfo = argc > 3 ? argv[3] : DEFAULT_CA_BUNDLE;
+        int in_flight = argc > 4 ? atoi(argv[4]) : DEFAULT_IN_FLIGHT;
+        char name[32], batch_name[32];
+
+        if (records <= 0 || in_flight <= 0) {
+                fprintf(stderr, "Usage: %s [records] [url] [cainfo] [in_flight]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        printf("%d records of %zu bytes to %s\n", records, strlen(json_body), url);
+        snprintf(name, sizeof(name), "%d in flight", in_flight);
+        snprintf(batch_name, sizeof(batch_name), "batches of %d", BATCH_RECORDS);
+        if (run("connection per record", records, url, cainfo, 1, false, BATCH_NONE) < 0 ||
+            run("kept connection", records, url, cainfo, 1, true, BATCH_NONE) < 0 ||
+            run(name, records, url, cainfo, (unsigned int)in_flight, true, BATCH_NONE) < 0 ||
+            run(batch_name, records, url, cainfo, (unsigned int)in_flight, true,
+                BATCH_JSON) < 0) {
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,223 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Benchmark telemprobd with many concurrent clients.
+ *
+ * A running telemprobd is required. For 1000 up to the given number of
+ * clients, the benchmark connects that many clients and keeps them open,
+ * then sends records over short-lived connections and waits for the daemon
+ * to close each of them, which it does once the record is stored. The time
+ * to connect the idle clients shows how fast the daemon accepts, and the
+ * record latency shows how the cost of each wakeup grows with the number of
+ * connected clients.
+ *
+ * Every record sent is staged in the daemon spool directory.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "configuration.h"
+#include "telemetry.h"
+
+#define DEFAULT_MAX_CLIENTS 10000
+#define RECORDS_PER_RUN 200
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int connect_daemon(const struct sockaddr_un *addr)
+{
+        int fd;
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+                return -errno;
+        }
+
+        if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1) {
+                int ret = -errno;
+                close(fd);
+                return ret;
+        }
+
+        return fd;
+}
+
+/* Serializes a record the way tm_send_record() does, without a config
+ * file name */
+static char *serialize_record(size_t *len)
+{
+        struct telem_ref *ref = NULL;
+        uint32_t record_size;
+        char *frame;
+
+        if (tm_create_record(&ref, 1, "org.clearlinux/bench/clients", 1) < 0 ||
+            tm_set_payload(ref, "benchmark payload") < 0) {
+                fprintf(stderr, "Record creation failed\n");
+                exit(EXIT_FAILURE);
+        }
+
+        *len = RECORD_SIZE_LEN + ref->record->size;
+        record_size = (uint32_t)*len;
+        frame = malloc(*len);
+        if (!frame) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+        memcpy(frame, &record_size, RECORD_SIZE_LEN);
+        memcpy(frame + RECORD_SIZE_LEN, ref->record->data, ref->record->size);
+        tm_free_record(ref);
+
+        return frame;
+}
+
+/* Sends one record and waits until the daemon closes the connection */
+static void send_record(const struct sockaddr_un *addr, const char *frame, size_t len)
+{
+        char c;
+        int fd;
+
+        fd = connect_daemon(addr);
+        if (fd < 0) {
+                fprintf(stderr, "connect() failed: %s\n", strerror(-fd));
+                exit(EXIT_FAILURE);
+        }
+
+        if (write(fd, frame, len) != (ssize_t)len || shutdown(fd, SHUT_WR) == -1) {
+                fprintf(stderr, "Failed to send record: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        while (read(fd, &c, 1) > 0) {
+                ;
+        }
+        close(fd);
+}
+
+static void run(const struct sockaddr_un *addr, int nclients, const char *frame,
+                size_t len)
+{
+        int *idle;
+        double start, connect_time, record_time;
+
+        idle = calloc((size_t)nclients, sizeof(int));
+        if (!idle) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+
+        start = now();
+        for (int i = 0; i < nclients; i++) {
+                idle[i] = connect_daemon(addr);
+                if (idle[i] < 0) {
+                        fprintf(stderr, "connect() failed after %d clients: %s\n",
+                                i, strerror(-idle[i]));
+                        exit(EXIT_FAILURE);
+                }
+        }
+        connect_time = now() - start;
+
+        start = now();
+        for (int i = 0; i < RECORDS_PER_RUN; i++) {
+                send_record(addr, frame, len);
+        }
+        record_time = now() - start;
+
+        for (int i = 0; i < nclients; i++) {
+                close(idle[i]);
+        }
+        free(idle);
+
+        printf("%8d %14.0f %16.1f\n", nclients, nclients / connect_time,
+               record_time * 1e6 / RECORDS_PER_RUN);
+}
+
+int main(int argc, char **argv)
+{
+        struct sockaddr_un addr;
+        struct rlimit rl;
+        int max_clients = DEFAULT_MAX_CLIENTS;
+        const char *path = NULL;
+        size_t len;
+        char *frame;
+        int fd;
+
+        if (argc > 1) {
+                max_clients = atoi(argv[1]);
+                if (max_clients <= 0) {
+                        fprintf(stderr, "Usage: %s [max_clients [socket_path]]\n", argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        path = argc > 2 ? argv[2] : socket_path_config();
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+        fd = connect_daemon(&addr);
+        if (fd < 0) {
+                printf("telemprobd is not listening on %s (%s), skipping\n",
+                       path, strerror(-fd));
+                return EXIT_SUCCESS;
+        }
+        close(fd);
+
+        /* Leave room for the record connections and stdio */
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+                rl.rlim_cur = rl.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &rl);
+                if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+                    rl.rlim_cur != RLIM_INFINITY && (rlim_t)max_clients + 16 > rl.rlim_cur) {
+                        max_clients = (int)rl.rlim_cur - 16;
+                        printf("Limited to %d clients by RLIMIT_NOFILE\n", max_clients);
+                }
+        }
+
+        frame = serialize_record(&len);
+
+        printf("%d records per run over new connections, %zu bytes each\n",
+               RECORDS_PER_RUN, len);
+        printf("%8s %14s %16s\n", "clients", "connects/s", "us per record");
+
+        for (int n = 1000; n <= max_clients; n = n < 2000 ? 2000 : (n < 5000 ? 5000 : n * 2)) {
+                run(&addr, n, frame, len);
+        }
+        if (max_clients < 1000) {
+                run(&addr, max_clients, frame, len);
+        }
+
+        free(frame);
+
+        return EXIT_SUCCESS;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
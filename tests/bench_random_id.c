@@ -0,0 +1,124 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Measures how many random ids per second can be generated.
+ *
+ * The "urandom" run reproduces the original get_random_id(), which opened
+ * /dev/urandom and formatted the id with asprintf() for every id. The
+ * "pooled" runs use the per-thread pool, returning a heap string as
+ * get_random_id() does, or writing to a caller buffer with fill_random_id().
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define DEFAULT_ITERATIONS 200000
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int urandom_id(char **buff)
+{
+        int result = -1;
+        int frandom = -1;
+        uint64_t random_id[2] = { '\0' };
+
+        frandom = open("/dev/urandom", O_RDONLY);
+        if (frandom < 0) {
+                return -1;
+        }
+
+        if (read(frandom, &random_id, sizeof(random_id)) == sizeof(random_id)) {
+                if (asprintf(buff, "%.16" PRIx64 "%.16" PRIx64, random_id[0], random_id[1]) == RANDOM_ID_LEN) {
+                        result = 0;
+                }
+        }
+
+        close(frandom);
+
+        return result;
+}
+
+static void fail(const char *what)
+{
+        fprintf(stderr, "%s failed\n", what);
+        exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+        long iterations = DEFAULT_ITERATIONS;
+        char id[RANDOM_ID_LEN + 1];
+        char *buff = NULL;
+        double start, urandom, pooled, pooled_buf;
+
+        if (argc > 1) {
+                iterations = strtol(argv[1], NULL, 10);
+                if (iterations <= 0) {
+                        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        start = now();
+        for (long i = 0; i < iterations; i++) {
+                if (urandom_id(&buff) != 0) {
+                        fail("urandom_id()");
+                }
+                free(buff);
+        }
+        urandom = (double)iterations / (now() - start);
+
+        start = now();
+        for (long i = 0; i < iterations; i++) {
+                if (get_random_id(&buff) != 0) {
+                        fail("get_random_id()");
+                }
+                free(buff);
+        }
+        pooled = (double)iterations / (now() - start);
+
+        start = now();
+        for (long i = 0; i < iterations; i++) {
+                if (fill_random_id(id) != 0) {
+                        fail("fill_random_id()");
+                }
+        }
+        pooled_buf = (double)iterations / (now() - start);
+
+        printf("random ids, %ld iterations\n", iterations);
+        printf("  urandom + asprintf: %12.0f ids/s\n", urandom);
+        printf("  pool + heap string: %12.0f ids/s\n", pooled);
+        printf("  pool + buffer:      %12.0f ids/s\n", pooled_buf);
+        printf("  speedup:            %12.1fx\n", pooled_buf / urandom);
+
+        return EXIT_SUCCESS;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
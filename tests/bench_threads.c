@@ -0,0 +1,145 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Stress test for record creation from many threads at once.
+ *
+ * Every thread creates, fills and frees records in a loop for a fixed time.
+ * The run is repeated for 1, 2, 4, ... threads up to the number of online
+ * cpus, and the aggregate throughput is reported for each thread count so
+ * that scaling with cores can be checked.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "telemetry.h"
+
+#define DEFAULT_SECONDS 1
+#define MAX_THREADS 256
+
+static volatile bool stop = false;
+
+struct worker {
+        pthread_t thread;
+        unsigned long records;
+        int failed;
+};
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void *worker_run(void *arg)
+{
+        struct worker *w = arg;
+        struct telem_ref *ref = NULL;
+
+        while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+                if (tm_create_record(&ref, 1, "org.clearlinux/bench/threads", 1) < 0) {
+                        w->failed = 1;
+                        break;
+                }
+                if (tm_set_payload(ref, "stress test payload") < 0) {
+                        w->failed = 1;
+                        tm_free_record(ref);
+                        break;
+                }
+                tm_free_record(ref);
+                w->records++;
+        }
+
+        return NULL;
+}
+
+static double run(int nthreads, int seconds)
+{
+        struct worker workers[MAX_THREADS];
+        unsigned long total = 0;
+        double start, elapsed;
+
+        memset(workers, 0, sizeof(workers));
+        stop = false;
+
+        start = now();
+        for (int i = 0; i < nthreads; i++) {
+                if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+                        fprintf(stderr, "pthread_create() failed\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        sleep((unsigned int)seconds);
+        __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+        for (int i = 0; i < nthreads; i++) {
+                pthread_join(workers[i].thread, NULL);
+                if (workers[i].failed) {
+                        fprintf(stderr, "Record creation failed\n");
+                        exit(EXIT_FAILURE);
+                }
+                total += workers[i].records;
+        }
+        elapsed = now() - start;
+
+        return (double)total / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+        int seconds = DEFAULT_SECONDS;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        double base = 0, rate;
+
+        if (argc > 1) {
+                seconds = atoi(argv[1]);
+                if (seconds <= 0) {
+                        fprintf(stderr, "Usage: %s [seconds]\n", argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (cpus < 1) {
+                cpus = 1;
+        } else if (cpus > MAX_THREADS) {
+                cpus = MAX_THREADS;
+        }
+
+        printf("tm_create_record + tm_set_payload + tm_free_record, %ds per run\n",
+               seconds);
+        printf("%8s %16s %10s\n", "threads", "records/s", "scaling");
+
+        for (int n = 1; n <= cpus; n = (n * 2 > cpus && n < cpus) ? (int)cpus : n * 2) {
+                rate = run(n, seconds);
+                if (n == 1) {
+                        base = rate;
+                }
+                printf("%8d %16.0f %9.2fx\n", n, rate, rate / base);
+        }
+
+        return EXIT_SUCCESS;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -46,6 +46,8 @@ START_TEST(check_read_valid_config)
         ck_assert_int_eq(config.intValues[CONF_RECORD_BURST_LIMIT], 100);
         ck_assert_int_eq(config.intValues[CONF_RECORD_WINDOW_LENGTH], 15);
         ck_assert_int_eq(config.intValues[CONF_BYTE_BURST_LIMIT], 1000);
+        ck_assert_int_eq(config.intValues[CONF_BUFFER_POOL_MAX_SIZE], 2048);
+        ck_assert_int_eq(config.intValues[CONF_MEMORY_RELEASE_IDLE_TIME], 30);
         ck_assert_int_eq(config.intValues[CONF_BYTE_WINDOW_LENGTH], 20);
         ck_assert(config.boolValues[CONF_RATE_LIMIT_ENABLED] == true);
         ck_assert_str_eq(config.strValues[CONF_RATE_LIMIT_STRATEGY], "spool");
@@ -78,6 +80,8 @@ START_TEST(check_default_config)
         ck_assert_int_eq(config.intValues[CONF_BYTE_WINDOW_LENGTH], DEFAULT_BYTE_WINDOW_LENGTH);
         ck_assert_int_eq(config.intValues[CONF_RECORD_BURST_LIMIT], DEFAULT_RECORD_BURST_LIMIT);
         ck_assert_int_eq(config.intValues[CONF_BYTE_BURST_LIMIT], DEFAULT_BYTE_BURST_LIMIT);
+        ck_assert_int_eq(config.intValues[CONF_BUFFER_POOL_MAX_SIZE], DEFAULT_BUFFER_POOL_MAX_SIZE);
+        ck_assert_int_eq(config.intValues[CONF_MEMORY_RELEASE_IDLE_TIME], DEFAULT_MEMORY_RELEASE_IDLE_TIME);
 
         ck_assert(config.boolValues[CONF_RATE_LIMIT_ENABLED] == DEFAULT_RATE_LIMIT_ENABLED);
         ck_assert(config.boolValues[CONF_DAEMON_RECYCLING_ENABLED] == DEFAULT_DAEMON_RECYCLING_ENABLED);
@@ -110,6 +114,8 @@ START_TEST(check_layered_config)
         ck_assert_int_eq(config.intValues[CONF_BYTE_WINDOW_LENGTH], DEFAULT_BYTE_WINDOW_LENGTH);
         ck_assert_int_eq(config.intValues[CONF_RECORD_BURST_LIMIT], DEFAULT_RECORD_BURST_LIMIT);
         ck_assert_int_eq(config.intValues[CONF_BYTE_BURST_LIMIT], DEFAULT_BYTE_BURST_LIMIT);
+        ck_assert_int_eq(config.intValues[CONF_BUFFER_POOL_MAX_SIZE], DEFAULT_BUFFER_POOL_MAX_SIZE);
+        ck_assert_int_eq(config.intValues[CONF_MEMORY_RELEASE_IDLE_TIME], DEFAULT_MEMORY_RELEASE_IDLE_TIME);
 
         ck_assert(config.boolValues[CONF_RATE_LIMIT_ENABLED] == DEFAULT_RATE_LIMIT_ENABLED);
         ck_assert(config.boolValues[CONF_DAEMON_RECYCLING_ENABLED] == DEFAULT_DAEMON_RECYCLING_ENABLED);
@@ -135,6 +141,27 @@ START_TEST(check_read_valid_config_record_retention_delivery)
 }
 END_TEST
 
+START_TEST(check_read_class_limits)
+{
+        char *config_file = TOPSRCDIR "/src/data/example.conf";
+        configuration config = { { 0 }, { 0 }, { 0 }, false, NULL };
+
+        int ret = read_config_from_file(config_file, &config);
+        ck_assert(ret == true);
+
+        /* The invalid rate limit is skipped */
+        ck_assert_int_eq(config.num_limits[CONF_RECORD_RATE_LIMITS], 2);
+        ck_assert_int_eq(config.num_limits[CONF_RECORD_SAMPLING], 1);
+        ck_assert_str_eq(config.limits[CONF_RECORD_SAMPLING][0].pattern,
+                         "org.clearlinux/sampled/*");
+        ck_assert_int_eq(config.limits[CONF_RECORD_SAMPLING][0].records, 4);
+        ck_assert_int_eq(config.num_limits[CONF_PEER_RATE_LIMITS], 1);
+        ck_assert_int_eq(config.num_limits[CONF_PEER_CLASS_RATE_LIMITS], 1);
+
+        free_config_struct(&config);
+}
+END_TEST
+
 START_TEST(check_config_initialised)
 {
         char *config_file = ABSTOPSRCDIR "/src/data/example.conf";
@@ -157,6 +184,63 @@ START_TEST(check_config_initialised)
         ck_assert_str_eq(get_tidheader_config(),
                          "X-Telemetry-TID: 6907c830-eed9-4ce9-81ae-76daf8d88f0f");
         ck_assert(daemon_recycling_enabled_config() == true);
+        ck_assert_int_eq(buffer_pool_max_size_config(), 2048);
+        ck_assert_int_eq(memory_release_idle_time_config(), 30);
+        ck_assert_int_eq(connection_idle_time_config(), 10);
+        ck_assert_int_eq(max_concurrent_posts_config(), 4);
+        ck_assert(batch_format_config() == BATCH_NDJSON);
+        ck_assert_int_eq(batch_max_records_config(), 16);
+        ck_assert_int_eq(batch_max_size_config(), 32 * 1024);
+        ck_assert(compression_config() == COMPRESSION_ZSTD);
+        ck_assert_int_eq(compression_level_config(), 3);
+        ck_assert_str_eq(compression_dictionary_config(), "/etc/telemetrics/records.dict");
+        ck_assert_int_eq(segment_max_size_config(), 64);
+        ck_assert_int_eq(segment_max_age_config(), 5);
+        ck_assert(durability_config() == DURABILITY_GROUP);
+        ck_assert_int_eq(durability_group_records_config(), 8);
+        ck_assert_int_eq(durability_group_interval_config(), 50);
+        ck_assert(direct_handoff_enabled_config() == false);
+        ck_assert_int_eq(peer_max_connections_config(), 64);
+}
+END_TEST
+
+START_TEST(check_class_limits_lookup)
+{
+        char *config_file = ABSTOPSRCDIR "/src/data/example.conf";
+        int64_t records = 0, window = 0;
+
+        set_config_file(config_file);
+
+        ck_assert(class_limits_enabled_config() == true);
+
+        /* An exact match wins over a pattern */
+        ck_assert(record_rate_limit_config("org.clearlinux/limited/exact", &records, &window));
+        ck_assert_int_eq(records, 5);
+        ck_assert_int_eq(window, 1);
+
+        ck_assert(record_rate_limit_config("org.clearlinux/limited/other", &records, &window));
+        ck_assert_int_eq(records, 100);
+        ck_assert_int_eq(window, 3600);
+
+        ck_assert(!record_rate_limit_config("org.clearlinux/invalid/x", &records, &window));
+        ck_assert(!record_rate_limit_config("org.clearlinux/other/x", &records, &window));
+
+        ck_assert_int_eq(record_sampling_config("org.clearlinux/sampled/x"), 4);
+        ck_assert_int_eq(record_sampling_config("org.clearlinux/limited/exact"), 1);
+
+        /* Peer limits are only applied by telemprobd */
+        ck_assert(!record_rate_limit_config("org.clearlinux/throttled/x", &records, &window));
+        ck_assert(peer_rate_limit_config(65534, &records, &window));
+        ck_assert_int_eq(records, 10);
+        ck_assert_int_eq(window, 1);
+        ck_assert(!peer_rate_limit_config(6553, &records, &window));
+        ck_assert_str_eq(peer_class_rate_limit_config("org.clearlinux/throttled/x",
+                                                      &records, &window),
+                         "org.clearlinux/throttled/*");
+        ck_assert_int_eq(records, 2);
+        ck_assert_int_eq(window, 3600);
+        ck_assert(peer_class_rate_limit_config("org.clearlinux/limited/exact",
+                                               &records, &window) == NULL);
 }
 END_TEST
 
@@ -172,7 +256,9 @@ Suite *config_suite(void)
         tcase_add_test(t, check_default_config);
         tcase_add_test(t, check_layered_config);
         tcase_add_test(t, check_read_valid_config_record_retention_delivery);
+        tcase_add_test(t, check_read_class_limits);
         tcase_add_test(t, check_config_initialised);
+        tcase_add_test(t, check_class_limits_lookup);
 
         // add more TCases here
 
@@ -51,6 +51,31 @@ START_TEST(check_unsuccessful_open_journal)
 }
 END_TEST
 
+START_TEST(check_journal_group_sync)
+{
+        struct TelemJournal *j = open_journal(journal_file);
+        ck_assert_ptr_nonnull(j);
+        ck_assert(j->sync.mode == DURABILITY_NONE);
+
+        /* Entries are synced two at a time */
+        sync_policy_init(&j->sync, DURABILITY_GROUP, 2, 60000);
+        ck_assert_int_eq(new_journal_entry(j, "t/t/t", 1520054957, eid), 0);
+        ck_assert_int_eq(j->sync.pending, 1);
+        ck_assert_int_eq(flush_journal(j, false), 0);
+        ck_assert_int_eq(j->sync.pending, 1);
+        ck_assert_int_eq(new_journal_entry(j, "t/t/t", 1520054957, eid), 0);
+        ck_assert_int_eq(j->sync.pending, 0);
+        ck_assert(j->sync.syncs == 1);
+
+        /* A forced flush syncs a partial group */
+        ck_assert_int_eq(new_journal_entry(j, "t/t/t", 1520054957, eid), 0);
+        ck_assert_int_eq(flush_journal(j, true), 0);
+        ck_assert_int_eq(j->sync.pending, 0);
+        ck_assert(j->sync.syncs == 2);
+        close_journal(j);
+}
+END_TEST
+
 void new_entry_setup(void)
 {
         if (journal) {
@@ -208,6 +233,7 @@ Suite *config_suite(void)
         tcase_add_unchecked_fixture(t, NULL, teardown);
         tcase_add_test(t, check_open_journal);
         tcase_add_test(t, check_unsuccessful_open_journal);
+        tcase_add_test(t, check_journal_group_sync);
         suite_add_tcase(s, t);
 
         t = tcase_create("new entry");
@@ -17,15 +17,38 @@
 #define _GNU_SOURCE
 #include <check.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include "common.h"
+#include "configuration.h"
 #include "telemetry.h"
+#include "util.h"
 
 static struct telem_ref *ref = NULL;
 static char *original_event_id = NULL;
 
+/* Returns a null-terminated copy of a header of the shared record */
+static const char *header_str(int index)
+{
+        static char buf[512];
+        const char *header;
+        size_t len;
+
+        header = tm_record_header(ref->record, index, &len);
+        ck_assert(len < sizeof(buf));
+        memcpy(buf, header, len);
+        buf[len] = '\0';
+
+        return buf;
+}
+
 void create_setup(void)
 {
         int ret;
@@ -63,7 +86,7 @@ START_TEST(record_create_severity)
         if (asprintf(&result, "%s: %u\n", TM_SEVERITY_STR, 1) < 0) {
                 return;
         }
-        ck_assert_str_eq(ref->record->headers[TM_SEVERITY], result);
+        ck_assert_str_eq(header_str(TM_SEVERITY), result);
         free(result);
 }
 END_TEST
@@ -74,7 +97,7 @@ START_TEST(record_create_classification)
         if (asprintf(&result, "%s: %s\n", TM_CLASSIFICATION_STR, "t/t/t") < 0) {
                 return;
         }
-        ck_assert_str_eq(ref->record->headers[TM_CLASSIFICATION], result);
+        ck_assert_str_eq(header_str(TM_CLASSIFICATION), result);
         free(result);
 }
 END_TEST
@@ -85,11 +108,108 @@ START_TEST(record_create_version)
         if (asprintf(&result, "%s: %u\n", TM_PAYLOAD_VERSION_STR, 2000) < 0) {
                 return;
         }
-        ck_assert_str_eq(ref->record->headers[TM_PAYLOAD_VERSION], result);
+        ck_assert_str_eq(header_str(TM_PAYLOAD_VERSION), result);
         free(result);
 }
 END_TEST
 
+START_TEST(record_create_host_info_refresh)
+{
+        char *arch = strdup(header_str(TM_ARCH));
+
+        ck_assert_ptr_ne(arch, NULL);
+        ck_assert_int_eq(tm_refresh_host_info(), 0);
+        ck_assert_str_eq(header_str(TM_ARCH), arch);
+        free(arch);
+}
+END_TEST
+
+#define HOST_INFO_THREADS 4
+
+/* Creates records from a new thread, returns the arch header of the last */
+static void *host_info_thread(void *arg)
+{
+        struct telem_ref *r = NULL;
+        char *arch = NULL;
+        const char *header;
+        size_t len;
+
+        (void)arg;
+        for (int i = 0; i < 50; i++) {
+                ck_assert_int_eq(tm_create_record(&r, 1, "t/t/t", 1), 0);
+                header = tm_record_header(r->record, TM_ARCH, &len);
+                free(arch);
+                arch = strndup(header, len);
+                tm_free_record(r);
+        }
+
+        return arch;
+}
+
+START_TEST(record_create_host_info_threads)
+{
+        pthread_t threads[HOST_INFO_THREADS];
+        char *arch = strdup(header_str(TM_ARCH));
+        void *thread_arch;
+
+        /* Threads share the host info of the process, also while it is
+         * refreshed */
+        for (int i = 0; i < HOST_INFO_THREADS; i++) {
+                ck_assert(pthread_create(&threads[i], NULL, host_info_thread, NULL) == 0);
+        }
+        ck_assert_int_eq(tm_refresh_host_info(), 0);
+        for (int i = 0; i < HOST_INFO_THREADS; i++) {
+                ck_assert(pthread_join(threads[i], &thread_arch) == 0);
+                ck_assert_str_eq((char *)thread_arch, arch);
+                free(thread_arch);
+        }
+        free(arch);
+}
+END_TEST
+
+START_TEST(record_set_large_payload)
+{
+        char *classification = strdup(header_str(TM_CLASSIFICATION));
+        char payload[8000];
+
+        ck_assert_ptr_ne(classification, NULL);
+        memset(payload, 'x', sizeof(payload) - 1);
+        payload[sizeof(payload) - 1] = '\0';
+
+        ck_assert_int_eq(tm_set_payload(ref, payload), 0);
+        ck_assert(ref->record->payload_size == sizeof(payload) - 1);
+        ck_assert_str_eq(tm_record_payload(ref->record), payload);
+        /* Headers must survive the record growing */
+        ck_assert_str_eq(header_str(TM_CLASSIFICATION), classification);
+
+        ck_assert_int_eq(tm_set_payload(ref, "small"), 0);
+        ck_assert_str_eq(tm_record_payload(ref->record), "small");
+        free(classification);
+}
+END_TEST
+
+START_TEST(record_layout)
+{
+        struct telem_record *record = ref->record;
+        uint32_t header_size;
+
+        /* The data is the record as sent to the daemon: header size,
+         * headers, payload and a null byte, with nothing in between */
+        memcpy(&header_size, record->data, sizeof(header_size));
+        ck_assert_uint_eq(header_size, record->header_size);
+        ck_assert_uint_eq(record->header_offset[0], sizeof(uint32_t));
+        ck_assert_uint_eq(record->header_offset[NUM_HEADERS],
+                          sizeof(uint32_t) + record->header_size);
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                ck_assert(record->header_offset[i] < record->header_offset[i + 1]);
+                ck_assert(record->data[record->header_offset[i + 1] - 1] == '\n');
+        }
+        ck_assert_uint_eq(record->size, record->header_offset[NUM_HEADERS] +
+                          record->payload_size + 1);
+        ck_assert(record->data[record->size - 1] == '\0');
+}
+END_TEST
+
 void create_teardown(void)
 {
         if (ref) {
@@ -141,7 +261,7 @@ START_TEST(record_create_severity_underflow)
         if (asprintf(&result, "%s: %u\n", TM_SEVERITY_STR, 1) < 0) {
                 return;
         }
-        ck_assert_str_eq(ref->record->headers[TM_SEVERITY], result);
+        ck_assert_str_eq(header_str(TM_SEVERITY), result);
         free(result);
 
         create_teardown();
@@ -161,7 +281,7 @@ START_TEST(record_create_severity_overflow)
         if (asprintf(&result, "%s: %u\n", TM_SEVERITY_STR, 4) < 0) {
                 return;
         }
-        ck_assert_str_eq(ref->record->headers[TM_SEVERITY], result);
+        ck_assert_str_eq(header_str(TM_SEVERITY), result);
         free(result);
 
         create_teardown();
@@ -177,7 +297,7 @@ void event_id_setup(void)
         }
 
         ret = tm_create_record(&ref, 1, "t/t/t", 2000);
-        original_event_id = strdup(ref->record->headers[TM_EVENT_ID]);
+        original_event_id = strdup(header_str(TM_EVENT_ID));
         if (!original_event_id) {
                 return;
         }
@@ -193,10 +313,10 @@ START_TEST(record_set_event_id)
         if (asprintf(&result, "%s: %s\n", TM_EVENT_ID_STR, event_id) < 0) {
                 return;
         }
-        ck_assert_str_ne(ref->record->headers[TM_EVENT_ID], result);
+        ck_assert_str_ne(header_str(TM_EVENT_ID), result);
         ret = tm_set_event_id(ref, event_id);
         ck_assert_int_eq(ret, 0);
-        ck_assert_str_eq(ref->record->headers[TM_EVENT_ID], result);
+        ck_assert_str_eq(header_str(TM_EVENT_ID), result);
         free(result);
 }
 END_TEST
@@ -207,7 +327,7 @@ START_TEST(record_set_event_id_invalid_chars)
         char *event_id = "aaaaaa000000333333444444666666ZZ";
         ret = tm_set_event_id(ref, event_id);
         ck_assert_int_eq(ret, -1);
-        ck_assert_str_eq(ref->record->headers[TM_EVENT_ID], original_event_id);
+        ck_assert_str_eq(header_str(TM_EVENT_ID), original_event_id);
 }
 END_TEST
 
@@ -217,7 +337,7 @@ START_TEST(record_set_event_id_null)
         char *event_id = NULL;
         ret = tm_set_event_id(ref, event_id);
         ck_assert_int_eq(ret, -1);
-        ck_assert_str_eq(ref->record->headers[TM_EVENT_ID], original_event_id);
+        ck_assert_str_eq(header_str(TM_EVENT_ID), original_event_id);
 }
 END_TEST
 
@@ -227,7 +347,7 @@ START_TEST(record_set_event_id_short)
         char *event_id = "aaaa";
         ret = tm_set_event_id(ref, event_id);
         ck_assert_int_eq(ret, -1);
-        ck_assert_str_eq(ref->record->headers[TM_EVENT_ID], original_event_id);
+        ck_assert_str_eq(header_str(TM_EVENT_ID), original_event_id);
 }
 END_TEST
 
@@ -237,7 +357,7 @@ START_TEST(record_set_event_id_long)
         char *event_id = "0000000000000000000000000000000000000000000";
         ret = tm_set_event_id(ref, event_id);
         ck_assert_int_eq(ret, -1);
-        ck_assert_str_eq(ref->record->headers[TM_EVENT_ID], original_event_id);
+        ck_assert_str_eq(header_str(TM_EVENT_ID), original_event_id);
 }
 END_TEST
 
@@ -248,6 +368,653 @@ void event_id_teardown(void)
         free(original_event_id);
 }
 
+/* Compares a header of two records */
+static bool same_header(struct telem_ref *a, struct telem_ref *b, int index)
+{
+        const char *ha, *hb;
+        size_t la, lb;
+
+        ha = tm_record_header(a->record, index, &la);
+        hb = tm_record_header(b->record, index, &lb);
+
+        return la == lb && memcmp(ha, hb, la) == 0;
+}
+
+START_TEST(template_record)
+{
+        struct tm_template *tmpl = NULL;
+        struct telem_ref *plain = NULL;
+        struct telem_ref *r1 = NULL;
+        struct telem_ref *r2 = NULL;
+        uint32_t header_size;
+
+        ck_assert_int_eq(tm_prepare_record(&tmpl, 2, "t/t/template", 3), 0);
+        ck_assert_int_eq(tm_create_record(&plain, 2, "t/t/template", 3), 0);
+        ck_assert_int_eq(tm_record_from_template(tmpl, &r1), 0);
+        ck_assert_int_eq(tm_record_from_template(tmpl, &r2), 0);
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                if (i == TM_TIMESTAMP || i == TM_EVENT_ID) {
+                        continue;
+                }
+                ck_assert_msg(same_header(plain, r1, i), "header %d differs", i);
+        }
+        ck_assert(!same_header(r1, r2, TM_EVENT_ID));
+        ck_assert_uint_eq(r1->record->header_size, plain->record->header_size);
+        memcpy(&header_size, r1->record->data, sizeof(header_size));
+        ck_assert_uint_eq(header_size, r1->record->header_size);
+
+        /* Records from a template are independent of it */
+        tm_free_template(tmpl);
+        ck_assert_int_eq(tm_set_payload(r1, "payload"), 0);
+        ck_assert_str_eq(tm_record_payload(r1->record), "payload");
+        ck_assert_str_eq(tm_record_payload(r2->record), "");
+
+        tm_free_record(plain);
+        tm_free_record(r1);
+        tm_free_record(r2);
+}
+END_TEST
+
+START_TEST(template_invalid_class)
+{
+        struct tm_template *tmpl = NULL;
+
+        ck_assert_int_eq(tm_prepare_record(&tmpl, 1, "t/t", 1), -EINVAL);
+        ck_assert_ptr_eq(tmpl, NULL);
+}
+END_TEST
+
+START_TEST(random_id_format)
+{
+        char id[RANDOM_ID_LEN + 1];
+        char prev[RANDOM_ID_LEN + 1] = "";
+
+        /* Enough ids to refill the pool a few times */
+        for (int i = 0; i < 1000; i++) {
+                ck_assert_int_eq(fill_random_id(id), 0);
+                ck_assert_uint_eq(strlen(id), RANDOM_ID_LEN);
+                ck_assert_uint_eq(strspn(id, "0123456789abcdef"), RANDOM_ID_LEN);
+                ck_assert_str_ne(id, prev);
+                strcpy(prev, id);
+        }
+}
+END_TEST
+
+START_TEST(random_id_fork)
+{
+        char parent_id[RANDOM_ID_LEN + 1];
+        char child_id[RANDOM_ID_LEN + 1];
+        int fds[2];
+        int status;
+        pid_t pid;
+
+        /* Make sure the pool holds unused ids when forking */
+        ck_assert_int_eq(fill_random_id(parent_id), 0);
+        ck_assert_int_eq(pipe(fds), 0);
+
+        pid = fork();
+        ck_assert_int_ge(pid, 0);
+        if (pid == 0) {
+                if (fill_random_id(child_id) != 0 ||
+                    write(fds[1], child_id, sizeof(child_id)) != sizeof(child_id)) {
+                        _exit(1);
+                }
+                _exit(0);
+        }
+
+        ck_assert_int_eq(fill_random_id(parent_id), 0);
+        ck_assert(read(fds[0], child_id, sizeof(child_id)) == sizeof(child_id));
+        ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+        ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        ck_assert_str_ne(parent_id, child_id);
+        close(fds[0]);
+        close(fds[1]);
+}
+END_TEST
+
+static void limits_setup(void)
+{
+        ck_assert_int_eq(tm_set_config_file(ABSTOPSRCDIR "/src/data/example.conf"), 0);
+        reload_config();
+}
+
+START_TEST(limit_rate)
+{
+        struct telem_ref *r = NULL;
+        char *class = "org.clearlinux/limited/exact";
+        const char *header;
+        size_t len;
+
+        /* 5 records per second */
+        for (int i = 0; i < 5; i++) {
+                ck_assert_int_eq(tm_create_record(&r, 1, class, 1), 0);
+                header = tm_record_header(r->record, TM_DROPPED_COUNT, &len);
+                ck_assert(strncmp(header, "dropped_count: 0\n", len) == 0);
+                tm_free_record(r);
+        }
+        ck_assert_int_eq(tm_create_record(&r, 1, class, 1), -EAGAIN);
+        ck_assert_int_eq(tm_create_record(&r, 1, class, 1), -EAGAIN);
+
+        /* The next record let through reports the dropped ones */
+        usleep(300000);
+        ck_assert_int_eq(tm_create_record(&r, 1, class, 1), 0);
+        header = tm_record_header(r->record, TM_DROPPED_COUNT, &len);
+        ck_assert(strncmp(header, "dropped_count: 2\n", len) == 0);
+        tm_free_record(r);
+}
+END_TEST
+
+START_TEST(limit_rate_template)
+{
+        struct tm_template *tmpl = NULL;
+        struct telem_ref *r = NULL;
+
+        /* 100 records per hour */
+        ck_assert_int_eq(tm_prepare_record(&tmpl, 1, "org.clearlinux/limited/tmpl", 1), 0);
+        for (int i = 0; i < 100; i++) {
+                ck_assert_int_eq(tm_record_from_template(tmpl, &r), 0);
+                tm_free_record(r);
+        }
+        ck_assert_int_eq(tm_record_from_template(tmpl, &r), -EAGAIN);
+        tm_free_template(tmpl);
+}
+END_TEST
+
+#define LIMIT_THREADS 4
+
+static void *limit_rate_thread(void *arg)
+{
+        struct telem_ref *r = NULL;
+        int *kept = arg;
+
+        for (int i = 0; i < 50; i++) {
+                if (tm_create_record(&r, 1, "org.clearlinux/limited/threads", 1) == 0) {
+                        tm_free_record(r);
+                        (*kept)++;
+                }
+        }
+
+        return NULL;
+}
+
+START_TEST(limit_rate_threads)
+{
+        pthread_t threads[LIMIT_THREADS];
+        int kept[LIMIT_THREADS] = { 0 };
+        int total = 0;
+
+        /* The threads share one bucket of 100 records per hour */
+        for (int i = 0; i < LIMIT_THREADS; i++) {
+                ck_assert(pthread_create(&threads[i], NULL, limit_rate_thread, &kept[i]) == 0);
+        }
+        for (int i = 0; i < LIMIT_THREADS; i++) {
+                ck_assert(pthread_join(threads[i], NULL) == 0);
+                total += kept[i];
+        }
+        ck_assert_int_eq(total, 100);
+}
+END_TEST
+
+START_TEST(limit_sampling)
+{
+        struct telem_ref *r = NULL;
+        const char *header;
+        size_t len;
+        int kept = 0;
+        int ret;
+
+        /* One record in 4 is kept */
+        for (int i = 0; i < 400; i++) {
+                ret = tm_create_record(&r, 1, "org.clearlinux/sampled/x", 1);
+                if (ret == -EAGAIN) {
+                        continue;
+                }
+                ck_assert_int_eq(ret, 0);
+                header = tm_record_header(r->record, TM_SAMPLE_RATE, &len);
+                ck_assert(strncmp(header, "sample_rate: 1/4\n", len) == 0);
+                tm_free_record(r);
+                kept++;
+        }
+        ck_assert_int_gt(kept, 50);
+        ck_assert_int_lt(kept, 150);
+
+        /* Other classifications are not affected */
+        ck_assert_int_eq(tm_create_record(&r, 1, "org.clearlinux/other/x", 1), 0);
+        header = tm_record_header(r->record, TM_SAMPLE_RATE, &len);
+        ck_assert(strncmp(header, "sample_rate: 1/1\n", len) == 0);
+        tm_free_record(r);
+}
+END_TEST
+
+START_TEST(async_start_stop)
+{
+        struct tm_async_stats stats;
+        int ret;
+
+        ret = tm_async_start(4, TM_ASYNC_DROP_NEWEST);
+        ck_assert_msg(ret != -ECONNREFUSED,
+                      "First time opt-in required to run test");
+        ck_assert_int_eq(ret, 0);
+        ck_assert_int_eq(tm_async_start(4, TM_ASYNC_DROP_NEWEST), -EALREADY);
+        ck_assert_int_ge(tm_async_eventfd(), 0);
+        ck_assert_int_eq(tm_async_send(NULL), -EINVAL);
+        ck_assert_int_eq(tm_async_get_stats(&stats), 0);
+        ck_assert(stats.queued == 0);
+        ck_assert_int_eq(tm_async_stop(), 0);
+        ck_assert_int_eq(tm_async_eventfd(), -EINVAL);
+        ck_assert_int_eq(tm_async_stop(), -EINVAL);
+}
+END_TEST
+
+START_TEST(async_invalid_policy)
+{
+        ck_assert_int_eq(tm_async_start(4, (enum tm_async_overflow)42), -EINVAL);
+}
+END_TEST
+
+START_TEST(send_acked_invalid)
+{
+        struct telem_ref *r = NULL;
+        struct tm_ack ack;
+
+        ck_assert_int_eq(tm_create_record(&r, 1, "t/t/t", 1), 0);
+        ck_assert_int_eq(tm_send_record_acked(NULL, &ack), -EINVAL);
+        ck_assert_int_eq(tm_send_record_acked(r, NULL), -EINVAL);
+        ck_assert_int_eq(tm_session_send_acked(NULL, r, &ack), -EINVAL);
+        tm_free_record(r);
+}
+END_TEST
+
+/* Records sent by reconnect_send, each with a payload that identifies it */
+#define RECONNECT_RECORDS 64
+#define RECONNECT_PAYLOAD 8000
+/* Bytes the daemon reads before dropping the first connection, and at most */
+#define RECONNECT_DROP_AFTER (RECONNECT_RECORDS / 2 * RECONNECT_PAYLOAD)
+#define RECONNECT_RECEIVED (RECONNECT_RECORDS * 2 * RECONNECT_PAYLOAD)
+
+struct fake_daemon {
+        int sfd;
+        /* written to once the records are queued */
+        int queued[2];
+        char *received;
+        size_t len;
+};
+
+static void fake_daemon_read(struct fake_daemon *d, int cfd, size_t max)
+{
+        ssize_t b;
+
+        while (max > 0 && (b = read(cfd, d->received + d->len, max)) > 0) {
+                d->len += (size_t)b;
+                max -= (size_t)b;
+        }
+}
+
+/* Drops the first connection in the middle of the records, and reads the
+ * second one until the sender closes it */
+static void *fake_daemon_run(void *arg)
+{
+        struct fake_daemon *d = arg;
+        char c;
+        int cfd;
+
+        cfd = accept(d->sfd, NULL, NULL);
+        ck_assert(cfd >= 0);
+        ck_assert(read(d->queued[0], &c, 1) == 1);
+        fake_daemon_read(d, cfd, RECONNECT_DROP_AFTER);
+        close(cfd);
+
+        cfd = accept(d->sfd, NULL, NULL);
+        ck_assert(cfd >= 0);
+        fake_daemon_read(d, cfd, RECONNECT_RECEIVED - d->len);
+        close(cfd);
+
+        return NULL;
+}
+
+START_TEST(reconnect_send)
+{
+        struct fake_daemon d = { 0 };
+        struct sockaddr_un addr = { 0 };
+        struct telem_ref *r = NULL;
+        char payload[RECONNECT_PAYLOAD + 1];
+        char id[32];
+        pthread_t thread;
+        char *found;
+
+        d.received = malloc(RECONNECT_RECEIVED + 1);
+        ck_assert(d.received != NULL);
+        ck_assert(pipe(d.queued) == 0);
+        d.sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ck_assert(d.sfd >= 0);
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path_config(), sizeof(addr.sun_path) - 1);
+        unlink(addr.sun_path);
+        ck_assert(bind(d.sfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        ck_assert(listen(d.sfd, 4) == 0);
+        ck_assert(pthread_create(&thread, NULL, fake_daemon_run, &d) == 0);
+
+        /* The records do not fit in the socket buffers, the sender is still
+         * writing them when the connection is dropped */
+        ck_assert_int_eq(tm_async_start(RECONNECT_RECORDS, TM_ASYNC_BLOCK), 0);
+        memset(payload, 'x', RECONNECT_PAYLOAD);
+        payload[RECONNECT_PAYLOAD] = '\0';
+        for (int i = 0; i < RECONNECT_RECORDS; i++) {
+                ck_assert_int_eq(tm_create_record(&r, 1, "t/t/t", 1), 0);
+                snprintf(id, sizeof(id), "<record %04d>", i);
+                memcpy(payload, id, strlen(id));
+                ck_assert_int_eq(tm_set_payload(r, payload), 0);
+                ck_assert_int_eq(tm_async_send(r), 0);
+        }
+        ck_assert(write(d.queued[1], "", 1) == 1);
+        ck_assert_int_eq(tm_async_stop(), 0);
+        ck_assert(pthread_join(thread, NULL) == 0);
+        d.received[d.len] = '\0';
+
+        /* Records the daemon read before the connection dropped are not sent
+         * again, and the ones after them are sent once reconnected */
+        for (int i = 0; i < RECONNECT_RECORDS; i++) {
+                snprintf(id, sizeof(id), "<record %04d>", i);
+                found = memmem(d.received, d.len, id, strlen(id));
+                if (found) {
+                        ck_assert_msg(memmem(found + 1, d.len - (size_t)(found + 1 - d.received),
+                                             id, strlen(id)) == NULL,
+                                      "%s was received twice", id);
+                }
+        }
+        ck_assert(memmem(d.received, d.len, id, strlen(id)) != NULL);
+
+        close(d.sfd);
+        close(d.queued[0]);
+        close(d.queued[1]);
+        unlink(addr.sun_path);
+        free(d.received);
+}
+END_TEST
+
+/* Records sent by stalled_send, more than the socket buffers hold */
+#define STALLED_RECORDS 128
+/* Bytes a connection of the stalled daemon holds at most */
+#define STALLED_RECEIVED (STALLED_RECORDS * 2 * RECONNECT_PAYLOAD)
+
+struct stalled_daemon {
+        int sfd;
+        /* written to once the sender timed out, and once it is done */
+        int signal[2];
+        /* complete frames received over all connections */
+        size_t frames;
+        /* size of the first frame, which all the others share */
+        uint32_t frame_size;
+        char *received;
+};
+
+/* Reads a connection until the sender closes it, and counts its frames,
+ * failing on one that does not start where the previous one ends */
+static void stalled_daemon_read(struct stalled_daemon *d, int cfd)
+{
+        size_t len = 0, off = 0;
+        uint32_t size;
+        ssize_t b;
+
+        while (len < STALLED_RECEIVED &&
+               (b = read(cfd, d->received + len, STALLED_RECEIVED - len)) > 0) {
+                len += (size_t)b;
+        }
+        close(cfd);
+
+        while (len - off >= sizeof(size)) {
+                memcpy(&size, d->received + off, sizeof(size));
+                if (d->frame_size == 0) {
+                        d->frame_size = size;
+                }
+                ck_assert_msg(size == d->frame_size, "frame %zu has size %u", d->frames,
+                              size);
+                if (len - off < size) {
+                        break;
+                }
+                off += size;
+                d->frames++;
+        }
+}
+
+/* Stops reading the first connection until the sender times out, then reads
+ * it and the ones opened after until the sender is done */
+static void *stalled_daemon_run(void *arg)
+{
+        struct stalled_daemon *d = arg;
+        struct pollfd pfd[2];
+        char c;
+        int cfd;
+
+        cfd = accept(d->sfd, NULL, NULL);
+        ck_assert(cfd >= 0);
+        ck_assert(read(d->signal[0], &c, 1) == 1);
+        stalled_daemon_read(d, cfd);
+
+        pfd[0].fd = d->sfd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = d->signal[0];
+        pfd[1].events = POLLIN;
+        for (;;) {
+                ck_assert(poll(pfd, 2, -1) > 0);
+                if (pfd[0].revents & POLLIN) {
+                        cfd = accept(d->sfd, NULL, NULL);
+                        ck_assert(cfd >= 0);
+                        stalled_daemon_read(d, cfd);
+                } else {
+                        break;
+                }
+        }
+
+        return NULL;
+}
+
+START_TEST(stalled_send)
+{
+        struct stalled_daemon d = { 0 };
+        struct sockaddr_un addr = { 0 };
+        struct tm_async_stats stats;
+        struct telem_ref *r = NULL;
+        char payload[RECONNECT_PAYLOAD + 1];
+        pthread_t thread;
+
+        d.received = malloc(STALLED_RECEIVED);
+        ck_assert(d.received != NULL);
+        ck_assert(pipe(d.signal) == 0);
+        d.sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ck_assert(d.sfd >= 0);
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path_config(), sizeof(addr.sun_path) - 1);
+        unlink(addr.sun_path);
+        ck_assert(bind(d.sfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        ck_assert(listen(d.sfd, 4) == 0);
+        ck_assert(pthread_create(&thread, NULL, stalled_daemon_run, &d) == 0);
+
+        /* The daemon does not read, the socket buffers fill up until a write
+         * times out, most likely in the middle of a record */
+        ck_assert_int_eq(tm_async_start(STALLED_RECORDS, TM_ASYNC_BLOCK), 0);
+        memset(payload, 'x', RECONNECT_PAYLOAD);
+        payload[RECONNECT_PAYLOAD] = '\0';
+        for (int i = 0; i < STALLED_RECORDS; i++) {
+                ck_assert_int_eq(tm_create_record(&r, 1, "t/t/t", 1), 0);
+                ck_assert_int_eq(tm_set_payload(r, payload), 0);
+                ck_assert_int_eq(tm_async_send(r), 0);
+        }
+        for (int i = 0; i < 500; i++) {
+                ck_assert_int_eq(tm_async_get_stats(&stats), 0);
+                if (stats.failed > 0) {
+                        break;
+                }
+                usleep(10000);
+        }
+        ck_assert(stats.failed > 0);
+        ck_assert(write(d.signal[1], "", 1) == 1);
+
+        /* The next records start a new frame, on a new connection if the
+         * previous one was left in the middle of a frame, and each record is
+         * either received or failed */
+        for (int i = 0; i < 500; i++) {
+                ck_assert_int_eq(tm_async_get_stats(&stats), 0);
+                if (stats.sent + stats.failed == STALLED_RECORDS) {
+                        break;
+                }
+                usleep(10000);
+        }
+        ck_assert_int_eq(tm_async_stop(), 0);
+        ck_assert(write(d.signal[1], "", 1) == 1);
+        ck_assert(pthread_join(thread, NULL) == 0);
+        ck_assert_int_eq(stats.sent + stats.failed, STALLED_RECORDS);
+        ck_assert_int_eq(d.frames, stats.sent);
+
+        close(d.sfd);
+        close(d.signal[0]);
+        close(d.signal[1]);
+        unlink(addr.sun_path);
+        free(d.received);
+}
+END_TEST
+
+/* Reads the records sent asking for acknowledgements and closes the
+ * connection without any, the way daemons that do not acknowledge records
+ * do, then reads the records sent again */
+static void *old_daemon_run(void *arg)
+{
+        struct stalled_daemon *d = arg;
+        struct pollfd pfd;
+        char buf[16384];
+        int cfd;
+
+        cfd = accept(d->sfd, NULL, NULL);
+        ck_assert(cfd >= 0);
+        pfd.fd = cfd;
+        pfd.events = POLLIN;
+        while (poll(&pfd, 1, 200) > 0 && read(cfd, buf, sizeof(buf)) > 0) {
+        }
+        close(cfd);
+
+        cfd = accept(d->sfd, NULL, NULL);
+        ck_assert(cfd >= 0);
+        stalled_daemon_read(d, cfd);
+
+        return NULL;
+}
+
+START_TEST(send_records_old_daemon)
+{
+        struct stalled_daemon d = { 0 };
+        struct sockaddr_un addr = { 0 };
+        struct telem_ref *refs[RECONNECT_RECORDS];
+        char payload[RECONNECT_PAYLOAD + 1];
+        pthread_t thread;
+
+        d.received = malloc(STALLED_RECEIVED);
+        ck_assert(d.received != NULL);
+        d.sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ck_assert(d.sfd >= 0);
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path_config(), sizeof(addr.sun_path) - 1);
+        unlink(addr.sun_path);
+        ck_assert(bind(d.sfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        ck_assert(listen(d.sfd, 4) == 0);
+        ck_assert(pthread_create(&thread, NULL, old_daemon_run, &d) == 0);
+
+        /* The records do not fit in the socket buffers, so they are written
+         * in several parts, and the group durability of example.conf asks
+         * for acknowledgements */
+        memset(payload, 'x', RECONNECT_PAYLOAD);
+        payload[RECONNECT_PAYLOAD] = '\0';
+        for (int i = 0; i < RECONNECT_RECORDS; i++) {
+                ck_assert_int_eq(tm_create_record(&refs[i], 1, "t/t/t", 1), 0);
+                ck_assert_int_eq(tm_set_payload(refs[i], payload), 0);
+        }
+        ck_assert_int_eq(tm_send_records(refs, RECONNECT_RECORDS), 0);
+        ck_assert(pthread_join(thread, NULL) == 0);
+
+        /* All the records are sent again whole */
+        ck_assert_int_eq(d.frames, RECONNECT_RECORDS);
+
+        for (int i = 0; i < RECONNECT_RECORDS; i++) {
+                tm_free_record(refs[i]);
+        }
+        close(d.sfd);
+        unlink(addr.sun_path);
+        free(d.received);
+}
+END_TEST
+
+/* Acknowledges the first record after the client gave up waiting, and the
+ * next one as throttled, on whichever connection it comes */
+static void *late_ack_daemon_run(void *arg)
+{
+        int sfd = *(int *)arg;
+        struct record_ack ack = { TM_ACK_ACCEPTED, 0 };
+        struct pollfd pfd[2];
+        char buf[16384];
+        int cfd;
+
+        cfd = accept(sfd, NULL, NULL);
+        ck_assert(cfd >= 0);
+        ck_assert(read(cfd, buf, sizeof(buf)) > 0);
+        usleep(1500000);
+        /* The client may have closed the connection already */
+        send(cfd, &ack, sizeof(ack), MSG_NOSIGNAL);
+
+        pfd[0].fd = sfd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = cfd;
+        pfd[1].events = POLLIN;
+        ck_assert(poll(pfd, 2, -1) > 0);
+        if (pfd[0].revents & POLLIN) {
+                close(cfd);
+                cfd = accept(sfd, NULL, NULL);
+                ck_assert(cfd >= 0);
+        }
+        ck_assert(read(cfd, buf, sizeof(buf)) > 0);
+        ack.status = TM_ACK_THROTTLED;
+        ck_assert(write(cfd, &ack, sizeof(ack)) == sizeof(ack));
+        ck_assert(read(cfd, buf, sizeof(buf)) == 0);
+        close(cfd);
+
+        return NULL;
+}
+
+START_TEST(late_ack_session)
+{
+        struct sockaddr_un addr = { 0 };
+        struct tm_session *session = NULL;
+        struct telem_ref *r = NULL;
+        struct tm_ack ack;
+        pthread_t thread;
+        int sfd;
+
+        sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ck_assert(sfd >= 0);
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path_config(), sizeof(addr.sun_path) - 1);
+        unlink(addr.sun_path);
+        ck_assert(bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        ck_assert(listen(sfd, 4) == 0);
+        ck_assert(pthread_create(&thread, NULL, late_ack_daemon_run, &sfd) == 0);
+
+        ck_assert_int_eq(tm_create_record(&r, 1, "t/t/t", 1), 0);
+        ck_assert_int_eq(tm_set_payload(r, "late"), 0);
+        ck_assert_int_eq(tm_open_session(&session), 0);
+        ck_assert_int_eq(tm_session_send_acked(session, r, &ack), -ETIMEDOUT);
+
+        /* The late acknowledgement is not taken for the one of the next
+         * record */
+        ck_assert_int_eq(tm_session_send_acked(session, r, &ack), 0);
+        ck_assert_int_eq(ack.status, TM_ACK_THROTTLED);
+        tm_close_session(session);
+        ck_assert(pthread_join(thread, NULL) == 0);
+
+        tm_free_record(r);
+        close(sfd);
+        unlink(addr.sun_path);
+}
+END_TEST
+
 Suite *lib_suite(void)
 {
         Suite *s = suite_create("libtelemetry");
@@ -259,6 +1026,20 @@ Suite *lib_suite(void)
         tcase_add_test(t, record_create_severity);
         tcase_add_test(t, record_create_classification);
         tcase_add_test(t, record_create_version);
+        tcase_add_test(t, record_create_host_info_refresh);
+        tcase_add_test(t, record_create_host_info_threads);
+        tcase_add_test(t, record_set_large_payload);
+        tcase_add_test(t, record_layout);
+        suite_add_tcase(s, t);
+
+        t = tcase_create("record templates");
+        tcase_add_test(t, template_record);
+        tcase_add_test(t, template_invalid_class);
+        suite_add_tcase(s, t);
+
+        t = tcase_create("random ids");
+        tcase_add_test(t, random_id_format);
+        tcase_add_test(t, random_id_fork);
         suite_add_tcase(s, t);
 
         t = tcase_create("Opt-in");
@@ -284,6 +1065,33 @@ Suite *lib_suite(void)
         tcase_add_test(t, record_set_event_id_long);
         suite_add_tcase(s, t);
 
+        t = tcase_create("async sender");
+        tcase_add_test(t, async_start_stop);
+        tcase_add_test(t, async_invalid_policy);
+        suite_add_tcase(s, t);
+
+        t = tcase_create("acknowledgements");
+        tcase_add_test(t, send_acked_invalid);
+        suite_add_tcase(s, t);
+
+        /* Last, since it changes the configuration */
+        t = tcase_create("client-side limits");
+        tcase_add_unchecked_fixture(t, limits_setup, NULL);
+        tcase_add_test(t, limit_rate);
+        tcase_add_test(t, limit_rate_template);
+        tcase_add_test(t, limit_rate_threads);
+        tcase_add_test(t, limit_sampling);
+        suite_add_tcase(s, t);
+
+        /* Uses the socket path of the configuration of client-side limits */
+        t = tcase_create("reconnect");
+        tcase_add_unchecked_fixture(t, limits_setup, NULL);
+        tcase_add_test(t, reconnect_send);
+        tcase_add_test(t, stalled_send);
+        tcase_add_test(t, late_ack_session);
+        tcase_add_test(t, send_records_old_daemon);
+        suite_add_tcase(s, t);
+
         return s;
 }
 
@@ -14,25 +14,47 @@
  * details.
  */
 
+#include "config.h"
+
 #include <check.h>
 #include <sys/socket.h>
 #include <sys/fcntl.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <sys/queue.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
 
 #include "configuration.h"
+#include "uploader.h"
+#include "segment.h"
+#include "handoff.h"
+#include "iorecord.h"
 #include "telempostdaemon.h"
 #include "common.h"
+#include "mock_backend.h"
+#include "compress.h"
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
 
 TelemPostDaemon tdaemon;
 
-bool dummy_post(char *headers[], char *body, char *cfg_file)
+static int records_posted = 0;
+
+#define TIDHEADER "X-Telemetry-TID: 6907c830-eed9-4ce9-81ae-76daf8d88f0f"
+
+void dummy_post(char *headers[], char *body, char *cfg_file, upload_done_fn done,
+                void *data)
 {
-        return true;
+        records_posted++;
+        done(true, data);
 }
 
-bool (*post_record_ptr)(char *headers[], char *body, char *cfg_file) = dummy_post;
+void (*post_record_ptr)(char *headers[], char *body, char *cfg_file,
+                        upload_done_fn done, void *data) = dummy_post;
 
 void setup(void)
 {
@@ -93,6 +115,52 @@ START_TEST(check_process_record_with_correct_size_and_data)
 }
 END_TEST
 
+START_TEST(check_create_json_message)
+{
+        char *headers[NUM_HEADERS] = { NULL };
+        char *copies[NUM_HEADERS];
+        char *body = NULL, *cfg_file = NULL, *json;
+        const char *json_headers =
+                "{\"record_format_version\":\"1\",\"classification\":\"crash/kernel/bug\","
+                "\"severity\":\"0\",\"machine_id\":\"1234\",\"creation_timestamp\":"
+                "\"1418672344\",\"arch\":\"x86_64\",\"host_type\":\"macbookpro\","
+                "\"build\":\"200\",\"kernel_version\":\"3.15\",\"payload_format_version\":"
+                "\"1\",\"system_name\":\"clear-linux-os\",\"board_name\":\"Qemu|Intel\","
+                "\"cpu_model\":\"Intel(R)\",\"bios_version\":\"Qemu\",\"event_id\":"
+                "\"3a2d799826edc6266d72824d2aac6763\",\"dropped_count\":\"0\","
+                "\"sample_rate\":\"1/1\",";
+
+        ck_assert(read_record(ABSTOPSRCDIR "/tests/telempostd/correct_message", headers,
+                              &body, &cfg_file));
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                copies[i] = strdup(headers[i]);
+        }
+
+        /* The same bytes json-c gave, a header value ends at its first
+         * space */
+        json = create_json_message(headers, body);
+        ck_assert(strncmp(json, json_headers, strlen(json_headers)) == 0);
+        ck_assert_str_eq(json + strlen(json_headers), "\"payload\":\"test message\\n\"}");
+        free(json);
+
+        /* Only control characters, quotes and backslashes are escaped */
+        json = create_json_message(headers, "\"quoted\" back\\slash /path\ttab"
+                                   "\x01\x1f\x7f\xc3\xa9");
+        ck_assert_str_eq(json + strlen(json_headers), "\"payload\":\"\\\"quoted\\\" back"
+                         "\\\\slash /path\\ttab\\u0001\\u001f\x7f\xc3\xa9\"}");
+        free(json);
+
+        /* The headers can be posted again */
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                ck_assert_str_eq(headers[i], copies[i]);
+                free(headers[i]);
+                free(copies[i]);
+        }
+        free(body);
+        free(cfg_file);
+}
+END_TEST
+
 START_TEST(check_process_record_with_incorrect_headers)
 {
         setup();
@@ -389,6 +457,489 @@ START_TEST(check_strategy_if_record_sent)
 }
 END_TEST
 
+/* Stages the content of a single-record file twice in a sealed segment */
+static void stage_segment(const char *record_file, char *sealed)
+{
+        struct segment_writer writer;
+        struct iovec iov;
+        char data[4096];
+        ssize_t len;
+        int fd;
+
+        fd = open(record_file, O_RDONLY);
+        ck_assert(fd >= 0);
+        len = read(fd, data, sizeof(data));
+        ck_assert(len > 0);
+        close(fd);
+
+        ck_assert(segment_writer_init(&writer) == 0);
+        writer.max_size = 1024 * 1024;
+        writer.max_age = 60;
+        iov.iov_base = data;
+        iov.iov_len = (size_t)len;
+        for (int i = 0; i < 2; i++) {
+                ck_assert(segment_append(&writer, spool_dir_config(), &iov, 1) == 0);
+        }
+        ck_assert(writer.fd >= 0);
+
+        /* Open segments are left to telemprobd */
+        ck_assert(process_staged_record(writer.path, &tdaemon) == false);
+
+        strcpy(sealed, writer.path);
+        sealed[strlen(sealed) - strlen(SEGMENT_OPEN_SUFFIX)] = '\0';
+        segment_writer_close(&writer);
+        ck_assert(writer.sealed == 1);
+}
+
+static int count_spooled_records(void)
+{
+        struct dirent *entry;
+        DIR *dir;
+        int count = 0;
+
+        dir = opendir(spool_dir_config());
+        ck_assert(dir != NULL);
+        while ((entry = readdir(dir)) != NULL) {
+                if (strncmp(entry->d_name, SPOOLED_RECORD_PREFIX,
+                            strlen(SPOOLED_RECORD_PREFIX)) == 0) {
+                        count++;
+                }
+        }
+        closedir(dir);
+
+        return count;
+}
+
+START_TEST(check_process_segment)
+{
+        setup();
+
+        char path[PATH_MAX];
+        char target[PATH_MAX + 8];
+        int spooled;
+
+        stage_segment(ABSTOPSRCDIR "/tests/telempostd/correct_message", path);
+        records_posted = 0;
+        ck_assert(process_staged_record(path, &tdaemon) == true);
+        ck_assert_int_eq(records_posted, 2);
+        unlink(path);
+
+        /* Records that can not be delivered now are moved to the spool */
+        spooled = count_spooled_records();
+        stage_segment(ABSTOPSRCDIR "/tests/telempostd/correct_message", path);
+        tdaemon.bypass_http_post_ts = time(NULL);
+        records_posted = 0;
+        ck_assert(process_staged_record(path, &tdaemon) == true);
+        ck_assert_int_eq(records_posted, 0);
+        ck_assert_int_eq(count_spooled_records(), spooled + 2);
+        unlink(path);
+
+        /* Corrupted records are dropped */
+        stage_segment(ABSTOPSRCDIR "/tests/telempostd/incorrect_headers", path);
+        tdaemon.bypass_http_post_ts = 0;
+        ck_assert(process_staged_record(path, &tdaemon) == true);
+        ck_assert_int_eq(records_posted, 0);
+        unlink(path);
+
+        /* Segments are kept until they can be read, links are not followed */
+        stage_segment(ABSTOPSRCDIR "/tests/telempostd/correct_message", path);
+        ck_assert(chmod(path, 0) == 0);
+        if (geteuid() != 0) {
+                ck_assert(process_staged_record(path, &tdaemon) == false);
+                ck_assert_int_eq(records_posted, 0);
+        }
+        strcpy(target, path);
+        strcat(target, ".target");
+        ck_assert(rename(path, target) == 0);
+        ck_assert(symlink(target, path) == 0);
+        ck_assert(process_staged_record(path, &tdaemon) == true);
+        ck_assert_int_eq(records_posted, 0);
+        unlink(path);
+        unlink(target);
+}
+END_TEST
+
+START_TEST(check_receive_handoff_records)
+{
+        setup();
+
+        char *headers[NUM_HEADERS] = { NULL };
+        char *body = NULL;
+        char *cfg_file = NULL;
+        struct handoff_frame_header header;
+        struct record_view view;
+        struct iovec iov[HANDOFF_MAX_IOV];
+        size_t size;
+        int spooled;
+        int sv[2];
+
+        ck_assert(read_record(ABSTOPSRCDIR "/tests/telempostd/correct_message", headers,
+                              &body, &cfg_file));
+        record_view_init(&view, headers, body, cfg_file);
+        size = handoff_frame_iov(&header, &view, iov);
+
+        /* direct_handoff_enabled is not set in example.conf */
+        ck_assert(tdaemon.pollfds[handofflfd].fd == -1);
+        ck_assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+        tdaemon.pollfds[handoffcfd].fd = sv[1];
+        tdaemon.handoff_frame = malloc(HANDOFF_MAX_FRAME);
+        tdaemon.handoff_copy = malloc(HANDOFF_MAX_FRAME);
+
+        tdaemon.bypass_http_post_ts = 0;
+        records_posted = 0;
+        ck_assert(writev(sv[0], iov, HANDOFF_MAX_IOV) == (ssize_t)size);
+        ck_assert(writev(sv[0], iov, HANDOFF_MAX_IOV) == (ssize_t)size);
+        ck_assert_int_eq(receive_handoff_records(&tdaemon), 2);
+        ck_assert_int_eq(records_posted, 2);
+
+        /* Records that can not be delivered now are moved to the spool */
+        spooled = count_spooled_records();
+        tdaemon.bypass_http_post_ts = time(NULL);
+        records_posted = 0;
+        ck_assert(writev(sv[0], iov, HANDOFF_MAX_IOV) == (ssize_t)size);
+        ck_assert_int_eq(receive_handoff_records(&tdaemon), 1);
+        ck_assert_int_eq(records_posted, 0);
+        ck_assert_int_eq(count_spooled_records(), spooled + 1);
+        tdaemon.bypass_http_post_ts = 0;
+
+        /* The connection is closed once telemprobd is gone */
+        close(sv[0]);
+        ck_assert_int_eq(receive_handoff_records(&tdaemon), 0);
+        ck_assert(tdaemon.pollfds[handoffcfd].fd == -1);
+
+        free(tdaemon.handoff_frame);
+        free(tdaemon.handoff_copy);
+        tdaemon.handoff_frame = NULL;
+        tdaemon.handoff_copy = NULL;
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                free(headers[i]);
+        }
+        free(body);
+        free(cfg_file);
+}
+END_TEST
+
+START_TEST(check_backend_cache)
+{
+        struct backend_cache cache = { NULL, false, 0 };
+        struct backend *first, *second;
+        struct backend_config config = { "https://127.0.0.1:1/", "", TIDHEADER,
+                                          COMPRESSION_NONE, 0, "" };
+
+        ck_assert_int_eq(backend_cache_timeout(&cache, 30, time(NULL)), -1);
+
+        /* Records to the same backend share its handle */
+        first = backend_get(&cache, &config);
+        ck_assert(first != NULL);
+        ck_assert(cache.curl_initialized);
+        ck_assert(backend_get(&cache, &config) == first);
+        config.url = "https://127.0.0.1:2/";
+        second = backend_get(&cache, &config);
+        ck_assert(second != NULL && second != first);
+        config.url = "https://127.0.0.1:1/";
+        config.cainfo = "/tmp/cacert.crt";
+        ck_assert(backend_get(&cache, &config) != first);
+        config.cainfo = "";
+        config.compression = COMPRESSION_GZIP;
+        ck_assert(backend_get(&cache, &config) != first);
+
+        /* The backends are kept until the cache is idle */
+        ck_assert_int_eq(backend_cache_timeout(&cache, 30, cache.last_used), 30000);
+        ck_assert_int_eq(backend_cache_timeout(&cache, 30, cache.last_used + 10), 20000);
+        ck_assert_int_eq(backend_cache_timeout(&cache, 30, cache.last_used + 30), 0);
+        ck_assert_int_eq(backend_cache_timeout(&cache, 0, cache.last_used), 0);
+
+        backend_cache_clear(&cache);
+        ck_assert(cache.backends == NULL);
+        ck_assert(!cache.curl_initialized);
+        ck_assert_int_eq(backend_cache_timeout(&cache, 30, time(NULL)), -1);
+}
+END_TEST
+
+static void count_failed_post(bool sent, void *data)
+{
+        if (!sent) {
+                (*(int *)data)++;
+        }
+}
+
+START_TEST(check_uploader)
+{
+        struct uploader up;
+        struct backend_config config = { "http://127.0.0.1:1/", "", TIDHEADER,
+                                          COMPRESSION_NONE, 0, "" };
+        int failed = 0;
+
+        ck_assert_int_eq(uploader_init(&up, 2), 0);
+        ck_assert_int_eq(uploader_timeout(&up, 30), -1);
+
+        /* Nothing listens on port 1, no more than 2 posts are in flight */
+        for (int i = 0; i < 3; i++) {
+                ck_assert_int_eq(uploader_submit(&up, &config, strdup("{}"),
+                                                 count_failed_post, &failed), 0);
+                ck_assert(up.in_flight > 0 && up.in_flight <= 2);
+        }
+        ck_assert_int_eq(uploader_wait(&up, 0), 0);
+        ck_assert_int_eq(up.in_flight, 0);
+        ck_assert_int_eq(failed, 3);
+        ck_assert(up.nidle > 0 && up.nidle <= 2);
+
+        /* The connections are kept until the uploader is idle */
+        uploader_expire(&up, 30, up.cache.last_used + 29);
+        ck_assert(up.multi != NULL);
+        uploader_expire(&up, 30, up.cache.last_used + 30);
+        ck_assert(up.multi == NULL);
+        ck_assert(up.idle == NULL);
+        ck_assert(!up.cache.curl_initialized);
+        ck_assert_int_eq(uploader_timeout(&up, 30), -1);
+
+        uploader_close(&up);
+}
+END_TEST
+
+START_TEST(check_uploader_batch)
+{
+        struct mock_backend mock;
+        struct uploader up;
+        struct backend_config config = { NULL, "", TIDHEADER, COMPRESSION_NONE, 0, "" };
+        /* Both records have the same size */
+        const char *record = "{\"payload\":\"mock-backend-accept\"}";
+        const char *rejected = "{\"payload\":\"" MOCK_BACKEND_REJECT "\"}";
+        int failed = 0;
+
+        ck_assert_int_eq(mock_backend_start(&mock), 0);
+        config.url = mock.url;
+
+        /* Records are sent once their batch is full, only the record the
+         * server rejected fails */
+        ck_assert_int_eq(uploader_init(&up, 2), 0);
+        uploader_set_batch(&up, BATCH_JSON, 4, 64 * 1024);
+        for (int i = 0; i < 3; i++) {
+                ck_assert_int_eq(uploader_submit(&up, &config, strdup(record),
+                                                 count_failed_post, &failed), 0);
+                ck_assert_int_eq(up.in_flight, 0);
+        }
+        ck_assert_int_eq(uploader_submit(&up, &config, strdup(rejected),
+                                         count_failed_post, &failed), 0);
+        ck_assert_int_eq(up.in_flight, 1);
+        ck_assert_int_eq(uploader_wait(&up, 0), 0);
+        mock_backend_update(&mock);
+        ck_assert_int_eq(mock.requests, 1);
+        ck_assert_int_eq(mock.records, 4);
+        ck_assert_int_eq(failed, 1);
+
+        /* A batch not full is sent when flushed */
+        for (int i = 0; i < 2; i++) {
+                ck_assert_int_eq(uploader_submit(&up, &config, strdup(record),
+                                                 count_failed_post, &failed), 0);
+        }
+        ck_assert(uploader_timeout(&up, 30) == 0);
+        uploader_flush(&up);
+        ck_assert_int_eq(uploader_wait(&up, 0), 0);
+        mock_backend_update(&mock);
+        ck_assert_int_eq(mock.requests, 2);
+        ck_assert_int_eq(mock.records, 6);
+        ck_assert_int_eq(failed, 1);
+        uploader_close(&up);
+
+        /* One record per line, sent once the batch reaches its size */
+        ck_assert_int_eq(uploader_init(&up, 2), 0);
+        uploader_set_batch(&up, BATCH_NDJSON, 64, 2 * strlen(record) + 2);
+        for (int i = 0; i < 4; i++) {
+                ck_assert_int_eq(uploader_submit(&up, &config,
+                                                 strdup(i == 1 ? rejected : record),
+                                                 count_failed_post, &failed), 0);
+        }
+        uploader_close(&up);
+        mock_backend_update(&mock);
+        ck_assert_int_eq(mock.requests, 4);
+        ck_assert_int_eq(mock.records, 10);
+        ck_assert_int_eq(failed, 2);
+
+        /* A record that fills a batch on its own, after the previous batch
+         * was sent, is left for the flush rather than started as a second
+         * request */
+        ck_assert_int_eq(uploader_init(&up, 2), 0);
+        uploader_set_batch(&up, BATCH_JSON, 64, 2 * strlen(record));
+        ck_assert_int_eq(uploader_submit(&up, &config, strdup(record),
+                                         count_failed_post, &failed), 0);
+        ck_assert_int_eq(up.in_flight, 0);
+        char *large = calloc(1, 2 * strlen(record) + 1);
+        memset(large, ' ', 2 * strlen(record));
+        memcpy(large, record, strlen(record));
+        ck_assert_int_eq(uploader_submit(&up, &config, large, count_failed_post,
+                                         &failed), 0);
+        ck_assert_int_eq(up.in_flight, 1);
+        ck_assert(up.pending != NULL);
+        uploader_flush(&up);
+        ck_assert_int_eq(up.in_flight, 2);
+        uploader_close(&up);
+        mock_backend_update(&mock);
+        ck_assert_int_eq(mock.requests, 6);
+        ck_assert_int_eq(mock.records, 12);
+        ck_assert_int_eq(failed, 2);
+
+        /* A batch answered with no body after one answered with the status
+         * of its records, on the same handle, is sent as a whole */
+        ck_assert_int_eq(uploader_init(&up, 1), 0);
+        uploader_set_batch(&up, BATCH_JSON, 2, 64 * 1024);
+        ck_assert_int_eq(uploader_submit(&up, &config, strdup(record),
+                                         count_failed_post, &failed), 0);
+        ck_assert_int_eq(uploader_submit(&up, &config, strdup(rejected),
+                                         count_failed_post, &failed), 0);
+        ck_assert_int_eq(uploader_wait(&up, 0), 0);
+        ck_assert_int_eq(failed, 3);
+        ck_assert_int_eq(uploader_submit(&up, &config, strdup(record),
+                                         count_failed_post, &failed), 0);
+        ck_assert_int_eq(uploader_submit(&up, &config,
+                                         strdup("{\"payload\":\"" MOCK_BACKEND_EMPTY "\"}"),
+                                         count_failed_post, &failed), 0);
+        ck_assert_int_eq(uploader_wait(&up, 0), 0);
+        ck_assert_int_eq(failed, 3);
+        uploader_close(&up);
+        mock_backend_update(&mock);
+        ck_assert_int_eq(mock.requests, 8);
+        ck_assert_int_eq(mock.records, 16);
+
+        mock_backend_stop(&mock);
+}
+END_TEST
+
+START_TEST(check_compression)
+{
+        struct mock_backend mock;
+        struct uploader up;
+        struct compressor c;
+        struct backend_config config = { NULL, "", TIDHEADER, COMPRESSION_GZIP, 0, "" };
+        const char *record = "{\"payload\":\"mock-backend-accept\"}";
+        char *out = NULL;
+        size_t size = 0;
+        int failed = 0;
+
+        /* gzip, with the level clamped */
+        ck_assert_int_eq(compressor_init(&c, COMPRESSION_GZIP, 42, ""), 0);
+        ck_assert_str_eq(compressor_encoding(&c), "gzip");
+        ck_assert_int_eq(c.level, 9);
+        ck_assert(compressor_compress(&c, record, strlen(record), &out, &size) > 10);
+        ck_assert(out[0] == '\x1f' && out[1] == '\x8b');
+        compressor_free(&c);
+        ck_assert(compressor_encoding(&c) == NULL);
+
+#ifdef HAVE_ZSTD_H
+        /* zstd, with a raw content dictionary the server shares */
+        char dictionary[] = "/tmp/check_postd_dictXXXXXX";
+        char decoded[256];
+        ssize_t len;
+        int fd = mkstemp(dictionary);
+
+        ck_assert(fd >= 0);
+        ck_assert(write(fd, record, strlen(record)) == (ssize_t)strlen(record));
+        close(fd);
+        ck_assert_int_eq(compressor_init(&c, COMPRESSION_ZSTD, 3, dictionary), 0);
+        ck_assert_str_eq(compressor_encoding(&c), "zstd");
+        len = compressor_compress(&c, record, strlen(record), &out, &size);
+        ck_assert(len > 0 && (size_t)len < strlen(record));
+        ZSTD_DCtx *dctx = ZSTD_createDCtx();
+        ck_assert_int_eq(ZSTD_decompress_usingDict(dctx, decoded, sizeof(decoded), out,
+                                                   (size_t)len, record, strlen(record)),
+                         strlen(record));
+        ck_assert(memcmp(decoded, record, strlen(record)) == 0);
+        ZSTD_freeDCtx(dctx);
+        compressor_free(&c);
+        unlink(dictionary);
+#endif
+        free(out);
+
+        /* The server decodes batches with their Content-Encoding */
+        ck_assert_int_eq(mock_backend_start(&mock), 0);
+        config.url = mock.url;
+        ck_assert_int_eq(uploader_init(&up, 2), 0);
+        uploader_set_batch(&up, BATCH_JSON, 2, 64 * 1024);
+        for (int i = 0; i < 4; i++) {
+#ifdef HAVE_ZSTD_H
+                config.compression = i < 2 ? COMPRESSION_GZIP : COMPRESSION_ZSTD;
+#endif
+                ck_assert_int_eq(uploader_submit(&up, &config, strdup(record),
+                                                 count_failed_post, &failed), 0);
+        }
+        uploader_close(&up);
+        mock_backend_update(&mock);
+        ck_assert_int_eq(mock.requests, 2);
+        ck_assert_int_eq(mock.records, 4);
+        ck_assert_int_eq(failed, 0);
+        mock_backend_stop(&mock);
+}
+END_TEST
+
+/* Posts that complete once the test completes them */
+static upload_done_fn deferred_done[2];
+static void *deferred_data[2];
+
+void deferred_post(char *headers[], char *body, char *cfg_file, upload_done_fn done,
+                   void *data)
+{
+        ck_assert(records_posted < 2);
+        deferred_done[records_posted] = done;
+        deferred_data[records_posted] = data;
+        records_posted++;
+}
+
+static void stage_record_file(const char *record_file, char *path)
+{
+        char data[4096];
+        ssize_t len;
+        int fd;
+
+        fd = open(record_file, O_RDONLY);
+        ck_assert(fd >= 0);
+        len = read(fd, data, sizeof(data));
+        ck_assert(len > 0);
+        close(fd);
+
+        snprintf(path, PATH_MAX, "%s/check_postd_record", spool_dir_config());
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        ck_assert(fd >= 0);
+        ck_assert(write(fd, data, (size_t)len) == len);
+        close(fd);
+}
+
+START_TEST(check_posts_complete_later)
+{
+        setup();
+
+        char path[PATH_MAX];
+        int spooled;
+
+        post_record_ptr = deferred_post;
+        tdaemon.bypass_http_post_ts = 0;
+
+        /* A staged file is removed once its own post succeeded */
+        stage_record_file(ABSTOPSRCDIR "/tests/telempostd/correct_message", path);
+        records_posted = 0;
+        ck_assert(process_staged_record(path, &tdaemon) == false);
+        ck_assert_int_eq(records_posted, 1);
+        ck_assert(access(path, F_OK) == 0);
+        deferred_done[0](true, deferred_data[0]);
+        ck_assert(access(path, F_OK) == -1);
+
+        /* The records of a segment are spooled once their post failed */
+        spooled = count_spooled_records();
+        stage_segment(ABSTOPSRCDIR "/tests/telempostd/correct_message", path);
+        records_posted = 0;
+        ck_assert(process_staged_record(path, &tdaemon) == true);
+        ck_assert_int_eq(records_posted, 2);
+        unlink(path);
+        ck_assert_int_eq(count_spooled_records(), spooled);
+        deferred_done[0](true, deferred_data[0]);
+        deferred_done[1](false, deferred_data[1]);
+        ck_assert_int_eq(count_spooled_records(), spooled + 1);
+        ck_assert(tdaemon.bypass_http_post_ts != 0);
+
+        tdaemon.bypass_http_post_ts = 0;
+        post_record_ptr = dummy_post;
+}
+END_TEST
+
 Suite *config_suite(void)
 {
         // A suite is comprised of test cases, defined below
@@ -400,7 +951,15 @@ Suite *config_suite(void)
         tcase_add_test(t, check_handle_client_with_no_data);
         tcase_add_test(t, check_handle_client_with_incorrect_data);
         tcase_add_test(t, check_process_record_with_correct_size_and_data);
+        tcase_add_test(t, check_create_json_message);
         tcase_add_test(t, check_process_record_with_incorrect_headers);
+        tcase_add_test(t, check_process_segment);
+        tcase_add_test(t, check_receive_handoff_records);
+        tcase_add_test(t, check_backend_cache);
+        tcase_add_test(t, check_uploader);
+        tcase_add_test(t, check_uploader_batch);
+        tcase_add_test(t, check_compression);
+        tcase_add_test(t, check_posts_complete_later);
         tcase_add_test(t, check_rate_limit_enabled_functions);
         tcase_add_test(t, check_rate_limit_records_that_pass);
         tcase_add_test(t, check_rate_limit_records_that_do_not_pass);
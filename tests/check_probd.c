@@ -17,13 +17,19 @@
 #include <check.h>
 #include <sys/socket.h>
 #include <sys/fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/queue.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 #include "configuration.h"
 #include "configuration_check.h"
 #include "telemdaemon.h"
+#include "iorecord.h"
+#include "handoff.h"
+#include "telemetry.h"
 #include "common.h"
 
 TelemDaemon tdaemon;
@@ -41,7 +47,7 @@ char *get_serialized_record(char *headers, char *post_body, size_t *record_size)
         *record_size = 2 * sizeof(uint32_t) + totalsize + 1;
         data = malloc(*record_size);
         memset(data, 0, *record_size);
-        memcpy(data, &totalsize, sizeof(uint32_t));
+        memcpy(data, record_size, sizeof(uint32_t));
         offset += sizeof(uint32_t);
 
         memcpy(data + offset, &headersize, sizeof(uint32_t));
@@ -64,64 +70,83 @@ void setup(void)
 
 void teardown(void)
 {
+        free_probe_daemon(&tdaemon);
         free_config_file();
 }
 
+void set_up_socket_pair(int *client, int *server)
+{
+        int sv[2];
+        int ret;
+
+        ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        ck_assert_msg(ret == 0, "Failed to create socket pair\n");
+        ck_assert_msg((fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0),
+                      "Failed to set socket to non-blocking\n");
+        ck_assert_msg((fcntl(sv[1], F_SETFL, O_NONBLOCK) == 0),
+                      "Failed to set socket to non-blocking\n");
+        *client = sv[0];
+        *server = sv[1];
+}
+
 START_TEST(check_daemon_is_initialized)
 {
         setup();
 
-        ck_assert(tdaemon.nfds == 0);
-        ck_assert(tdaemon.pollfds == NULL);
+        ck_assert(tdaemon.epollfd >= 0);
+        ck_assert(tdaemon.nclients == 0);
 
         teardown();
 }
 END_TEST
 
-int get_poll_fd(TelemDaemon *tdaemon, nfds_t i)
+START_TEST(check_add_del_epoll_fd)
 {
-        if (i >= 0 && i < tdaemon->nfds) {
-                return tdaemon->pollfds[i].fd;
-        }
-        return -1;
+        setup();
+
+        struct epoll_event ev;
+        int sv[2];
+        int source;
+
+        ck_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        ck_assert(add_epollfd(&tdaemon, sv[0], EPOLLIN, &source) == 0);
+        ck_assert(add_epollfd(&tdaemon, sv[0], EPOLLIN, &source) == -EEXIST);
+
+        /* The event carries the pointer given when the fd was added */
+        ck_assert(epoll_wait(tdaemon.epollfd, &ev, 1, 0) == 0);
+        ck_assert(write(sv[1], "x", 1) == 1);
+        ck_assert(epoll_wait(tdaemon.epollfd, &ev, 1, 0) == 1);
+        ck_assert(ev.data.ptr == &source);
+
+        del_epollfd(&tdaemon, sv[0]);
+        ck_assert_msg(epoll_wait(tdaemon.epollfd, &ev, 1, 0) == 0, "Failed to delete epoll fd");
+
+        close(sv[0]);
+        close(sv[1]);
+        teardown();
 }
+END_TEST
 
-START_TEST(check_add_del_poll_fd)
+START_TEST(check_watch_client)
 {
         setup();
 
-        int fd = 1;
-        int short events = 1;
-        add_pollfd(&tdaemon, 1, events);
-        add_pollfd(&tdaemon, 2, events);
-        add_pollfd(&tdaemon, 3, events);
-        ck_assert_msg(tdaemon.nfds == 3, "Failed to add pollfd");
-
-        fd = get_poll_fd(&tdaemon, 0);
-        ck_assert(fd == 1);
-        fd = get_poll_fd(&tdaemon, 1);
-        ck_assert(fd == 2);
-        fd = get_poll_fd(&tdaemon, 2);
-        ck_assert(fd == 3);
-
-        del_pollfd(&tdaemon, 1);
-        ck_assert_msg(tdaemon.nfds == 2, "Failed to delete pollfd");
-        fd = get_poll_fd(&tdaemon, 1);
-        ck_assert(fd == 3);
-
-        del_pollfd(&tdaemon, 1);
-        ck_assert_msg(tdaemon.nfds == 1, "Failed to delete pollfd");
-        fd = get_poll_fd(&tdaemon, 1);
-        ck_assert(fd == -1);
-
-        del_pollfd(&tdaemon, 0);
-        ck_assert_msg(tdaemon.nfds == 0, "Failed to delete pollfd");
-        fd = get_poll_fd(&tdaemon, 0);
-        ck_assert(fd == -1);
-
-        /* Cleaning alloctions */
-        free(tdaemon.pollfds);
+        struct epoll_event ev;
+        client *cl;
+        int client_fd, server_fd;
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = watch_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        ck_assert(tdaemon.nclients == 1);
+
+        ck_assert(write(server_fd, "x", 1) == 1);
+        ck_assert(epoll_wait(tdaemon.epollfd, &ev, 1, 0) == 1);
+        ck_assert(ev.data.ptr == cl);
+
+        close(server_fd);
         teardown();
+        ck_assert(is_client_list_empty(&(tdaemon.client_head)));
 }
 END_TEST
 
@@ -150,21 +175,6 @@ START_TEST(check_add_remove_client)
 }
 END_TEST
 
-void set_up_socket_pair(int *client, int *server)
-{
-        int sv[2];
-        int ret;
-
-        ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
-        ck_assert_msg(ret == 0, "Failed to create socket pair\n");
-        ck_assert_msg((fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0),
-                      "Failed to set socket to non-blocking\n");
-        ck_assert_msg((fcntl(sv[1], F_SETFL, O_NONBLOCK) == 0),
-                      "Failed to set socket to non-blocking\n");
-        *client = sv[0];
-        *server = sv[1];
-}
-
 START_TEST(check_handle_client_with_no_data)
 {
         setup();
@@ -176,15 +186,20 @@ START_TEST(check_handle_client_with_no_data)
         bool processed;
 
         set_up_socket_pair(&client_fd, &server_fd);
-        cl = add_client(&(tdaemon.client_head), client_fd);
+        cl = watch_client(&tdaemon, client_fd);
         ck_assert_msg(cl != NULL, "failed to malloc client");
-        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
 
-        processed = handle_client(&tdaemon, 0, cl);
+        /* Nothing to read yet, the client is kept */
+        processed = handle_client(&tdaemon, cl);
         ck_assert(processed == false);
-        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with no data\n");
-        ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with n data\n");
+        ck_assert_msg(!is_client_list_empty(&(tdaemon.client_head)), "Removed client waiting for data\n");
+        ck_assert_msg(tdaemon.nclients == 1, "Removed epoll fd for client waiting for data\n");
+
         close(server_fd);
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with no data\n");
+        ck_assert_msg(tdaemon.nclients == 0, "Failed to remove epoll fd for client with n data\n");
 
         teardown();
 }
@@ -201,18 +216,17 @@ START_TEST(check_handle_client_with_incorrect_data)
         bool processed;
 
         set_up_socket_pair(&client_fd, &server_fd);
-        cl = add_client(&(tdaemon.client_head), client_fd);
+        cl = watch_client(&tdaemon, client_fd);
         ck_assert_msg(cl != NULL, "failed to malloc client");
-        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
 
         ssize_t ret = write(server_fd, buf, 2);
         ck_assert(ret == 2);
+        close(server_fd);
 
-        processed = handle_client(&tdaemon, 0, cl);
+        processed = handle_client(&tdaemon, cl);
         ck_assert(processed == false);
         ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with no data\n");
-        ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with n data\n");
-        close(server_fd);
+        ck_assert_msg(tdaemon.nclients == 0, "Failed to remove epoll fd for client with n data\n");
 
         teardown();
 }
@@ -230,9 +244,8 @@ START_TEST(check_handle_client_with_incorrect_size)
         char buf[4096];
 
         set_up_socket_pair(&client_fd, &server_fd);
-        cl = add_client(&(tdaemon.client_head), client_fd);
+        cl = watch_client(&tdaemon, client_fd);
         ck_assert_msg(cl != NULL, "failed to malloc client");
-        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
 
         int size = 10;
         memset(buf, 0, 4096);
@@ -240,12 +253,12 @@ START_TEST(check_handle_client_with_incorrect_size)
         memcpy(buf + RECORD_SIZE_LEN, data, sizeof(uint32_t));
         ssize_t ret = write(server_fd, buf, 2);
         ck_assert(ret == 2);
+        close(server_fd);
 
-        processed = handle_client(&tdaemon, 0, cl);
+        processed = handle_client(&tdaemon, cl);
         ck_assert(processed == false);
         ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with no data\n");
-        ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with n data\n");
-        close(server_fd);
+        ck_assert_msg(tdaemon.nclients == 0, "Failed to remove epoll fd for client with n data\n");
 
         teardown();
 }
@@ -263,9 +276,8 @@ START_TEST(check_handle_client_with_correct_size)
         char buf[256];
 
         set_up_socket_pair(&client_fd, &server_fd);
-        cl = add_client(&(tdaemon.client_head), client_fd);
+        cl = watch_client(&tdaemon, client_fd);
         ck_assert_msg(cl != NULL, "failed to malloc client");
-        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
 
         size_t size = strlen(data);
         memset(buf, 0, 256);
@@ -276,12 +288,12 @@ START_TEST(check_handle_client_with_correct_size)
 
         ssize_t ret = write(server_fd, buf, 2 * sizeof(uint32_t) + size + 1);
         ck_assert(ret != -1);
-        processed = handle_client(&tdaemon, 0, cl);
+        close(server_fd);
+        processed = handle_client(&tdaemon, cl);
         ck_assert(processed == true);
 
         ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with no data\n");
-        ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with n data\n");
-        close(server_fd);
+        ck_assert_msg(tdaemon.nclients == 0, "Failed to remove epoll fd for client with n data\n");
 }
 END_TEST
 
@@ -306,19 +318,18 @@ START_TEST(check_process_record_with_correct_size_and_data)
         char *post_body = "test message";
 
         set_up_socket_pair(&client_fd, &server_fd);
-        cl = add_client(&(tdaemon.client_head), client_fd);
+        cl = watch_client(&tdaemon, client_fd);
         ck_assert_msg(cl != NULL, "failed to malloc client");
-        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
 
         record = get_serialized_record(headers, post_body, &record_size);
         ssize_t ret = write(server_fd, record, record_size);
         ck_assert(ret == record_size);
+        close(server_fd);
 
-        processed = handle_client(&tdaemon, 0, cl);
+        processed = handle_client(&tdaemon, cl);
         ck_assert(processed == true);
         ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with correct data\n");
-        ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with correct data\n");
-        close(server_fd);
+        ck_assert_msg(tdaemon.nclients == 0, "Failed to remove epoll fd for client with correct data\n");
         free(record);
 }
 END_TEST
@@ -338,25 +349,775 @@ START_TEST(check_process_record_with_incorrect_headers)
         char *post_body = "test message";
 
         set_up_socket_pair(&client_fd, &server_fd);
-        cl = add_client(&(tdaemon.client_head), client_fd);
+        cl = watch_client(&tdaemon, client_fd);
         ck_assert_msg(cl != NULL, "failed to malloc client");
-        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
 
         record = get_serialized_record(headers, post_body, &record_size);
         ssize_t ret = write(server_fd, record, record_size);
         ck_assert(ret == record_size);
+        close(server_fd);
 
-        processed = handle_client(&tdaemon, 0, cl);
+        processed = handle_client(&tdaemon, cl);
         ck_assert(processed == true);
         ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with incorrect headers\n");
-        ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with incorrect headers\n");
+        ck_assert_msg(tdaemon.nclients == 0, "Failed to remove epoll fd for client with incorrect headers\n");
+        free(record);
+
+        teardown();
+}
+END_TEST
+
+START_TEST(check_process_records_in_session)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        bool processed;
+        char *record;
+        size_t record_size;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+        char *post_body = "test message";
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = watch_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+
+        record = get_serialized_record(headers, post_body, &record_size);
+        for (int i = 0; i < 2; i++) {
+                ssize_t ret = write(server_fd, record, record_size);
+                ck_assert(ret == record_size);
+        }
+
+        /* Client keeps the session open, so the daemon must keep it too */
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == true);
+        ck_assert_msg(!is_client_list_empty(&(tdaemon.client_head)), "Removed client with open session\n");
+        ck_assert_msg(tdaemon.nclients == 1, "Removed epoll fd for client with open session\n");
+
+        /* A record followed by part of the next record size */
+        ssize_t ret = write(server_fd, record, record_size);
+        ck_assert(ret == record_size);
+        ret = write(server_fd, record, 2);
+        ck_assert(ret == 2);
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == true);
+        ck_assert_msg(tdaemon.nclients == 1, "Removed epoll fd for client with partial size\n");
+        ret = write(server_fd, record + 2, record_size - 2);
+        ck_assert(ret == record_size - 2);
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == true);
+        ck_assert_msg(tdaemon.nclients == 1, "Removed epoll fd for client with open session\n");
+
+        /* Part of a record, then the rest */
+        ret = write(server_fd, record, record_size / 2);
+        ck_assert(ret == record_size / 2);
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(tdaemon.nclients == 1, "Removed epoll fd for client with partial record\n");
+
+        ret = write(server_fd, record + record_size / 2, record_size - record_size / 2);
+        ck_assert(ret == record_size - record_size / 2);
+        close(server_fd);
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == true);
+        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client after session end\n");
+        ck_assert_msg(tdaemon.nclients == 0, "Failed to remove epoll fd for client after session end\n");
+        free(record);
+
+        teardown();
+}
+END_TEST
+
+START_TEST(check_process_records_byte_by_byte)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        bool processed;
+        char *record;
+        size_t record_size;
+        int records = 0;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+        char *post_body = "test message";
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = watch_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+
+        /* Two records, one byte per wakeup */
+        record = get_serialized_record(headers, post_body, &record_size);
+        for (int i = 0; i < 2; i++) {
+                for (size_t j = 0; j < record_size; j++) {
+                        ck_assert(write(server_fd, record + j, 1) == 1);
+                        processed = handle_client(&tdaemon, cl);
+                        ck_assert_msg(tdaemon.nclients == 1, "Removed client sending byte %zu\n", j);
+                        if (processed) {
+                                ck_assert(j == record_size - 1);
+                                records++;
+                        }
+                        if (j < RECORD_SIZE_LEN - 1) {
+                                ck_assert(cl->state == CLIENT_READ_SIZE);
+                        } else if (j < record_size - 1) {
+                                ck_assert(cl->state == CLIENT_READ_RECORD);
+                                ck_assert(cl->record_size == record_size);
+                        }
+                }
+                ck_assert(cl->state == CLIENT_READ_SIZE);
+                ck_assert(cl->offset == 0);
+        }
+        ck_assert_int_eq(records, 2);
+
+        close(server_fd);
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client after session end\n");
+        free(record);
+
+        teardown();
+}
+END_TEST
+
+START_TEST(check_buffer_pool)
+{
+        struct buffer_pool pool;
+        size_t capacity;
+        void *small, *large, *huge, *block;
+
+        buffer_pool_init(&pool, 16384 + 128);
+
+        /* Blocks are rounded up to their size class */
+        small = buffer_pool_get(&pool, 100, &capacity);
+        ck_assert(small != NULL);
+        ck_assert_int_eq(capacity, 128);
+        large = buffer_pool_get(&pool, 13000, &capacity);
+        ck_assert(large != NULL);
+        ck_assert_int_eq(capacity, 16384);
+        huge = buffer_pool_get(&pool, 100000, &capacity);
+        ck_assert(huge != NULL);
+        ck_assert_int_eq(capacity, 100000);
+        ck_assert(pool.hits == 0 && pool.misses == 3);
+
+        /* Freed blocks are reused for requests of the same class */
+        buffer_pool_put(&pool, small, 100);
+        buffer_pool_put(&pool, large, 16384);
+        buffer_pool_put(&pool, huge, 100000);
+        ck_assert_int_eq(pool.cached, 16384 + 128);
+        block = buffer_pool_get(&pool, 65, &capacity);
+        ck_assert(block == small);
+        ck_assert(pool.hits == 1);
+        ck_assert_int_eq(pool.cached, 16384);
+
+        /* Nothing is cached past the high-water mark */
+        small = buffer_pool_get(&pool, 128, &capacity);
+        buffer_pool_put(&pool, block, capacity);
+        buffer_pool_put(&pool, small, capacity);
+        ck_assert_int_eq(pool.cached, 16384 + 128);
+        ck_assert(pool.classes[1].count == 1);
+        ck_assert(buffer_pool_hit_rate(&pool) == 20.0);
+
+        buffer_pool_shrink(&pool, 128);
+        ck_assert_int_eq(pool.cached, 128);
+        ck_assert(pool.classes[8].count == 0);
+        buffer_pool_shrink(&pool, 0);
+        ck_assert_int_eq(pool.cached, 0);
+}
+END_TEST
+
+START_TEST(check_client_memory_reused)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        char *record;
+        size_t record_size;
+        uint64_t misses;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n";
+
+        /* buffer_pool_max_size in example.conf */
+        ck_assert_int_eq(tdaemon.pool.max_cached, 2048 * 1024);
+
+        record = get_serialized_record(headers, "test message", &record_size);
+        for (int i = 0; i < 3; i++) {
+                set_up_socket_pair(&client_fd, &server_fd);
+                cl = watch_client(&tdaemon, client_fd);
+                ck_assert_msg(cl != NULL, "failed to malloc client");
+                ck_assert(write(server_fd, record, record_size) == record_size);
+                close(server_fd);
+                handle_client(&tdaemon, cl);
+                ck_assert(is_client_list_empty(&(tdaemon.client_head)));
+                if (i == 0) {
+                        misses = tdaemon.pool.misses;
+                }
+        }
+
+        /* The client struct and buffer of the first client are reused */
+        ck_assert(tdaemon.pool.misses == misses);
+        ck_assert(tdaemon.pool.hits == 4);
+        ck_assert(tdaemon.pool.cached > 0);
+
+        release_probe_daemon_memory(&tdaemon);
+        ck_assert_int_eq(tdaemon.pool.cached, 0);
+        ck_assert(tdaemon.memory_releases == 1);
+        free(record);
+
+        teardown();
+}
+END_TEST
+
+/* Checks a record staged by the tests below and counts it */
+static void count_record(const char *data, size_t size, void *count)
+{
+        char *hdrs[NUM_HEADERS] = { NULL };
+        char *body = NULL, *cfg = NULL;
+
+        ck_assert(parse_record(data, size, hdrs, &body, &cfg));
+        ck_assert_str_eq(hdrs[TM_CLASSIFICATION], "classification: crash/kernel/bug");
+        ck_assert_str_eq(body, "test message\n");
+        ck_assert(cfg == NULL);
+        for (int k = 0; k < NUM_HEADERS; k++) {
+                free(hdrs[k]);
+        }
+        free(body);
+        (*(int *)count)++;
+}
+
+START_TEST(check_records_staged_in_segment)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        char *record;
+        size_t record_size;
+        char path[PATH_MAX];
+        int records = 0;
+        int fd;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+
+        /* segment_max_size and segment_max_age in example.conf */
+        ck_assert_int_eq(tdaemon.segment.max_size, 64 * 1024);
+        ck_assert_int_eq(tdaemon.segment.max_age, 5);
+
+        record = get_serialized_record(headers, "test message", &record_size);
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = watch_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        for (int i = 0; i < 3; i++) {
+                ck_assert(write(server_fd, record, record_size) == record_size);
+        }
+        close(server_fd);
+        handle_client(&tdaemon, cl);
+
+        /* The records share a segment that is still open */
+        ck_assert(tdaemon.segment.fd >= 0);
+        ck_assert(tdaemon.segment.records == 3);
+        ck_assert(segment_is_open(strrchr(tdaemon.segment.path, '/') + 1));
+        strcpy(path, tdaemon.segment.path);
+        path[strlen(path) - strlen(SEGMENT_OPEN_SUFFIX)] = '\0';
+
+        ck_assert(segment_seal(&tdaemon.segment) == 0);
+        ck_assert(tdaemon.segment.fd == -1);
+        ck_assert(tdaemon.segment.sealed == 1);
+        ck_assert(segment_is_sealed(strrchr(path, '/') + 1));
+
+        /* A torn write at the end of the segment is ignored */
+        fd = open(path, O_RDWR | O_APPEND);
+        ck_assert(fd >= 0);
+        ck_assert(write(fd, "SEG1", 4) == 4);
+        ck_assert(segment_for_each_record(fd, count_record, &records) == 3);
+        ck_assert_int_eq(records, 3);
+        close(fd);
+        unlink(path);
+
+        /* A segment reaching its maximum size is sealed right away */
+        tdaemon.segment.max_size = 1;
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = watch_client(&tdaemon, client_fd);
+        ck_assert(write(server_fd, record, record_size) == record_size);
         close(server_fd);
+        handle_client(&tdaemon, cl);
+        ck_assert(tdaemon.segment.fd == -1);
+        ck_assert(tdaemon.segment.sealed == 2);
         free(record);
 
         teardown();
 }
 END_TEST
 
+/* Sends a record from a new client that then ends its session, asking for
+ * its acknowledgement first if acks is set, returns the client side of the
+ * connection */
+static int send_from_client(char *record, size_t record_size, bool acks)
+{
+        client *cl;
+        int server_fd, client_fd;
+        uint32_t ack_request = RECORD_ACK_REQUEST;
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = watch_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        if (acks) {
+                ck_assert(write(server_fd, &ack_request, sizeof(ack_request)) ==
+                          sizeof(ack_request));
+        }
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        ck_assert(shutdown(server_fd, SHUT_WR) == 0);
+        handle_client(&tdaemon, cl);
+
+        return server_fd;
+}
+
+/* Checks whether the daemon accepted the record and then closed its end of
+ * the connection */
+static bool is_acknowledged(int fd)
+{
+        struct record_ack ack;
+
+        if (recv(fd, &ack, sizeof(ack), MSG_DONTWAIT) != sizeof(ack)) {
+                return false;
+        }
+        ck_assert_int_eq(ack.status, TM_ACK_ACCEPTED);
+
+        return recv(fd, &ack, sizeof(ack), MSG_DONTWAIT) == 0;
+}
+
+/* Checks whether the daemon closed its end of the connection */
+static bool is_closed(int fd)
+{
+        char c;
+
+        return recv(fd, &c, 1, MSG_DONTWAIT) == 0;
+}
+
+START_TEST(check_records_acknowledged_after_sync)
+{
+        setup();
+
+        char *record;
+        size_t record_size;
+        int first, second;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+
+        /* durability settings in example.conf */
+        ck_assert(tdaemon.segment.sync.mode == DURABILITY_GROUP);
+        ck_assert_int_eq(tdaemon.segment.sync.group_records, 8);
+        ck_assert_int_eq(tdaemon.segment.sync.group_interval, 50);
+
+        record = get_serialized_record(headers, "test message", &record_size);
+
+        /* A group sync covers two records */
+        sync_policy_init(&tdaemon.segment.sync, DURABILITY_GROUP, 2, 60000);
+        first = send_from_client(record, record_size, true);
+        ck_assert_int_eq(tdaemon.segment.sync.pending, 1);
+        ck_assert(tdaemon.nclients == 0);
+        ck_assert(!is_acknowledged(first));
+
+        second = send_from_client(record, record_size, true);
+        ck_assert_int_eq(tdaemon.segment.sync.pending, 0);
+        ck_assert(tdaemon.segment.sync.syncs == 1);
+        ck_assert(is_acknowledged(first));
+        ck_assert(is_acknowledged(second));
+        close(first);
+        close(second);
+
+        /* The timer syncs a group that does not fill up */
+        sync_policy_init(&tdaemon.segment.sync, DURABILITY_GROUP, 100, 10);
+        first = send_from_client(record, record_size, true);
+        ck_assert(!is_acknowledged(first));
+        usleep(20000);
+        ck_assert(handle_probe_daemon_staging_timer(&tdaemon) == 0);
+        ck_assert_int_eq(tdaemon.segment.sync.pending, 0);
+        ck_assert(is_acknowledged(first));
+        close(first);
+
+        /* Every record is synced before it is acknowledged */
+        sync_policy_init(&tdaemon.segment.sync, DURABILITY_PER_RECORD, 1, 0);
+        first = send_from_client(record, record_size, true);
+        ck_assert(tdaemon.segment.sync.syncs == 1);
+        ck_assert(is_acknowledged(first));
+        close(first);
+
+        /* A client that does not wait for acknowledgements is closed
+         * right away */
+        sync_policy_init(&tdaemon.segment.sync, DURABILITY_GROUP, 100, 60000);
+        first = send_from_client(record, record_size, false);
+        ck_assert_int_eq(tdaemon.segment.sync.pending, 1);
+        ck_assert(is_closed(first));
+        close(first);
+
+        free(record);
+        teardown();
+}
+END_TEST
+
+START_TEST(check_records_handed_off)
+{
+        setup();
+
+        char *record;
+        size_t record_size;
+        char frame[HANDOFF_MAX_FRAME];
+        char *headers[NUM_HEADERS];
+        char *body, *cfg_file;
+        ssize_t len;
+        int sv[2];
+        char *record_headers = "record_format_version: 1\nclassification: crash/kernel/bug\n"
+                               "severity: 0\nmachine_id: 1234\ncreation_timestamp: 1418672344\n"
+                               "arch:x86_64\nhost_type: macbookpro\nbuild: 200\n"
+                               "kernel_version: 3.15\npayload_format_version: 1\n"
+                               "system_name: clear-linux-os\n"
+                               "board_name: Qemu|Intel\n"
+                               "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                               "bios_version: Qemu\n"
+                               "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+
+        /* direct_handoff_enabled is not set in example.conf */
+        ck_assert(!tdaemon.handoff_enabled);
+        ck_assert(tdaemon.handoff_fd == -1);
+
+        ck_assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+        tdaemon.handoff_enabled = true;
+        tdaemon.handoff_fd = sv[0];
+        /* Do not reconnect to the configured socket */
+        tdaemon.handoff_attempt_time = time(NULL) + 60;
+
+        record = get_serialized_record(record_headers, "test message", &record_size);
+        close(send_from_client(record, record_size, false));
+        ck_assert(tdaemon.handed_off == 1);
+        ck_assert(tdaemon.segment.fd == -1);
+
+        len = recv(sv[1], frame, sizeof(frame), MSG_DONTWAIT);
+        ck_assert(len > 0);
+        ck_assert(handoff_parse_frame(frame, (size_t)len, headers, &body, &cfg_file));
+        ck_assert_str_eq(headers[TM_CLASSIFICATION], "classification: crash/kernel/bug");
+        ck_assert_str_eq(headers[TM_EVENT_ID], "event_id: 3a2d799826edc6266d72824d2aac6763");
+        ck_assert_str_eq(body, "test message");
+        ck_assert_ptr_null(cfg_file);
+
+        /* The machine id comes from the daemon cache, which is only reloaded
+         * when the machine id files change */
+        ck_assert_str_eq(headers[TM_MACHINE_ID], tdaemon.machine_id_header);
+        ck_assert(!handle_probe_daemon_machine_id_event(&tdaemon));
+        tdaemon.machine_id_header_len = (size_t)sprintf(tdaemon.machine_id_header,
+                                                        "machine_id: cached");
+        close(send_from_client(record, record_size, false));
+        len = recv(sv[1], frame, sizeof(frame), MSG_DONTWAIT);
+        ck_assert(handoff_parse_frame(frame, (size_t)len, headers, &body, &cfg_file));
+        ck_assert_str_eq(headers[TM_MACHINE_ID], "machine_id: cached");
+        ck_assert(tdaemon.handed_off == 2);
+
+        /* Records overflow to the spool once telempostd is gone */
+        close(sv[1]);
+        close(send_from_client(record, record_size, false));
+        ck_assert(tdaemon.handoff_fd == -1);
+        ck_assert(tdaemon.handoff_overflows == 1);
+        ck_assert(tdaemon.segment.records == 1);
+
+        free(record);
+        teardown();
+}
+END_TEST
+
+START_TEST(check_records_acknowledged_with_status)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        char *record, *invalid;
+        size_t record_size, invalid_size;
+        uint32_t ack_request = RECORD_ACK_REQUEST;
+        uint32_t bad_size = UINT32_MAX;
+        struct record_ack acks[4];
+        ssize_t len;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+        char *bad_headers = "record_format_version: 1\nclassificatioooon: crash/kernel/bug\n";
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = watch_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+
+        record = get_serialized_record(headers, "test message", &record_size);
+        invalid = get_serialized_record(bad_headers, "test message", &invalid_size);
+
+        /* Records sent before the request are not acknowledged */
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        ck_assert(write(server_fd, &ack_request, sizeof(ack_request)) == sizeof(ack_request));
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        ck_assert(write(server_fd, invalid, invalid_size) == invalid_size);
+        ck_assert(handle_client(&tdaemon, cl) == true);
+        ck_assert(cl->acks);
+        ck_assert(tdaemon.nclients == 1);
+
+        len = recv(server_fd, acks, sizeof(acks), MSG_DONTWAIT);
+        ck_assert_int_eq(len, 2 * sizeof(struct record_ack));
+        ck_assert_int_eq(acks[0].status, TM_ACK_ACCEPTED);
+        ck_assert_int_eq(acks[0].retry_after, 0);
+        ck_assert_int_eq(acks[1].status, TM_ACK_REJECTED);
+
+        /* An invalid record size is rejected, and ends the connection */
+        ck_assert(write(server_fd, &bad_size, sizeof(bad_size)) == sizeof(bad_size));
+        handle_client(&tdaemon, cl);
+        ck_assert(tdaemon.nclients == 0);
+        len = recv(server_fd, acks, sizeof(acks), MSG_DONTWAIT);
+        ck_assert_int_eq(len, sizeof(struct record_ack));
+        ck_assert_int_eq(acks[0].status, TM_ACK_REJECTED);
+
+        close(server_fd);
+        free(record);
+        free(invalid);
+        teardown();
+}
+END_TEST
+
+START_TEST(check_accepted_acks_held_until_sync)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        char *record, *invalid;
+        size_t record_size, invalid_size;
+        uint32_t ack_request = RECORD_ACK_REQUEST;
+        struct record_ack acks[4];
+        ssize_t len;
+        uint64_t sealed;
+        int sv[2];
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+        char *bad_headers = "record_format_version: 1\nclassificatioooon: crash/kernel/bug\n";
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = watch_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        record = get_serialized_record(headers, "test message", &record_size);
+        invalid = get_serialized_record(bad_headers, "test message", &invalid_size);
+        ck_assert(write(server_fd, &ack_request, sizeof(ack_request)) == sizeof(ack_request));
+
+        /* A group sync covers two records, the first one waits for it */
+        sync_policy_init(&tdaemon.segment.sync, DURABILITY_GROUP, 2, 60000);
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        ck_assert(handle_client(&tdaemon, cl) == true);
+        ck_assert_int_eq(cl->held_acks, 1);
+        ck_assert(recv(server_fd, acks, sizeof(acks), MSG_DONTWAIT) == -1);
+
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        ck_assert(handle_client(&tdaemon, cl) == true);
+        ck_assert(tdaemon.segment.sync.syncs == 1);
+        ck_assert_int_eq(cl->held_acks, 0);
+        len = recv(server_fd, acks, sizeof(acks), MSG_DONTWAIT);
+        ck_assert_int_eq(len, 2 * sizeof(struct record_ack));
+        ck_assert_int_eq(acks[0].status, TM_ACK_ACCEPTED);
+        ck_assert_int_eq(acks[1].status, TM_ACK_ACCEPTED);
+
+        /* A rejection does not overtake the records accepted before it */
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        ck_assert(write(server_fd, invalid, invalid_size) == invalid_size);
+        ck_assert(handle_client(&tdaemon, cl) == true);
+        ck_assert(tdaemon.segment.sync.syncs == 2);
+        len = recv(server_fd, acks, sizeof(acks), MSG_DONTWAIT);
+        ck_assert_int_eq(len, 2 * sizeof(struct record_ack));
+        ck_assert_int_eq(acks[0].status, TM_ACK_ACCEPTED);
+        ck_assert_int_eq(acks[1].status, TM_ACK_REJECTED);
+
+        /* The timer syncs a group that does not fill up */
+        sync_policy_init(&tdaemon.segment.sync, DURABILITY_GROUP, 100, 10);
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        ck_assert(handle_client(&tdaemon, cl) == true);
+        ck_assert(recv(server_fd, acks, sizeof(acks), MSG_DONTWAIT) == -1);
+        usleep(20000);
+        ck_assert(handle_probe_daemon_staging_timer(&tdaemon) == 0);
+        len = recv(server_fd, acks, sizeof(acks), MSG_DONTWAIT);
+        ck_assert_int_eq(len, sizeof(struct record_ack));
+        ck_assert_int_eq(acks[0].status, TM_ACK_ACCEPTED);
+
+        /* Records sealed without a sync are to be sent again, a pipe in
+         * place of the segment fails the sync */
+        sync_policy_init(&tdaemon.segment.sync, DURABILITY_GROUP, 100, 60000);
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        ck_assert(handle_client(&tdaemon, cl) == true);
+        ck_assert_int_eq(cl->held_acks, 1);
+        ck_assert(pipe(sv) == 0);
+        ck_assert(dup2(sv[1], tdaemon.segment.fd) == tdaemon.segment.fd);
+        tdaemon.segment.max_size = 1;
+        sealed = tdaemon.segment.sealed;
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        ck_assert(handle_client(&tdaemon, cl) == true);
+        ck_assert(tdaemon.segment.fd == -1);
+        ck_assert_int_eq(tdaemon.segment.sealed, sealed + 1);
+        len = recv(server_fd, acks, sizeof(acks), MSG_DONTWAIT);
+        ck_assert_int_eq(len, 2 * sizeof(struct record_ack));
+        ck_assert_int_eq(acks[0].status, TM_ACK_RETRY_AFTER);
+        ck_assert_int_eq(acks[1].status, TM_ACK_RETRY_AFTER);
+        close(sv[0]);
+        close(sv[1]);
+
+        close(server_fd);
+        handle_client(&tdaemon, cl);
+        free(record);
+        free(invalid);
+        teardown();
+}
+END_TEST
+
+/* Headers of a valid record of a classification */
+#define TEST_HEADERS(classification) \
+        "record_format_version: 1\nclassification: " classification "\nseverity: 0\n" \
+        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n" \
+        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n" \
+        "payload_format_version: 1\nsystem_name: clear-linux-os\n" \
+        "board_name: Qemu|Intel\n" \
+        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n" \
+        "bios_version: Qemu\nevent_id: 3a2d799826edc6266d72824d2aac6763\n"
+
+START_TEST(check_peers_throttled)
+{
+        setup();
+
+        client *cl, *refused;
+        int server_fd, client_fd, fds[2];
+        char *record, *first, *second;
+        size_t record_size, first_size, second_size;
+        uint32_t ack_request = RECORD_ACK_REQUEST;
+        struct record_ack acks[4];
+        struct peer *peer;
+        ssize_t len;
+
+        /* peer_max_connections in example.conf */
+        ck_assert_int_eq(tdaemon.admission.max_connections, 64);
+        tdaemon.admission.max_connections = 1;
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = watch_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        peer = cl->peer;
+        ck_assert(peer != NULL);
+        ck_assert(peer->uid == getuid());
+        ck_assert_int_eq(peer->connections, 1);
+
+        /* A second connection of the same user is over the limit */
+        set_up_socket_pair(&fds[0], &fds[1]);
+        refused = watch_client(&tdaemon, fds[0]);
+        ck_assert(refused == NULL);
+        ck_assert_int_eq(errno, EUSERS);
+        ck_assert_int_eq(peer->refused, 1);
+        ck_assert_int_eq(peer->connections, 1);
+        ck_assert(tdaemon.nclients == 1);
+        close(fds[0]);
+        close(fds[1]);
+
+        record = get_serialized_record(TEST_HEADERS("crash/kernel/bug"), "test message",
+                                       &record_size);
+        first = get_serialized_record(TEST_HEADERS("org.clearlinux/throttled/a"),
+                                      "test message", &first_size);
+        second = get_serialized_record(TEST_HEADERS("org.clearlinux/throttled/b"),
+                                       "test message", &second_size);
+
+        /* Allow one record per hour for the user */
+        peer->limited = true;
+        peer->bucket.capacity = 1;
+        peer->bucket.tokens = 1;
+        peer->bucket.refill_rate = 1.0 / 3600;
+        clock_gettime(CLOCK_MONOTONIC, &peer->bucket.last_refill);
+
+        ck_assert(write(server_fd, &ack_request, sizeof(ack_request)) == sizeof(ack_request));
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        ck_assert(write(server_fd, record, record_size / 2) == record_size / 2);
+        ck_assert(handle_client(&tdaemon, cl) == true);
+
+        /* The throttled record is acknowledged before it is received, and
+         * what arrived of it is not buffered */
+        len = recv(server_fd, acks, sizeof(acks), MSG_DONTWAIT);
+        ck_assert_int_eq(len, 2 * sizeof(struct record_ack));
+        ck_assert_int_eq(acks[0].status, TM_ACK_ACCEPTED);
+        ck_assert_int_eq(acks[1].status, TM_ACK_THROTTLED);
+        ck_assert(acks[1].retry_after > 3500 * 1000);
+        ck_assert(cl->state == CLIENT_SKIP_RECORD);
+        ck_assert_int_eq(cl->offset, 0);
+        ck_assert_int_eq(peer->throttled, 1);
+
+        /* Records of a classification share the limit of their pattern */
+        peer->limited = false;
+        ck_assert(write(server_fd, record + record_size / 2, record_size - record_size / 2) ==
+                  record_size - record_size / 2);
+        ck_assert(write(server_fd, first, first_size) == first_size);
+        ck_assert(write(server_fd, second, second_size) == second_size);
+        ck_assert(write(server_fd, first, first_size) == first_size);
+        ck_assert(handle_client(&tdaemon, cl) == true);
+
+        len = recv(server_fd, acks, sizeof(acks), MSG_DONTWAIT);
+        ck_assert_int_eq(len, 3 * sizeof(struct record_ack));
+        ck_assert_int_eq(acks[0].status, TM_ACK_ACCEPTED);
+        ck_assert_int_eq(acks[1].status, TM_ACK_ACCEPTED);
+        ck_assert_int_eq(acks[2].status, TM_ACK_THROTTLED);
+        ck_assert(acks[2].retry_after > 0);
+        ck_assert_int_eq(peer->records, 5);
+        ck_assert_int_eq(peer->class_throttled, 1);
+
+        /* Closing the connection makes room for another one */
+        close(server_fd);
+        handle_client(&tdaemon, cl);
+        ck_assert_int_eq(peer->connections, 0);
+
+        free(record);
+        free(first);
+        free(second);
+        teardown();
+}
+END_TEST
+
 Suite *config_suite(void)
 {
         // A suite is comprised of test cases, defined below
@@ -364,8 +1125,9 @@ Suite *config_suite(void)
 
         // Individual unit tests are added to "test cases"
         TCase *t = tcase_create("probd");
-        tcase_add_test(t, check_add_del_poll_fd);
+        tcase_add_test(t, check_add_del_epoll_fd);
         tcase_add_test(t, check_daemon_is_initialized);
+        tcase_add_test(t, check_watch_client);
         tcase_add_test(t, check_add_remove_client);
         tcase_add_test(t, check_handle_client_with_no_data);
         tcase_add_test(t, check_handle_client_with_incorrect_data);
@@ -373,6 +1135,16 @@ Suite *config_suite(void)
         tcase_add_test(t, check_handle_client_with_correct_size);
         tcase_add_test(t, check_process_record_with_correct_size_and_data);
         tcase_add_test(t, check_process_record_with_incorrect_headers);
+        tcase_add_test(t, check_process_records_in_session);
+        tcase_add_test(t, check_process_records_byte_by_byte);
+        tcase_add_test(t, check_buffer_pool);
+        tcase_add_test(t, check_client_memory_reused);
+        tcase_add_test(t, check_records_staged_in_segment);
+        tcase_add_test(t, check_records_acknowledged_after_sync);
+        tcase_add_test(t, check_records_handed_off);
+        tcase_add_test(t, check_records_acknowledged_with_status);
+        tcase_add_test(t, check_accepted_acks_held_until_sync);
+        tcase_add_test(t, check_peers_throttled);
 
         suite_add_tcase(s, t);
 
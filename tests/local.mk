@@ -47,6 +47,14 @@ endif
 	%D%/check_probd.c \
 	src/telemdaemon.c \
 	src/telemdaemon.h \
+	src/admission.c \
+	src/admission.h \
+	src/bufpool.c \
+	src/bufpool.h \
+	src/segment.c \
+	src/segment.h \
+	src/handoff.c \
+	src/handoff.h \
 	src/iorecord.h \
 	src/iorecord.c \
 	src/journal/journal.c \
@@ -72,9 +80,23 @@ endif
 
 %C%_check_postd_SOURCES = \
 	%D%/check_postd.c \
+	%D%/mock_backend.c \
+	%D%/mock_backend.h \
 	src/spool.c \
 	src/iorecord.c \
 	src/retention.c \
+	src/segment.c \
+	src/segment.h \
+	src/handoff.c \
+	src/handoff.h \
+	src/backend.c \
+	src/backend.h \
+	src/uploader.c \
+	src/uploader.h \
+	src/compress.c \
+	src/compress.h \
+	src/jsonenc.c \
+	src/jsonenc.h \
         src/telempostdaemon.c \
         src/telempostdaemon.h \
         src/journal/journal.c \
@@ -89,11 +111,15 @@ EXTRA_DIST += \
 %C%_check_postd_CFLAGS = \
         $(AM_CFLAGS) \
         @CHECK_CFLAGS@ \
-        @CURL_CFLAGS@
+        @CURL_CFLAGS@ \
+        @ZLIB_CFLAGS@ \
+        @ZSTD_CFLAGS@
 %C%_check_postd_LDADD = \
         @CHECK_LIBS@ \
         @CURL_LIBS@ \
         @JSON_C_LIBS@ \
+        @ZLIB_LIBS@ \
+        @ZSTD_LIBS@ \
         $(top_builddir)/src/libtelem-shared.la
 
 if LOG_SYSTEMD
@@ -163,14 +189,17 @@ endif
 	%D%/check_journal.c \
 	src/journal/journal.c \
 	src/util.h \
-	src/util.c
+	src/util.c \
+	src/common.c \
+	src/durability.c
 
 %C%_check_journal_CFLAGS = \
 	$(AM_CFLAGS) \
 	@CHECK_CFLAGS@
 
 %C%_check_journal_LDADD = \
-	@CHECK_LIBS@
+	@CHECK_LIBS@ \
+	-lpthread
 
 if HAVE_SYSTEMD_JOURNAL
 if LOG_SYSTEMD
@@ -192,7 +221,8 @@ endif
 %C%_check_libtelemetry_LDADD = \
 	@CHECK_LIBS@ \
 	$(top_builddir)/src/libtelemetry.la \
-	$(top_builddir)/src/libtelem-shared.la
+	$(top_builddir)/src/libtelem-shared.la \
+	-lpthread
 
 if HAVE_SYSTEMD_JOURNAL
 if LOG_SYSTEMD
@@ -201,6 +231,152 @@ if LOG_SYSTEMD
 endif
 endif
 
+# Benchmarks are not run as part of "make check"; build and run them with
+# "make benchmarks".
+EXTRA_PROGRAMS = \
+	%D%/bench_create_record \
+	%D%/bench_probd_clients \
+	%D%/bench_random_id \
+	%D%/bench_threads \
+	%D%/bench_durability \
+	%D%/bench_post_http \
+	%D%/bench_compress \
+	%D%/bench_json_message
+
+%C%_bench_create_record_SOURCES = \
+	%D%/bench_create_record.c
+
+%C%_bench_create_record_LDADD = \
+	$(top_builddir)/src/libtelemetry.la
+
+%C%_bench_probd_clients_SOURCES = \
+	%D%/bench_probd_clients.c
+
+%C%_bench_probd_clients_LDADD = \
+	$(top_builddir)/src/libtelemetry.la \
+	$(top_builddir)/src/libtelem-shared.la
+
+if HAVE_SYSTEMD_JOURNAL
+if LOG_SYSTEMD
+%C%_bench_probd_clients_CFLAGS = $(AM_CFLAGS) $(SYSTEMD_JOURNAL_CFLAGS)
+%C%_bench_probd_clients_LDADD += $(SYSTEMD_JOURNAL_LIBS)
+endif
+endif
+
+%C%_bench_random_id_SOURCES = \
+	%D%/bench_random_id.c
+
+%C%_bench_random_id_LDADD = \
+	$(top_builddir)/src/libtelem-shared.la
+
+if HAVE_SYSTEMD_JOURNAL
+if LOG_SYSTEMD
+%C%_bench_random_id_CFLAGS = $(AM_CFLAGS) $(SYSTEMD_JOURNAL_CFLAGS)
+%C%_bench_random_id_LDADD += $(SYSTEMD_JOURNAL_LIBS)
+endif
+endif
+
+%C%_bench_threads_SOURCES = \
+	%D%/bench_threads.c
+
+%C%_bench_threads_LDADD = \
+	$(top_builddir)/src/libtelemetry.la \
+	-lpthread
+
+%C%_bench_durability_SOURCES = \
+	%D%/bench_durability.c \
+	src/segment.c \
+	src/segment.h
+
+%C%_bench_durability_LDADD = \
+	$(top_builddir)/src/libtelem-shared.la
+
+if HAVE_SYSTEMD_JOURNAL
+if LOG_SYSTEMD
+%C%_bench_durability_CFLAGS = $(AM_CFLAGS) $(SYSTEMD_JOURNAL_CFLAGS)
+%C%_bench_durability_LDADD += $(SYSTEMD_JOURNAL_LIBS)
+endif
+endif
+
+%C%_bench_post_http_SOURCES = \
+	%D%/bench_post_http.c \
+	src/backend.c \
+	src/backend.h \
+	src/uploader.c \
+	src/uploader.h \
+	src/compress.c \
+	src/compress.h
+
+%C%_bench_post_http_CFLAGS = \
+	$(AM_CFLAGS) \
+	@CURL_CFLAGS@ \
+	@ZLIB_CFLAGS@ \
+	@ZSTD_CFLAGS@
+
+%C%_bench_post_http_LDADD = \
+	$(top_builddir)/src/libtelem-shared.la \
+	@CURL_LIBS@ \
+	@JSON_C_LIBS@ \
+	@ZLIB_LIBS@ \
+	@ZSTD_LIBS@
+
+if HAVE_SYSTEMD_JOURNAL
+if LOG_SYSTEMD
+%C%_bench_post_http_CFLAGS += $(SYSTEMD_JOURNAL_CFLAGS)
+%C%_bench_post_http_LDADD += $(SYSTEMD_JOURNAL_LIBS)
+endif
+endif
+
+%C%_bench_compress_SOURCES = \
+	%D%/bench_compress.c \
+	src/compress.c \
+	src/compress.h
+
+%C%_bench_compress_CFLAGS = \
+	$(AM_CFLAGS) \
+	@ZLIB_CFLAGS@ \
+	@ZSTD_CFLAGS@
+
+%C%_bench_compress_LDADD = \
+	$(top_builddir)/src/libtelem-shared.la \
+	@ZLIB_LIBS@ \
+	@ZSTD_LIBS@
+
+if HAVE_SYSTEMD_JOURNAL
+if LOG_SYSTEMD
+%C%_bench_compress_CFLAGS += $(SYSTEMD_JOURNAL_CFLAGS)
+%C%_bench_compress_LDADD += $(SYSTEMD_JOURNAL_LIBS)
+endif
+endif
+
+%C%_bench_json_message_SOURCES = \
+	%D%/bench_json_message.c \
+	src/jsonenc.c \
+	src/jsonenc.h \
+	src/iorecord.c \
+	src/iorecord.h
+
+%C%_bench_json_message_CFLAGS = \
+	$(AM_CFLAGS) \
+	@JSON_C_CFLAGS@
+
+%C%_bench_json_message_LDADD = \
+	$(top_builddir)/src/libtelem-shared.la \
+	@JSON_C_LIBS@
+
+if HAVE_SYSTEMD_JOURNAL
+if LOG_SYSTEMD
+%C%_bench_json_message_CFLAGS += $(SYSTEMD_JOURNAL_CFLAGS)
+%C%_bench_json_message_LDADD += $(SYSTEMD_JOURNAL_LIBS)
+endif
+endif
+
+.PHONY: benchmarks
+benchmarks: $(EXTRA_PROGRAMS)
+	@for b in $(EXTRA_PROGRAMS); do ./$$b || exit 1; done
+
+CLEANFILES = $(EXTRA_PROGRAMS)
+
 @VALGRIND_CHECK_RULES@
 VALGRIND_SUPPRESSIONS_FILES = %D%/telemetrics-client.supp
 VALGRIND_FLAGS = \
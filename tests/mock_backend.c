@@ -0,0 +1,372 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <json-c/json.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
+#include "mock_backend.h"
+
+/* Largest request the mock backend reads */
+#define MOCK_BACKEND_MAX_REQUEST (4 * 1024 * 1024)
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t n = write(fd, buf, len);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return false;
+                }
+                buf += n;
+                len -= (size_t)n;
+        }
+
+        return true;
+}
+
+/* Decompresses a gzip body, returns NULL if it is not valid */
+static char *gunzip(const char *body, size_t len)
+{
+        z_stream zs = { 0 };
+        char *out = NULL, *grown;
+        size_t size = len * 4 + 64;
+        int ret = Z_OK;
+
+        if (inflateInit2(&zs, MAX_WBITS + 16) != Z_OK) {
+                return NULL;
+        }
+        zs.next_in = (Bytef *)body;
+        zs.avail_in = (uInt)len;
+        /* Without room for the whole body, inflate() stops short */
+        while (ret == Z_OK || (ret == Z_BUF_ERROR && zs.avail_out == 0)) {
+                grown = realloc(out, size + 1);
+                if (!grown) {
+                        break;
+                }
+                out = grown;
+                zs.next_out = (Bytef *)out + zs.total_out;
+                zs.avail_out = (uInt)(size - zs.total_out);
+                ret = inflate(&zs, Z_FINISH);
+                size *= 2;
+        }
+        if (ret != Z_STREAM_END) {
+                free(out);
+                out = NULL;
+        } else {
+                out[zs.total_out] = 0;
+        }
+        inflateEnd(&zs);
+
+        return out;
+}
+
+#ifdef HAVE_ZSTD_H
+/* Decompresses a zstd body made without a dictionary, returns NULL if it is
+ * not valid */
+static char *unzstd(const char *body, size_t len)
+{
+        unsigned long long size = ZSTD_getFrameContentSize(body, len);
+        size_t ret;
+        char *out;
+
+        if (size > MOCK_BACKEND_MAX_REQUEST || (out = malloc(size + 1)) == NULL) {
+                return NULL;
+        }
+        ret = ZSTD_decompress(out, size, body, len);
+        if (ZSTD_isError(ret)) {
+                free(out);
+                return NULL;
+        }
+        out[ret] = 0;
+
+        return out;
+}
+#endif
+
+/* Decodes a body with its Content-Encoding */
+static char *decode_body(char *body, size_t len, const char *headers)
+{
+        char *decoded = body;
+
+        if (strcasestr(headers, "\r\nContent-Encoding: gzip")) {
+                decoded = gunzip(body, len);
+                free(body);
+#ifdef HAVE_ZSTD_H
+        } else if (strcasestr(headers, "\r\nContent-Encoding: zstd")) {
+                decoded = unzstd(body, len);
+                free(body);
+#endif
+        }
+
+        return decoded;
+}
+
+/* Reads a request, returns its body, or NULL once the client is gone */
+static char *read_request(int fd, bool *ndjson)
+{
+        char *buf = NULL, *end, *header;
+        size_t len = 0, size = 0, body_len = 0;
+        bool continued = false;
+
+        while (1) {
+                ssize_t n;
+
+                if (len + 1 >= size) {
+                        char *grown;
+
+                        size = size ? size * 2 : 4096;
+                        if (size > MOCK_BACKEND_MAX_REQUEST ||
+                            (grown = realloc(buf, size)) == NULL) {
+                                break;
+                        }
+                        buf = grown;
+                }
+                n = read(fd, buf + len, size - len - 1);
+                if (n <= 0) {
+                        break;
+                }
+                len += (size_t)n;
+                buf[len] = 0;
+
+                end = strstr(buf, "\r\n\r\n");
+                if (!end) {
+                        continue;
+                }
+                header = strcasestr(buf, "\r\nContent-Length:");
+                if (!header || header > end) {
+                        break;
+                }
+                body_len = strtoul(header + strlen("\r\nContent-Length:"), NULL, 10);
+                *ndjson = strcasestr(buf, "application/x-ndjson") != NULL;
+
+                /* Large bodies are only sent once the server agrees */
+                if (!continued && strcasestr(buf, "100-continue")) {
+                        const char *reply = "HTTP/1.1 100 Continue\r\n\r\n";
+                        write_all(fd, reply, strlen(reply));
+                        continued = true;
+                }
+
+                if (len - (size_t)(end + 4 - buf) >= body_len) {
+                        char *body = malloc(body_len + 1);
+
+                        if (!body) {
+                                break;
+                        }
+                        memcpy(body, end + 4, body_len);
+                        body[body_len] = 0;
+                        end[2] = 0;
+                        body = decode_body(body, body_len, buf);
+                        free(buf);
+                        return body;
+                }
+        }
+
+        free(buf);
+        return NULL;
+}
+
+static int record_status(const char *record)
+{
+        return strstr(record, MOCK_BACKEND_REJECT) ? 503 : 201;
+}
+
+/* Appends the status of a record of a batch to the response */
+static void add_status(char *response, size_t size, const char *record,
+                       unsigned int *records)
+{
+        size_t len = strlen(response);
+
+        snprintf(response + len, size - len, "%s%d", *records ? "," : "",
+                 record_status(record));
+        (*records)++;
+}
+
+static void serve_request(int fd, int reports)
+{
+        char *body, *line, *next;
+        char *response;
+        char reply[256];
+        unsigned int records = 0;
+        bool ndjson = false;
+        int status = 200;
+        size_t size;
+        json_object *root = NULL;
+        bool batch = true;
+
+        body = read_request(fd, &ndjson);
+        if (!body) {
+                return;
+        }
+
+        /* At least two bytes per record in the body, four in the response */
+        size = strlen(body) * 2 + 16;
+        response = calloc(1, size);
+        if (!response) {
+                free(body);
+                return;
+        }
+
+        if (ndjson) {
+                for (line = body; *line; line = next) {
+                        next = strchr(line, '\n');
+                        if (next) {
+                                *next++ = 0;
+                        } else {
+                                next = line + strlen(line);
+                        }
+                        if (*line) {
+                                add_status(response, size, line, &records);
+                        }
+                }
+        } else if ((root = json_tokener_parse(body)) != NULL &&
+                   json_object_is_type(root, json_type_array)) {
+                size_t n = json_object_array_length(root);
+
+                for (size_t i = 0; i < n; i++) {
+                        json_object *record = json_object_array_get_idx(root, i);
+                        add_status(response, size, json_object_to_json_string(record),
+                                   &records);
+                }
+        } else {
+                /* A single record gets its status as the status of the
+                 * request */
+                status = record_status(body);
+                records = 1;
+                batch = false;
+        }
+        json_object_put(root);
+
+        if (batch && strstr(body, MOCK_BACKEND_EMPTY)) {
+                response[0] = 0;
+        } else if (batch) {
+                memmove(response + 1, response, strlen(response) + 1);
+                response[0] = '[';
+                strcat(response, "]");
+        }
+
+        write_all(reports, (const char *)&records, sizeof(records));
+        snprintf(reply, sizeof(reply), "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\n"
+                 "Content-Length: %zu\r\nConnection: close\r\n\r\n", status,
+                 status == 503 ? "Service Unavailable" : "OK", strlen(response));
+        write_all(fd, reply, strlen(reply));
+        write_all(fd, response, strlen(response));
+
+        free(response);
+        free(body);
+}
+
+int mock_backend_start(struct mock_backend *mock)
+{
+        struct sockaddr_in addr = { 0 };
+        socklen_t addrlen = sizeof(addr);
+        int listener, fds[2];
+
+        memset(mock, 0, sizeof(struct mock_backend));
+
+        listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener == -1) {
+                return -errno;
+        }
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(listener, 16) == -1 ||
+            getsockname(listener, (struct sockaddr *)&addr, &addrlen) == -1 ||
+            pipe2(fds, O_CLOEXEC) == -1) {
+                int ret = -errno;
+                close(listener);
+                return ret;
+        }
+
+        mock->pid = fork();
+        if (mock->pid == -1) {
+                int ret = -errno;
+                close(listener);
+                close(fds[0]);
+                close(fds[1]);
+                return ret;
+        } else if (mock->pid == 0) {
+                /* Not left behind by a test that failed */
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                close(fds[0]);
+                while (1) {
+                        int fd = accept(listener, NULL, NULL);
+                        if (fd == -1) {
+                                if (errno == EINTR) {
+                                        continue;
+                                }
+                                _exit(EXIT_FAILURE);
+                        }
+                        serve_request(fd, fds[1]);
+                        close(fd);
+                }
+        }
+
+        close(listener);
+        close(fds[1]);
+        mock->reports = fds[0];
+        fcntl(mock->reports, F_SETFL, O_NONBLOCK);
+        snprintf(mock->url, sizeof(mock->url), "http://127.0.0.1:%u/",
+                 (unsigned int)ntohs(addr.sin_port));
+
+        return 0;
+}
+
+void mock_backend_update(struct mock_backend *mock)
+{
+        unsigned int records;
+
+        while (read(mock->reports, &records, sizeof(records)) == sizeof(records)) {
+                mock->requests++;
+                mock->records += records;
+        }
+}
+
+void mock_backend_stop(struct mock_backend *mock)
+{
+        if (mock->pid > 0) {
+                kill(mock->pid, SIGTERM);
+                waitpid(mock->pid, NULL, 0);
+                mock->pid = 0;
+        }
+        if (mock->reports >= 0) {
+                close(mock->reports);
+                mock->reports = -1;
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
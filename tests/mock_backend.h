@@ -0,0 +1,70 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+/* Records holding this text are rejected by the mock backend */
+#define MOCK_BACKEND_REJECT "mock-backend-reject"
+/* Batches holding a record with this text get a response with no body */
+#define MOCK_BACKEND_EMPTY "mock-backend-empty"
+
+/*
+ * A local HTTP backend records are posted to in tests, run in a child
+ * process. A request holds a record, answered with 201, or a batch of
+ * records as a JSON array or NDJSON, answered with 200 and a JSON array of
+ * the status of each record. Records holding MOCK_BACKEND_REJECT get 503,
+ * batches holding MOCK_BACKEND_EMPTY an empty body.
+ * Bodies may be compressed with gzip, or zstd without a dictionary.
+ */
+struct mock_backend {
+        pid_t pid;
+        /* the URL records are posted to */
+        char url[64];
+        /* pipe the child reports the number of records of each request on */
+        int reports;
+        /* requests and records received so far */
+        unsigned int requests;
+        unsigned int records;
+};
+
+/**
+ * Start a mock backend listening on a port of 127.0.0.1
+ *
+ * @param mock The mock backend
+ *
+ * @return 0 on success, a negative errno otherwise
+ */
+int mock_backend_start(struct mock_backend *mock);
+
+/**
+ * Update the requests and records received by the mock backend
+ *
+ * A request is counted before it is answered.
+ *
+ * @param mock The mock backend
+ */
+void mock_backend_update(struct mock_backend *mock);
+
+/**
+ * Stop a mock backend
+ *
+ * @param mock The mock backend
+ */
+void mock_backend_stop(struct mock_backend *mock);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */